@@ -38,6 +38,191 @@ HEIMDAL_MUTEX ccache_mutex = HEIMDAL_MUTEX_INITIALIZER;
 kcm_ccache_data *ccache_head = NULL;
 static unsigned int ccache_nextid = 0;
 
+/*
+ * Besides ccache_head every valid cache is hashed by name and by uuid,
+ * chained through name_next and uuid_next.  The tables are protected by
+ * ccache_mutex like the list; should they fail to grow the old ones are
+ * kept, and without any lookups fall back to walking ccache_head.
+ */
+static kcm_ccache *ccache_by_name = NULL;
+static kcm_ccache *ccache_by_uuid = NULL;
+static size_t ccache_nbuckets = 0;
+static size_t ccache_count = 0;
+
+#define KCM_CCACHE_MIN_BUCKETS	64
+
+/*
+ * Credentials of a cache holding more than KCM_CRED_INDEX_MIN of them
+ * are likewise hashed by server and by uuid, under the cache's mutex.
+ * The server hash leaves out the realm so that lookups ignoring it land
+ * in the same chain, and each chain keeps the order of ccache->creds so
+ * the first match is the same one a walk of the list would return.
+ */
+#define KCM_CRED_INDEX_MIN	8
+
+#define FNV_OFFSET		2166136261U
+#define FNV_PRIME		16777619U
+
+static uint32_t
+hash_string(uint32_t h, const char *s)
+{
+    while (*s != '\0')
+	h = (h ^ (unsigned char)*s++) * FNV_PRIME;
+    return h;
+}
+
+static uint32_t
+hash_uuid(const unsigned char *uuid)
+{
+    uint32_t h;
+
+    /* uuids come from RAND_bytes() */
+    memcpy(&h, uuid, sizeof(h));
+    return h;
+}
+
+static uint32_t
+hash_server(krb5_const_principal p)
+{
+    uint32_t h = FNV_OFFSET;
+    size_t i;
+
+    if (p == NULL)
+	return 0;
+    for (i = 0; i < p->name.name_string.len; i++) {
+	h = hash_string(h, p->name.name_string.val[i]);
+	h = (h ^ '/') * FNV_PRIME;
+    }
+    return h;
+}
+
+static void
+ccache_index_insert(kcm_ccache p)
+{
+    size_t i;
+
+    i = hash_string(FNV_OFFSET, p->name) & (ccache_nbuckets - 1);
+    p->name_next = ccache_by_name[i];
+    ccache_by_name[i] = p;
+
+    i = hash_uuid(p->uuid) & (ccache_nbuckets - 1);
+    p->uuid_next = ccache_by_uuid[i];
+    ccache_by_uuid[i] = p;
+}
+
+static int
+ccache_index_rebuild(size_t nbuckets)
+{
+    kcm_ccache *by_name, *by_uuid, p;
+
+    by_name = calloc(nbuckets, sizeof(by_name[0]));
+    by_uuid = calloc(nbuckets, sizeof(by_uuid[0]));
+    if (by_name == NULL || by_uuid == NULL) {
+	free(by_name);
+	free(by_uuid);
+	return ENOMEM;
+    }
+
+    free(ccache_by_name);
+    free(ccache_by_uuid);
+    ccache_by_name = by_name;
+    ccache_by_uuid = by_uuid;
+    ccache_nbuckets = nbuckets;
+
+    for (p = ccache_head; p != NULL; p = p->next)
+	if (p->flags & KCM_FLAGS_VALID)
+	    ccache_index_insert(p);
+
+    return 0;
+}
+
+/* p must already be valid and on ccache_head */
+static void
+ccache_index_add(kcm_ccache p)
+{
+    size_t nbuckets;
+
+    ccache_count++;
+    if (ccache_count > ccache_nbuckets) {
+	nbuckets = ccache_nbuckets ? ccache_nbuckets * 2 : KCM_CCACHE_MIN_BUCKETS;
+	if (ccache_index_rebuild(nbuckets) == 0)
+	    return;
+    }
+    if (ccache_by_name != NULL)
+	ccache_index_insert(p);
+}
+
+static void
+ccache_index_remove(kcm_ccache p)
+{
+    kcm_ccache *pp;
+
+    ccache_count--;
+    if (ccache_by_name == NULL)
+	return;
+
+    pp = &ccache_by_name[hash_string(FNV_OFFSET, p->name) & (ccache_nbuckets - 1)];
+    for (; *pp != NULL; pp = &(*pp)->name_next) {
+	if (*pp == p) {
+	    *pp = p->name_next;
+	    break;
+	}
+    }
+    pp = &ccache_by_uuid[hash_uuid(p->uuid) & (ccache_nbuckets - 1)];
+    for (; *pp != NULL; pp = &(*pp)->uuid_next) {
+	if (*pp == p) {
+	    *pp = p->uuid_next;
+	    break;
+	}
+    }
+    p->name_next = NULL;
+    p->uuid_next = NULL;
+}
+
+static kcm_ccache
+ccache_find_by_name(const char *name)
+{
+    kcm_ccache p;
+
+    if (ccache_by_name != NULL) {
+	p = ccache_by_name[hash_string(FNV_OFFSET, name) & (ccache_nbuckets - 1)];
+	for (; p != NULL; p = p->name_next)
+	    if (strcmp(p->name, name) == 0)
+		return p;
+	return NULL;
+    }
+
+    for (p = ccache_head; p != NULL; p = p->next) {
+	if ((p->flags & KCM_FLAGS_VALID) == 0)
+	    continue;
+	if (strcmp(p->name, name) == 0)
+	    return p;
+    }
+    return NULL;
+}
+
+static kcm_ccache
+ccache_find_by_uuid(const unsigned char *uuid)
+{
+    kcm_ccache p;
+
+    if (ccache_by_uuid != NULL) {
+	p = ccache_by_uuid[hash_uuid(uuid) & (ccache_nbuckets - 1)];
+	for (; p != NULL; p = p->uuid_next)
+	    if (memcmp(p->uuid, uuid, sizeof(p->uuid)) == 0)
+		return p;
+	return NULL;
+    }
+
+    for (p = ccache_head; p != NULL; p = p->next) {
+	if ((p->flags & KCM_FLAGS_VALID) == 0)
+	    continue;
+	if (memcmp(p->uuid, uuid, sizeof(p->uuid)) == 0)
+	    return p;
+    }
+    return NULL;
+}
+
 char *kcm_ccache_nextid(pid_t pid, uid_t uid, gid_t gid)
 {
     unsigned n;
@@ -69,16 +254,9 @@ kcm_ccache_resolve(krb5_context context,
 
     HEIMDAL_MUTEX_lock(&ccache_mutex);
 
-    for (p = ccache_head; p != NULL; p = p->next) {
-	if ((p->flags & KCM_FLAGS_VALID) == 0)
-	    continue;
-	if (strcmp(p->name, name) == 0) {
-	    ret = 0;
-	    break;
-	}
-    }
-
-    if (ret == 0) {
+    p = ccache_find_by_name(name);
+    if (p != NULL) {
+	ret = 0;
 	kcm_retain_ccache(context, p);
 	*ccache = p;
     }
@@ -102,16 +280,9 @@ kcm_ccache_resolve_by_uuid(krb5_context context,
 
     HEIMDAL_MUTEX_lock(&ccache_mutex);
 
-    for (p = ccache_head; p != NULL; p = p->next) {
-	if ((p->flags & KCM_FLAGS_VALID) == 0)
-	    continue;
-	if (memcmp(p->uuid, uuid, sizeof(*uuid)) == 0) {
-	    ret = 0;
-	    break;
-	}
-    }
-
-    if (ret == 0) {
+    p = ccache_find_by_uuid(uuid);
+    if (p != NULL) {
+	ret = 0;
 	kcm_retain_ccache(context, p);
 	*ccache = p;
     }
@@ -220,6 +391,8 @@ kcm_free_ccache_data_internal(krb5_context context,
     cache->kdc_offset = 0;
 
     cache->next = NULL;
+    cache->name_next = NULL;
+    cache->uuid_next = NULL;
     cache->refcnt = 0;
 
     HEIMDAL_MUTEX_unlock(&cache->mutex);
@@ -233,28 +406,28 @@ kcm_ccache_destroy(krb5_context context, const char *name)
     kcm_ccache *p, ccache;
     krb5_error_code ret;
 
-    ret = KRB5_FCC_NOFILE;
+    ret = 0;
 
     HEIMDAL_MUTEX_lock(&ccache_mutex);
-    for (p = &ccache_head; *p != NULL; p = &(*p)->next) {
-	if (((*p)->flags & KCM_FLAGS_VALID) == 0)
-	    continue;
-	if (strcmp((*p)->name, name) == 0) {
-	    ret = 0;
-	    break;
-	}
-    }
-    if (ret)
+    ccache = ccache_find_by_name(name);
+    if (ccache == NULL) {
+	ret = KRB5_FCC_NOFILE;
 	goto out;
+    }
 
-    if ((*p)->refcnt != 1) {
+    /* KDC worker threads take references too */
+    HEIMDAL_MUTEX_lock(&ccache->mutex);
+    if (ccache->refcnt != 1) {
+	HEIMDAL_MUTEX_unlock(&ccache->mutex);
 	ret = EAGAIN;
 	goto out;
     }
 
-    ccache = *p;
-    *p = (*p)->next;
-    kcm_free_ccache_data_internal(context, ccache);
+    for (p = &ccache_head; *p != ccache; p = &(*p)->next)
+	;
+    *p = ccache->next;
+    ccache_index_remove(ccache);
+    kcm_free_ccache_data_internal(context, ccache);	/* unlocks */
     free(ccache);
 
 out:
@@ -268,50 +441,35 @@ kcm_ccache_alloc(krb5_context context,
 		 const char *name,
 		 kcm_ccache *ccache)
 {
-    kcm_ccache slot = NULL, p;
+    kcm_ccache slot;
     krb5_error_code ret;
-    int new_slot = 0;
 
     *ccache = NULL;
 
     /* First, check for duplicates */
     HEIMDAL_MUTEX_lock(&ccache_mutex);
     ret = 0;
-    for (p = ccache_head; p != NULL; p = p->next) {
-	if (p->flags & KCM_FLAGS_VALID) {
-	    if (strcmp(p->name, name) == 0) {
-		ret = KRB5_CC_WRITE;
-		break;
-	    }
-	} else if (slot == NULL)
-	    slot = p;
-    }
-
-    if (ret)
+    if (ccache_find_by_name(name) != NULL) {
+	ret = KRB5_CC_WRITE;
 	goto out;
+    }
 
-    /*
-     * Create an enpty slot for us.
-     */
+    slot = (kcm_ccache_data *)malloc(sizeof(*slot));
     if (slot == NULL) {
-	slot = (kcm_ccache_data *)malloc(sizeof(*slot));
-	if (slot == NULL) {
-	    ret = KRB5_CC_NOMEM;
-	    goto out;
-	}
-	slot->next = ccache_head;
-	HEIMDAL_MUTEX_init(&slot->mutex);
-	new_slot = 1;
+	ret = KRB5_CC_NOMEM;
+	goto out;
     }
 
-    RAND_bytes(slot->uuid, sizeof(slot->uuid));
-
     slot->name = strdup(name);
     if (slot->name == NULL) {
+	free(slot);
 	ret = KRB5_CC_NOMEM;
 	goto out;
     }
 
+    HEIMDAL_MUTEX_init(&slot->mutex);
+    RAND_bytes(slot->uuid, sizeof(slot->uuid));
+
     slot->refcnt = 1;
     slot->flags = KCM_FLAGS_VALID;
     slot->mode = S_IRUSR | S_IWUSR;
@@ -320,26 +478,132 @@ kcm_ccache_alloc(krb5_context context,
     slot->client = NULL;
     slot->server = NULL;
     slot->creds = NULL;
+    slot->creds_by_server = NULL;
+    slot->creds_by_uuid = NULL;
+    slot->ncreds = 0;
+    slot->ncred_buckets = 0;
+    slot->generation = 0;
     slot->key.keytab = NULL;
     slot->tkt_life = 0;
     slot->renew_life = 0;
     slot->kdc_offset = 0;
 
-    if (new_slot)
-	ccache_head = slot;
+    slot->next = ccache_head;
+    ccache_head = slot;
+    ccache_index_add(slot);
 
     *ccache = slot;
 
+out:
     HEIMDAL_MUTEX_unlock(&ccache_mutex);
+    return ret;
+}
+
+static void
+cred_index_insert(kcm_ccache ccache, struct kcm_creds *c)
+{
+    struct kcm_creds **cp;
+    size_t i;
+
+    i = c->server_hash & (ccache->ncred_buckets - 1);
+    for (cp = &ccache->creds_by_server[i]; *cp != NULL; cp = &(*cp)->server_next)
+	;
+    *cp = c;
+    c->server_next = NULL;
+
+    i = hash_uuid(c->uuid) & (ccache->ncred_buckets - 1);
+    c->uuid_next = ccache->creds_by_uuid[i];
+    ccache->creds_by_uuid[i] = c;
+}
+
+static void
+cred_index_free(kcm_ccache ccache)
+{
+    free(ccache->creds_by_server);
+    free(ccache->creds_by_uuid);
+    ccache->creds_by_server = NULL;
+    ccache->creds_by_uuid = NULL;
+    ccache->ncred_buckets = 0;
+}
+
+static int
+cred_index_rebuild(kcm_ccache ccache)
+{
+    struct kcm_creds **by_server, **by_uuid, *c;
+    size_t nbuckets = KCM_CRED_INDEX_MIN;
+
+    while (nbuckets < ccache->ncreds)
+	nbuckets *= 2;
+
+    by_server = calloc(nbuckets, sizeof(by_server[0]));
+    by_uuid = calloc(nbuckets, sizeof(by_uuid[0]));
+    if (by_server == NULL || by_uuid == NULL) {
+	free(by_server);
+	free(by_uuid);
+	return ENOMEM;
+    }
+
+    cred_index_free(ccache);
+    ccache->creds_by_server = by_server;
+    ccache->creds_by_uuid = by_uuid;
+    ccache->ncred_buckets = nbuckets;
+
+    for (c = ccache->creds; c != NULL; c = c->next)
+	cred_index_insert(ccache, c);
+
     return 0;
+}
 
-out:
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
-    if (new_slot && slot != NULL) {
-	HEIMDAL_MUTEX_destroy(&slot->mutex);
-	free(slot);
+/*
+ * Append c to the credentials of ccache, the cache must be locked
+ */
+void
+kcm_ccache_link_cred_internal(krb5_context context,
+			      kcm_ccache ccache,
+			      struct kcm_creds *c)
+{
+    struct kcm_creds **cp;
+
+    for (cp = &ccache->creds; *cp != NULL; cp = &(*cp)->next)
+	;
+    *cp = c;
+    c->next = NULL;
+    c->server_hash = hash_server(c->cred.server);
+    ccache->ncreds++;
+
+    if (ccache->ncreds > KCM_CRED_INDEX_MIN &&
+	ccache->ncreds > 2 * ccache->ncred_buckets &&
+	cred_index_rebuild(ccache) == 0)
+	return;
+    if (ccache->creds_by_server != NULL)
+	cred_index_insert(ccache, c);
+}
+
+static void
+cred_unlink(kcm_ccache ccache, struct kcm_creds **cp)
+{
+    struct kcm_creds *c = *cp, **hp;
+
+    *cp = c->next;
+    ccache->ncreds--;
+
+    if (ccache->creds_by_server == NULL)
+	return;
+
+    hp = &ccache->creds_by_server[c->server_hash & (ccache->ncred_buckets - 1)];
+    for (; *hp != NULL; hp = &(*hp)->server_next) {
+	if (*hp == c) {
+	    *hp = c->server_next;
+	    break;
+	}
+    }
+    hp = &ccache->creds_by_uuid[hash_uuid(c->uuid) & (ccache->ncred_buckets - 1)];
+    for (; *hp != NULL; hp = &(*hp)->uuid_next) {
+	if (*hp == c) {
+	    *hp = c->uuid_next;
+	    break;
+	}
     }
-    return ret;
 }
 
 krb5_error_code
@@ -358,6 +622,9 @@ kcm_ccache_remove_creds_internal(krb5_context context,
 	free(old);
     }
     ccache->creds = NULL;
+    ccache->ncreds = 0;
+    ccache->generation++;
+    cred_index_free(ccache);
 
     return 0;
 }
@@ -415,9 +682,8 @@ krb5_error_code
 kcm_retain_ccache(krb5_context context,
 		  kcm_ccache ccache)
 {
-    KCM_ASSERT_VALID(ccache);
-
     HEIMDAL_MUTEX_lock(&ccache->mutex);
+    KCM_ASSERT_VALID(ccache);
     ccache->refcnt++;
     HEIMDAL_MUTEX_unlock(&ccache->mutex);
 
@@ -429,9 +695,8 @@ kcm_release_ccache(krb5_context context, kcm_ccache c)
 {
     krb5_error_code ret = 0;
 
-    KCM_ASSERT_VALID(c);
-
     HEIMDAL_MUTEX_lock(&c->mutex);
+    KCM_ASSERT_VALID(c);
     if (c->refcnt == 1) {
 	kcm_free_ccache_data_internal(context, c);
 	free(c);
@@ -517,6 +782,10 @@ kcm_ccache_store_cred(krb5_context context,
     return ret;
 }
 
+/*
+ * The result points into the cache: hold ccache->mutex until done
+ * with it.
+ */
 struct kcm_creds *
 kcm_ccache_find_cred_uuid(krb5_context context,
 			  kcm_ccache ccache,
@@ -524,6 +793,14 @@ kcm_ccache_find_cred_uuid(krb5_context context,
 {
     struct kcm_creds *c;
 
+    if (ccache->creds_by_uuid != NULL) {
+	c = ccache->creds_by_uuid[hash_uuid(uuid) & (ccache->ncred_buckets - 1)];
+	for (; c != NULL; c = c->uuid_next)
+	    if (memcmp(c->uuid, uuid, sizeof(c->uuid)) == 0)
+		return c;
+	return NULL;
+    }
+
     for (c = ccache->creds; c != NULL; c = c->next)
 	if (memcmp(c->uuid, uuid, sizeof(c->uuid)) == 0)
 	    return c;
@@ -540,32 +817,28 @@ kcm_ccache_store_cred_internal(krb5_context context,
 			       int copy,
 			       krb5_creds **credp)
 {
-    struct kcm_creds **c;
+    struct kcm_creds *c;
     krb5_error_code ret;
 
-    for (c = &ccache->creds; *c != NULL; c = &(*c)->next)
-	;
-
-    *c = (struct kcm_creds *)calloc(1, sizeof(**c));
-    if (*c == NULL)
+    c = (struct kcm_creds *)calloc(1, sizeof(*c));
+    if (c == NULL)
 	return KRB5_CC_NOMEM;
 
-    RAND_bytes((*c)->uuid, sizeof((*c)->uuid));
-
-    *credp = &(*c)->cred;
+    RAND_bytes(c->uuid, sizeof(c->uuid));
 
     if (copy) {
-	ret = krb5_copy_creds_contents(context, creds, *credp);
+	ret = krb5_copy_creds_contents(context, creds, &c->cred);
 	if (ret) {
-	    free(*c);
-	    *c = NULL;
+	    free(c);
+	    return ret;
 	}
-    } else {
-	**credp = *creds;
-	ret = 0;
-    }
+    } else
+	c->cred = *creds;
 
-    return ret;
+    kcm_ccache_link_cred_internal(context, ccache, c);
+    *credp = &c->cred;
+
+    return 0;
 }
 
 krb5_error_code
@@ -583,9 +856,10 @@ kcm_ccache_remove_cred_internal(krb5_context context,
 	if (krb5_compare_creds(context, whichfields, mcreds, &(*c)->cred)) {
 	    struct kcm_creds *cred = *c;
 
-	    *c = cred->next;
+	    cred_unlink(ccache, c);
 	    krb5_free_cred_contents(context, &cred->cred);
 	    free(cred);
+	    ccache->generation++;
 	    ret = 0;
 	    if (*c == NULL)
 		break;
@@ -628,10 +902,20 @@ kcm_ccache_retrieve_cred_internal(krb5_context context,
     ret = KRB5_CC_END;
 
     match = FALSE;
-    for (c = ccache->creds; c != NULL; c = c->next) {
-	match = krb5_compare_creds(context, whichfields, mcreds, &c->cred);
-	if (match)
-	    break;
+    if (ccache->creds_by_server != NULL && mcreds->server != NULL) {
+	c = ccache->creds_by_server[hash_server(mcreds->server) &
+				    (ccache->ncred_buckets - 1)];
+	for (; c != NULL; c = c->server_next) {
+	    match = krb5_compare_creds(context, whichfields, mcreds, &c->cred);
+	    if (match)
+		break;
+	}
+    } else {
+	for (c = ccache->creds; c != NULL; c = c->next) {
+	    match = krb5_compare_creds(context, whichfields, mcreds, &c->cred);
+	    if (match)
+		break;
+	}
     }
 
     if (match) {
@@ -642,25 +926,6 @@ kcm_ccache_retrieve_cred_internal(krb5_context context,
     return ret;
 }
 
-krb5_error_code
-kcm_ccache_retrieve_cred(krb5_context context,
-			 kcm_ccache ccache,
-			 krb5_flags whichfields,
-			 const krb5_creds *mcreds,
-			 krb5_creds **credp)
-{
-    krb5_error_code ret;
-
-    KCM_ASSERT_VALID(ccache);
-
-    HEIMDAL_MUTEX_lock(&ccache->mutex);
-    ret = kcm_ccache_retrieve_cred_internal(context, ccache,
-					    whichfields, mcreds, credp);
-    HEIMDAL_MUTEX_unlock(&ccache->mutex);
-
-    return ret;
-}
-
 char *
 kcm_ccache_first_name(kcm_client *client)
 {
@@ -60,6 +60,7 @@ static const char *ticket_life = NULL;
 int launchd_flag = 0;
 int disallow_getting_krbtgt = 0;
 int name_constraints = -1;
+int kcm_threads = -1;
 
 static int help_flag;
 static int version_flag;
@@ -130,6 +131,10 @@ static struct getargs args[] = {
 	"keytab",	't',	arg_string,	&system_keytab,
 	"system keytab name",	"keytab"
     },
+    {
+	"threads",	0,	arg_integer,	&kcm_threads,
+	"number of threads for requests to the KDC",	"number"
+    },
     {
 	"user",		'u',	arg_string,	&system_user,
 	"system cache owner",	"user"
@@ -146,6 +151,33 @@ usage(int ret)
     exit (ret);
 }
 
+/*
+ * A new context with the configuration of kcm_context, for a worker
+ * thread; krb5_copy_context() leaves out too much of it.
+ */
+
+krb5_error_code
+kcm_context_dup(krb5_context *context)
+{
+    krb5_error_code ret;
+    char **files;
+
+    ret = krb5_init_context(context);
+    if (ret)
+	return ret;
+
+    ret = krb5_prepend_config_files_default(config_file, &files);
+    if (ret == 0) {
+	ret = krb5_set_config_files(*context, files);
+	krb5_free_config_files(files);
+    }
+    if (ret) {
+	krb5_free_context(*context);
+	*context = NULL;
+    }
+    return ret;
+}
+
 static int parse_owners(kcm_ccache ccache)
 {
     uid_t uid = 0;
@@ -378,6 +410,9 @@ kcm_configure(int argc, char **argv)
 							   FALSE,
 							   "kcm",
 							   "detach", NULL);
+    if (kcm_threads < 0)
+	kcm_threads = krb5_config_get_int_default(kcm_context, NULL, 4,
+						  "kcm", "threads", NULL);
     kcm_openlog();
     if(max_request == 0)
 	max_request = 64 * 1024;
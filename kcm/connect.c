@@ -35,11 +35,12 @@
 
 #include "kcm_locl.h"
 
-void
-kcm_service(void *ctx, const heim_idata *req,
-	    const heim_icred cred,
-	    heim_ipc_complete complete,
-	    heim_sipc_call cctx)
+static void
+service(const heim_idata *req,
+	const heim_icred cred,
+	heim_ipc_complete complete,
+	heim_sipc_call cctx,
+	int async)
 {
     kcm_client peercred;
     krb5_error_code ret;
@@ -53,6 +54,7 @@ kcm_service(void *ctx, const heim_idata *req,
     peercred.gid = heim_ipc_cred_get_gid(cred);
     peercred.pid = heim_ipc_cred_get_pid(cred);
     peercred.session = heim_ipc_cred_get_session(cred);
+    peercred.flags = async ? KCM_CLIENT_NO_KDC : 0;
 
     if (req->length < 4) {
 	kcm_log(1, "malformed request from process %d (too short)",
@@ -79,6 +81,39 @@ kcm_service(void *ctx, const heim_idata *req,
 
     ret = kcm_dispatch(kcm_context, &peercred, &request, &rep);
 
+    /* needs a KDC; a worker completes the call */
+    if (ret == KCM_ERR_NEEDS_KDC && (peercred.flags & KCM_CLIENT_NO_KDC)) {
+	if (kcm_worker_enqueue(&peercred, &request, complete, cctx) == 0)
+	    return;
+	/* no workers, wait here */
+	peercred.flags &= ~KCM_CLIENT_NO_KDC;
+	ret = kcm_dispatch(kcm_context, &peercred, &request, &rep);
+    }
+
     (*complete)(cctx, ret, &rep);
     krb5_data_free(&rep);
 }
+
+void
+kcm_service(void *ctx, const heim_idata *req,
+	    const heim_icred cred,
+	    heim_ipc_complete complete,
+	    heim_sipc_call cctx)
+{
+    service(req, cred, complete, cctx, 0);
+}
+
+/*
+ * For transports that can complete a call from another thread: the
+ * requests that need a KDC are handed to the worker threads, so the
+ * IPC loop doesn't wait for it.
+ */
+
+void
+kcm_service_async(void *ctx, const heim_idata *req,
+		  const heim_icred cred,
+		  heim_ipc_complete complete,
+		  heim_sipc_call cctx)
+{
+    service(req, cred, complete, cctx, 1);
+}
@@ -301,3 +301,112 @@ kcm_internal_ccache(krb5_context context,
     return 0;
 }
 
+
+static int
+uuid_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, sizeof(kcmuuid_t));
+}
+
+/*
+ * Get credentials for `ccache' from the KDC without keeping it locked
+ * over the network round trips: the exchange runs on a private copy of
+ * the cache, and the credentials it stores are then added to `ccache'.
+ * The caller must not hold the cache lock.
+ */
+
+krb5_error_code
+kcm_ccache_get_credentials(krb5_context context,
+			   kcm_ccache ccache,
+			   krb5_kdc_flags flags,
+			   krb5_creds *in,
+			   krb5_creds **out)
+{
+    kcm_ccache_data copy;
+    krb5_ccache_data ccdata;
+    struct kcm_creds *c, *n, *next;
+    kcmuuid_t *snap = NULL;
+    size_t nsnap = 0;
+    unsigned generation;
+    krb5_error_code ret = 0;
+
+    KCM_ASSERT_VALID(ccache);
+
+    memset(&copy, 0, sizeof(copy));
+    copy.flags = KCM_FLAGS_VALID;
+    copy.refcnt = 1;
+
+    HEIMDAL_MUTEX_lock(&ccache->mutex);
+    generation = ccache->generation;
+    copy.name = strdup(ccache->name);
+    if (copy.name == NULL)
+	ret = KRB5_CC_NOMEM;
+    if (ret == 0 && ccache->client != NULL)
+	ret = krb5_copy_principal(context, ccache->client, &copy.client);
+    if (ret == 0 && ccache->ncreds > 0) {
+	snap = calloc(ccache->ncreds, sizeof(snap[0]));
+	if (snap == NULL)
+	    ret = KRB5_CC_NOMEM;
+    }
+    for (c = ccache->creds; ret == 0 && c != NULL; c = c->next) {
+	n = calloc(1, sizeof(*n));
+	if (n == NULL) {
+	    ret = KRB5_CC_NOMEM;
+	    break;
+	}
+	memcpy(n->uuid, c->uuid, sizeof(c->uuid));
+	ret = krb5_copy_creds_contents(context, &c->cred, &n->cred);
+	if (ret) {
+	    free(n);
+	    break;
+	}
+	kcm_ccache_link_cred_internal(context, &copy, n);
+	memcpy(snap[nsnap++], c->uuid, sizeof(c->uuid));
+    }
+    copy.kdc_offset = ccache->kdc_offset;
+    HEIMDAL_MUTEX_unlock(&ccache->mutex);
+
+    if (nsnap > 1)
+	qsort(snap, nsnap, sizeof(snap[0]), uuid_cmp);
+
+    if (ret == 0) {
+	kcm_internal_ccache(context, &copy, &ccdata);
+	ret = krb5_get_credentials_with_flags(context, 0, flags,
+					      &ccdata, in, out);
+    }
+
+    /*
+     * Move the credentials the exchange added to the copy over to the
+     * cache, unless credentials were removed from the cache or it was
+     * reinitialized or moved meanwhile: those must not come back.
+     */
+    if (ret == 0) {
+	HEIMDAL_MUTEX_lock(&ccache->mutex);
+	if (ccache->generation != generation ||
+	    ccache->client == NULL || copy.client == NULL ||
+	    !krb5_principal_compare(context, ccache->client, copy.client)) {
+	    HEIMDAL_MUTEX_unlock(&ccache->mutex);
+	    goto out;
+	}
+	c = copy.creds;
+	copy.creds = NULL;
+	kcm_ccache_remove_creds_internal(context, &copy);
+	for (; c != NULL; c = next) {
+	    next = c->next;
+	    if (bsearch(c->uuid, snap, nsnap, sizeof(snap[0]), uuid_cmp) == NULL) {
+		kcm_ccache_link_cred_internal(context, ccache, c);
+	    } else {
+		c->next = copy.creds;
+		copy.creds = c;
+	    }
+	}
+	HEIMDAL_MUTEX_unlock(&ccache->mutex);
+    }
+
+out:
+    kcm_zero_ccache_data_internal(context, &copy);
+    free(copy.name);
+    free(snap);
+
+    return ret;
+}
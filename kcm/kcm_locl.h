@@ -80,6 +80,10 @@ struct kcm_creds {
     kcmuuid_t uuid;
     krb5_creds cred;
     struct kcm_creds *next;
+    /* hash chains of the per-cache credential index, see cache.c */
+    struct kcm_creds *server_next;
+    struct kcm_creds *uuid_next;
+    uint32_t server_hash;
 };
 
 typedef struct kcm_ccache_data {
@@ -94,6 +98,11 @@ typedef struct kcm_ccache_data {
     krb5_principal client; /* primary client principal */
     krb5_principal server; /* primary server principal (TGS if NULL) */
     struct kcm_creds *creds;
+    struct kcm_creds **creds_by_server; /* index of creds, may be NULL */
+    struct kcm_creds **creds_by_uuid;
+    size_t ncreds;
+    size_t ncred_buckets;
+    unsigned generation; /* bumped when creds are removed or moved away */
     krb5_deltat tkt_life;
     krb5_deltat renew_life;
     int32_t kdc_offset;
@@ -103,6 +112,8 @@ typedef struct kcm_ccache_data {
     } key;
     HEIMDAL_MUTEX mutex;
     struct kcm_ccache_data *next;
+    struct kcm_ccache_data *name_next; /* hash chains, see cache.c */
+    struct kcm_ccache_data *uuid_next;
 } kcm_ccache_data;
 
 #define KCM_ASSERT_VALID(_ccache)		do { \
@@ -147,8 +158,23 @@ typedef struct kcm_client {
     uid_t uid;
     gid_t gid;
     pid_t session;
+    int flags;
 } kcm_client;
 
+/*
+ * Request served on the IPC loop: operations that would wait for a KDC
+ * fail with KCM_ERR_NEEDS_KDC instead, and are run again by a worker
+ * thread.
+ */
+#define KCM_CLIENT_NO_KDC	1
+
+/*
+ * Internal status for the above; never sent to a client.  It must not be
+ * an errno or com_err code, as those (EAGAIN from kcm_ccache_destroy(),
+ * say) mean the operation has already been done, or failed.
+ */
+#define KCM_ERR_NEEDS_KDC	(-1)
+
 #define CLIENT_IS_ROOT(client) ((client)->uid == 0)
 
 /* Dispatch table */
@@ -171,6 +197,7 @@ extern int detach_from_console;
 extern int daemon_child;
 extern int launchd_flag;
 extern int disallow_getting_krbtgt;
+extern int kcm_threads;
 
 #if 0
 extern const krb5_cc_ops krb5_kcmss_ops;
@@ -178,6 +205,8 @@ extern const krb5_cc_ops krb5_kcmss_ops;
 
 void	kcm_service(void *, const heim_idata *, const heim_icred,
 		    heim_ipc_complete, heim_sipc_call);
+void	kcm_service_async(void *, const heim_idata *, const heim_icred,
+			  heim_ipc_complete, heim_sipc_call);
 
 #include <kcm-protos.h>
 
@@ -95,7 +95,15 @@ main(int argc, char **argv)
 	heim_sipc_launchd_mach_init(service_name, kcm_service, NULL, &mach);
     } else {
 	heim_sipc un;
-	heim_sipc_service_unix(service_name, kcm_service, NULL, &un);
+	heim_ipc_callback callback = kcm_service;
+
+#ifndef HAVE_GCD
+	/* only the poll loop takes completions from other threads */
+	if (kcm_threads > 0 &&
+	    kcm_worker_start(kcm_threads) == 0)
+	    callback = kcm_service_async;
+#endif
+	heim_sipc_service_unix(service_name, callback, NULL, &un);
     }
 #ifdef HAVE_DOOR_CREATE
     {
@@ -313,7 +313,6 @@ kcm_op_retrieve(krb5_context context,
     kcm_ccache ccache;
     char *name;
     krb5_creds *credp;
-    int free_creds = 0;
 
     ret = krb5_ret_stringz(request, &name);
     if (ret)
@@ -350,37 +349,42 @@ kcm_op_retrieve(krb5_context context,
 	return ret;
     }
 
-    ret = kcm_ccache_retrieve_cred(context, ccache, flags,
-				   &mcreds, &credp);
-    if (ret && ((flags & KRB5_GC_CACHED) == 0) &&
-	!krb5_is_config_principal(context, mcreds.server)) {
-	krb5_ccache_data ccdata;
-
-	/* try and acquire */
-	HEIMDAL_MUTEX_lock(&ccache->mutex);
-
-	/* Fake up an internal ccache */
-	kcm_internal_ccache(context, ccache, &ccdata);
-
-	/* glue cc layer will store creds */
-	ret = krb5_get_credentials(context, 0, &ccdata, &mcreds, &credp);
-	if (ret == 0)
-	    free_creds = 1;
+    /*
+     * credp points into the cache, so it is only good while the cache
+     * is locked: another thread may remove the credential or destroy
+     * the cache as soon as the lock is dropped.
+     */
+    HEIMDAL_MUTEX_lock(&ccache->mutex);
+    KCM_ASSERT_VALID(ccache);
+    ret = kcm_ccache_retrieve_cred_internal(context, ccache, flags,
+					    &mcreds, &credp);
+    if (ret == 0)
+	ret = krb5_store_creds(response, credp);
+    HEIMDAL_MUTEX_unlock(&ccache->mutex);
 
-	HEIMDAL_MUTEX_unlock(&ccache->mutex);
-    }
+    if (ret == KRB5_CC_END && ((flags & KRB5_GC_CACHED) == 0) &&
+	!krb5_is_config_principal(context, mcreds.server)) {
+	krb5_kdc_flags kdcflags;
 
-    if (ret == 0) {
-	ret = krb5_store_creds(response, credp);
+	/* try and acquire, off the IPC loop */
+	if (client->flags & KCM_CLIENT_NO_KDC) {
+	    ret = KCM_ERR_NEEDS_KDC;
+	} else {
+	    kdcflags.i = 0;
+	    ret = kcm_ccache_get_credentials(context, ccache, kdcflags,
+					     &mcreds, &credp);
+	    if (ret == 0) {
+		/* a copy, not a pointer into the cache */
+		ret = krb5_store_creds(response, credp);
+		krb5_free_creds(context, credp);
+	    }
+	}
     }
 
     free(name);
     krb5_free_cred_contents(context, &mcreds);
     kcm_release_ccache(context, ccache);
 
-    if (free_creds)
-	krb5_free_cred_contents(context, credp);
-
     return ret;
 }
 
@@ -458,6 +462,7 @@ kcm_op_get_cred_uuid_list(krb5_context context,
     if (ret)
 	return ret;
 
+    HEIMDAL_MUTEX_lock(&ccache->mutex);
     for (creds = ccache->creds ; creds ; creds = creds->next) {
 	ssize_t sret;
 	sret = krb5_storage_write(response, &creds->uuid, sizeof(creds->uuid));
@@ -466,6 +471,7 @@ kcm_op_get_cred_uuid_list(krb5_context context,
 	    break;
 	}
     }
+    HEIMDAL_MUTEX_unlock(&ccache->mutex);
 
     kcm_release_ccache(context, ccache);
 
@@ -513,14 +519,12 @@ kcm_op_get_cred_by_uuid(krb5_context context,
 	return KRB5_CC_IO;
     }
 
-    c = kcm_ccache_find_cred_uuid(context, ccache, uuid);
-    if (c == NULL) {
-	kcm_release_ccache(context, ccache);
-	return KRB5_CC_END;
-    }
-
     HEIMDAL_MUTEX_lock(&ccache->mutex);
-    ret = krb5_store_creds(response, &c->cred);
+    c = kcm_ccache_find_cred_uuid(context, ccache, uuid);
+    if (c == NULL)
+	ret = KRB5_CC_END;
+    else
+	ret = krb5_store_creds(response, &c->cred);
     HEIMDAL_MUTEX_unlock(&ccache->mutex);
 
     kcm_release_ccache(context, ccache);
@@ -853,10 +857,13 @@ kcm_op_get_ticket(krb5_context context,
     kcm_ccache ccache;
     char *name;
     krb5_principal server = NULL;
-    krb5_ccache_data ccdata;
     krb5_creds in, *out;
     krb5_kdc_flags flags;
 
+    /* this one is for the workers */
+    if (client->flags & KCM_CLIENT_NO_KDC)
+	return KCM_ERR_NEEDS_KDC;
+
     memset(&in, 0, sizeof(in));
 
     ret = krb5_ret_stringz(request, &name);
@@ -892,20 +899,19 @@ kcm_op_get_ticket(krb5_context context,
     }
 
     HEIMDAL_MUTEX_lock(&ccache->mutex);
+    if (ccache->client != NULL)
+	ret = krb5_copy_principal(context, ccache->client, &in.client);
+    else
+	ret = KRB5_CC_NOTFOUND;
+    HEIMDAL_MUTEX_unlock(&ccache->mutex);
 
-    /* Fake up an internal ccache */
-    kcm_internal_ccache(context, ccache, &ccdata);
-
-    in.client = ccache->client;
     in.server = server;
     in.times.endtime = 0;
 
-    /* glue cc layer will store creds */
-    ret = krb5_get_credentials_with_flags(context, 0, flags,
-					  &ccdata, &in, &out);
-
-    HEIMDAL_MUTEX_unlock(&ccache->mutex);
+    if (ret == 0)
+	ret = kcm_ccache_get_credentials(context, ccache, flags, &in, &out);
 
+    krb5_free_principal(context, in.client);
     krb5_free_principal(context, server);
 
     if (ret == 0)
@@ -987,11 +993,17 @@ kcm_op_move_cache(krb5_context context,
 	MOVE(newid, oldid, client);
 	MOVE(newid, oldid, server);
 	MOVE(newid, oldid, creds);
+	MOVE(newid, oldid, creds_by_server);
+	MOVE(newid, oldid, creds_by_uuid);
+	MOVE(newid, oldid, ncreds);
+	MOVE(newid, oldid, ncred_buckets);
 	MOVE(newid, oldid, tkt_life);
 	MOVE(newid, oldid, renew_life);
 	MOVE(newid, oldid, key);
 	MOVE(newid, oldid, kdc_offset);
 #undef MOVE
+	newid->generation++;
+	oldid->generation++;
     }
 
     HEIMDAL_MUTEX_unlock(&oldid->mutex);
@@ -1798,6 +1810,13 @@ kcm_dispatch(krb5_context context,
 
     ret = (*method)(context, client, opcode, req_sp, resp_sp);
 
+    /* to be run again by a worker, see kcm_service() */
+    if (ret == KCM_ERR_NEEDS_KDC && (client->flags & KCM_CLIENT_NO_KDC)) {
+	krb5_storage_free(req_sp);
+	krb5_storage_free(resp_sp);
+	return KCM_ERR_NEEDS_KDC;
+    }
+
 out:
     if (req_sp != NULL) {
 	krb5_storage_free(req_sp);
@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Run KCM_OP_RETRIEVE, REMOVE_CRED and cache iteration against one
+ * cache of a running kcm from several threads at once.  A RETRIEVE
+ * that misses is handed to a kcm worker thread, which looks in the
+ * cache again and otherwise gets the credential from the KDC and adds
+ * it to the cache, while the IPC loop keeps serving the removals and
+ * iterations.  Run it with KRB5_CONFIG and HEIM_IPC_DIR pointing at
+ * the kcm under test, which must be able to reach a KDC for the
+ * services named.  It fails if any request fails, or if kcm stops
+ * answering.
+ *
+ * Each thread has its own IPC connection: the one krb5_kcm_call()
+ * shares is not safe to use from several threads at once.
+ */
+
+#include "config.h"
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <krb5.h>
+#include <kcm.h>
+#include <heim-ipc.h>
+#include <getarg.h>
+#include <err.h>
+#include <roken.h>
+
+static int num_seconds = 5;
+static int num_retrievers = 2;
+static int help_flag;
+static int version_flag;
+
+static struct getargs args[] = {
+    {	"seconds",	's',	arg_integer, &num_seconds,
+	"how long to run", "seconds" },
+    {	"retrievers",	'r',	arg_integer, &num_retrievers,
+	"number of threads doing KCM_OP_RETRIEVE", "number" },
+    {	"help",		'h',	arg_flag,   &help_flag,    NULL, NULL },
+    {	"version",	'v',	arg_flag,   &version_flag, NULL, NULL }
+};
+
+static int num_args = sizeof(args) / sizeof(args[0]);
+
+static const char *cache_name;
+static char *client_name;
+static char **services;
+static int num_services;
+static time_t deadline;
+
+struct race_thread {
+    pthread_t thread;
+    void (*func)(struct race_thread *);
+    const char *what;
+    unsigned seed;
+    unsigned long ok;
+    unsigned long failed;
+    krb5_context context;
+    heim_ipc ipc;
+    krb5_principal client;
+};
+
+static void
+usage(int ret)
+{
+    arg_printusage (args, num_args, NULL, "cache service ...");
+    exit (ret);
+}
+
+/* Like krb5_kcm_call(), over this thread's connection */
+static krb5_error_code
+kcm_call(struct race_thread *t, krb5_storage *request,
+	 krb5_storage **response, krb5_data *response_data)
+{
+    krb5_data request_data;
+    krb5_error_code ret;
+    int32_t status;
+
+    *response = NULL;
+    krb5_data_zero(response_data);
+
+    ret = krb5_storage_to_data(request, &request_data);
+    if (ret)
+	return ret;
+    ret = heim_ipc_call(t->ipc, &request_data, response_data, NULL);
+    krb5_data_free(&request_data);
+    if (ret)
+	return KRB5_CC_NOSUPP;
+
+    *response = krb5_storage_from_data(response_data);
+    if (*response == NULL)
+	ret = KRB5_CC_NOMEM;
+    else if (krb5_ret_int32(*response, &status))
+	ret = KRB5_CC_FORMAT;
+    else
+	ret = status;
+    if (ret) {
+	if (*response)
+	    krb5_storage_free(*response);
+	*response = NULL;
+	krb5_data_free(response_data);
+    }
+    return ret;
+}
+
+static krb5_error_code
+request_creds(struct race_thread *t, int opcode, krb5_storage **request,
+	      krb5_creds *mcreds)
+{
+    krb5_error_code ret;
+
+    memset(mcreds, 0, sizeof(*mcreds));
+    mcreds->client = t->client;
+    ret = krb5_parse_name(t->context,
+			  services[rand_r(&t->seed) % num_services],
+			  &mcreds->server);
+    if (ret)
+	return ret;
+
+    ret = krb5_kcm_storage_request(t->context, opcode, request);
+    if (ret == 0)
+	ret = krb5_store_stringz(*request, cache_name);
+    if (ret == 0)
+	ret = krb5_store_int32(*request, 0);
+    if (ret == 0)
+	ret = krb5_store_creds_tag(*request, mcreds);
+    return ret;
+}
+
+static void
+free_request_creds(struct race_thread *t, krb5_storage *request,
+		   krb5_creds *mcreds)
+{
+    if (request)
+	krb5_storage_free(request);
+    krb5_free_principal(t->context, mcreds->server);
+}
+
+/* Without KRB5_GC_CACHED, so that misses go to the KDC */
+static void
+retrieve(struct race_thread *t)
+{
+    krb5_storage *request = NULL, *response;
+    krb5_data response_data;
+    krb5_creds mcreds, creds;
+    krb5_error_code ret;
+
+    ret = request_creds(t, KCM_OP_RETRIEVE, &request, &mcreds);
+    if (ret == 0)
+	ret = kcm_call(t, request, &response, &response_data);
+    if (ret == 0) {
+	ret = krb5_ret_creds(response, &creds);
+	if (ret == 0) {
+	    if (!krb5_principal_compare(t->context, creds.server,
+					mcreds.server))
+		ret = KRB5_CC_IO;
+	    krb5_free_cred_contents(t->context, &creds);
+	}
+	krb5_storage_free(response);
+	krb5_data_free(&response_data);
+    }
+    free_request_creds(t, request, &mcreds);
+
+    if (ret) {
+	krb5_warn(t->context, ret, "retrieve");
+	t->failed++;
+    } else
+	t->ok++;
+}
+
+static void
+remove_cred(struct race_thread *t)
+{
+    krb5_storage *request = NULL, *response;
+    krb5_data response_data;
+    krb5_creds mcreds;
+    krb5_error_code ret;
+
+    ret = request_creds(t, KCM_OP_REMOVE_CRED, &request, &mcreds);
+    if (ret == 0)
+	ret = kcm_call(t, request, &response, &response_data);
+    if (ret == 0) {
+	krb5_storage_free(response);
+	krb5_data_free(&response_data);
+    }
+    free_request_creds(t, request, &mcreds);
+
+    if (ret && ret != KRB5_CC_NOTFOUND) {
+	krb5_warn(t->context, ret, "remove");
+	t->failed++;
+    } else
+	t->ok++;
+}
+
+/* GET_CRED_UUID_LIST, then GET_CRED_BY_UUID for each */
+static void
+iterate(struct race_thread *t)
+{
+    krb5_storage *request, *response, *list = NULL;
+    krb5_data response_data, list_data;
+    krb5_error_code ret;
+    kcmuuid_t uuid;
+
+    krb5_data_zero(&list_data);
+    ret = krb5_kcm_storage_request(t->context, KCM_OP_GET_CRED_UUID_LIST,
+				   &request);
+    if (ret == 0) {
+	ret = krb5_store_stringz(request, cache_name);
+	if (ret == 0)
+	    ret = kcm_call(t, request, &list, &list_data);
+	krb5_storage_free(request);
+    }
+
+    while (ret == 0 && krb5_storage_read(list, uuid, sizeof(uuid)) ==
+	   sizeof(uuid)) {
+	krb5_creds creds;
+
+	ret = krb5_kcm_storage_request(t->context, KCM_OP_GET_CRED_BY_UUID,
+				       &request);
+	if (ret)
+	    break;
+	ret = krb5_store_stringz(request, cache_name);
+	if (ret == 0 &&
+	    krb5_storage_write(request, uuid, sizeof(uuid)) != sizeof(uuid))
+	    ret = ENOMEM;
+	if (ret == 0)
+	    ret = kcm_call(t, request, &response, &response_data);
+	krb5_storage_free(request);
+	if (ret == KRB5_CC_END) {
+	    /* removed since the list was made */
+	    ret = 0;
+	    continue;
+	}
+	if (ret)
+	    break;
+	ret = krb5_ret_creds(response, &creds);
+	if (ret == 0) {
+	    if (!krb5_principal_compare(t->context, creds.client, t->client))
+		ret = KRB5_CC_IO;
+	    krb5_free_cred_contents(t->context, &creds);
+	}
+	krb5_storage_free(response);
+	krb5_data_free(&response_data);
+    }
+    if (list) {
+	krb5_storage_free(list);
+	krb5_data_free(&list_data);
+    }
+
+    if (ret) {
+	krb5_warn(t->context, ret, "iterate");
+	t->failed++;
+    } else
+	t->ok++;
+}
+
+static void *
+race_thread(void *arg)
+{
+    struct race_thread *t = arg;
+    krb5_error_code ret;
+
+    ret = krb5_init_context(&t->context);
+    if (ret)
+	errx(1, "krb5_init_context failed: %d", ret);
+    ret = krb5_parse_name(t->context, client_name, &t->client);
+    if (ret)
+	krb5_err(t->context, 1, ret, "krb5_parse_name: %s", client_name);
+    if (heim_ipc_init_context("ANY:org.h5l.kcm", &t->ipc))
+	errx(1, "cannot connect to kcm");
+
+    while (time(NULL) < deadline)
+	t->func(t);
+
+    heim_ipc_free_context(t->ipc);
+    krb5_free_principal(t->context, t->client);
+    krb5_free_context(t->context);
+    return NULL;
+}
+
+static void
+cache_principal(krb5_context context, const char *name, krb5_principal *p)
+{
+    krb5_ccache id;
+    krb5_error_code ret;
+
+    ret = krb5_cc_resolve(context, name, &id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_cc_resolve: %s", name);
+    ret = krb5_cc_get_principal(context, id, p);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_cc_get_principal: %s", name);
+    krb5_cc_close(context, id);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct race_thread *threads;
+    krb5_context context;
+    krb5_principal client;
+    krb5_error_code ret;
+    unsigned long failed = 0;
+    int optidx = 0;
+    int i, n;
+
+    setprogname(argv[0]);
+
+    if (getarg(args, num_args, argc, argv, &optidx))
+	usage(1);
+
+    if (help_flag)
+	usage(0);
+
+    if (version_flag) {
+	print_version(NULL);
+	exit(0);
+    }
+
+    argc -= optidx;
+    argv += optidx;
+
+    if (argc < 2 || num_seconds <= 0 || num_retrievers <= 0)
+	usage(1);
+
+    if (strncmp(argv[0], "KCM:", 4) != 0)
+	errx(1, "%s is not a KCM cache", argv[0]);
+    cache_name = argv[0] + 4;
+    services = argv + 1;
+    num_services = argc - 1;
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context failed: %d", ret);
+    cache_principal(context, argv[0], &client);
+    ret = krb5_unparse_name(context, client, &client_name);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_unparse_name");
+    krb5_free_principal(context, client);
+
+    n = num_retrievers + 2;
+    threads = ecalloc(n, sizeof(threads[0]));
+    for (i = 0; i < num_retrievers; i++) {
+	threads[i].func = retrieve;
+	threads[i].what = "retrieve";
+    }
+    threads[i].func = remove_cred;
+    threads[i++].what = "remove";
+    threads[i].func = iterate;
+    threads[i].what = "iterate";
+
+    deadline = time(NULL) + num_seconds;
+    for (i = 0; i < n; i++) {
+	threads[i].seed = i + 1;
+	if (pthread_create(&threads[i].thread, NULL, race_thread,
+			   &threads[i]) != 0)
+	    errx(1, "pthread_create");
+    }
+    for (i = 0; i < n; i++) {
+	pthread_join(threads[i].thread, NULL);
+	printf("%s: %lu ok, %lu failed\n", threads[i].what,
+	       threads[i].ok, threads[i].failed);
+	failed += threads[i].failed;
+	if (threads[i].ok == 0)
+	    failed++;
+    }
+    free(threads);
+
+    /* kcm must still be there, with the cache */
+    cache_principal(context, argv[0], &client);
+    krb5_free_principal(context, client);
+    free(client_name);
+    krb5_free_context(context);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Retrieve latency benchmark for a running kcm: fill it with many
+ * caches of a few credentials each through the KCM client, then time
+ * lookups of a random service in a random cache and report the mean,
+ * median and 99th percentile.  By default the lookups go through
+ * krb5_cc_retrieve_cred(), which iterates the cache; with --raw they
+ * are single KCM_OP_RETRIEVE calls.  Run it with KRB5_CONFIG and
+ * HEIM_IPC_DIR pointing at the kcm under test.  The caches are left
+ * behind unless --destroy is given.
+ */
+
+#include "config.h"
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <krb5.h>
+#include <kcm.h>
+#include <getarg.h>
+#include <err.h>
+#include <roken.h>
+
+static int num_caches = 10000;
+static int num_creds = 10;
+static int num_calls = 20000;
+static char *client_string = "user@TEST.H5L.SE";
+static char *realm_string = "TEST.H5L.SE";
+static int raw_flag;
+static int destroy_flag;
+static int help_flag;
+static int version_flag;
+
+static struct getargs args[] = {
+    {	"caches",	'n',	arg_integer, &num_caches,
+	"number of caches", "number" },
+    {	"creds",	'c',	arg_integer, &num_creds,
+	"number of credentials per cache", "number" },
+    {	"calls",	'r',	arg_integer, &num_calls,
+	"number of lookups to time", "number" },
+    {	"client",	0,	arg_string, &client_string,
+	"client principal of the caches", "principal" },
+    {	"realm",	0,	arg_string, &realm_string,
+	"realm of the services", "realm" },
+    {	"raw",		0,	arg_flag,   &raw_flag,
+	"time KCM_OP_RETRIEVE calls, not krb5_cc_retrieve_cred()", NULL },
+    {	"destroy",	0,	arg_flag,   &destroy_flag,
+	"destroy the caches when done", NULL },
+    {	"help",		'h',	arg_flag,   &help_flag,    NULL, NULL },
+    {	"version",	'v',	arg_flag,   &version_flag, NULL, NULL }
+};
+
+static int num_args = sizeof(args) / sizeof(args[0]);
+
+static void
+usage(int ret)
+{
+    arg_printusage (args, num_args, NULL, "");
+    exit (ret);
+}
+
+static double
+now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static krb5_error_code
+make_server(krb5_context context, int i, krb5_principal *server)
+{
+    char *s;
+    krb5_error_code ret;
+
+    if (asprintf(&s, "host/s%d.bench@%s", i, realm_string) == -1 || s == NULL)
+	return krb5_enomem(context);
+    ret = krb5_parse_name(context, s, server);
+    free(s);
+    return ret;
+}
+
+/* One KCM_OP_RETRIEVE of `mcreds' from the cache named `name' */
+static krb5_error_code
+kcm_retrieve(krb5_context context, const char *name, krb5_creds *mcreds)
+{
+    krb5_storage *request, *response;
+    krb5_data response_data;
+    krb5_creds creds;
+    krb5_error_code ret;
+
+    ret = krb5_kcm_storage_request(context, KCM_OP_RETRIEVE, &request);
+    if (ret)
+	return ret;
+    ret = krb5_store_stringz(request, name);
+    if (ret == 0)
+	ret = krb5_store_int32(request, 0);
+    if (ret == 0)
+	ret = krb5_store_creds_tag(request, mcreds);
+    if (ret == 0)
+	ret = krb5_kcm_call(context, request, &response, &response_data);
+    krb5_storage_free(request);
+    if (ret)
+	return ret;
+
+    ret = krb5_ret_creds(response, &creds);
+    if (ret == 0)
+	krb5_free_cred_contents(context, &creds);
+    krb5_storage_free(response);
+    krb5_data_free(&response_data);
+    return ret;
+}
+
+static void
+fill_cache(krb5_context context, krb5_ccache id, krb5_principal client)
+{
+    krb5_error_code ret;
+    krb5_creds creds;
+    int i;
+
+    ret = krb5_cc_initialize(context, id, client);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_cc_initialize");
+
+    /* Fake credentials: kcm doesn't look inside them */
+    for (i = 0; i < num_creds; i++) {
+	memset(&creds, 0, sizeof(creds));
+	ret = krb5_copy_principal(context, client, &creds.client);
+	if (ret == 0)
+	    ret = make_server(context, i, &creds.server);
+	if (ret == 0)
+	    ret = krb5_data_alloc(&creds.session.keyvalue, 32);
+	if (ret == 0)
+	    ret = krb5_data_alloc(&creds.ticket, 300);
+	if (ret)
+	    krb5_err(context, 1, ret, "making credentials");
+	creds.session.keytype = ETYPE_AES256_CTS_HMAC_SHA1_96;
+	memset(creds.session.keyvalue.data, 0, creds.session.keyvalue.length);
+	memset(creds.ticket.data, 0, creds.ticket.length);
+	creds.times.authtime = creds.times.starttime = time(NULL);
+	creds.times.endtime = creds.times.starttime + 36000;
+
+	ret = krb5_cc_store_cred(context, id, &creds);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_cc_store_cred");
+	krb5_free_cred_contents(context, &creds);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_principal client;
+    krb5_ccache *ids;
+    krb5_error_code ret;
+    double start, sum = 0, *lat;
+    int optidx = 0;
+    int i;
+
+    setprogname(argv[0]);
+
+    if (getarg(args, num_args, argc, argv, &optidx))
+	usage(1);
+
+    if (help_flag)
+	usage(0);
+
+    if (version_flag) {
+	print_version(NULL);
+	exit(0);
+    }
+
+    if (num_caches <= 0 || num_creds <= 0 || num_calls <= 0)
+	usage(1);
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context failed: %d", ret);
+
+    ret = krb5_parse_name(context, client_string, &client);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name: %s", client_string);
+
+    ids = ecalloc(num_caches, sizeof(ids[0]));
+    lat = ecalloc(num_calls, sizeof(lat[0]));
+
+    start = now_us();
+    for (i = 0; i < num_caches; i++) {
+	char *name;
+
+	if (asprintf(&name, "KCM:bench%d", i) == -1 || name == NULL)
+	    errx(1, "out of memory");
+	ret = krb5_cc_resolve(context, name, &ids[i]);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_cc_resolve: %s", name);
+	free(name);
+	fill_cache(context, ids[i], client);
+    }
+    printf("filled %d caches of %d credentials in %.1f s\n",
+	   num_caches, num_creds, (now_us() - start) / 1e6);
+
+    srand(1);
+    for (i = 0; i < num_calls; i++) {
+	krb5_creds mcreds, creds;
+	int n = rand() % num_caches;
+
+	memset(&mcreds, 0, sizeof(mcreds));
+	mcreds.client = client;
+	ret = make_server(context, rand() % num_creds, &mcreds.server);
+	if (ret)
+	    krb5_err(context, 1, ret, "make_server");
+
+	if (raw_flag) {
+	    char name[32];
+
+	    snprintf(name, sizeof(name), "bench%d", n);
+	    start = now_us();
+	    ret = kcm_retrieve(context, name, &mcreds);
+	    lat[i] = now_us() - start;
+	} else {
+	    start = now_us();
+	    ret = krb5_cc_retrieve_cred(context, ids[n], 0, &mcreds, &creds);
+	    lat[i] = now_us() - start;
+	    if (ret == 0)
+		krb5_free_cred_contents(context, &creds);
+	}
+	if (ret)
+	    krb5_err(context, 1, ret, "retrieve from cache %d", n);
+	krb5_free_principal(context, mcreds.server);
+	sum += lat[i];
+    }
+
+    qsort(lat, num_calls, sizeof(lat[0]), cmp_double);
+    printf("%s: %d calls, mean %.1f us, p50 %.1f us, p99 %.1f us\n",
+	   raw_flag ? "KCM_OP_RETRIEVE" : "krb5_cc_retrieve_cred",
+	   num_calls, sum / num_calls, lat[num_calls / 2],
+	   lat[(num_calls - 1) * 99 / 100]);
+
+    for (i = 0; i < num_caches; i++) {
+	if (destroy_flag)
+	    krb5_cc_destroy(context, ids[i]);
+	else
+	    krb5_cc_close(context, ids[i]);
+    }
+    free(ids);
+    free(lat);
+    krb5_free_principal(context, client);
+    krb5_free_context(context);
+
+    return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "kcm_locl.h"
+
+/*
+ * Worker threads for the requests that need a round trip to a KDC.
+ * Requests are first run on the IPC loop with KCM_CLIENT_NO_KDC; those
+ * that turn out to need the KDC are queued here, run again from the
+ * start by a worker with a krb5_context of its own, and completed by
+ * it.  Meanwhile the loop goes on serving the other clients.
+ */
+
+struct kcm_job {
+    kcm_client client;
+    krb5_data request;
+    heim_ipc_complete complete;
+    heim_sipc_call cctx;
+    struct kcm_job *next;
+};
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+
+static HEIMDAL_MUTEX job_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static struct kcm_job *job_head = NULL;
+static struct kcm_job **job_tail = &job_head;
+static unsigned int num_workers = 0;
+
+static void *
+kcm_worker(void *arg)
+{
+    krb5_context context = arg;
+    struct kcm_job *job;
+    krb5_error_code ret;
+    krb5_data rep;
+
+    for (;;) {
+	HEIMDAL_MUTEX_lock(&job_mutex);
+	while (job_head == NULL)
+	    pthread_cond_wait(&job_cond, &job_mutex);
+	job = job_head;
+	job_head = job->next;
+	if (job_head == NULL)
+	    job_tail = &job_head;
+	HEIMDAL_MUTEX_unlock(&job_mutex);
+
+	krb5_data_zero(&rep);
+	ret = kcm_dispatch(context, &job->client, &job->request, &rep);
+	(*job->complete)(job->cctx, ret, &rep);
+
+	krb5_data_free(&rep);
+	krb5_data_free(&job->request);
+	free(job);
+    }
+
+    return NULL;
+}
+
+krb5_error_code
+kcm_worker_start(unsigned int n)
+{
+    sigset_t all, old;
+    krb5_context wctx;
+    pthread_t thread;
+    krb5_error_code ret = 0;
+
+    /* signals are for the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for (; n > 0; n--) {
+	ret = kcm_context_dup(&wctx);
+	if (ret)
+	    break;
+	ret = pthread_create(&thread, NULL, kcm_worker, wctx);
+	if (ret) {
+	    krb5_free_context(wctx);
+	    break;
+	}
+	pthread_detach(thread);
+	num_workers++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret)
+	kcm_log(0, "failed to start worker threads: %d, %u running",
+		ret, num_workers);
+    return num_workers ? 0 : ret;
+}
+
+krb5_error_code
+kcm_worker_enqueue(const kcm_client *client,
+		   const krb5_data *request,
+		   heim_ipc_complete complete,
+		   heim_sipc_call cctx)
+{
+    struct kcm_job *job;
+    krb5_error_code ret;
+
+    if (num_workers == 0)
+	return EAGAIN;
+
+    job = calloc(1, sizeof(*job));
+    if (job == NULL)
+	return ENOMEM;
+
+    job->client = *client;
+    job->client.flags &= ~KCM_CLIENT_NO_KDC;
+    ret = krb5_data_copy(&job->request, request->data, request->length);
+    if (ret) {
+	free(job);
+	return ret;
+    }
+    job->complete = complete;
+    job->cctx = cctx;
+
+    HEIMDAL_MUTEX_lock(&job_mutex);
+    *job_tail = job;
+    job_tail = &job->next;
+    pthread_cond_signal(&job_cond);
+    HEIMDAL_MUTEX_unlock(&job_mutex);
+
+    return 0;
+}
+
+#else
+
+krb5_error_code
+kcm_worker_start(unsigned int n)
+{
+    return n ? ENOTSUP : 0;
+}
+
+krb5_error_code
+kcm_worker_enqueue(const kcm_client *client,
+		   const krb5_data *request,
+		   heim_ipc_complete complete,
+		   heim_sipc_call cctx)
+{
+    return EAGAIN;
+}
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "kdc_locl.h"
+#include "bench.h"
+
+void
+latency_add(struct latency *l, uint32_t usec)
+{
+    if (l->len == l->alloc) {
+	size_t n = l->alloc ? l->alloc * 2 : 1024;
+	uint32_t *p = realloc(l->val, n * sizeof(l->val[0]));
+
+	if (p == NULL)
+	    errx(1, "out of memory");
+	l->val = p;
+	l->alloc = n;
+    }
+    l->val[l->len++] = usec;
+    l->sorted = 0;
+}
+
+void
+latency_merge(struct latency *to, const struct latency *from)
+{
+    size_t i;
+
+    for (i = 0; i < from->len; i++)
+	latency_add(to, from->val[i]);
+}
+
+static int
+cmp_uint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Nearest-rank percentile, `pct' is 0..100.
+ */
+
+uint32_t
+latency_percentile(struct latency *l, double pct)
+{
+    size_t rank;
+
+    if (l->len == 0)
+	return 0;
+    if (!l->sorted) {
+	qsort(l->val, l->len, sizeof(l->val[0]), cmp_uint32);
+	l->sorted = 1;
+    }
+    rank = (size_t)(pct / 100.0 * l->len + 0.5);
+    if (rank > 0)
+	rank--;
+    if (rank >= l->len)
+	rank = l->len - 1;
+    return l->val[rank];
+}
+
+void
+latency_free(struct latency *l)
+{
+    free(l->val);
+    memset(l, 0, sizeof(*l));
+}
+
+int
+latency_write(int fd, const struct latency *l)
+{
+    uint64_t len = l->len;
+
+    if (net_write(fd, &len, sizeof(len)) != sizeof(len))
+	return errno ? errno : EIO;
+    if (len &&
+	net_write(fd, l->val, len * sizeof(l->val[0])) !=
+	(ssize_t)(len * sizeof(l->val[0])))
+	return errno ? errno : EIO;
+    return 0;
+}
+
+int
+latency_read(int fd, struct latency *l)
+{
+    uint64_t len;
+    uint32_t *p;
+
+    if (net_read(fd, &len, sizeof(len)) != sizeof(len))
+	return EIO;
+    if (len > SIZE_MAX / sizeof(l->val[0]) - l->len)
+	return EOVERFLOW;
+    if (l->len + len > l->alloc) {
+	p = realloc(l->val, (l->len + len) * sizeof(l->val[0]));
+	if (p == NULL)
+	    return ENOMEM;
+	l->val = p;
+	l->alloc = l->len + len;
+    }
+    if (len &&
+	net_read(fd, l->val + l->len, len * sizeof(l->val[0])) !=
+	(ssize_t)(len * sizeof(l->val[0])))
+	return EIO;
+    l->len += len;
+    l->sorted = 0;
+    return 0;
+}
+
+uint32_t
+latency_since(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    timevalsub(&now, start);
+    return now.tv_sec * 1000000 + now.tv_usec;
+}
@@ -65,6 +65,15 @@ const char *request_log;
 /* A string describing on what ports to listen */
 const char *port_str;
 
+/* Which event loop the workers should use ("select" or "epoll") */
+const char *event_loop_str;
+
+/* Should every worker bind its own SO_REUSEPORT sockets? */
+int reuse_port = -1;
+
+/* Should every worker be pinned to a CPU of its own? */
+int pin_workers = -1;
+
 krb5_addresses explicit_addresses;
 
 size_t max_request_udp;
@@ -221,6 +230,15 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
     if (ret)
 	krb5_err(context, 1, ret, "krb5_kdc_set_dbinfo");
 
+    /*
+     * Shared crypto contexts are not locked, so only this program,
+     * which uses its context from one thread, turns the cache on;
+     * applications embedding libkdc decide for themselves.  It is only
+     * an optimisation, so run without it if out of memory.
+     */
+    if (config->crypto_cache_size > 0)
+	(void) krb5_crypto_set_cache_size(context, config->crypto_cache_size);
+
     if(max_request_str)
 	max_request_tcp = max_request_udp = parse_bytes(max_request_str, NULL);
 
@@ -285,6 +303,45 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
     if (port_str == NULL)
 	port_str = "+";
 
+    if (event_loop_str == NULL)
+	event_loop_str = krb5_config_get_string_default(context, NULL,
+							"select", "kdc",
+							"event-loop", NULL);
+
+    if (reuse_port == -1)
+	reuse_port = krb5_config_get_bool_default(context, NULL, FALSE, "kdc",
+						  "reuse-port", NULL);
+    /*
+     * Workers that can't share the ports would fail to bind and be
+     * restarted forever, so check the option is taken before using it.
+     */
+#if defined(HAVE_SETSOCKOPT) && defined(SOL_SOCKET) && defined(SO_REUSEPORT)
+    if (reuse_port) {
+	rk_socket_t s = socket(AF_INET, SOCK_DGRAM, 0);
+	int one = 1;
+
+	if (rk_IS_BAD_SOCKET(s) ||
+	    setsockopt(s, SOL_SOCKET, SO_REUSEPORT,
+		       (void *)&one, sizeof(one)) < 0) {
+	    krb5_warn(context, rk_SOCK_ERRNO,
+		      "reuse-port is not supported, ignoring it");
+	    reuse_port = 0;
+	}
+	if (!rk_IS_BAD_SOCKET(s))
+	    rk_closesocket(s);
+    }
+#else
+    if (reuse_port) {
+	krb5_warnx(context, "reuse-port is not supported on this platform, "
+		   "ignoring it");
+	reuse_port = 0;
+    }
+#endif
+
+    if (pin_workers == -1)
+	pin_workers = krb5_config_get_bool_default(context, NULL, FALSE, "kdc",
+						   "pin-workers", NULL);
+
     if(disable_des == -1)
 	disable_des = krb5_config_get_bool_default(context, NULL,
 						   FALSE,
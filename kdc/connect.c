@@ -49,6 +49,16 @@ static struct port_desc *ports;
 static size_t num_ports;
 static pid_t bonjour_pid = -1;
 
+/*
+ * exit status of a reuse-port worker that could not bind its sockets;
+ * the master backs off before forking another one
+ */
+#define KDC_WORKER_NO_SOCKETS	3
+static krb5_boolean worker_bind_failed;
+
+/* set when the worker runs the epoll loop, which has no FD_SETSIZE limit */
+static krb5_boolean using_epoll;
+
 /*
  * add `family, port, protocol' to the list with duplicate suppresion.
  */
@@ -203,6 +213,8 @@ struct descr {
     struct sockaddr *sa;
     socklen_t sock_len;
     char addr_string[128];
+    int tw_next;	/* timer wheel links, indices into the descr array */
+    int tw_prev;
 };
 
 static void
@@ -211,6 +223,7 @@ init_descr(struct descr *d)
     memset(d, 0, sizeof(*d));
     d->sa = (struct sockaddr *)&d->__ss;
     d->s = rk_INVALID_SOCKET;
+    d->tw_next = d->tw_prev = -1;
 }
 
 /*
@@ -265,6 +278,15 @@ init_socket(krb5_context context,
 	int one = 1;
 	setsockopt(d->s, SOL_SOCKET, SO_REUSEADDR, (void *)&one, sizeof(one));
     }
+#endif
+#if defined(HAVE_SETSOCKOPT) && defined(SOL_SOCKET) && defined(SO_REUSEPORT)
+    if (reuse_port) {
+	int one = 1;
+
+	if (setsockopt(d->s, SOL_SOCKET, SO_REUSEPORT,
+		       (void *)&one, sizeof(one)) < 0)
+	    krb5_warn(context, errno, "setsockopt(SO_REUSEPORT)");
+    }
 #endif
     d->type = type;
     d->port = port;
@@ -311,7 +333,9 @@ init_sockets(krb5_context context,
     krb5_addresses addresses;
 
     if (explicit_addresses.len) {
-	addresses = explicit_addresses;
+	ret = krb5_copy_addresses(context, &explicit_addresses, &addresses);
+	if (ret)
+	    krb5_err (context, 1, ret, "krb5_copy_addresses");
     } else {
 	ret = krb5_get_all_server_addrs (context, &addresses);
 	if (ret)
@@ -561,7 +585,7 @@ add_new_tcp (krb5_context context,
     }
 
 #ifdef FD_SETSIZE
-    if (s >= FD_SETSIZE) {
+    if (!using_epoll && s >= FD_SETSIZE) {
 	krb5_warnx(context, "socket FD too large");
 	rk_closesocket (s);
 	return;
@@ -931,8 +955,8 @@ next_min_free(krb5_context context, struct descr **d, unsigned int *ndescr)
 }
 
 static void
-loop(krb5_context context, krb5_kdc_configuration *config,
-     struct descr **dp, unsigned int *ndescrp, int islive)
+loop_select(krb5_context context, krb5_kdc_configuration *config,
+	    struct descr **dp, unsigned int *ndescrp, int islive)
 {
     struct descr *d = *dp;
     unsigned int ndescr = *ndescrp;
@@ -944,6 +968,11 @@ loop(krb5_context context, krb5_kdc_configuration *config,
 	int max_fd = 0;
 	size_t i;
 
+	if (stats_flag) {
+	    stats_flag = 0;
+	    krb5_kdc_stats_log(context, config);
+	}
+
 	FD_ZERO(&fds);
         if (islive > -1) {
             FD_SET(islive, &fds);
@@ -998,6 +1027,236 @@ loop(krb5_context context, krb5_kdc_configuration *config,
 		}
 	}
     }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/*
+ * A timer wheel for expiring TCP connections in the epoll loop, so
+ * that a wakeup does not have to look at every descriptor.  Every
+ * connection gets the same TCP_TIMEOUT, so one slot per second and a
+ * few more slots than the timeout is all that is needed.
+ */
+
+#define TW_SLOTS (TCP_TIMEOUT + 2)
+
+struct timer_wheel {
+    int slot[TW_SLOTS];
+    time_t last;	/* slots up to and including this second are done */
+    size_t count;
+};
+
+static void
+tw_init(struct timer_wheel *tw, time_t now)
+{
+    size_t i;
+
+    for (i = 0; i < TW_SLOTS; i++)
+	tw->slot[i] = -1;
+    tw->last = now - 1;
+    tw->count = 0;
+}
+
+static void
+tw_insert(struct timer_wheel *tw, struct descr *d, int idx)
+{
+    int *head = &tw->slot[d[idx].timeout % TW_SLOTS];
+
+    d[idx].tw_prev = -1;
+    d[idx].tw_next = *head;
+    if (*head != -1)
+	d[*head].tw_prev = idx;
+    *head = idx;
+    tw->count++;
+}
+
+static void
+tw_remove(struct timer_wheel *tw, struct descr *d, int idx)
+{
+    int *head = &tw->slot[d[idx].timeout % TW_SLOTS];
+
+    if (d[idx].tw_prev != -1)
+	d[d[idx].tw_prev].tw_next = d[idx].tw_next;
+    else if (*head == idx)
+	*head = d[idx].tw_next;
+    else
+	return; /* not linked */
+    if (d[idx].tw_next != -1)
+	d[d[idx].tw_next].tw_prev = d[idx].tw_prev;
+    d[idx].tw_next = d[idx].tw_prev = -1;
+    tw->count--;
+}
+
+/*
+ * Expire the connections whose timeout is before `now', same as the
+ * select loop does.
+ */
+
+static void
+tw_expire(krb5_context context, krb5_kdc_configuration *config,
+	  struct timer_wheel *tw, struct descr *d, time_t now)
+{
+    if (now - 1 - tw->last > TW_SLOTS)
+	tw->last = now - 1 - TW_SLOTS;
+
+    while (tw->last < now - 1) {
+	int idx, next;
+
+	tw->last++;
+	for (idx = tw->slot[tw->last % TW_SLOTS]; idx != -1; idx = next) {
+	    next = d[idx].tw_next;
+	    if (d[idx].timeout >= now)
+		continue;
+	    tw_remove(tw, d, idx);
+	    kdc_log(context, config, 2,
+		    "TCP-connection from %s expired after %lu bytes",
+		    d[idx].addr_string, (unsigned long)d[idx].len);
+	    clear_descr(&d[idx]);
+	}
+    }
+}
+
+#define EPOLL_MAX_EVENTS 64
+#define EPOLL_ISLIVE ((uint32_t)-1)
+
+static int
+epoll_add(int epfd, krb5_socket_t s, uint32_t idx)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = idx;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev);
+}
+
+/*
+ * Same as loop_select(), but the kernel keeps the interest set, so the
+ * cost of a wakeup depends on the number of ready descriptors rather
+ * than on the number of open ones, and there is no FD_SETSIZE limit.
+ * Closing a connection removes it from the epoll set implicitly.
+ *
+ * Returns -1 if epoll could not be set up, and the caller should fall
+ * back to select.
+ */
+
+static int
+loop_epoll(krb5_context context, krb5_kdc_configuration *config,
+	   struct descr **dp, unsigned int *ndescrp, int islive)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    struct timer_wheel tw;
+    struct descr *d = *dp;
+    unsigned int ndescr = *ndescrp;
+    size_t i;
+    int epfd;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+	krb5_warn(context, errno, "epoll_create1");
+	return -1;
+    }
+    if (islive > -1 && epoll_add(epfd, islive, EPOLL_ISLIVE) == -1) {
+	krb5_warn(context, errno, "epoll_ctl");
+	close(epfd);
+	return -1;
+    }
+    for (i = 0; i < ndescr; i++) {
+	if (rk_IS_BAD_SOCKET(d[i].s))
+	    continue;
+	if (epoll_add(epfd, d[i].s, i) == -1) {
+	    krb5_warn(context, errno, "epoll_ctl");
+	    close(epfd);
+	    return -1;
+	}
+    }
+
+    using_epoll = TRUE;
+    tw_init(&tw, time(NULL));
+
+    while (exit_flag == 0) {
+	int n, k;
+
+	if (stats_flag) {
+	    stats_flag = 0;
+	    krb5_kdc_stats_log(context, config);
+	}
+
+	n = epoll_wait(epfd, events, EPOLL_MAX_EVENTS,
+		       (tw.count ? 1 : TCP_TIMEOUT) * 1000);
+	if (n == -1) {
+	    if (errno != EINTR)
+		krb5_warn(context, errno, "epoll_wait");
+	    n = 0;
+	}
+
+	for (k = 0; k < n; k++) {
+	    uint32_t idx = events[k].data.u32;
+
+	    if (idx == EPOLL_ISLIVE) {
+#ifdef HAVE_FORK
+		handle_islive(islive);
+#endif
+		continue;
+	    }
+	    /* may have been closed by an earlier event in this batch */
+	    if (idx >= ndescr || rk_IS_BAD_SOCKET(d[idx].s))
+		continue;
+
+	    if (d[idx].type == SOCK_DGRAM) {
+		handle_udp(context, config, &d[idx]);
+	    } else if (d[idx].type == SOCK_STREAM && d[idx].timeout == 0) {
+		int min_free = next_min_free(context, dp, ndescrp);
+
+		ndescr = *ndescrp;
+		d = *dp;
+
+		add_new_tcp(context, config, d, idx, min_free);
+		if (min_free == -1 || rk_IS_BAD_SOCKET(d[min_free].s))
+		    continue;
+		if (epoll_add(epfd, d[min_free].s, min_free) == -1) {
+		    krb5_warn(context, errno, "epoll_ctl");
+		    clear_descr(&d[min_free]);
+		    continue;
+		}
+		tw_insert(&tw, d, min_free);
+	    } else if (d[idx].type == SOCK_STREAM) {
+		handle_tcp(context, config, d, idx, -1);
+		if (rk_IS_BAD_SOCKET(d[idx].s))
+		    tw_remove(&tw, d, idx);
+	    }
+	}
+
+	tw_expire(context, config, &tw, d, time(NULL));
+    }
+
+    close(epfd);
+    return 0;
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+static void
+loop(krb5_context context, krb5_kdc_configuration *config,
+     struct descr **dp, unsigned int *ndescrp, int islive)
+{
+    if (strcasecmp(event_loop_str, "epoll") == 0) {
+#ifdef HAVE_SYS_EPOLL_H
+	if (loop_epoll(context, config, dp, ndescrp, islive) != 0) {
+	    kdc_log(context, config, 1,
+		    "epoll event loop unavailable, using select");
+	    loop_select(context, config, dp, ndescrp, islive);
+	}
+#else
+	kdc_log(context, config, 1,
+		"epoll event loop not supported, using select");
+	loop_select(context, config, dp, ndescrp, islive);
+#endif
+    } else {
+	if (strcasecmp(event_loop_str, "select") != 0)
+	    kdc_log(context, config, 1,
+		    "unknown event-loop `%s', using select", event_loop_str);
+	loop_select(context, config, dp, ndescrp, islive);
+    }
 
     switch (exit_flag) {
     case -1:
@@ -1096,6 +1355,10 @@ reap_kid(krb5_context context, krb5_kdc_configuration *config,
         }
     }
 
+    if (ret && WIFEXITED(status) &&
+        WEXITSTATUS(status) == KDC_WORKER_NO_SOCKETS)
+        worker_bind_failed = TRUE;
+
     if (WIFEXITED(status))
         kdc_log(context, config, level,
                 "%sKDC reaped %s process: %d, exit status: %d",
@@ -1127,6 +1390,41 @@ reap_kids(krb5_context context, krb5_kdc_configuration *config,
     return reaped;
 }
 
+#ifdef HAVE_SCHED_SETAFFINITY
+/*
+ * Pin the calling worker to the `n'th CPU (modulo the number of CPUs)
+ * of the set it is allowed to run on.
+ */
+
+static void
+pin_worker(krb5_context context, krb5_kdc_configuration *config, int n)
+{
+    cpu_set_t allowed, set;
+    int cpu, count;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+	kdc_log(context, config, 1, "sched_getaffinity: %s", strerror(errno));
+	return;
+    }
+    count = CPU_COUNT(&allowed);
+    if (count < 2)
+	return;
+    n %= count;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+	    break;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+	kdc_log(context, config, 1, "sched_setaffinity(%d): %s",
+		cpu, strerror(errno));
+    else
+	kdc_log(context, config, 4, "KDC worker process %d pinned to CPU %d",
+		(int)getpid(), cpu);
+}
+#endif
+
 static void
 select_sleep(int microseconds)
 {
@@ -1189,6 +1487,20 @@ start_kdc(krb5_context context,
 	krb5_errx(context, 1, "No sockets!");
 
 #ifdef HAVE_FORK
+    /*
+     * With reuse-port every worker binds sockets of its own, and the
+     * kernel spreads flows over them instead of waking every worker for
+     * every datagram.  The master's sockets only show that we can bind;
+     * left open, they would get their share of the traffic and nobody
+     * would read it.
+     */
+    if (reuse_port && !testing_flag) {
+	for (i = 0; i < ndescr; ++i)
+	    clear_descr(&d[i]);
+	free(d);
+	d = NULL;
+	ndescr = 0;
+    }
 
 # ifdef __APPLE__
     if (do_bonjour < 0)
@@ -1207,6 +1519,16 @@ start_kdc(krb5_context context,
         /* Note that we might never execute the body of this loop */
         while (exit_flag == 0) {
 
+#ifdef SIGUSR1
+            /* the workers have the statistics, pass the signal on */
+            if (stats_flag) {
+                stats_flag = 0;
+                for (i = 0; i < max_kdcs; i++)
+                    if (pids[i] > 0)
+                        kill(pids[i], SIGUSR1);
+            }
+#endif
+
             if (num_kdcs >= max_kdcs) {
                 num_kdcs -= reap_kid(context, config, pids, max_kdcs, 0);
                 continue;
@@ -1215,10 +1537,35 @@ start_kdc(krb5_context context,
             if (num_kdcs > 0)
                 num_kdcs -= reap_kids(context, config, pids, max_kdcs);
 
+            if (worker_bind_failed) {
+                /* don't respawn workers that can't bind in a tight loop */
+                worker_bind_failed = FALSE;
+                kdc_log(context, config, 1,
+                        "KDC worker process could not bind its sockets");
+                sleep(10);
+                continue;
+            }
+
+            for (i = 0; i < max_kdcs; i++) {
+                if (pids[i] <= 0)
+                    break;
+            }
+
             pid = fork();
             switch (pid) {
             case 0:
                 close(islive[0]);
+#ifdef HAVE_SCHED_SETAFFINITY
+                if (pin_workers)
+                    pin_worker(context, config, i);
+#endif
+                if (reuse_port) {
+                    ndescr = init_sockets(context, config, &d);
+                    if (ndescr <= 0) {
+                        kdc_log(context, config, 0, "No sockets!");
+                        exit(KDC_WORKER_NO_SOCKETS);
+                    }
+                }
                 loop(context, config, &d, &ndescr, islive[1]);
                 exit(0);
             case -1:
@@ -1228,13 +1575,9 @@ start_kdc(krb5_context context,
                 sleep(10);
                 break;
             default:
-		for (i = 0; i < max_kdcs; i++) {
-		    if (pids[i] <= 0) {
-			pids[i] = pid;
-			break;
-		    }
-		}
-                if (i >= max_kdcs) {
+                if (i < max_kdcs) {
+                    pids[i] = pid;
+                } else {
                     /* This should not happen */
                     kdc_log(context, config, 1,
                             "warning: forked untracked child process: %d",
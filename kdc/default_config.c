@@ -107,6 +107,10 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
     c->enable_derived_keys = FALSE;
     c->derived_keys_ndots = 2;
     c->derived_keys_maxdots = -1;
+    c->db_keep_open = FALSE;
+    c->db_cache_size = 0;
+    c->db_cache_lifetime = 10;
+    c->crypto_cache_size = 0;
 
     c->num_kdc_processes =
         krb5_config_get_int_default(context, NULL, c->num_kdc_processes,
@@ -298,6 +302,41 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
 	krb5_config_get_int_default(context, NULL, c->derived_keys_maxdots,
 				    "kdc", "derived_keys_maxdots", NULL);
 
+    c->db_keep_open =
+	krb5_config_get_bool_default(context, NULL, c->db_keep_open,
+				     "kdc", "hdb-keep-open", NULL);
+
+    c->db_cache_size =
+	krb5_config_get_int_default(context, NULL, c->db_cache_size,
+				    "kdc", "hdb-entry-cache-size", NULL);
+
+    c->db_cache_lifetime =
+	krb5_config_get_time_default(context, NULL, c->db_cache_lifetime,
+				     "kdc", "hdb-entry-cache-lifetime", NULL);
+
+    c->crypto_cache_size =
+	krb5_config_get_int_default(context, NULL, c->crypto_cache_size,
+				    "kdc", "crypto-cache-size", NULL);
+
+    c->phase_stats =
+	krb5_config_get_bool_default(context, NULL, c->phase_stats,
+				     "kdc", "phase-stats", NULL);
+
+    {
+	const char *format, *file;
+	krb5_error_code ret;
+
+	format = krb5_config_get_string_default(context, NULL, "text", "kdc",
+						"audit-format", NULL);
+	file = krb5_config_get_string(context, NULL, "kdc", "audit-file",
+				      NULL);
+	ret = _kdc_audit_sink_init(context, c, format, file);
+	if (ret) {
+	    free(c);
+	    return ret;
+	}
+    }
+
     *config = c;
 
     return 0;
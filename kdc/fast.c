@@ -524,6 +524,23 @@ _kdc_fast_unwrap_request(astgs_request_t r)
     }		
     krb5_data_free(&data);
 
+    /*
+     * The body and padata are replaced with malloc()ed copies below,
+     * so take the request out of the arena first.  What is left in
+     * the arena is released with it at the end of the request.
+     */
+    if (r->req_in_arena) {
+	KDC_REQ req;
+
+	ret = copy_AS_REQ(&r->req, &req);
+	if (ret) {
+	    free_KrbFastReq(&fastreq);
+	    goto out;
+	}
+	r->req = req;
+	r->req_in_arena = 0;
+    }
+
     free_KDC_REQ_BODY(&r->req.req_body);
     ret = copy_KDC_REQ_BODY(&fastreq.req_body, &r->req.req_body);
     if (ret)
@@ -32,11 +32,18 @@
  */
 
 #include "kdc_locl.h"
+#include "bench.h"
 
 static int version_flag;
 static int help_flag;
+static int loops = 1;
+static int quiet_flag;
 
 struct getargs args[] = {
+    { "loops",     0,	arg_integer, &loops,
+      "number of times to replay the log", "number" },
+    { "quiet",     'q',	arg_flag, &quiet_flag,
+      "only print the summary", NULL },
     { "version",   0,	arg_flag, &version_flag, NULL, NULL },
     { "help",     'h',	arg_flag, &help_flag,    NULL, NULL }
 };
@@ -57,7 +64,9 @@ main(int argc, char **argv)
     krb5_context context;
     krb5_kdc_configuration *config;
     krb5_storage *sp;
-    int fd, optidx = 0;
+    struct latency lat;
+    uint64_t total = 0;
+    int fd, optidx = 0, loop = 0;
 
     setprogname(argv[0]);
 
@@ -108,6 +117,8 @@ main(int argc, char **argv)
 
     printf("kdc replay\n");
 
+    memset(&lat, 0, sizeof(lat));
+
     fd = open(argv[1], O_RDONLY);
     if (fd < 0)
 	err(1, "open: %s", argv[1]);
@@ -126,9 +137,11 @@ main(int argc, char **argv)
 	char astr[80];
 
 	ret = krb5_ret_uint32(sp, &t);
-	if (ret == HEIM_ERR_EOF)
+	if (ret == HEIM_ERR_EOF) {
+	    if (++loop < loops && krb5_storage_seek(sp, 0, SEEK_SET) == 0)
+		continue;
 	    break;
-	else if (ret)
+	} else if (ret)
 	    krb5_errx(context, 1, "krb5_ret_uint32(version)");
 	if (t != 1)
 	    krb5_errx(context, 1, "version not 1");
@@ -160,8 +173,9 @@ main(int argc, char **argv)
 	if (ret)
 	    krb5_err(context, 1, ret, "krb5_print_address");
 
-	printf("processing request from %s, %lu bytes\n",
-	       astr, (unsigned long)d.length);
+	if (!quiet_flag)
+	    printf("processing request from %s, %lu bytes\n",
+		   astr, (unsigned long)d.length);
 
 	r.length = 0;
 	r.data = NULL;
@@ -172,9 +186,18 @@ main(int argc, char **argv)
 	krb5_kdc_update_time(&tv);
 	krb5_set_real_time(context, tv.tv_sec, 0);
 
-	ret = krb5_kdc_process_request(context, config, d.data, d.length,
-				       &r, NULL, astr,
-				       (struct sockaddr *)&sa, 0);
+	{
+	    struct timeval start;
+	    uint32_t usec;
+
+	    gettimeofday(&start, NULL);
+	    ret = krb5_kdc_process_request(context, config, d.data, d.length,
+					   &r, NULL, astr,
+					   (struct sockaddr *)&sa, 0);
+	    usec = latency_since(&start);
+	    latency_add(&lat, usec);
+	    total += usec;
+	}
 	if (ret)
 	    krb5_err(context, 1, ret, "krb5_kdc_process_request");
 
@@ -204,8 +227,20 @@ main(int argc, char **argv)
     }
 
     krb5_storage_free(sp);
+    _kdc_audit_sink_free(context, config);
     krb5_free_context(context);
 
+    if (lat.len) {
+	printf("%lu requests, %.2lf req/s in krb5_kdc_process_request\n",
+	       (unsigned long)lat.len,
+	       total ? lat.len * 1000000.0 / total : 0.0);
+	printf("latency usec p50 %lu p99 %lu p999 %lu\n",
+	       (unsigned long)latency_percentile(&lat, 50),
+	       (unsigned long)latency_percentile(&lat, 99),
+	       (unsigned long)latency_percentile(&lat, 99.9));
+    }
+    latency_free(&lat);
+
     printf("done\n");
 
     return 0;
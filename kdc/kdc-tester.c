@@ -35,10 +35,18 @@
 
 #include "kdc_locl.h"
 #include "send_to_kdc_plugin.h"
+#include "bench.h"
+#include <getarg.h>
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
 
 struct perf {
+    const char *name;
     unsigned long as_req;
     unsigned long tgs_req;
+    struct latency as_lat;
+    struct latency tgs_lat;
     struct timeval start;
     struct timeval stop;
     struct perf *next;
@@ -54,6 +62,14 @@ static krb5_context kdc_context;
 static struct sockaddr_storage sa;
 static const char *astr = "0.0.0.0";
 
+/* let libkrb5 send the requests to the realm's KDCs instead */
+static int use_network;
+
+static heim_dict_t results;
+static char *results_file;
+static char *baseline_file;
+static int max_regression = 10;
+
 static void eval_object(heim_object_t);
 
 
@@ -94,6 +110,9 @@ plugin_send_to_realm(krb5_context context,
 {
     int ret;
 
+    if (use_network)
+	return KRB5_PLUGIN_NO_HANDLE;
+
     krb5_kdc_update_time(NULL);
 
     ret = krb5_kdc_process_request(kdc_context, kdc_config,
@@ -115,70 +134,287 @@ static krb5plugin_send_to_kdc_ftable send_to_kdc = {
 };
 
 static void
-perf_start(struct perf *perf)
+perf_start(struct perf *perf, const char *name)
 {
     memset(perf, 0, sizeof(*perf));
 
+    perf->name = name;
     gettimeofday(&perf->start, NULL);
     perf->next = ptop;
     ptop = perf;
 }
 
+static void
+perf_print_latency(const char *what, struct latency *l)
+{
+    printf("%s latency usec p50 %lu p99 %lu p999 %lu\n", what,
+	   (unsigned long)latency_percentile(l, 50),
+	   (unsigned long)latency_percentile(l, 99),
+	   (unsigned long)latency_percentile(l, 99.9));
+}
+
+static void
+perf_set_result(heim_dict_t r, const char *key, double value)
+{
+    heim_string_t k = heim_string_create(key);
+    heim_number_t v = heim_number_create((int)(value + 0.5));
+
+    heim_dict_set_value(r, k, v);
+    heim_release(k);
+    heim_release(v);
+}
+
 static void
 perf_stop(struct perf *perf)
 {
+    double usec, as_ps = 0.0, tgs_ps = 0.0;
+
     gettimeofday(&perf->stop, NULL);
     ptop = perf->next;
 
     if (ptop) {
 	ptop->as_req += perf->as_req;
 	ptop->tgs_req += perf->tgs_req;
+	latency_merge(&ptop->as_lat, &perf->as_lat);
+	latency_merge(&ptop->tgs_lat, &perf->tgs_lat);
     }
 
     timevalsub(&perf->stop, &perf->start);
+    if (perf->name)
+	printf("%s: ", perf->name);
     printf("time: %lu.%06lu\n",
 	   (unsigned long)perf->stop.tv_sec,
 	   (unsigned long)perf->stop.tv_usec);
 
 #define USEC_PER_SEC 1000000
 
+    usec = (double)((perf->stop.tv_sec * USEC_PER_SEC) + perf->stop.tv_usec);
+    if (usec == 0)
+	usec = 1;
+
     if (perf->as_req) {
-	double as_ps = 0.0;
-	as_ps = (perf->as_req * USEC_PER_SEC) / (double)((perf->stop.tv_sec * USEC_PER_SEC) + perf->stop.tv_usec);
+	as_ps = (perf->as_req * USEC_PER_SEC) / usec;
 	printf("as-req/s %.2lf  (total %lu requests)\n", as_ps, perf->as_req);
+	perf_print_latency("as-req", &perf->as_lat);
     }
 	    
     if (perf->tgs_req) {
-	double tgs_ps = 0.0;
-	tgs_ps = (perf->tgs_req * USEC_PER_SEC) / (double)((perf->stop.tv_sec * USEC_PER_SEC) + perf->stop.tv_usec);
+	tgs_ps = (perf->tgs_req * USEC_PER_SEC) / usec;
 	printf("tgs-req/s %.2lf (total %lu requests)\n", tgs_ps, perf->tgs_req);
+	perf_print_latency("tgs-req", &perf->tgs_lat);
     }
+
+    if (perf->name) {
+	heim_dict_t r = heim_dict_create(11);
+	heim_string_t k = heim_string_create(perf->name);
+
+	if (perf->as_req) {
+	    perf_set_result(r, "as-req/s", as_ps);
+	    perf_set_result(r, "as-req-p50",
+			    latency_percentile(&perf->as_lat, 50));
+	    perf_set_result(r, "as-req-p99",
+			    latency_percentile(&perf->as_lat, 99));
+	    perf_set_result(r, "as-req-p999",
+			    latency_percentile(&perf->as_lat, 99.9));
+	}
+	if (perf->tgs_req) {
+	    perf_set_result(r, "tgs-req/s", tgs_ps);
+	    perf_set_result(r, "tgs-req-p50",
+			    latency_percentile(&perf->tgs_lat, 50));
+	    perf_set_result(r, "tgs-req-p99",
+			    latency_percentile(&perf->tgs_lat, 99));
+	    perf_set_result(r, "tgs-req-p999",
+			    latency_percentile(&perf->tgs_lat, 99.9));
+	}
+	heim_dict_set_value(results, k, r);
+	heim_release(k);
+	heim_release(r);
+    }
+
+    latency_free(&perf->as_lat);
+    latency_free(&perf->tgs_lat);
 }
 
 /*
  *
  */
 
+static void
+repeat_loop(heim_object_t or, int num, int secs)
+{
+    struct timeval start;
+    int i;
+
+    gettimeofday(&start, NULL);
+
+    for (i = 0; num == 0 || i < num; i++) {
+	if (secs && latency_since(&start) >= (uint32_t)secs * 1000000)
+	    break;
+	eval_object(or);
+    }
+}
+
+/*
+ * Run the loop in `nprocs' forked copies of the tester, each with its
+ * own in-process KDC (or its own connections to the real one), and
+ * collect their counts and latencies into `perf'.
+ */
+
+static void
+repeat_procs(struct perf *perf, heim_object_t or, int num, int secs,
+	     int nprocs)
+{
+    pid_t *pids;
+    int *fds;
+    int i, status;
+
+    pids = calloc(nprocs, sizeof(pids[0]));
+    fds = calloc(nprocs, sizeof(fds[0]));
+    if (pids == NULL || fds == NULL)
+	errx(1, "out of memory");
+
+    fflush(stdout);
+    fflush(stderr);
+
+    for (i = 0; i < nprocs; i++) {
+	int fd[2];
+
+	if (pipe(fd) < 0)
+	    err(1, "pipe");
+	pids[i] = fork();
+	if (pids[i] < 0)
+	    err(1, "fork");
+	if (pids[i] == 0) {
+	    uint64_t counts[2];
+
+	    close(fd[0]);
+	    repeat_loop(or, num, secs);
+	    counts[0] = perf->as_req;
+	    counts[1] = perf->tgs_req;
+	    if (net_write(fd[1], counts, sizeof(counts)) != sizeof(counts) ||
+		latency_write(fd[1], &perf->as_lat) ||
+		latency_write(fd[1], &perf->tgs_lat))
+		_exit(1);
+	    _exit(0);
+	}
+	close(fd[1]);
+	fds[i] = fd[0];
+    }
+
+    for (i = 0; i < nprocs; i++) {
+	uint64_t counts[2];
+
+	if (net_read(fds[i], counts, sizeof(counts)) != sizeof(counts) ||
+	    latency_read(fds[i], &perf->as_lat) ||
+	    latency_read(fds[i], &perf->tgs_lat))
+	    errx(1, "lost results from worker %d", i);
+	perf->as_req += counts[0];
+	perf->tgs_req += counts[1];
+	close(fds[i]);
+    }
+    for (i = 0; i < nprocs; i++) {
+	if (waitpid(pids[i], &status, 0) < 0)
+	    err(1, "waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	    errx(1, "worker %d failed", i);
+    }
+
+    free(pids);
+    free(fds);
+}
+
+static int
+dict_get_int(heim_dict_t o, heim_string_t key, int def)
+{
+    heim_object_t v = heim_dict_get_value(o, key);
+
+    if (v == NULL)
+	return def;
+    heim_assert(heim_get_tid(v) == heim_number_get_type_id(),
+		"expected a number");
+    return heim_number_get_int(v);
+}
+
 static void
 eval_repeat(heim_dict_t o)
 {
     heim_object_t or = heim_dict_get_value(o, HSTR("value"));
-    heim_number_t n = heim_dict_get_value(o, HSTR("num"));
-    int i, num;
+    heim_string_t name = heim_dict_get_value(o, HSTR("name"));
+    heim_string_t transport = heim_dict_get_value(o, HSTR("transport"));
+    int num, secs, nprocs;
+    int saved_network = use_network;
     struct perf perf;
 
-    perf_start(&perf);
-
     heim_assert(or != NULL, "value missing");
-    heim_assert(n != NULL, "num missing");
 
-    num = heim_number_get_int(n);
+    num = dict_get_int(o, HSTR("num"), 0);
+    secs = dict_get_int(o, HSTR("duration"), 0);
+    nprocs = dict_get_int(o, HSTR("procs"), 1);
     heim_assert(num >= 0, "num >= 0");
+    heim_assert(secs >= 0, "duration >= 0");
+    heim_assert(num > 0 || secs > 0, "num or duration missing");
+    heim_assert(nprocs >= 1, "procs >= 1");
+
+    if (transport) {
+	const char *t = heim_string_get_utf8(transport);
+
+	if (strcmp(t, "network") == 0)
+	    use_network = 1;
+	else if (strcmp(t, "in-process") == 0)
+	    use_network = 0;
+	else
+	    errx(1, "unknown transport %s", t);
+    }
 
-    for (i = 0; i < num; i++)
-	eval_object(or);
+    perf_start(&perf, name ? heim_string_get_utf8(name) : NULL);
+
+    if (nprocs > 1)
+	repeat_procs(&perf, or, num, secs, nprocs);
+    else
+	repeat_loop(or, num, secs);
 
     perf_stop(&perf);
+
+    use_network = saved_network;
+}
+
+/*
+ * Pick one of the "values" at random, in proportion to their
+ * "weight", to get a mix of request types inside a repeat.
+ */
+
+static void
+eval_mix(heim_dict_t o)
+{
+    heim_array_t values = heim_dict_get_value(o, HSTR("values"));
+    size_t i, len;
+    unsigned long total = 0, pick;
+
+    heim_assert(values != NULL, "values missing");
+    heim_assert(heim_get_tid(values) == heim_array_get_type_id(),
+		"values not an array");
+
+    len = heim_array_get_length(values);
+    heim_assert(len > 0, "values empty");
+    for (i = 0; i < len; i++)
+	total += dict_get_int(heim_array_get_value(values, i),
+			      HSTR("weight"), 1);
+    heim_assert(total > 0, "weights sum to 0");
+
+    pick = (unsigned long)rk_random() % total;
+    for (i = 0; i < len; i++) {
+	heim_dict_t v = heim_array_get_value(values, i);
+	unsigned long w = dict_get_int(v, HSTR("weight"), 1);
+
+	if (pick < w) {
+	    heim_object_t or = heim_dict_get_value(v, HSTR("value"));
+
+	    heim_assert(or != NULL, "value missing");
+	    eval_object(or);
+	    return;
+	}
+	pick -= w;
+    }
 }
 
 /*
@@ -216,6 +452,7 @@ eval_kinit(heim_dict_t o)
     krb5_keytab ktmem = NULL;
     krb5_ccache fast_cc = NULL;
     krb5_error_code ret;
+    struct timeval start;
 
     if (ptop)
 	ptop->as_req++;
@@ -299,9 +536,12 @@ eval_kinit(heim_dict_t o)
 	    krb5_err(kdc_context, 1, ret, "krb5_init_creds_set_keytab");
     }
 
+    gettimeofday(&start, NULL);
     ret = krb5_init_creds_get(kdc_context, ctx);
     if (ret)
 	krb5_err(kdc_context, 1, ret, "krb5_init_creds_get");
+    if (ptop)
+	latency_add(&ptop->as_lat, latency_since(&start));
 
     if (ccache) {
 	const char *name = heim_string_get_utf8(ccache);
@@ -347,6 +587,7 @@ eval_kgetcred(heim_dict_t o)
     krb5_ccache cc = NULL;
     krb5_principal s;
     krb5_creds *out = NULL;
+    struct timeval start;
 
     if (ptop)
 	ptop->tgs_req++;
@@ -378,9 +619,12 @@ eval_kgetcred(heim_dict_t o)
     if (heim_bool_val(nostore))
 	krb5_get_creds_opt_add_options(kdc_context, opt, KRB5_GC_NO_STORE);
 
+    gettimeofday(&start, NULL);
     ret = krb5_get_creds(kdc_context, opt, cc, s, &out);
     if (ret)
 	krb5_err(kdc_context, 1, ret, "krb5_get_creds");
+    if (ptop)
+	latency_add(&ptop->tgs_lat, latency_since(&start));
     
     krb5_free_creds(kdc_context, out);
     krb5_free_principal(kdc_context, s);
@@ -413,6 +657,29 @@ eval_kdestroy(heim_dict_t o)
 }
 
 
+/*
+ * Run a shell command between requests, e.g. kadmin changing an entry
+ * the kdc has already looked up.
+ */
+
+static void
+eval_system(heim_dict_t o)
+{
+    heim_string_t command = heim_dict_get_value(o, HSTR("command"));
+    const char *cmd;
+    int status;
+
+    heim_assert(command != NULL, "command missing");
+
+    cmd = heim_string_get_utf8(command);
+    status = system(cmd);
+    if (status == -1)
+	err(1, "system: %s", cmd);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	errx(1, "%s: failed", cmd);
+}
+
+
 /*
  *
  */
@@ -437,12 +704,16 @@ eval_object(heim_object_t o)
 
 	if (strcmp(op, "repeat") == 0) {
 	    eval_repeat(o);
+	} else if (strcmp(op, "mix") == 0) {
+	    eval_mix(o);
 	} else if (strcmp(op, "kinit") == 0) {
 	    eval_kinit(o);
 	} else if (strcmp(op, "kgetcred") == 0) {
 	    eval_kgetcred(o);
 	} else if (strcmp(op, "kdestroy") == 0) {
 	    eval_kdestroy(o);
+	} else if (strcmp(op, "system") == 0) {
+	    eval_system(o);
 	} else {
 	    errx(1, "unsupported ops %s", op);
 	}
@@ -452,11 +723,129 @@ eval_object(heim_object_t o)
 }
 
 
+/*
+ * Compare the named results with an earlier run, a throughput drop or
+ * latency increase of more than max_regression percent is a failure.
+ */
+
+struct compare {
+    heim_dict_t baseline;
+    int regressions;
+};
+
+static void
+compare_result(heim_object_t key, heim_object_t value, void *ptr)
+{
+    static const struct {
+	const char *metric;
+	int higher_is_better;
+    } metrics[] = {
+	{ "as-req/s", 1 },
+	{ "as-req-p50", 0 },
+	{ "as-req-p99", 0 },
+	{ "tgs-req/s", 1 },
+	{ "tgs-req-p50", 0 },
+	{ "tgs-req-p99", 0 }
+    };
+    struct compare *c = ptr;
+    heim_dict_t base = heim_dict_get_value(c->baseline, key);
+    const char *name = heim_string_get_utf8(key);
+    size_t i;
+
+    if (base == NULL) {
+	printf("%s: not in baseline\n", name);
+	return;
+    }
+
+    for (i = 0; i < sizeof(metrics)/sizeof(metrics[0]); i++) {
+	heim_string_t m = heim_string_create(metrics[i].metric);
+	heim_number_t b = heim_dict_get_value(base, m);
+	heim_number_t n = heim_dict_get_value(value, m);
+	double bv, nv, change;
+	int bad;
+
+	heim_release(m);
+	if (b == NULL || n == NULL)
+	    continue;
+	bv = heim_number_get_int(b);
+	nv = heim_number_get_int(n);
+	change = bv ? (nv - bv) * 100.0 / bv : 0.0;
+	if (metrics[i].higher_is_better)
+	    bad = change < -max_regression;
+	else
+	    bad = change > max_regression;
+	printf("%s %s: baseline %.0lf now %.0lf (%+.1lf%%)%s\n",
+	       name, metrics[i].metric, bv, nv, change,
+	       bad ? " REGRESSION" : "");
+	c->regressions += bad;
+    }
+}
+
+static int
+compare_baseline(const char *file)
+{
+    struct compare c;
+    void *buf;
+    size_t size;
+
+    if (rk_undumpdata(file, &buf, &size))
+	errx(1, "undumpdata: %s", file);
+    c.baseline = heim_json_create_with_bytes(buf, size, 10, 0, NULL);
+    free(buf);
+    if (c.baseline == NULL ||
+	heim_get_tid(c.baseline) != heim_dict_get_type_id())
+	errx(1, "%s: not a results file", file);
+    c.regressions = 0;
+
+    heim_dict_iterate_f(results, &c, compare_result);
+    heim_release(c.baseline);
+
+    if (c.regressions)
+	printf("%d regression%s against %s\n", c.regressions,
+	       c.regressions == 1 ? "" : "s", file);
+    return c.regressions ? 1 : 0;
+}
+
+static void
+write_results(const char *file)
+{
+    heim_string_t s;
+    const char *str;
+
+    s = heim_json_copy_serialize(results, 0, NULL);
+    if (s == NULL)
+	errx(1, "could not serialize results");
+    str = heim_string_get_utf8(s);
+    rk_dumpdata(file, str, strlen(str));
+    heim_release(s);
+}
+
+static int help_flag;
+
+static struct getargs tester_args[] = {
+    {	"results",	0,	arg_string,	&results_file,
+	"write the named repeat results to this file", "file" },
+    {	"baseline",	0,	arg_string,	&baseline_file,
+	"compare the named repeat results with this file", "file" },
+    {	"max-regression", 0,	arg_integer,	&max_regression,
+	"percent change that fails the baseline comparison", "percent" },
+    {	"help",		'h',	arg_flag,	&help_flag, NULL, NULL }
+};
+
+static void
+tester_usage(int ret)
+{
+    arg_printusage(tester_args, sizeof(tester_args)/sizeof(tester_args[0]),
+		   NULL, "");
+    exit(ret);
+}
+
 int
 main(int argc, char **argv)
 {
     krb5_error_code ret;
     int optidx = 0;
+    int ec = 0;
 
     setprogname(argv[0]);
 
@@ -478,6 +867,18 @@ main(int argc, char **argv)
     if (argc == 0)
 	errx(1, "missing operations");
 
+    /* tester options follow the operations file */
+    optidx = 0;
+    if (getarg(tester_args, sizeof(tester_args)/sizeof(tester_args[0]),
+	       argc, argv, &optidx))
+	tester_usage(1);
+    if (help_flag)
+	tester_usage(0);
+    if (optidx != argc)
+	tester_usage(1);
+
+    results = heim_dict_create(11);
+
     krb5_plugin_register(kdc_context, PLUGIN_TYPE_DATA,
 			 KRB5_PLUGIN_SEND_TO_KDC, &send_to_kdc);
 
@@ -503,6 +904,16 @@ main(int argc, char **argv)
 	heim_release(o);
     }
 
+    if (kdc_config->phase_stats)
+	krb5_kdc_stats_log(kdc_context, kdc_config);
+
+    if (results_file)
+	write_results(results_file);
+    if (baseline_file)
+	ec = compare_baseline(baseline_file);
+    heim_release(results);
+
+    _kdc_audit_sink_free(kdc_context, kdc_config);
     krb5_free_context(kdc_context);
-    return 0;
+    return ec;
 }
@@ -51,6 +51,8 @@ enum krb5_kdc_trpolicy {
     TRPOLICY_ALWAYS_HONOUR_REQUEST
 };
 
+struct heim_svc_audit_record;
+
 typedef struct krb5_kdc_configuration {
     krb5_boolean require_preauth; /* require preauth for all principals */
     time_t kdc_warn_pwexpire; /* time before expiration to print a warning */
@@ -100,6 +102,17 @@ typedef struct krb5_kdc_configuration {
     int derived_keys_maxdots;
 
     const char *app;
+
+    /* new fields go after app, so that its offset does not change */
+    krb5_boolean db_keep_open;
+    size_t db_cache_size;
+    time_t db_cache_lifetime;
+    size_t crypto_cache_size;	/* only acted on by the kdc program */
+    krb5_boolean phase_stats;
+
+    /* receives structured audit records instead of the kdc log */
+    void (*audit_sink)(void *, const struct heim_svc_audit_record *);
+    void *audit_sink_ctx;
 } krb5_kdc_configuration;
 
 typedef struct kdc_request_desc *kdc_request_t;
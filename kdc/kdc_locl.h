@@ -68,6 +68,8 @@ struct astgs_request_desc {
 
     /* Both AS and TGS */
     KDC_REQ req;
+    heim_asn1_arena *arena;	/* decoding memory for the whole request */
+    unsigned int req_in_arena:1;	/* req was decoded into arena */
 
     /* Only AS */
     METHOD_DATA *padata;
@@ -112,14 +114,35 @@ typedef struct kx509_req_context_desc {
 #undef heim_pconfig
 #undef heim_pcontext
 
+/* stages timed by _kdc_stats_mark(), see stats.c */
+enum kdc_stat {
+    KDC_STAT_AS_FAST = 0,
+    KDC_STAT_AS_DB,
+    KDC_STAT_AS_PREAUTH,
+    KDC_STAT_AS_POLICY,
+    KDC_STAT_AS_REPLY,
+    KDC_STAT_AS_TOTAL,
+    KDC_STAT_TGS_PARSE,
+    KDC_STAT_TGS_PAC,
+    KDC_STAT_TGS_POLICY,
+    KDC_STAT_TGS_REPLY,
+    KDC_STAT_TGS_TOTAL,
+    KDC_STAT_DB_FETCH,
+    KDC_STAT_MAX
+};
+
 extern sig_atomic_t exit_flag;
+extern sig_atomic_t stats_flag;
 extern size_t max_request_udp;
 extern size_t max_request_tcp;
 extern const char *request_log;
 extern const char *port_str;
+extern const char *event_loop_str;
 extern krb5_addresses explicit_addresses;
 
 extern int enable_http;
+extern int reuse_port;
+extern int pin_workers;
 
 extern int detach_from_console;
 extern int daemon_child;
@@ -367,15 +367,13 @@ _kdc_log_timestamp(astgs_request_t r, const char *type,
 	endtime_str[100], renewtime_str[100];
 
     if (authtime)
-	_kdc_audit_addkv((kdc_request_t)r, 0, "auth", "%ld", (long)authtime);
+	_kdc_audit_setkv_number((kdc_request_t)r, "auth", authtime);
     if (starttime && *starttime)
-	_kdc_audit_addkv((kdc_request_t)r, 0, "start", "%ld",
-			 (long)*starttime);
+	_kdc_audit_setkv_number((kdc_request_t)r, "start", *starttime);
     if (endtime)
-	_kdc_audit_addkv((kdc_request_t)r, 0, "end", "%ld", (long)endtime);
+	_kdc_audit_setkv_number((kdc_request_t)r, "end", endtime);
     if (renew_till && *renew_till)
-	_kdc_audit_addkv((kdc_request_t)r, 0, "renew", "%ld",
-			 (long)*renew_till);
+	_kdc_audit_setkv_number((kdc_request_t)r, "renew", *renew_till);
 
     krb5_format_time(context, authtime,
 		     authtime_str, sizeof(authtime_str), TRUE);
@@ -789,8 +787,8 @@ pa_enc_ts_validate(astgs_request_t r, const PA_DATA *pa)
 	str = NULL;
     _kdc_r_log(r, 4, "ENC-TS Pre-authentication succeeded -- %s using %s",
 	       r->cname, str ? str : "unknown enctype");
-    _kdc_audit_addkv((kdc_request_t)r, 0, "pa-etype", "%d",
-		     (int)pa_key->key.keytype);
+    _kdc_audit_setkv_number((kdc_request_t)r, "pa-etype",
+			    pa_key->key.keytype);
     free(str);
 
     ret = 0;
@@ -880,6 +878,49 @@ log_patypes(astgs_request_t r, METHOD_DATA *padata)
     free(str);
 }
 
+/*
+ * The ticket and the reply are encoded with ASN1_MALLOC_ENCODE_HINT(),
+ * guessing their size from the opaque blobs (PAC, ciphertexts, padata)
+ * they carry, so that they are encoded in a single pass.
+ */
+
+#define ENCODE_HINT_SLACK 1024
+
+static size_t
+padata_size_hint(const METHOD_DATA *md)
+{
+    size_t i, n = 0;
+
+    if (md)
+	for (i = 0; i < md->len; i++)
+	    n += md->val[i].padata_value.length;
+    return n;
+}
+
+static size_t
+enc_ticket_size_hint(const EncTicketPart *et)
+{
+    size_t i, n = ENCODE_HINT_SLACK + et->transited.contents.length;
+
+    if (et->authorization_data)
+	for (i = 0; i < et->authorization_data->len; i++)
+	    n += et->authorization_data->val[i].ad_data.length;
+    return n;
+}
+
+static size_t
+enc_kdc_rep_size_hint(const EncKDCRepPart *ek)
+{
+    return ENCODE_HINT_SLACK + padata_size_hint(ek->encrypted_pa_data);
+}
+
+static size_t
+kdc_rep_size_hint(const KDC_REP *rep)
+{
+    return ENCODE_HINT_SLACK + rep->ticket.enc_part.cipher.length +
+	rep->enc_part.cipher.length + padata_size_hint(rep->padata);
+}
+
 /*
  *
  */
@@ -902,7 +943,8 @@ _kdc_encode_reply(krb5_context context,
     krb5_error_code ret;
     krb5_crypto crypto;
 
-    ASN1_MALLOC_ENCODE(EncTicketPart, buf, buf_size, et, &len, ret);
+    ASN1_MALLOC_ENCODE_HINT(EncTicketPart, buf, buf_size, et, &len, ret,
+			    enc_ticket_size_hint(et));
     if(ret) {
 	const char *msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 4, "Failed to encode ticket: %s", msg);
@@ -952,8 +994,9 @@ _kdc_encode_reply(krb5_context context,
 	finished.crealm = et->crealm;
 	finished.cname = et->cname;
 
-	ASN1_MALLOC_ENCODE(Ticket, data.data, data.length,
-			   &rep->ticket, &len, ret);
+	ASN1_MALLOC_ENCODE_HINT(Ticket, data.data, data.length,
+				&rep->ticket, &len, ret,
+				kdc_rep_size_hint(rep));
 	if (ret)
 	    return ret;
 	if (data.length != len)
@@ -1001,9 +1044,11 @@ _kdc_encode_reply(krb5_context context,
     }
 
     if(rep->msg_type == krb_as_rep && !config->encode_as_rep_as_tgs_rep)
-	ASN1_MALLOC_ENCODE(EncASRepPart, buf, buf_size, ek, &len, ret);
+	ASN1_MALLOC_ENCODE_HINT(EncASRepPart, buf, buf_size, ek, &len, ret,
+				enc_kdc_rep_size_hint(ek));
     else
-	ASN1_MALLOC_ENCODE(EncTGSRepPart, buf, buf_size, ek, &len, ret);
+	ASN1_MALLOC_ENCODE_HINT(EncTGSRepPart, buf, buf_size, ek, &len, ret,
+				enc_kdc_rep_size_hint(ek));
     if(ret) {
 	const char *msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 4, "Failed to encode KDC-REP: %s", msg);
@@ -1033,7 +1078,8 @@ _kdc_encode_reply(krb5_context context,
 				   ckvno,
 				   &rep->enc_part);
 	free(buf);
-	ASN1_MALLOC_ENCODE(AS_REP, buf, buf_size, rep, &len, ret);
+	ASN1_MALLOC_ENCODE_HINT(AS_REP, buf, buf_size, rep, &len, ret,
+				kdc_rep_size_hint(rep));
     } else {
 	krb5_encrypt_EncryptedData(context,
 				   crypto,
@@ -1043,7 +1089,8 @@ _kdc_encode_reply(krb5_context context,
 				   ckvno,
 				   &rep->enc_part);
 	free(buf);
-	ASN1_MALLOC_ENCODE(TGS_REP, buf, buf_size, rep, &len, ret);
+	ASN1_MALLOC_ENCODE_HINT(TGS_REP, buf, buf_size, rep, &len, ret,
+				kdc_rep_size_hint(rep));
     }
     krb5_crypto_destroy(context, crypto);
     if(ret) {
@@ -1788,11 +1835,14 @@ _kdc_as_rep(astgs_request_t r)
     const PA_DATA *pa;
     krb5_boolean is_tgs;
     const char *msg;
+    uint64_t t0, stage_t;
 
     memset(&rep, 0, sizeof(rep));
     error_method.len = 0;
     error_method.val = NULL;
 
+    stage_t = t0 = _kdc_stats_now(config);
+
     /*
      * Look for FAST armor and unwrap
      */
@@ -1801,6 +1851,7 @@ _kdc_as_rep(astgs_request_t r)
 	_kdc_r_log(r, 1, "FAST unwrap request from %s failed: %d", from, ret);
 	goto out;
     }
+    stage_t = _kdc_stats_mark(config, KDC_STAT_AS_FAST, stage_t);
 
     b = &req->req_body;
     f = b->kdc_options;
@@ -1906,6 +1957,7 @@ _kdc_as_rep(astgs_request_t r)
 	ret = KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN;
 	goto out;
     }
+    stage_t = _kdc_stats_mark(config, KDC_STAT_AS_DB, stage_t);
 
     /*
      * Select a session enctype from the list of the crypto system
@@ -2029,6 +2081,7 @@ _kdc_as_rep(astgs_request_t r)
 	if (ret)
 	    goto out;
     }
+    stage_t = _kdc_stats_mark(config, KDC_STAT_AS_PREAUTH, stage_t);
 
     if (r->clientdb->hdb_auth_status) {
 	r->clientdb->hdb_auth_status(context, r->clientdb, r->client,
@@ -2043,6 +2096,7 @@ _kdc_as_rep(astgs_request_t r)
     ret = _kdc_check_access(r, req, &error_method);
     if(ret)
 	goto out;
+    stage_t = _kdc_stats_mark(config, KDC_STAT_AS_POLICY, stage_t);
 
     if (_kdc_is_anon_request(&r->req)) {
 	ret = _kdc_check_anon_policy(r);
@@ -2379,6 +2433,7 @@ _kdc_as_rep(astgs_request_t r)
 			    &r->reply_key, 0, &r->e_text, r->reply);
     if (ret)
 	goto out;
+    _kdc_stats_mark(config, KDC_STAT_AS_REPLY, stage_t);
 
     /*
      * Check if message too large
@@ -2390,6 +2445,7 @@ _kdc_as_rep(astgs_request_t r)
     }
 
 out:
+    _kdc_stats_mark(config, KDC_STAT_AS_TOTAL, t0);
     free_AS_REP(&rep);
 
     /*
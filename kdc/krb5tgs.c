@@ -1190,6 +1190,36 @@ need_referral(krb5_context context, krb5_kdc_configuration *config,
     return _krb5_get_host_realm_int(context, name, FALSE, realms) == 0;
 }
 
+/*
+ * Like krb5_decode_ap_req(), but when the request has an arena the
+ * AP-REQ (and so the Ticket) is decoded into it and must not be freed
+ * with free_AP_REQ().
+ */
+
+static krb5_error_code
+tgs_decode_ap_req(astgs_request_t r, const krb5_data *inbuf,
+		  krb5_ap_req *ap_req)
+{
+    krb5_error_code ret;
+    size_t len;
+
+    if (r->arena == NULL)
+	return krb5_decode_ap_req(r->context, inbuf, ap_req);
+
+    ret = decode_AP_REQ_arena(inbuf->data, inbuf->length, ap_req, &len,
+			      r->arena);
+    if (ret)
+	return ret;
+    krb5_clear_error_message(r->context);
+    if (ap_req->pvno != 5)
+	return KRB5KRB_AP_ERR_BADVERSION;
+    if (ap_req->msg_type != krb_ap_req)
+	return KRB5KRB_AP_ERR_MSG_TYPE;
+    if (ap_req->ticket.tkt_vno != 5)
+	return KRB5KRB_AP_ERR_BADVERSION;
+    return 0;
+}
+
 static krb5_error_code
 tgs_parse_request(astgs_request_t r,
 		  const PA_DATA *tgs_req,
@@ -1230,7 +1260,7 @@ tgs_parse_request(astgs_request_t r,
     *replykey = NULL;
 
     memset(&ap_req, 0, sizeof(ap_req));
-    ret = krb5_decode_ap_req(context, &tgs_req->padata_value, &ap_req);
+    ret = tgs_decode_ap_req(r, &tgs_req->padata_value, &ap_req);
     if(ret){
 	const char *msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 4, "Failed to decode AP-REQ: %s", msg);
@@ -1472,7 +1502,8 @@ next_kvno:
     krb5_auth_con_free(context, ac);
 
 out:
-    free_AP_REQ(&ap_req);
+    if (r->arena == NULL)
+	free_AP_REQ(&ap_req);
 
     return ret;
 }
@@ -1602,6 +1633,7 @@ tgs_build_reply(astgs_request_t priv,
     Key *tkey_check;
     Key *tkey_sign;
     int flags = HDB_F_FOR_TGS_REQ;
+    uint64_t stage_t;
 
     memset(&sessionkey, 0, sizeof(sessionkey));
     memset(&adtkt, 0, sizeof(adtkt));
@@ -1996,11 +2028,13 @@ server_lookup:
 	krb5_free_error_message(context, msg);
     }
 
+    stage_t = _kdc_stats_now(config);
     ret = check_PAC(context, config, cp, NULL,
 		    client, server, krbtgt,
 		    &tkey_check->key,
 		    ekey, &tkey_sign->key,
 		    tgt, &rspac, &signedpath);
+    _kdc_stats_mark(config, KDC_STAT_TGS_PAC, stage_t);
     if (ret) {
 	const char *msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 4,
@@ -2317,11 +2351,13 @@ server_lookup:
 	 * TODO: pass in t->sname and t->realm and build
 	 * a S4U_DELEGATION_INFO blob to the PAC.
 	 */
+	stage_t = _kdc_stats_now(config);
 	ret = check_PAC(context, config, tp, dp,
 			client, server, krbtgt,
 			&clientkey->key,
 			ekey, &tkey_sign->key,
 			&adtkt, &rspac, &ad_signedpath);
+	_kdc_stats_mark(config, KDC_STAT_TGS_PAC, stage_t);
 	if (ret) {
 	    const char *msg = krb5_get_error_message(context, ret);
 	    kdc_log(context, config, 4,
@@ -2372,6 +2408,7 @@ server_lookup:
      * Check flags
      */
 
+    stage_t = _kdc_stats_now(config);
     ret = kdc_check_flags(priv, FALSE);
     if(ret)
 	goto out;
@@ -2398,6 +2435,7 @@ server_lookup:
 	if (ret)
 	    goto out;
     }
+    stage_t = _kdc_stats_mark(config, KDC_STAT_TGS_POLICY, stage_t);
 
     /*
      * If this is an referral, add server referral data to the
@@ -2456,6 +2494,8 @@ server_lookup:
 			 spp,
 			 &rspac,
 			 &enc_pa_data);
+    if (ret == 0)
+	_kdc_stats_mark(config, KDC_STAT_TGS_REPLY, stage_t);
 
 out:
     if (tpn != cpn)
@@ -2517,6 +2557,7 @@ _kdc_tgs_rep(astgs_request_t r)
     int rk_is_subkey = 0;
     time_t *csec = NULL;
     int *cusec = NULL;
+    uint64_t t0 = _kdc_stats_now(config);
 
     if(req->padata == NULL){
 	ret = KRB5KDC_ERR_PREAUTH_REQUIRED; /* XXX ??? */
@@ -2553,6 +2594,7 @@ _kdc_tgs_rep(astgs_request_t r)
 		"Failed parsing TGS-REQ from %s", from);
 	goto out;
     }
+    _kdc_stats_mark(config, KDC_STAT_TGS_PARSE, t0);
 
     {
 	const PA_DATA *pa = _kdc_find_padata(req, &i, KRB5_PADATA_FX_FAST);
@@ -2616,5 +2658,6 @@ out:
 	free(auth_data);
     }
 
+    _kdc_stats_mark(config, KDC_STAT_TGS_TOTAL, t0);
     return ret;
 }
@@ -41,6 +41,7 @@ kdc_openlog(krb5_context context,
 	    krb5_kdc_configuration *config)
 {
     char **s = NULL, **p;
+    int queue_size;
     krb5_initlog(context, "kdc", &config->logf);
     s = krb5_config_get_strings(context, NULL, service, "logging", NULL);
     if(s == NULL)
@@ -57,6 +58,12 @@ kdc_openlog(krb5_context context,
 	krb5_addlog_dest(context, config->logf, ss);
 	free(ss);
     }
+    /* write log files and the audit trail off the request path */
+    queue_size = krb5_config_get_int_default(context, NULL, 0, service,
+					     "async-log-queue-size", NULL);
+    if (queue_size > 0 &&
+	krb5_log_set_async(context, config->logf, queue_size) != 0)
+	krb5_warnx(context, "could not enable asynchronous logging");
     krb5_set_warn_dest(context, config->logf);
 }
 
@@ -108,3 +115,115 @@ kdc_log(krb5_context context,
     free(kdc_log_msg_va(context, config, level, fmt, ap));
     va_end(ap);
 }
+
+/*
+ * The built-in sink for structured audit records: JSON lines or binary
+ * records appended to a file, or JSON in the kdc log at level 3.
+ */
+
+struct audit_sink {
+    krb5_context context;
+    krb5_kdc_configuration *config;
+    int fd;
+    int binary;
+};
+
+static void
+audit_sink(void *ptr, const struct heim_svc_audit_record *rec)
+{
+    struct audit_sink *s = ptr;
+    unsigned char buf[8192];
+    unsigned char *p = buf;
+    ssize_t len, sz;
+
+    if (s->binary)
+	len = heim_audit_record_binary(rec, buf, sizeof(buf));
+    else
+	len = heim_audit_record_json(rec, (char *)buf, sizeof(buf));
+    if (len < 0) {
+	kdc_log(s->context, s->config, 1, "audit record for %s too large",
+		rec->reqtype);
+	return;
+    }
+
+    if (s->fd == -1) {
+	buf[len - 1] = '\0';	/* the log adds its own newline */
+	kdc_log(s->context, s->config, 3, "%s", (char *)buf);
+	return;
+    }
+    /* one write per record, so kdc processes do not interleave */
+    while (len > 0) {
+	sz = write(s->fd, p, len);
+	if (sz < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	p += sz;
+	len -= sz;
+    }
+}
+
+krb5_error_code
+_kdc_audit_sink_init(krb5_context context,
+		     krb5_kdc_configuration *config,
+		     const char *format,
+		     const char *file)
+{
+    struct audit_sink *s;
+    int binary;
+
+    if (format == NULL || strcasecmp(format, "text") == 0)
+	return 0;
+    if (strcasecmp(format, "json") == 0) {
+	binary = 0;
+    } else if (strcasecmp(format, "binary") == 0) {
+	binary = 1;
+	if (file == NULL) {
+	    krb5_set_error_message(context, EINVAL,
+				   "audit-format = binary needs an audit-file");
+	    return EINVAL;
+	}
+    } else {
+	krb5_set_error_message(context, EINVAL,
+			       "unknown audit-format %s", format);
+	return EINVAL;
+    }
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL)
+	return krb5_enomem(context);
+    s->context = context;
+    s->config = config;
+    s->binary = binary;
+    s->fd = -1;
+    if (file) {
+	s->fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0600);
+	if (s->fd < 0) {
+	    krb5_error_code ret = errno;
+
+	    krb5_set_error_message(context, ret, "open(%s): %s", file,
+				   strerror(ret));
+	    free(s);
+	    return ret;
+	}
+	rk_cloexec(s->fd);
+    }
+    config->audit_sink = audit_sink;
+    config->audit_sink_ctx = s;
+    return 0;
+}
+
+void
+_kdc_audit_sink_free(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct audit_sink *s = config->audit_sink_ctx;
+
+    if (config->audit_sink != audit_sink || s == NULL)
+	return;
+    if (s->fd != -1)
+	close(s->fd);
+    free(s);
+    config->audit_sink = NULL;
+    config->audit_sink_ctx = NULL;
+}
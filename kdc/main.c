@@ -43,6 +43,7 @@
 #endif
 
 sig_atomic_t exit_flag = 0;
+sig_atomic_t stats_flag = 0;
 
 int detach_from_console = -1;
 int daemon_child = -1;
@@ -59,6 +60,14 @@ sigterm(int sig)
     exit_flag = sig;
 }
 
+#ifdef SIGUSR1
+static RETSIGTYPE
+sigusr1(int sig)
+{
+    stats_flag = 1;
+}
+#endif
+
 /*
  * Allow dropping root bit, since heimdal reopens the database all the
  * time the database needs to be owned by the user you are switched
@@ -151,6 +160,11 @@ main(int argc, char **argv)
 	sigaction(SIGCHLD, &sa, NULL);
 #endif
 
+#ifdef SIGUSR1
+	sa.sa_handler = sigusr1;
+	sigaction(SIGUSR1, &sa, NULL);
+#endif
+
 	sa.sa_handler = SIG_IGN;
 #ifdef SIGPIPE
 	sigaction(SIGPIPE, &sa, NULL);
@@ -162,6 +176,9 @@ main(int argc, char **argv)
 #ifdef SIGCHLD
     signal(SIGCHLD, sigchld);
 #endif
+#ifdef SIGUSR1
+    signal(SIGUSR1, sigusr1);
+#endif
 #ifdef SIGXCPU
     signal(SIGXCPU, sigterm);
 #endif
@@ -175,6 +192,7 @@ main(int argc, char **argv)
 
     start_kdc(context, config, argv[0]);
     _krb5_unload_plugins(context, "kdc");
+    _kdc_audit_sink_free(context, config);
     krb5_free_context(context);
     free(config);
     return 0;
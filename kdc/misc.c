@@ -229,14 +229,434 @@ _fetch_it(krb5_context context, krb5_kdc_configuration *config, HDB *db,
 
 struct timeval _kdc_now;
 
-krb5_error_code
-_kdc_db_fetch(krb5_context context,
-	      krb5_kdc_configuration *config,
-	      krb5_const_principal principal,
-	      unsigned flags,
-	      krb5uint32 *kvno_ptr,
-	      HDB **db,
-	      hdb_entry_ex **h)
+/*
+ * We keep a little state per database file: the result of the last
+ * stat(2), refreshed at most once a second, which tells us when the
+ * database has been written to or replaced.
+ */
+
+struct db_file {
+    HDB *db;
+    time_t checked;
+    int have_st;
+    struct stat st;
+    /* identity of the file when it was opened with hdb-keep-open */
+    dev_t open_dev;
+    ino_t open_ino;
+    int keep_open_warned;
+    /* generation the entry cache was filled from */
+    ino_t cache_ino;
+    time_t cache_mtime;
+    off_t cache_size;
+};
+
+static struct db_file *db_files;
+static size_t num_db_files;
+
+static struct db_file *
+find_db_file(HDB *db)
+{
+    static const char *suffixes[] = { ".mdb", ".db", "" };
+    struct db_file *tmp, *f = NULL;
+    size_t i;
+
+    for (i = 0; i < num_db_files; i++) {
+	if (db_files[i].db == db) {
+	    f = &db_files[i];
+	    break;
+	}
+    }
+    if (f == NULL) {
+	tmp = realloc(db_files, (num_db_files + 1) * sizeof(*tmp));
+	if (tmp == NULL)
+	    return NULL;
+	db_files = tmp;
+	f = &db_files[num_db_files++];
+	memset(f, 0, sizeof(*f));
+	f->db = db;
+	f->checked = -1;
+    }
+
+    if (f->checked != kdc_time) {
+	f->checked = kdc_time;
+	f->have_st = 0;
+	for (i = 0; i < sizeof(suffixes)/sizeof(suffixes[0]); i++) {
+	    char *fn;
+
+	    if (asprintf(&fn, "%s%s", db->hdb_name, suffixes[i]) == -1 ||
+		fn == NULL)
+		break;
+	    f->have_st = (stat(fn, &f->st) == 0);
+	    free(fn);
+	    if (f->have_st)
+		break;
+	}
+    }
+    return f;
+}
+
+/*
+ * With [kdc] hdb-keep-open, databases whose backend lets an open handle
+ * see updates made by other processes stay open for the life of the
+ * process instead of being opened and closed around every lookup.  A
+ * database that is replaced as a whole (hprop, an iprop full resync)
+ * gets a new inode, which we notice and reopen it.
+ */
+
+static krb5_error_code
+open_db(krb5_context context, krb5_kdc_configuration *config, HDB *db)
+{
+    krb5_error_code ret;
+    struct db_file *f;
+
+    if (!config->db_keep_open)
+	return db->hdb_open(context, db, O_RDONLY, 0);
+
+    f = find_db_file(db);
+    if (f == NULL)
+	return krb5_enomem(context);
+
+    if (!(db->hdb_capability_flags & HDB_CAP_F_CONCURRENT_READERS)) {
+	if (!f->keep_open_warned) {
+	    f->keep_open_warned = 1;
+	    kdc_log(context, config, 0,
+		    "hdb-keep-open: not keeping database %s open, "
+		    "its backend does not see updates through an open handle",
+		    db->hdb_name);
+	}
+	return db->hdb_open(context, db, O_RDONLY, 0);
+    }
+
+    if (db->hdb_openp && f->have_st &&
+	(f->st.st_dev != f->open_dev || f->st.st_ino != f->open_ino)) {
+	kdc_log(context, config, 3,
+		"Database %s was replaced, reopening", db->hdb_name);
+	db->hdb_close(context, db);
+	db->hdb_openp = 0;
+    }
+    if (db->hdb_openp)
+	return 0;
+
+    /* use the stat from before opening, so a racing replacement reopens */
+    if (f->have_st) {
+	f->open_dev = f->st.st_dev;
+	f->open_ino = f->st.st_ino;
+    }
+
+    ret = db->hdb_open(context, db, O_RDONLY, 0);
+    if (ret == 0) {
+	kdc_log(context, config, 3, "Keeping database %s open", db->hdb_name);
+	db->hdb_openp = 1;
+    }
+    return ret;
+}
+
+static void
+close_db(krb5_context context, HDB *db)
+{
+    if (!db->hdb_openp)
+	db->hdb_close(context, db);
+}
+
+/*
+ * With [kdc] hdb-entry-cache-size set, the decoded and decrypted
+ * entries of recently used principals are kept in a small LRU cache so
+ * that the krbtgt and popular services are not decoded and unsealed
+ * with the master key on every request.  An entry is dropped when its
+ * database file changes (written to or replaced) and in any case after
+ * hdb-entry-cache-lifetime, so that changes made by kadmin are seen
+ * promptly even when they cannot be detected from the file.
+ *
+ * Callers get their own copy of the entry and may modify or free it.
+ */
+
+struct db_cache_ent {
+    struct db_cache_ent *next;		/* hash chain */
+    struct db_cache_ent *lru_prev;	/* more recently used */
+    struct db_cache_ent *lru_next;	/* less recently used */
+    unsigned hash;
+    krb5_principal principal;
+    unsigned flags;
+    krb5uint32 kvno;
+    HDB *db;
+    time_t expires;
+    hdb_entry entry;
+};
+
+static struct db_cache {
+    struct db_cache_ent **buckets;
+    size_t nbuckets;
+    size_t count;
+    struct db_cache_ent *lru_head, *lru_tail;
+    unsigned long hits, misses, evictions, flushes;
+} db_cache;
+
+static unsigned
+principal_hash(krb5_const_principal p)
+{
+    unsigned h = 2166136261U;
+    const unsigned char *s;
+    size_t i;
+
+    for (s = (const unsigned char *)p->realm; *s; s++)
+	h = (h ^ *s) * 16777619U;
+    for (i = 0; i < p->name.name_string.len; i++) {
+	h = (h ^ '/') * 16777619U;
+	for (s = (const unsigned char *)p->name.name_string.val[i]; *s; s++)
+	    h = (h ^ *s) * 16777619U;
+    }
+    return h;
+}
+
+static void
+db_cache_unlink(struct db_cache_ent *e)
+{
+    struct db_cache_ent **pp;
+
+    for (pp = &db_cache.buckets[e->hash % db_cache.nbuckets];
+	 *pp != e; pp = &(*pp)->next)
+	;
+    *pp = e->next;
+
+    if (e->lru_prev)
+	e->lru_prev->lru_next = e->lru_next;
+    else
+	db_cache.lru_head = e->lru_next;
+    if (e->lru_next)
+	e->lru_next->lru_prev = e->lru_prev;
+    else
+	db_cache.lru_tail = e->lru_prev;
+    db_cache.count--;
+}
+
+static void
+db_cache_free_ent(krb5_context context, struct db_cache_ent *e)
+{
+    krb5_free_principal(context, e->principal);
+    free_hdb_entry(&e->entry);
+    free(e);
+}
+
+static void
+db_cache_remove(krb5_context context, struct db_cache_ent *e)
+{
+    db_cache_unlink(e);
+    db_cache_free_ent(context, e);
+}
+
+static void
+db_cache_flush(krb5_context context, HDB *db)
+{
+    struct db_cache_ent *e, *next;
+
+    for (e = db_cache.lru_head; e != NULL; e = next) {
+	next = e->lru_next;
+	if (e->db == db)
+	    db_cache_remove(context, e);
+    }
+}
+
+static void
+db_cache_log_stats(krb5_context context, krb5_kdc_configuration *config,
+		   int level)
+{
+    kdc_log(context, config, level,
+	    "stats pid %d HDB entry cache: %lu hits, %lu misses, "
+	    "%lu evictions, %lu flushes, %lu entries", (int)getpid(),
+	    db_cache.hits, db_cache.misses, db_cache.evictions,
+	    db_cache.flushes, (unsigned long)db_cache.count);
+}
+
+/*
+ * Log the entry cache counters at level 0, from krb5_kdc_stats_log().
+ */
+
+void
+_kdc_db_cache_stats_log(krb5_context context, krb5_kdc_configuration *config)
+{
+    if (config->db_cache_size > 0)
+	db_cache_log_stats(context, config, 0);
+}
+
+/*
+ * Drop the cached entries of `db' if its file has changed since they
+ * were fetched.
+ */
+
+static void
+db_cache_check_generation(krb5_context context,
+			  krb5_kdc_configuration *config,
+			  HDB *db)
+{
+    struct db_file *f = find_db_file(db);
+
+    if (f == NULL || !f->have_st)
+	return;
+    if (f->st.st_ino == f->cache_ino &&
+	f->st.st_mtime == f->cache_mtime &&
+	f->st.st_size == f->cache_size)
+	return;
+
+    if (f->cache_mtime != 0) {
+	kdc_log(context, config, 5,
+		"Database %s changed, flushing the HDB entry cache",
+		db->hdb_name);
+	db_cache_flush(context, db);
+	db_cache.flushes++;
+    }
+    f->cache_ino = f->st.st_ino;
+    f->cache_mtime = f->st.st_mtime;
+    f->cache_size = f->st.st_size;
+}
+
+static struct db_cache_ent *
+db_cache_find(krb5_context context, krb5_const_principal principal,
+	      unsigned hash, unsigned flags, krb5uint32 kvno)
+{
+    struct db_cache_ent *e;
+
+    for (e = db_cache.buckets[hash % db_cache.nbuckets]; e; e = e->next) {
+	if (e->hash == hash && e->flags == flags && e->kvno == kvno &&
+	    principal->name.name_type == e->principal->name.name_type &&
+	    krb5_principal_compare(context, principal, e->principal))
+	    return e;
+    }
+    return NULL;
+}
+
+static krb5_error_code
+db_cache_get(krb5_context context,
+	     krb5_kdc_configuration *config,
+	     krb5_const_principal principal,
+	     unsigned flags,
+	     krb5uint32 kvno,
+	     HDB **db,
+	     hdb_entry_ex *ent)
+{
+    struct db_cache_ent *e;
+    unsigned hash;
+
+    if (db_cache.buckets == NULL)
+	return HDB_ERR_NOENTRY;
+
+    hash = principal_hash(principal);
+    e = db_cache_find(context, principal, hash, flags, kvno);
+    if (e != NULL) {
+	db_cache_check_generation(context, config, e->db);
+	/* the check may have flushed it */
+	e = db_cache_find(context, principal, hash, flags, kvno);
+    }
+    if (e != NULL && e->expires <= kdc_time) {
+	db_cache_remove(context, e);
+	e = NULL;
+    }
+    if (e == NULL) {
+	if ((++db_cache.misses & 4095) == 0)
+	    db_cache_log_stats(context, config, 4);
+	return HDB_ERR_NOENTRY;
+    }
+
+    if (copy_hdb_entry(&e->entry, &ent->entry))
+	return krb5_enomem(context);
+    ent->ctx = NULL;
+    ent->free_entry = NULL;
+    if (db)
+	*db = e->db;
+
+    /* move to the front of the LRU list */
+    if (e != db_cache.lru_head) {
+	e->lru_prev->lru_next = e->lru_next;
+	if (e->lru_next)
+	    e->lru_next->lru_prev = e->lru_prev;
+	else
+	    db_cache.lru_tail = e->lru_prev;
+	e->lru_prev = NULL;
+	e->lru_next = db_cache.lru_head;
+	db_cache.lru_head->lru_prev = e;
+	db_cache.lru_head = e;
+    }
+
+    if ((++db_cache.hits & 4095) == 0)
+	db_cache_log_stats(context, config, 4);
+    return 0;
+}
+
+static void
+db_cache_put(krb5_context context,
+	     krb5_kdc_configuration *config,
+	     krb5_const_principal principal,
+	     unsigned flags,
+	     krb5uint32 kvno,
+	     HDB *db,
+	     const hdb_entry_ex *ent)
+{
+    struct db_cache_ent *e;
+    struct db_file *f;
+
+    /* entries with backend private state can't be copied */
+    if (ent->ctx != NULL || ent->free_entry != NULL)
+	return;
+
+    /*
+     * A later write in the second the file was last written in would
+     * leave its mtime (and maybe its size) as it is, and go unnoticed.
+     */
+    f = find_db_file(db);
+    if (f != NULL && f->have_st && f->st.st_mtime >= kdc_time)
+	return;
+
+    if (db_cache.buckets == NULL) {
+	db_cache.nbuckets = config->db_cache_size;
+	db_cache.buckets = calloc(db_cache.nbuckets,
+				  sizeof(db_cache.buckets[0]));
+	if (db_cache.buckets == NULL)
+	    return;
+    }
+
+    db_cache_check_generation(context, config, db);
+
+    e = calloc(1, sizeof(*e));
+    if (e == NULL)
+	return;
+    if (krb5_copy_principal(context, principal, &e->principal)) {
+	free(e);
+	return;
+    }
+    if (copy_hdb_entry(&ent->entry, &e->entry)) {
+	krb5_free_principal(context, e->principal);
+	free(e);
+	return;
+    }
+    e->hash = principal_hash(principal);
+    e->flags = flags;
+    e->kvno = kvno;
+    e->db = db;
+    e->expires = kdc_time + config->db_cache_lifetime;
+
+    while (db_cache.count >= config->db_cache_size && db_cache.lru_tail) {
+	db_cache_remove(context, db_cache.lru_tail);
+	db_cache.evictions++;
+    }
+
+    e->next = db_cache.buckets[e->hash % db_cache.nbuckets];
+    db_cache.buckets[e->hash % db_cache.nbuckets] = e;
+    e->lru_next = db_cache.lru_head;
+    if (db_cache.lru_head)
+	db_cache.lru_head->lru_prev = e;
+    else
+	db_cache.lru_tail = e;
+    db_cache.lru_head = e;
+    db_cache.count++;
+}
+
+static krb5_error_code
+db_fetch(krb5_context context,
+	 krb5_kdc_configuration *config,
+	 krb5_const_principal principal,
+	 unsigned flags,
+	 krb5uint32 *kvno_ptr,
+	 HDB **db,
+	 hdb_entry_ex **h)
 {
     hdb_entry_ex *ent = NULL;
     krb5_error_code ret = HDB_ERR_NOENTRY;
@@ -261,6 +681,12 @@ _kdc_db_fetch(krb5_context context,
     if (ent == NULL)
         return krb5_enomem(context);
 
+    if (config->db_cache_size > 0 &&
+	db_cache_get(context, config, principal, flags, kvno, db, ent) == 0) {
+	*h = ent;
+	return 0;
+    }
+
     if (principal->name.name_type == KRB5_NT_ENTERPRISE_PRINCIPAL) {
         if (principal->name.name_string.len != 1) {
             ret = KRB5_PARSE_MALFORMED;
@@ -279,7 +705,7 @@ _kdc_db_fetch(krb5_context context,
     for (i = 0; i < config->num_db; i++) {
 	HDB *curdb = config->db[i];
 
-	ret = curdb->hdb_open(context, curdb, O_RDONLY, 0);
+	ret = open_db(context, config, curdb);
 	if (ret) {
 	    const char *msg = krb5_get_error_message(context, ret);
 	    kdc_log(context, config, 0, "Failed to open database: %s", msg);
@@ -292,7 +718,7 @@ _kdc_db_fetch(krb5_context context,
             princ = enterprise_principal;
 
 	ret = _fetch_it(context, config, curdb, princ, flags, kvno, ent);
-	curdb->hdb_close(context, curdb);
+	close_db(context, curdb);
 
 	switch (ret) {
 	case HDB_ERR_WRONG_REALM:
@@ -303,6 +729,9 @@ _kdc_db_fetch(krb5_context context,
 	     */
 	    /* fall through */
 	case 0:
+	    if (config->db_cache_size > 0 && ret == 0)
+		db_cache_put(context, config, principal, flags, kvno,
+			     curdb, ent);
 	    if (db)
 		*db = curdb;
 	    *h = ent;
@@ -335,6 +764,23 @@ out:
     return ret;
 }
 
+krb5_error_code
+_kdc_db_fetch(krb5_context context,
+	      krb5_kdc_configuration *config,
+	      krb5_const_principal principal,
+	      unsigned flags,
+	      krb5uint32 *kvno_ptr,
+	      HDB **db,
+	      hdb_entry_ex **h)
+{
+    uint64_t t = _kdc_stats_now(config);
+    krb5_error_code ret;
+
+    ret = db_fetch(context, config, principal, flags, kvno_ptr, db, h);
+    _kdc_stats_mark(config, KDC_STAT_DB_FETCH, t);
+    return ret;
+}
+
 void
 _kdc_free_ent(krb5_context context, hdb_entry_ex *ent)
 {
@@ -86,6 +86,12 @@ _kdc_audit_addkv(kdc_request_t r, int flags, const char *k,
     va_end(ap);
 }
 
+void
+_kdc_audit_setkv_number(kdc_request_t r, const char *k, int64_t v)
+{
+    heim_audit_setkv_number((heim_svc_req_desc)r, k, v);
+}
+
 void
 _kdc_audit_addkv_timediff(kdc_request_t r, const char *k,
 			  const struct timeval *start,
@@ -167,26 +173,54 @@ krb5_kdc_update_time(struct timeval *tv)
 	       sizeof(*RHS) - sizeof(*LHS));		\
     } while (0)
 
+/*
+ * The KDC-REQ, and the Ticket in a PA-TGS-REQ, are decoded into an
+ * arena that starts out on the stack; their OCTET STRINGs point into
+ * the request buffer.
+ */
+#define KDC_REQ_ARENA_SIZE 4096
+
+/* An AS-REQ and a TGS-REQ are both a KDC-REQ */
+static void
+free_req(astgs_request_t r)
+{
+    if (r->req_in_arena)
+	free_AS_REQ_arena(&r->req, r->arena);
+    else
+	free_AS_REQ(&r->req);
+    der_arena_free(r->arena);
+    r->arena = NULL;
+    r->req_in_arena = 0;
+}
+
 static krb5_error_code
 kdc_as_req(kdc_request_t *rptr, int *claim)
 {
     astgs_request_t r;
     krb5_error_code ret;
+    heim_asn1_arena arena;
+    unsigned char arenabuf[KDC_REQ_ARENA_SIZE];
     size_t len;
 
     /* We must free things in the extensions */
     EXTEND_REQUEST_T(*rptr, r);
 
-    ret = decode_AS_REQ(r->request.data, r->request.length, &r->req, &len);
-    if (ret)
+    der_arena_init(&arena, arenabuf, sizeof(arenabuf));
+    ret = decode_AS_REQ_arena(r->request.data, r->request.length, &r->req,
+			      &len, &arena);
+    if (ret) {
+	der_arena_free(&arena);
 	return ret;
+    }
+    r->arena = &arena;
+    r->req_in_arena = 1;
 
     r->reqtype = "AS-REQ";
     r->use_request_t = 1;
     *claim = 1;
 
     ret = _kdc_as_rep(r);
-    free_AS_REQ(&r->req);
+    free_req(r);
     return ret;
 }
 
@@ -196,21 +230,29 @@ kdc_tgs_req(kdc_request_t *rptr, int *claim)
 {
     astgs_request_t r;
     krb5_error_code ret;
+    heim_asn1_arena arena;
+    unsigned char arenabuf[KDC_REQ_ARENA_SIZE];
     size_t len;
 
     /* We must free things in the extensions */
     EXTEND_REQUEST_T(*rptr, r);
 
-    ret = decode_TGS_REQ(r->request.data, r->request.length, &r->req, &len);
-    if (ret)
+    der_arena_init(&arena, arenabuf, sizeof(arenabuf));
+    ret = decode_TGS_REQ_arena(r->request.data, r->request.length, &r->req,
+			       &len, &arena);
+    if (ret) {
+	der_arena_free(&arena);
 	return ret;
+    }
+    r->arena = &arena;
+    r->req_in_arena = 1;
 
     r->reqtype = "TGS-REQ";
     r->use_request_t = 1;
     *claim = 1;
 
     ret = _kdc_tgs_rep(r);
-    free_TGS_REQ(&r->req);
+    free_req(r);
     return ret;
 }
 
@@ -309,6 +351,8 @@ process_request(krb5_context context,
     r->request.length = len;
     r->datagram_reply = datagram_reply;
     r->reply = reply;
+    r->audit_sink = config->audit_sink;
+    r->audit_sink_ctx = config->audit_sink_ctx;
     r->kv = heim_array_create();
     if (!r->kv) {
 	free(r);
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "kdc_locl.h"
+
+/*
+ * Per-process latency histograms of the stages of AS and TGS request
+ * processing.  Each kdc worker is a process of its own, so these are
+ * per-worker without any locking.  Buckets are powers of two of
+ * microseconds: bucket i counts spans of less than 2^i usec.
+ */
+
+#define KDC_STATS_BUCKETS 32
+
+struct kdc_stats_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t bucket[KDC_STATS_BUCKETS];
+};
+
+static struct kdc_stats_hist stats[KDC_STAT_MAX];
+
+static const char *stat_names[KDC_STAT_MAX] = {
+    "as-fast",
+    "as-db",
+    "as-preauth",
+    "as-policy",
+    "as-reply",
+    "as-total",
+    "tgs-parse",
+    "tgs-pac",
+    "tgs-policy",
+    "tgs-reply",
+    "tgs-total",
+    "db-fetch"
+};
+
+static uint64_t
+monotonic_usec(void)
+{
+#if defined(CLOCK_MONOTONIC) && !defined(_WIN32)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+}
+
+/*
+ * Start of a span, or 0 when statistics are disabled so that the
+ * matching _kdc_stats_mark() does nothing.
+ */
+
+uint64_t
+_kdc_stats_now(krb5_kdc_configuration *config)
+{
+    if (!config->phase_stats)
+	return 0;
+    return monotonic_usec();
+}
+
+/*
+ * Account the time since `start' to `stat', one of the KDC_STAT_*
+ * values, and return the current time, so that back to back stages
+ * need only one clock read each.
+ */
+
+uint64_t
+_kdc_stats_mark(krb5_kdc_configuration *config, int stat, uint64_t start)
+{
+    struct kdc_stats_hist *h = &stats[stat];
+    uint64_t now, usec;
+    unsigned int b;
+
+    if (start == 0 || !config->phase_stats)
+	return 0;
+
+    now = monotonic_usec();
+    usec = now > start ? now - start : 0;
+
+    for (b = 0; b < KDC_STATS_BUCKETS - 1 && (usec >> b) != 0; b++)
+	;
+    h->bucket[b]++;
+    h->count++;
+    h->sum += usec;
+    if (usec > h->max)
+	h->max = usec;
+
+    return now;
+}
+
+/* upper bound of the bucket holding the `pct' percentile */
+static uint64_t
+hist_percentile(const struct kdc_stats_hist *h, unsigned int pct)
+{
+    uint64_t want = (h->count * pct + 99) / 100, seen = 0;
+    unsigned int b;
+
+    for (b = 0; b < KDC_STATS_BUCKETS; b++) {
+	seen += h->bucket[b];
+	if (seen >= want)
+	    break;
+    }
+    if (b >= KDC_STATS_BUCKETS - 1 || ((uint64_t)1 << b) > h->max)
+	return h->max;
+    return (uint64_t)1 << b;
+}
+
+/**
+ * Log the stage latency histograms of this process at level 0, one
+ * line per stage that has been seen, and the HDB entry cache counters
+ * if there is a cache.  The kdc does this on SIGUSR1.
+ *
+ * @param context A Kerberos 5 context.
+ * @param config the kdc configuration.
+ */
+
+void
+krb5_kdc_stats_log(krb5_context context, krb5_kdc_configuration *config)
+{
+    int i, logged = 0;
+
+    _kdc_db_cache_stats_log(context, config);
+
+    if (!config->phase_stats) {
+	kdc_log(context, config, 0, "phase-stats not enabled");
+	return;
+    }
+
+    for (i = 0; i < KDC_STAT_MAX; i++) {
+	const struct kdc_stats_hist *h = &stats[i];
+	char buckets[KDC_STATS_BUCKETS * 22];
+	size_t len = 0;
+	int b;
+
+	if (h->count == 0)
+	    continue;
+
+	buckets[0] = '\0';
+	for (b = 0; b < KDC_STATS_BUCKETS; b++) {
+	    int n;
+
+	    if (h->bucket[b] == 0)
+		continue;
+	    n = snprintf(buckets + len, sizeof(buckets) - len, " <%llu:%llu",
+			 (unsigned long long)1 << b,
+			 (unsigned long long)h->bucket[b]);
+	    if (n < 0 || (size_t)n >= sizeof(buckets) - len)
+		break;
+	    len += n;
+	}
+
+	kdc_log(context, config, 0,
+		"stats pid %d %s: count %llu mean %llu p50 %llu p99 %llu "
+		"max %llu usec; buckets%s",
+		(int)getpid(), stat_names[i],
+		(unsigned long long)h->count,
+		(unsigned long long)(h->sum / h->count),
+		(unsigned long long)hist_percentile(h, 50),
+		(unsigned long long)hist_percentile(h, 99),
+		(unsigned long long)h->max, buckets);
+	logged++;
+    }
+    if (logged == 0)
+	kdc_log(context, config, 0, "stats pid %d: no requests timed",
+		(int)getpid());
+}
@@ -53,6 +53,20 @@ typedef struct heim_bit_string {
 typedef struct heim_base_data heim_any;
 typedef struct heim_base_data heim_any_set;
 
+/*
+ * Memory for the decode_*_arena() functions: a buffer supplied by the
+ * caller, continued in malloc()ed chunks when it runs out, see
+ * der_arena_init().
+ */
+typedef struct heim_asn1_arena {
+    unsigned char *base;
+    size_t basesize;
+    unsigned char *buf;
+    size_t size;
+    size_t used;
+    void *chunks;
+} heim_asn1_arena;
+
 #define ASN1_MALLOC_ENCODE(T, B, BL, S, L, R)                  \
   do {                                                         \
     (BL) = length_##T((S));                                    \
@@ -69,6 +83,33 @@ typedef struct heim_base_data heim_any_set;
     }                                                          \
   } while (0)
 
+/*
+ * Like ASN1_MALLOC_ENCODE(), but without the length_*() walk: the
+ * value is encoded into a buffer of H (> 0) bytes, which is then
+ * trimmed to the encoding.  Only when H is too small is the length
+ * computed and the value encoded a second time.
+ */
+#define ASN1_MALLOC_ENCODE_HINT(T, B, BL, S, L, R, H)          \
+  do {                                                         \
+    (BL) = (H);                                                \
+    (B) = malloc((BL));                                        \
+    if((B) == NULL) {                                          \
+      (R) = ENOMEM;                                            \
+      break;                                                   \
+    }                                                          \
+    (R) = encode_##T(((unsigned char*)(B)) + (BL) - 1, (BL),   \
+                     (S), (L));                                \
+    if((R) == 0) {                                             \
+      (B) = der_encode_trim((B), (BL), *(L));                  \
+      (BL) = *(L);                                             \
+    } else {                                                   \
+      free((B));                                               \
+      (B) = NULL;                                              \
+      if((R) == ASN1_OVERFLOW)                                 \
+        ASN1_MALLOC_ENCODE(T, B, BL, S, L, R);                 \
+    }                                                          \
+  } while (0)
+
 #ifdef _WIN32
 #ifndef ASN1_LIB
 #define ASN1EXP  __declspec(dllimport)
@@ -1770,11 +1770,283 @@ test_seqof5(void)
     return ret;
 }
 
+/*
+ * Decode an AS-REQ into arenas of different sizes, the result must
+ * re-encode to the same bytes.
+ */
+
+static int
+test_arena(void)
+{
+    AS_REQ req, areq;
+    PA_DATA pa[2];
+    krb5int32 etypes[3] = { 18, 17, 23 };
+    unsigned char padata[32];
+    unsigned char *buf, *abuf;
+    size_t size, asize, len, alen;
+    size_t arenasizes[] = { 0, 64, 4096 };
+    int ret, failed = 0;
+    size_t i;
+
+    memset(&req, 0, sizeof(req));
+    memset(padata, 0x55, sizeof(padata));
+    req.pvno = 5;
+    req.msg_type = krb_as_req;
+    pa[0].padata_type = KRB5_PADATA_ENC_TIMESTAMP;
+    pa[0].padata_value.data = padata;
+    pa[0].padata_value.length = sizeof(padata);
+    pa[1].padata_type = KRB5_PADATA_REQ_ENC_PA_REP;
+    pa[1].padata_value.data = NULL;
+    pa[1].padata_value.length = 0;
+    req.padata = calloc(1, sizeof(*req.padata));
+    if (req.padata == NULL)
+	errx(1, "out of memory");
+    req.padata->len = 2;
+    req.padata->val = pa;
+    req.req_body.cname = calloc(1, sizeof(*req.req_body.cname));
+    req.req_body.sname = calloc(1, sizeof(*req.req_body.sname));
+    req.req_body.till = calloc(1, sizeof(*req.req_body.till));
+    if (req.req_body.cname == NULL || req.req_body.sname == NULL ||
+	req.req_body.till == NULL)
+	errx(1, "out of memory");
+    req.req_body.cname->name_type = KRB5_NT_PRINCIPAL;
+    req.req_body.cname->name_string.len = 2;
+    req.req_body.cname->name_string.val = lharoot_princ;
+    req.req_body.realm = "NADA.KTH.SE";
+    req.req_body.sname->name_type = KRB5_NT_SRV_INST;
+    req.req_body.sname->name_string.len = 2;
+    req.req_body.sname->name_string.val = nada_tgt_principal;
+    *req.req_body.till = 1200000000;
+    req.req_body.nonce = 4711;
+    req.req_body.etype.len = 3;
+    req.req_body.etype.val = etypes;
+
+    ASN1_MALLOC_ENCODE(AS_REQ, buf, size, &req, &len, ret);
+    if (ret)
+	errx(1, "encode_AS_REQ: %d", ret);
+    if (size != len)
+	errx(1, "internal asn1 encoder error");
+
+    for (i = 0; i < sizeof(arenasizes)/sizeof(arenasizes[0]); i++) {
+	heim_asn1_arena arena;
+	unsigned char *space = malloc(arenasizes[i] + 1);
+
+	if (space == NULL)
+	    errx(1, "out of memory");
+	der_arena_init(&arena, space, arenasizes[i]);
+	ret = decode_AS_REQ_arena(buf, size, &areq, &alen, &arena);
+	if (ret || alen != size) {
+	    printf("arena %lu: decode_AS_REQ_arena failed\n",
+		   (unsigned long)arenasizes[i]);
+	    failed++;
+	    free(space);
+	    continue;
+	}
+	if (areq.padata == NULL || areq.padata->len != 2 ||
+	    areq.padata->val[0].padata_value.data < (void *)buf ||
+	    areq.padata->val[0].padata_value.data >= (void *)(buf + size)) {
+	    printf("arena %lu: padata not borrowed from the input\n",
+		   (unsigned long)arenasizes[i]);
+	    failed++;
+	}
+	ASN1_MALLOC_ENCODE(AS_REQ, abuf, asize, &areq, &alen, ret);
+	if (ret || asize != size || memcmp(abuf, buf, size) != 0) {
+	    printf("arena %lu: AS-REQ does not re-encode\n",
+		   (unsigned long)arenasizes[i]);
+	    failed++;
+	}
+	if (ret == 0)
+	    free(abuf);
+	free_AS_REQ_arena(&areq, &arena);
+	free(space);
+    }
+
+    free(buf);
+    free(req.padata);
+    free(req.req_body.cname);
+    free(req.req_body.sname);
+    free(req.req_body.till);
+
+    return failed;
+}
+
+/*
+ * An EncTicketPart with a PAC sized authorization data element and
+ * the AS-REP carrying it, for ASN1_MALLOC_ENCODE_HINT().
+ */
+
+static unsigned char pac[4096];
+static unsigned char keyvalue[32];
+
+static void
+fill_ticket(EncTicketPart *et, AuthorizationData *ad,
+	    AuthorizationDataElement *ade, KerberosTime *t)
+{
+    memset(et, 0, sizeof(*et));
+    memset(pac, 0x33, sizeof(pac));
+    et->flags.forwardable = 1;
+    et->flags.initial = 1;
+    et->flags.pre_authent = 1;
+    et->key.keytype = 18;
+    et->key.keyvalue.data = keyvalue;
+    et->key.keyvalue.length = sizeof(keyvalue);
+    et->crealm = "NADA.KTH.SE";
+    et->cname.name_type = KRB5_NT_PRINCIPAL;
+    et->cname.name_string.len = 2;
+    et->cname.name_string.val = lharoot_princ;
+    et->transited.tr_type = 1;
+    et->authtime = 1200000000;
+    et->starttime = t;
+    et->endtime = 1200036000;
+    et->renew_till = t;
+    ade->ad_type = KRB5_AUTHDATA_IF_RELEVANT;
+    ade->ad_data.data = pac;
+    ade->ad_data.length = sizeof(pac);
+    ad->len = 1;
+    ad->val = ade;
+    et->authorization_data = ad;
+}
+
+static void
+fill_as_rep(AS_REP *rep, const unsigned char *ticket, size_t ticketlen)
+{
+    memset(rep, 0, sizeof(*rep));
+    rep->pvno = 5;
+    rep->msg_type = krb_as_rep;
+    rep->crealm = "NADA.KTH.SE";
+    rep->cname.name_type = KRB5_NT_PRINCIPAL;
+    rep->cname.name_string.len = 2;
+    rep->cname.name_string.val = lharoot_princ;
+    rep->ticket.tkt_vno = 5;
+    rep->ticket.realm = "NADA.KTH.SE";
+    rep->ticket.sname.name_type = KRB5_NT_SRV_INST;
+    rep->ticket.sname.name_string.len = 2;
+    rep->ticket.sname.name_string.val = nada_tgt_principal;
+    rep->ticket.enc_part.etype = 18;
+    rep->ticket.enc_part.cipher.data = rk_UNCONST(ticket);
+    rep->ticket.enc_part.cipher.length = ticketlen;
+    rep->enc_part.etype = 18;
+    rep->enc_part.cipher.data = pac;
+    rep->enc_part.cipher.length = 300;
+}
+
+static int
+test_encode_hint(void)
+{
+    EncTicketPart et;
+    AuthorizationData ad;
+    AuthorizationDataElement ade;
+    KerberosTime t = 1200000000;
+    AS_REP rep;
+    unsigned char *buf, *hbuf, *repbuf;
+    size_t size, hsize, len, hints[] = { 1, 100, 4200, 65536 };
+    int ret, failed = 0;
+    size_t i;
+
+    fill_ticket(&et, &ad, &ade, &t);
+    ASN1_MALLOC_ENCODE(EncTicketPart, buf, size, &et, &len, ret);
+    if (ret)
+	errx(1, "encode_EncTicketPart: %d", ret);
+    fill_as_rep(&rep, buf, size);
+
+    for (i = 0; i < sizeof(hints)/sizeof(hints[0]); i++) {
+	ASN1_MALLOC_ENCODE_HINT(EncTicketPart, hbuf, hsize, &et, &len, ret,
+				hints[i]);
+	if (ret || hsize != size || len != size ||
+	    memcmp(hbuf, buf, size) != 0) {
+	    printf("hint %lu: EncTicketPart differs\n", (unsigned long)hints[i]);
+	    failed++;
+	}
+	if (ret == 0)
+	    free(hbuf);
+    }
+
+    ASN1_MALLOC_ENCODE(AS_REP, repbuf, size, &rep, &len, ret);
+    if (ret)
+	errx(1, "encode_AS_REP: %d", ret);
+    ASN1_MALLOC_ENCODE_HINT(AS_REP, hbuf, hsize, &rep, &len, ret, 8192);
+    if (ret || hsize != size || memcmp(hbuf, repbuf, size) != 0) {
+	printf("AS-REP differs\n");
+	failed++;
+    }
+    if (ret == 0)
+	free(hbuf);
+    free(repbuf);
+    free(buf);
+
+    return failed;
+}
+
+/*
+ * check-gen --benchmark [count]: time ASN1_MALLOC_ENCODE() against
+ * ASN1_MALLOC_ENCODE_HINT() for a ticket and a reply.
+ */
+
+static void
+benchmark_encode(int count)
+{
+    EncTicketPart et;
+    AuthorizationData ad;
+    AuthorizationDataElement ade;
+    KerberosTime t = 1200000000;
+    AS_REP rep;
+    struct timeval start, tv[4];
+    unsigned char *buf, *ticket;
+    size_t size, ticketlen, len;
+    int i, ret;
+
+    fill_ticket(&et, &ad, &ade, &t);
+    ASN1_MALLOC_ENCODE(EncTicketPart, ticket, ticketlen, &et, &len, ret);
+    if (ret)
+	errx(1, "encode_EncTicketPart: %d", ret);
+    fill_as_rep(&rep, ticket, ticketlen);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < count; i++) {
+	ASN1_MALLOC_ENCODE(EncTicketPart, buf, size, &et, &len, ret);
+	free(buf);
+    }
+    gettimeofday(&tv[0], NULL);
+    for (i = 0; i < count; i++) {
+	ASN1_MALLOC_ENCODE_HINT(EncTicketPart, buf, size, &et, &len, ret,
+				ticketlen + 1024);
+	free(buf);
+    }
+    gettimeofday(&tv[1], NULL);
+    for (i = 0; i < count; i++) {
+	ASN1_MALLOC_ENCODE(AS_REP, buf, size, &rep, &len, ret);
+	free(buf);
+    }
+    gettimeofday(&tv[2], NULL);
+    for (i = 0; i < count; i++) {
+	ASN1_MALLOC_ENCODE_HINT(AS_REP, buf, size, &rep, &len, ret,
+				ticketlen + 2048);
+	free(buf);
+    }
+    gettimeofday(&tv[3], NULL);
+
+    for (i = 3; i > 0; i--)
+	timevalsub(&tv[i], &tv[i - 1]);
+    timevalsub(&tv[0], &start);
+    for (i = 0; i < 4; i++)
+	printf("%-13s %-26s %d in %ld.%06ld s\n",
+	       i < 2 ? "EncTicketPart" : "AS-REP",
+	       i % 2 ? "ASN1_MALLOC_ENCODE_HINT" : "ASN1_MALLOC_ENCODE",
+	       count, (long)tv[i].tv_sec, (long)tv[i].tv_usec);
+
+    free(ticket);
+}
+
 int
 main(int argc, char **argv)
 {
     int ret = 0;
 
+    if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+	benchmark_encode(argc > 2 ? atoi(argv[2]) : 100000);
+	return 0;
+    }
+
     ret += test_principal ();
     ret += test_authenticator();
     ret += test_krb_error();
@@ -1808,5 +2080,8 @@ main(int argc, char **argv)
     ret += test_seq4();
     ret += test_seqof5();
 
+    ret += test_arena();
+    ret += test_encode_hint();
+
     return ret;
 }
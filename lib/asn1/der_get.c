@@ -490,19 +490,23 @@ static int ASN1CALL
 der_get_time (const unsigned char *p, size_t len,
 	      time_t *data, size_t *size)
 {
-    char *times;
+    char buf[32];
+    char *times = buf;
     int e;
 
     if (len == SIZE_MAX || len == 0)
 	return ASN1_BAD_LENGTH;
 
-    times = malloc(len + 1);
-    if (times == NULL)
-	return ENOMEM;
+    if (len >= sizeof(buf)) {
+	times = malloc(len + 1);
+	if (times == NULL)
+	    return ENOMEM;
+    }
     memcpy(times, p, len);
     times[len] = '\0';
     e = generalizedtime2time(times, data);
-    free (times);
+    if (times != buf)
+	free (times);
     if(size) *size = len;
     return e;
 }
@@ -713,3 +717,285 @@ der_get_bit_string (const unsigned char *p, size_t len,
     if(size) *size = len;
     return 0;
 }
+
+/*
+ * Arena decoding.  The decode_*_arena() functions generated for the
+ * types listed with --arena-decode take all their memory from a
+ * heim_asn1_arena and let OCTET STRINGs point into the input buffer,
+ * which therefore has to outlive the decoded value.  The value is
+ * released all at once with der_arena_free() (or free_*_arena()),
+ * never with free_*().
+ */
+
+#define DER_ARENA_ALIGN (2 * sizeof(void *))
+#define DER_ARENA_CHUNK 4096
+
+struct der_arena_chunk {
+    struct der_arena_chunk *next;
+    void *pad;
+};
+
+/**
+ * Set up an arena in a caller supplied buffer.  When the buffer is
+ * used up further memory is malloc()ed.
+ *
+ * @param arena the arena
+ * @param buf the buffer, or NULL to only use malloc()ed memory
+ * @param len the size of buf
+ */
+
+void ASN1CALL
+der_arena_init(heim_asn1_arena *arena, void *buf, size_t len)
+{
+    uintptr_t off = (uintptr_t)buf % DER_ARENA_ALIGN;
+
+    if (buf == NULL || len < DER_ARENA_ALIGN) {
+	buf = NULL;
+	len = 0;
+    } else if (off) {
+	buf = (unsigned char *)buf + DER_ARENA_ALIGN - off;
+	len -= DER_ARENA_ALIGN - off;
+    }
+    arena->base = arena->buf = buf;
+    arena->basesize = arena->size = len;
+    arena->used = 0;
+    arena->chunks = NULL;
+}
+
+/**
+ * Allocate zeroed memory from an arena.
+ *
+ * @param arena the arena
+ * @param len number of bytes
+ *
+ * @return the memory, or NULL if out of memory
+ */
+
+void * ASN1CALL
+der_arena_alloc(heim_asn1_arena *arena, size_t len)
+{
+    size_t off = arena->used;
+    void *ptr;
+
+    if (off % DER_ARENA_ALIGN)
+	off += DER_ARENA_ALIGN - off % DER_ARENA_ALIGN;
+    if (arena->buf == NULL || off > arena->size || len > arena->size - off) {
+	struct der_arena_chunk *c;
+	size_t csize = len > DER_ARENA_CHUNK ? len : DER_ARENA_CHUNK;
+
+	if (csize > SIZE_MAX - sizeof(*c))
+	    return NULL;
+	c = malloc(sizeof(*c) + csize);
+	if (c == NULL)
+	    return NULL;
+	c->next = arena->chunks;
+	arena->chunks = c;
+	arena->buf = (unsigned char *)(c + 1);
+	arena->size = csize;
+	off = 0;
+    }
+    ptr = arena->buf + off;
+    arena->used = off + len;
+    memset(ptr, 0, len);
+    return ptr;
+}
+
+/**
+ * Release everything allocated from an arena, the arena can then be
+ * used again.
+ *
+ * @param arena the arena
+ */
+
+void ASN1CALL
+der_arena_free(heim_asn1_arena *arena)
+{
+    struct der_arena_chunk *c, *next;
+
+    for (c = arena->chunks; c != NULL; c = next) {
+	next = c->next;
+	free(c);
+    }
+    arena->chunks = NULL;
+    arena->buf = arena->base;
+    arena->size = arena->basesize;
+    arena->used = 0;
+}
+
+/* move memory der_get_*() malloc()ed into the arena */
+static int
+arena_adopt(heim_asn1_arena *arena, void *datap, size_t len)
+{
+    void **data = datap;
+    void *ptr;
+
+    if (*data == NULL)
+	return 0;
+    ptr = der_arena_alloc(arena, len);
+    if (ptr)
+	memcpy(ptr, *data, len);
+    free(*data);
+    *data = ptr;
+    return ptr ? 0 : ENOMEM;
+}
+
+int ASN1CALL
+der_get_octet_string_arena(const unsigned char *p, size_t len,
+			   heim_octet_string *data, size_t *size,
+			   heim_asn1_arena *arena)
+{
+    data->length = len;
+    data->data = len ? rk_UNCONST(p) : NULL;
+    if (size) *size = len;
+    return 0;
+}
+
+int ASN1CALL
+der_get_octet_string_ber_arena(const unsigned char *p, size_t len,
+			       heim_octet_string *data, size_t *size,
+			       heim_asn1_arena *arena)
+{
+    int e = der_get_octet_string_ber(p, len, data, size);
+
+    if (e == 0)
+	e = arena_adopt(arena, &data->data, data->length);
+    return e;
+}
+
+int ASN1CALL
+der_get_general_string_arena(const unsigned char *p, size_t len,
+			     heim_general_string *str, size_t *size,
+			     heim_asn1_arena *arena)
+{
+    const unsigned char *p1;
+    char *s;
+
+    /* the same checks as der_get_general_string() */
+    p1 = memchr(p, 0, len);
+    if (p1 != NULL) {
+	while ((size_t)(p1 - p) < len && *p1 == '\0')
+	    p1++;
+	if ((size_t)(p1 - p) != len) {
+	    *str = NULL;
+	    return ASN1_BAD_CHARACTER;
+	}
+    }
+    if (len == SIZE_MAX) {
+	*str = NULL;
+	return ASN1_BAD_LENGTH;
+    }
+
+    *str = s = der_arena_alloc(arena, len + 1);
+    if (s == NULL)
+	return ENOMEM;
+    memcpy(s, p, len);
+    if (size) *size = len;
+    return 0;
+}
+
+int ASN1CALL
+der_get_utf8string_arena(const unsigned char *p, size_t len,
+			 heim_utf8_string *str, size_t *size,
+			 heim_asn1_arena *arena)
+{
+    return der_get_general_string_arena(p, len, str, size, arena);
+}
+
+int ASN1CALL
+der_get_visible_string_arena(const unsigned char *p, size_t len,
+			     heim_visible_string *str, size_t *size,
+			     heim_asn1_arena *arena)
+{
+    return der_get_general_string_arena(p, len, str, size, arena);
+}
+
+int ASN1CALL
+der_get_printable_string_arena(const unsigned char *p, size_t len,
+			       heim_printable_string *str, size_t *size,
+			       heim_asn1_arena *arena)
+{
+    if (len == SIZE_MAX) {
+	gen_data_zero(str);
+	return ASN1_BAD_LENGTH;
+    }
+    str->data = der_arena_alloc(arena, len + 1);
+    if (str->data == NULL) {
+	gen_data_zero(str);
+	return ENOMEM;
+    }
+    str->length = len;
+    memcpy(str->data, p, len);
+    if (size) *size = len;
+    return 0;
+}
+
+int ASN1CALL
+der_get_ia5_string_arena(const unsigned char *p, size_t len,
+			 heim_ia5_string *str, size_t *size,
+			 heim_asn1_arena *arena)
+{
+    return der_get_printable_string_arena(p, len, str, size, arena);
+}
+
+int ASN1CALL
+der_get_bmp_string_arena(const unsigned char *p, size_t len,
+			 heim_bmp_string *data, size_t *size,
+			 heim_asn1_arena *arena)
+{
+    int e = der_get_bmp_string(p, len, data, size);
+
+    if (e == 0)
+	e = arena_adopt(arena, &data->data,
+			data->length * sizeof(data->data[0]));
+    return e;
+}
+
+int ASN1CALL
+der_get_universal_string_arena(const unsigned char *p, size_t len,
+			       heim_universal_string *data, size_t *size,
+			       heim_asn1_arena *arena)
+{
+    int e = der_get_universal_string(p, len, data, size);
+
+    if (e == 0)
+	e = arena_adopt(arena, &data->data,
+			data->length * sizeof(data->data[0]));
+    return e;
+}
+
+int ASN1CALL
+der_get_heim_integer_arena(const unsigned char *p, size_t len,
+			   heim_integer *data, size_t *size,
+			   heim_asn1_arena *arena)
+{
+    int e = der_get_heim_integer(p, len, data, size);
+
+    if (e == 0)
+	e = arena_adopt(arena, &data->data, data->length);
+    return e;
+}
+
+int ASN1CALL
+der_get_oid_arena(const unsigned char *p, size_t len,
+		  heim_oid *data, size_t *size,
+		  heim_asn1_arena *arena)
+{
+    int e = der_get_oid(p, len, data, size);
+
+    if (e == 0)
+	e = arena_adopt(arena, &data->components,
+			data->length * sizeof(data->components[0]));
+    return e;
+}
+
+int ASN1CALL
+der_get_bit_string_arena(const unsigned char *p, size_t len,
+			 heim_bit_string *data, size_t *size,
+			 heim_asn1_arena *arena)
+{
+    int e = der_get_bit_string(p, len, data, size);
+
+    if (e == 0)
+	e = arena_adopt(arena, &data->data, (data->length + 7) / 8);
+    return e;
+}
@@ -552,3 +552,27 @@ _heim_der_set_sort(const void *a1, const void *a2)
 	return ret;
     return (int)(s1->length - s2->length);
 }
+
+/**
+ * Move a value that was encoded backwards into the end of a malloc()ed
+ * buffer to the start of it and give back the unused space, see
+ * ASN1_MALLOC_ENCODE_HINT().
+ *
+ * @param buf the buffer
+ * @param size the size of buf
+ * @param len the length of the encoding at the end of buf
+ *
+ * @return the buffer, it may have moved
+ */
+
+void * ASN1CALL
+der_encode_trim(void *buf, size_t size, size_t len)
+{
+    void *ptr;
+
+    if (len >= size)
+	return buf;
+    memmove(buf, (unsigned char *)buf + size - len, len);
+    ptr = realloc(buf, len ? len : 1);
+    return ptr ? ptr : buf;
+}
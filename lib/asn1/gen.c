@@ -216,6 +216,15 @@ init_generate (const char *filename, const char *base)
     fprintf (headerfile,
 	     "typedef struct heim_base_data heim_any;\n"
 	     "typedef struct heim_base_data heim_any_set;\n\n");
+    fprintf (headerfile,
+	     "typedef struct heim_asn1_arena {\n"
+	     "  unsigned char *base;\n"
+	     "  size_t basesize;\n"
+	     "  unsigned char *buf;\n"
+	     "  size_t size;\n"
+	     "  size_t used;\n"
+	     "  void *chunks;\n"
+	     "} heim_asn1_arena;\n\n");
     fputs("#define ASN1_MALLOC_ENCODE(T, B, BL, S, L, R)                  \\\n"
 	  "  do {                                                         \\\n"
 	  "    (BL) = length_##T((S));                                    \\\n"
@@ -232,6 +241,27 @@ init_generate (const char *filename, const char *base)
 	  "    }                                                          \\\n"
 	  "  } while (0)\n\n",
 	  headerfile);
+    fputs("#define ASN1_MALLOC_ENCODE_HINT(T, B, BL, S, L, R, H)          \\\n"
+	  "  do {                                                         \\\n"
+	  "    (BL) = (H);                                                \\\n"
+	  "    (B) = malloc((BL));                                        \\\n"
+	  "    if((B) == NULL) {                                          \\\n"
+	  "      (R) = ENOMEM;                                            \\\n"
+	  "      break;                                                   \\\n"
+	  "    }                                                          \\\n"
+	  "    (R) = encode_##T(((unsigned char*)(B)) + (BL) - 1, (BL),   \\\n"
+	  "                     (S), (L));                                \\\n"
+	  "    if((R) == 0) {                                             \\\n"
+	  "      (B) = der_encode_trim((B), (BL), *(L));                  \\\n"
+	  "      (BL) = *(L);                                             \\\n"
+	  "    } else {                                                   \\\n"
+	  "      free((B));                                               \\\n"
+	  "      (B) = NULL;                                              \\\n"
+	  "      if((R) == ASN1_OVERFLOW)                                 \\\n"
+	  "        ASN1_MALLOC_ENCODE(T, B, BL, S, L, R);                 \\\n"
+	  "    }                                                          \\\n"
+	  "  } while (0)\n\n",
+	  headerfile);
     fputs("#ifdef _WIN32\n"
 	  "#ifndef ASN1_LIB\n"
 	  "#define ASN1EXP  __declspec(dllimport)\n"
@@ -1114,6 +1144,18 @@ generate_type (const Symbol *s)
 	     "%svoid   ASN1CALL free_%s  (%s *);\n",
 	     exp,
 	     s->gen_name, s->gen_name);
+    if (arena_type(s->name)) {
+	fprintf (h,
+		 "%sint    ASN1CALL "
+		 "decode_%s_arena(const unsigned char *, size_t, %s *, size_t *, "
+		 "heim_asn1_arena *);\n",
+		 exp,
+		 s->gen_name, s->gen_name);
+	fprintf (h,
+		 "%svoid   ASN1CALL free_%s_arena(%s *, heim_asn1_arena *);\n",
+		 exp,
+		 s->gen_name, s->gen_name);
+    }
 
     fprintf(h, "\n\n");
 
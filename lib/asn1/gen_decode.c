@@ -36,6 +36,29 @@
 
 RCSID("$Id$");
 
+/*
+ * Set while generating decode_<type>_arena(), which allocates from
+ * the heim_asn1_arena `arena' instead of malloc().
+ */
+static int arena;
+
+/* the der_get_<type>() functions that allocate and have an _arena version */
+static int
+primitive_allocates(const char *typename)
+{
+    static const char *types[] = {
+	"heim_integer", "octet_string", "octet_string_ber", "general_string",
+	"utf8string", "printable_string", "ia5_string", "bmp_string",
+	"universal_string", "visible_string", "oid", "bit_string"
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(types)/sizeof(types[0]); i++)
+	if (strcmp(types[i], typename) == 0)
+	    return 1;
+    return 0;
+}
+
 static void
 decode_primitive (const char *typename, const char *name, const char *forwstr)
 {
@@ -47,15 +70,37 @@ decode_primitive (const char *typename, const char *name, const char *forwstr)
 	     name,
 	     forwstr);
 #else
-    fprintf (codefile,
-	     "e = der_get_%s(p, len, %s, &l);\n"
-	     "if(e) %s;\np += l; len -= l; ret += l;\n",
-	     typename,
-	     name,
-	     forwstr);
+    if (arena && primitive_allocates(typename))
+	fprintf (codefile,
+		 "e = der_get_%s_arena(p, len, %s, &l, arena);\n"
+		 "if(e) %s;\np += l; len -= l; ret += l;\n",
+		 typename,
+		 name,
+		 forwstr);
+    else
+	fprintf (codefile,
+		 "e = der_get_%s(p, len, %s, &l);\n"
+		 "if(e) %s;\np += l; len -= l; ret += l;\n",
+		 typename,
+		 name,
+		 forwstr);
 #endif
 }
 
+/* allocate the pointed to value of an OPTIONAL member */
+static void
+alloc_optional(const char *name)
+{
+    if (arena)
+	fprintf (codefile,
+		 "%s = der_arena_alloc(arena, sizeof(*%s));\n",
+		 name, name);
+    else
+	fprintf (codefile,
+		 "%s = calloc(1, sizeof(*%s));\n",
+		 name, name);
+}
+
 static void
 find_tag (const Type *t,
 	  Der_class *cl, Der_type *ty, unsigned *tag)
@@ -214,23 +259,34 @@ decode_type(const char *name, const Type *t, int optional, struct value *defval,
 {
     switch (t->type) {
     case TType: {
-	if (optional)
+	if (optional) {
+	    alloc_optional(name);
 	    fprintf(codefile,
-		    "%s = calloc(1, sizeof(*%s));\n"
 		    "if (%s == NULL) %s;\n",
-		    name, name, name, forwstr);
-	fprintf (codefile,
-		 "e = decode_%s(p, len, %s, &l);\n",
-		 t->symbol->gen_name, name);
+		    name, forwstr);
+	}
+	if (arena) {
+	    if (!arena_type(t->symbol->name))
+		errx(1, "decode_%s_arena() needs --arena-decode=%s",
+		     t->symbol->gen_name, t->symbol->name);
+	    fprintf (codefile,
+		     "e = decode_%s_arena(p, len, %s, &l, arena);\n",
+		     t->symbol->gen_name, name);
+	} else {
+	    fprintf (codefile,
+		     "e = decode_%s(p, len, %s, &l);\n",
+		     t->symbol->gen_name, name);
+	}
 	if (optional) {
 	    fprintf (codefile,
 		     "if(e) {\n"
-		     "free(%s);\n"
+		     "%s%s%s"
 		     "%s = NULL;\n"
 		     "} else {\n"
 		     "p += l; len -= l; ret += l;\n"
 		     "}\n",
-		     name, name);
+		     arena ? "" : "free(", arena ? "" : name,
+		     arena ? "" : ");\n", name);
 	} else {
 	    fprintf (codefile,
 		     "if(e) %s;\n",
@@ -376,11 +432,12 @@ decode_type(const char *name, const Type *t, int optional, struct value *defval,
 
 	    if (asprintf (&s, "%s(%s)->%s", m->optional ? "" : "&", name, m->gen_name) < 0 || s == NULL)
 		errx(1, "malloc");
-	    if(m->optional)
+	    if(m->optional) {
+		alloc_optional(s);
 		fprintf(codefile,
-			"%s = calloc(1, sizeof(*%s));\n"
 			"if (%s == NULL) { e = ENOMEM; %s; }\n",
-			s, s, s, forwstr);
+			s, forwstr);
+	    }
 	    decode_type (s, m->type, 0, NULL, forwstr, m->gen_name, NULL, depth + 1);
 	    free (s);
 
@@ -423,32 +480,65 @@ decode_type(const char *name, const Type *t, int optional, struct value *defval,
 		 "size_t %s_origlen = len;\n"
 		 "size_t %s_oldret = ret;\n"
 		 "size_t %s_olen = 0;\n"
-		 "void *%s_tmp;\n"
-		 "ret = 0;\n"
-		 "(%s)->len = 0;\n"
-		 "(%s)->val = NULL;\n",
-		 tmpstr,
+		 "void *%s_tmp;\n",
 		 tmpstr,
 		 tmpstr,
 		 tmpstr,
+		 tmpstr);
+	if (arena)
+	    fprintf (codefile, "size_t %s_cap = 0;\n", tmpstr);
+	fprintf (codefile,
+		 "ret = 0;\n"
+		 "(%s)->len = 0;\n"
+		 "(%s)->val = NULL;\n",
 		 name,
 		 name);
 
-	fprintf (codefile,
-		 "while(ret < %s_origlen) {\n"
-		 "size_t %s_nlen = %s_olen + sizeof(*((%s)->val));\n"
-		 "if (%s_olen > %s_nlen) { e = ASN1_OVERFLOW; %s; }\n"
-		 "%s_olen = %s_nlen;\n"
-		 "%s_tmp = realloc((%s)->val, %s_olen);\n"
-		 "if (%s_tmp == NULL) { e = ENOMEM; %s; }\n"
-		 "(%s)->val = %s_tmp;\n",
-		 tmpstr,
-		 tmpstr, tmpstr, name,
-		 tmpstr, tmpstr, forwstr,
-		 tmpstr, tmpstr,
-		 tmpstr, name, tmpstr,
-		 tmpstr, forwstr,
-		 name, tmpstr);
+	if (arena) {
+	    /* grow by doubling, the arena can not give memory back */
+	    fprintf (codefile,
+		     "while(ret < %s_origlen) {\n"
+		     "size_t %s_nlen = %s_olen + sizeof(*((%s)->val));\n"
+		     "if (%s_olen > %s_nlen) { e = ASN1_OVERFLOW; %s; }\n"
+		     "if (%s_nlen > %s_cap) {\n"
+		     "size_t %s_ncap = %s_cap ? %s_cap * 2 : 4 * sizeof(*((%s)->val));\n"
+		     "if (%s_ncap < %s_cap) { e = ASN1_OVERFLOW; %s; }\n"
+		     "%s_tmp = der_arena_alloc(arena, %s_ncap);\n"
+		     "if (%s_tmp == NULL) { e = ENOMEM; %s; }\n"
+		     "if (%s_olen) memcpy(%s_tmp, (%s)->val, %s_olen);\n"
+		     "(%s)->val = %s_tmp;\n"
+		     "%s_cap = %s_ncap;\n"
+		     "}\n"
+		     "%s_olen = %s_nlen;\n",
+		     tmpstr,
+		     tmpstr, tmpstr, name,
+		     tmpstr, tmpstr, forwstr,
+		     tmpstr, tmpstr,
+		     tmpstr, tmpstr, tmpstr, name,
+		     tmpstr, tmpstr, forwstr,
+		     tmpstr, tmpstr,
+		     tmpstr, forwstr,
+		     tmpstr, tmpstr, name, tmpstr,
+		     name, tmpstr,
+		     tmpstr, tmpstr,
+		     tmpstr, tmpstr);
+	} else {
+	    fprintf (codefile,
+		     "while(ret < %s_origlen) {\n"
+		     "size_t %s_nlen = %s_olen + sizeof(*((%s)->val));\n"
+		     "if (%s_olen > %s_nlen) { e = ASN1_OVERFLOW; %s; }\n"
+		     "%s_olen = %s_nlen;\n"
+		     "%s_tmp = realloc((%s)->val, %s_olen);\n"
+		     "if (%s_tmp == NULL) { e = ENOMEM; %s; }\n"
+		     "(%s)->val = %s_tmp;\n",
+		     tmpstr,
+		     tmpstr, tmpstr, name,
+		     tmpstr, tmpstr, forwstr,
+		     tmpstr, tmpstr,
+		     tmpstr, name, tmpstr,
+		     tmpstr, forwstr,
+		     name, tmpstr);
+	}
 
 	if (asprintf (&n, "&(%s)->val[(%s)->len]", name, name) < 0 || n == NULL)
 	    errx(1, "malloc");
@@ -515,10 +605,12 @@ decode_type(const char *name, const Type *t, int optional, struct value *defval,
 	    fprintf(codefile,
 		    "if(e) {\n"
 		    "%s = NULL;\n"
-		    "} else {\n"
-		     "%s = calloc(1, sizeof(*%s));\n"
-		     "if (%s == NULL) { e = ENOMEM; %s; }\n",
-		     name, name, name, name, forwstr);
+		    "} else {\n",
+		    name);
+	    alloc_optional(name);
+	    fprintf(codefile,
+		    "if (%s == NULL) { e = ENOMEM; %s; }\n",
+		    name, forwstr);
 	} else {
             if (defval) {
                 char *s;
@@ -619,7 +711,20 @@ decode_type(const char *name, const Type *t, int optional, struct value *defval,
 		    "}\n");
 	    els = "else ";
 	}
-	if (have_ellipsis) {
+	if (have_ellipsis && arena) {
+	    fprintf(codefile,
+		    "else {\n"
+		    "e = der_get_octet_string_arena(p, len, &(%s)->u.%s, NULL, arena);\n"
+		    "if (e) %s;\n"
+		    "(%s)->element = %s;\n"
+		    "p += len;\n"
+		    "ret += len;\n"
+		    "len = 0;\n"
+		    "}\n",
+		    name, have_ellipsis->gen_name,
+		    forwstr,
+		    name, have_ellipsis->label);
+	} else if (have_ellipsis) {
 	    fprintf(codefile,
 		    "else {\n"
 		    "(%s)->u.%s.data = calloc(1, len);\n"
@@ -682,16 +787,24 @@ decode_type(const char *name, const Type *t, int optional, struct value *defval,
     return 0;
 }
 
-void
-generate_type_decode (const Symbol *s)
+static void
+generate_decode_function (const Symbol *s)
 {
     int preserve = preserve_type(s->name) ? TRUE : FALSE;
 
-    fprintf (codefile, "int ASN1CALL\n"
-	     "decode_%s(const unsigned char *p HEIMDAL_UNUSED_ATTRIBUTE,"
-	     " size_t len HEIMDAL_UNUSED_ATTRIBUTE, %s *data, size_t *size)\n"
-	     "{\n",
-	     s->gen_name, s->gen_name);
+    if (arena)
+	fprintf (codefile, "int ASN1CALL\n"
+		 "decode_%s_arena(const unsigned char *p HEIMDAL_UNUSED_ATTRIBUTE,"
+		 " size_t len HEIMDAL_UNUSED_ATTRIBUTE, %s *data, size_t *size,"
+		 " heim_asn1_arena *arena HEIMDAL_UNUSED_ATTRIBUTE)\n"
+		 "{\n",
+		 s->gen_name, s->gen_name);
+    else
+	fprintf (codefile, "int ASN1CALL\n"
+		 "decode_%s(const unsigned char *p HEIMDAL_UNUSED_ATTRIBUTE,"
+		 " size_t len HEIMDAL_UNUSED_ATTRIBUTE, %s *data, size_t *size)\n"
+		 "{\n",
+		 s->gen_name, s->gen_name);
 
     switch (s->type->type) {
     case TInteger:
@@ -729,7 +842,12 @@ generate_type_decode (const Symbol *s)
 	fprintf (codefile, "memset(data, 0, sizeof(*data));\n"); /* hack to avoid `unused variable' */
 
 	decode_type("data", s->type, 0, NULL, "goto fail", "Top", NULL, 1);
-	if (preserve)
+	if (preserve && arena)
+	    fprintf (codefile,
+		     "e = der_get_octet_string_arena(begin, ret, &data->_save, "
+		     "NULL, arena);\n"
+		     "if (e) goto fail;\n");
+	else if (preserve)
 	    fprintf (codefile,
 		     "data->_save.data = calloc(1, ret);\n"
 		     "if (data->_save.data == NULL) { \n"
@@ -740,14 +858,31 @@ generate_type_decode (const Symbol *s)
 	fprintf (codefile,
 		 "if(size) *size = ret;\n"
 		 "return 0;\n");
-	fprintf (codefile,
-		 "fail:\n"
-		 "free_%s(data);\n"
-		 "return e;\n",
-		 s->gen_name);
+	if (arena)
+	    fprintf (codefile,
+		     "fail:\n"
+		     "memset(data, 0, sizeof(*data));\n"
+		     "return e;\n");
+	else
+	    fprintf (codefile,
+		     "fail:\n"
+		     "free_%s(data);\n"
+		     "return e;\n",
+		     s->gen_name);
 	break;
     default:
 	abort ();
     }
     fprintf (codefile, "}\n\n");
 }
+
+void
+generate_type_decode (const Symbol *s)
+{
+    generate_decode_function(s);
+    if (arena_type(s->name)) {
+	arena = 1;
+	generate_decode_function(s);
+	arena = 0;
+    }
+}
@@ -187,5 +187,15 @@ generate_type_free (const Symbol *s)
 
     free_type ("data", s->type, preserve);
     fprintf (codefile, "}\n\n");
+
+    /* values from decode_<type>_arena() only live in the arena */
+    if (arena_type(s->name))
+	fprintf (codefile, "void ASN1CALL\n"
+		 "free_%s_arena(%s *data, heim_asn1_arena *arena)\n"
+		 "{\n"
+		 "memset(data, 0, sizeof(*data));\n"
+		 "der_arena_free(arena);\n"
+		 "}\n\n",
+		 s->gen_name, s->gen_name);
 }
 
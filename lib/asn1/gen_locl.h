@@ -82,6 +82,7 @@ int is_primitive_type(int);
 
 int preserve_type(const char *);
 int seq_type(const char *);
+int arena_type(const char *);
 
 void generate_header_of_codefile(const char *);
 void close_codefile(void);
@@ -39,6 +39,7 @@ extern FILE *yyin;
 
 static getarg_strings preserve;
 static getarg_strings seq;
+static getarg_strings arena;
 
 int
 preserve_type(const char *p)
@@ -60,6 +61,16 @@ seq_type(const char *p)
     return 0;
 }
 
+int
+arena_type(const char *p)
+{
+    int i;
+    for (i = 0; i < arena.num_strings; i++)
+	if (strcmp(arena.strings[i], p) == 0)
+	    return 1;
+    return 0;
+}
+
 const char *fuzzer_string = "";
 int fuzzer_flag;
 int support_ber;
@@ -79,6 +90,7 @@ struct getargs args[] = {
     { "support-ber", 0, arg_flag, &support_ber, NULL, NULL },
     { "preserve-binary", 0, arg_strings, &preserve, NULL, NULL },
     { "sequence", 0, arg_strings, &seq, NULL, NULL },
+    { "arena-decode", 0, arg_strings, &arena, NULL, NULL },
     { "one-code-file", 0, arg_flag, &one_code_file, NULL, NULL },
     { "option-file", 0, arg_string, &option_file, NULL, NULL },
     { "parse-units", 0, arg_negative_flag, &parse_units_flag, NULL, NULL },
@@ -195,6 +207,12 @@ main(int argc, char **argv)
 #endif
     }
 
+    if (template_flag && arena.num_strings) {
+	fprintf(stderr, "--arena-decode needs the generated decoders, "
+		"not --template\n");
+	exit(1);
+    }
+
 
     init_generate (file, name);
 
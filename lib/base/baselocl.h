@@ -95,4 +95,5 @@ struct heim_context_s {
     struct et_list          *et_list;
     char                    *error_string;
     heim_error_code         error_code;
+    struct heim_config_index *cf_index;
 };
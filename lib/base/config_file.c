@@ -49,6 +49,44 @@ struct fileptr {
     FILE *f;
 };
 
+/*
+ * A compiled configuration, see heim_config_compile().  Every path of
+ * names in the section is hashed to the first string and the first
+ * list binding heim_config_vget_next() would find for it, with that
+ * string already converted for the typed getters.  The paths are
+ * interned in one buffer, names separated by NULs.
+ */
+
+struct config_index_entry {
+    const char *path;
+    size_t pathlen;
+    uint32_t hash;
+    const heim_config_binding *string;
+    const heim_config_binding *list;
+    long intval;
+    time_t timeval;
+    unsigned int boolval:1;
+    unsigned int intvalid:1;
+};
+
+struct heim_config_index {
+    const heim_config_section *root;
+    size_t mask;
+    struct config_index_entry *entries;
+    char *paths;
+    size_t pathsused;
+};
+
+#define CONFIG_INDEX_MAXDEPTH 16
+
+static void
+config_index_forget(heim_context context, const heim_config_section *c)
+{
+    if (c != NULL && context != NULL && context->cf_index != NULL &&
+        context->cf_index->root == c)
+        (void) heim_config_compile(context, NULL);
+}
+
 static char *
 config_fgets(char *str, size_t len, struct fileptr *ptr)
 {
@@ -562,6 +600,9 @@ heim_config_parse_file_multi(heim_context context,
     struct fileptr f;
     struct stat st;
 
+    /* *res is about to change under its compiled form */
+    config_index_forget(context, *res);
+
     if (config_include_depth > 5) {
         heim_warnx(context, "Maximum config file include depth reached; "
                    "not including %s", fname);
@@ -703,6 +744,7 @@ free_binding(heim_context context, heim_config_binding *b)
 heim_error_code
 heim_config_file_free(heim_context context, heim_config_section *s)
 {
+    config_index_forget(context, s);
     free_binding (context, s);
     return 0;
 }
@@ -742,6 +784,237 @@ heim_config_copy(heim_context context,
 
 #endif /* HEIMDAL_SMALLER */
 
+#define CONFIG_HASH_INIT 2166136261U
+
+static uint32_t
+config_hash(uint32_t h, const char *s, size_t len)
+{
+    while (len--) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619;
+    }
+    return h;
+}
+
+/* config_hash() of a NUL terminated name, and its length */
+static uint32_t
+config_hash_name(uint32_t h, const char *s, size_t *len)
+{
+    const char *p;
+
+    for (p = s; *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 16777619;
+    }
+    *len = p - s;
+    return h;
+}
+
+static void
+config_index_count(const heim_config_binding *b, size_t prefix,
+                   size_t *n, size_t *bytes, size_t *maxlen)
+{
+    for (; b != NULL; b = b->next) {
+        size_t len = prefix + strlen(b->name);
+
+        (*n)++;
+        *bytes += len + 1;
+        if (len > *maxlen)
+            *maxlen = len;
+        if (b->type == heim_config_list)
+            config_index_count(b->u.list, len + 1, n, bytes, maxlen);
+    }
+}
+
+static struct config_index_entry *
+config_index_insert(struct heim_config_index *idx, const char *path,
+                    size_t len)
+{
+    struct config_index_entry *e;
+    uint32_t h = config_hash(CONFIG_HASH_INIT, path, len);
+    size_t i;
+
+    for (i = h & idx->mask; idx->entries[i].path; i = (i + 1) & idx->mask) {
+        e = &idx->entries[i];
+        if (e->hash == h && e->pathlen == len &&
+            memcmp(e->path, path, len) == 0)
+            return e;
+    }
+    e = &idx->entries[i];
+    e->path = idx->paths + idx->pathsused;
+    e->pathlen = len;
+    e->hash = h;
+    memcpy(idx->paths + idx->pathsused, path, len);
+    idx->paths[idx->pathsused + len] = '\0';
+    idx->pathsused += len + 1;
+    return e;
+}
+
+/*
+ * Visit the bindings in the order vget_next() does, so the first one
+ * recorded for a path is the one a walk would have found.
+ */
+
+static void
+config_index_add(struct heim_config_index *idx, const heim_config_binding *b,
+                 char *path, size_t prefix)
+{
+    for (; b != NULL; b = b->next) {
+        size_t len = prefix + strlen(b->name);
+        struct config_index_entry *e;
+
+        memcpy(path + prefix, b->name, len - prefix);
+        e = config_index_insert(idx, path, len);
+        if (b->type == heim_config_string && e->string == NULL) {
+            const char *s = b->u.string;
+            char *end;
+
+            e->string = b;
+            e->boolval = (strcasecmp(s, "yes") == 0 ||
+                          strcasecmp(s, "true") == 0 ||
+                          atoi(s));
+            e->intval = strtol(s, &end, 0);
+            e->intvalid = end != s;
+            e->timeval = parse_time(s, "s");
+        } else if (b->type == heim_config_list) {
+            if (e->list == NULL)
+                e->list = b;
+            path[len] = '\0';
+            config_index_add(idx, b->u.list, path, len + 1);
+        }
+    }
+}
+
+static void
+config_index_free(struct heim_config_index *idx)
+{
+    if (idx == NULL)
+        return;
+    free(idx->entries);
+    free(idx->paths);
+    free(idx);
+}
+
+/*
+ * Look the names in args up in the compiled configuration of context.
+ * Returns 0 if c is not the section that was compiled, or there are
+ * too many names, and the caller has to walk the bindings.  args is
+ * not consumed.
+ */
+
+static int
+config_index_lookup(heim_context context,
+                    const heim_config_section *c,
+                    va_list args,
+                    const struct config_index_entry **res)
+{
+    const struct heim_config_index *idx;
+    const char *names[CONFIG_INDEX_MAXDEPTH];
+    size_t lens[CONFIG_INDEX_MAXDEPTH];
+    size_t n = 0, len = 0, i, j;
+    uint32_t h = CONFIG_HASH_INIT;
+    const char *p;
+    va_list ap;
+
+    *res = NULL;
+    if (context == NULL || (idx = context->cf_index) == NULL ||
+        idx->root != c)
+        return 0;
+
+    va_copy(ap, args);
+    while ((p = va_arg(ap, const char *)) != NULL) {
+        if (n == CONFIG_INDEX_MAXDEPTH) {
+            va_end(ap);
+            return 0;
+        }
+        if (n > 0) {
+            h = config_hash(h, "", 1);
+            len++;
+        }
+        h = config_hash_name(h, p, &lens[n]);
+        len += lens[n];
+        names[n++] = p;
+    }
+    va_end(ap);
+    if (n == 0)
+        return 1;
+
+    for (i = h & idx->mask; idx->entries[i].path; i = (i + 1) & idx->mask) {
+        const struct config_index_entry *e = &idx->entries[i];
+        const char *q = e->path;
+
+        if (e->hash != h || e->pathlen != len)
+            continue;
+        for (j = 0; j < n; j++) {
+            if (memcmp(q, names[j], lens[j]) != 0 || q[lens[j]] != '\0')
+                break;
+            q += lens[j] + 1;
+        }
+        if (j == n) {
+            *res = e;
+            break;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Compile a configuration section for fast lookups.  Lookups with
+ * context in c through the heim_config_get*() functions then hash
+ * the list of names instead of walking the bindings, and the
+ * boolean, integer and time getters return values converted when c
+ * was compiled.  Results are the same as walking c.
+ *
+ * Only one section per context is compiled, compiling another one, or
+ * NULL, replaces the previous one.  c must not be changed afterwards,
+ * parsing more configuration into it or freeing it with
+ * heim_config_file_free() drops its compiled form.
+ *
+ * @param context A heim context
+ * @param c the configuration section to compile, or NULL
+ *
+ * @return Return an error code or 0, see heim_get_error_message().
+ *
+ * @ingroup heim_support
+ */
+
+heim_error_code
+heim_config_compile(heim_context context, const heim_config_section *c)
+{
+    struct heim_config_index *idx = NULL, *old;
+
+    if (c != NULL) {
+        size_t n = 0, bytes = 0, maxlen = 0, size;
+        char *path;
+
+        config_index_count(c, 0, &n, &bytes, &maxlen);
+        for (size = 16; size < n * 2; size <<= 1)
+            ;
+        path = malloc(maxlen + 1);
+        idx = calloc(1, sizeof(*idx));
+        if (idx != NULL) {
+            idx->entries = calloc(size, sizeof(idx->entries[0]));
+            idx->paths = malloc(bytes);
+        }
+        if (path == NULL || idx == NULL || idx->entries == NULL ||
+            idx->paths == NULL) {
+            free(path);
+            config_index_free(idx);
+            return heim_enomem(context);
+        }
+        idx->root = c;
+        idx->mask = size - 1;
+        config_index_add(idx, c, path, 0);
+        free(path);
+    }
+
+    /* the new snapshot is complete before it replaces the old one */
+    old = context->cf_index;
+    context->cf_index = idx;
+    config_index_free(old);
+    return 0;
+}
+
 const void *
 heim_config_get_next(heim_context context,
                      const heim_config_section *c,
@@ -796,6 +1069,23 @@ heim_config_vget_next(heim_context context,
         return NULL;
 
     if (*pointer == NULL) {
+        const struct config_index_entry *e;
+
+        if (config_index_lookup(context, c, args, &e)) {
+            if (e == NULL)
+                return NULL;
+            if (type == heim_config_string)
+                b = e->string;
+            else if (type == heim_config_list)
+                b = e->list;
+            else
+                b = NULL;
+            if (b == NULL)
+                return NULL;
+            *pointer = b;
+            return b->u.generic;
+        }
+
         /* first time here, walk down the tree looking for the right
            section */
         p = va_arg(args, const char *);
@@ -1175,7 +1465,12 @@ heim_config_vget_bool_default(heim_context context,
                               int def_value,
                               va_list args)
 {
+    const struct config_index_entry *e;
     const char *str;
+
+    if (config_index_lookup(context, c, args, &e))
+        return e && e->string ? e->boolval : def_value;
+
     str = heim_config_vget_string(context, c, args);
     if (str == NULL)
         return def_value;
@@ -1289,10 +1584,14 @@ heim_config_vget_time_default(heim_context context,
                               int def_value,
                               va_list args)
 {
+    const struct config_index_entry *e;
     const char *str;
     time_t t = -1;
 
-    if ((str = heim_config_vget_string(context, c, args)))
+    if (config_index_lookup(context, c, args, &e)) {
+        if (e && e->string)
+            t = e->timeval;
+    } else if ((str = heim_config_vget_string(context, c, args)))
         t = parse_time(str, "s");
     return t != -1 ? t : def_value;
 }
@@ -1378,7 +1677,12 @@ heim_config_vget_int_default(heim_context context,
                              int def_value,
                              va_list args)
 {
+    const struct config_index_entry *e;
     const char *str;
+
+    if (config_index_lookup(context, c, args, &e))
+        return e && e->string && e->intvalid ? e->intval : def_value;
+
     str = heim_config_vget_string (context, c, args);
     if(str == NULL)
         return def_value;
@@ -1444,6 +1748,8 @@ heim_config_parse_string_multi(heim_context context,
     f.f = NULL;
     f.s = string;
 
+    config_index_forget(context, *res);
+
     ret = heim_config_parse_debug(&f, res, &lineno, &str);
     if (ret) {
 	if (ret != HEIM_ERR_CONFIG_BADFORMAT) {
@@ -67,6 +67,7 @@ heim_context_free(heim_context *contextp)
     heim_closelog(context, context->warn_dest);
     heim_closelog(context, context->log_dest);
     free_error_table(context->et_list);
+    (void) heim_config_compile(context, NULL);
     free(context->time_fmt);
     free(context->error_string);
     free(context);
@@ -61,12 +61,20 @@
 #define heim_base_exchange_32(t,v)	atomic_exchange((t), (v))
 #define heim_base_exchange_64(t,v)	atomic_exchange((t), (v))
 
+static inline int
+heim_base_atomic_cas(heim_base_atomic_integer_type *x,
+		     unsigned int expected, unsigned int desired)
+{
+    return atomic_compare_exchange_strong(x, &expected, desired);
+}
+
 #elif defined(__GNUC__) && defined(HAVE___SYNC_ADD_AND_FETCH)
 
 #define heim_base_atomic_barrier()	__sync_synchronize()
 
 #define heim_base_atomic_inc(x)		__sync_add_and_fetch((x), 1)
 #define heim_base_atomic_dec(x)		__sync_sub_and_fetch((x), 1)
+#define heim_base_atomic_cas(x,e,d)	__sync_bool_compare_and_swap((x), (e), (d))
 #define heim_base_atomic_integer_type	unsigned int
 #define heim_base_atomic_integer_max	UINT_MAX
 
@@ -92,6 +100,7 @@
 
 #define heim_base_atomic_inc(x)		atomic_inc_uint_nv((volatile uint_t *)(x))
 #define heim_base_atomic_dec(x)		atomic_dec_uint_nv((volatile uint_t *)(x))
+#define heim_base_atomic_cas(x,e,d)	(atomic_cas_uint((volatile uint_t *)(x), (e), (d)) == (e))
 #define heim_base_atomic_integer_type	uint_t
 #define heim_base_atomic_integer_max	UINT_MAX
 
@@ -132,6 +141,13 @@ heim_base_exchange_32(uint32_t *p, uint32_t newval)
     return val;
 }
 
+static inline int
+heim_base_atomic_cas(unsigned int *p, unsigned int expected,
+		     unsigned int desired)
+{
+    return compare_and_swap((atomic_p)p, (int *)&expected, (int)desired);
+}
+
 static inline uint64_t
 heim_base_exchange_64(uint64_t *p, uint64_t newval)
 {
@@ -149,6 +165,7 @@ heim_base_exchange_64(uint64_t *p, uint64_t newval)
 
 #define heim_base_atomic_inc(x)		InterlockedIncrement(x)
 #define heim_base_atomic_dec(x)		InterlockedDecrement(x)
+#define heim_base_atomic_cas(x,e,d)	(InterlockedCompareExchange((x), (d), (e)) == (LONG)(e))
 #define heim_base_atomic_integer_type	LONG
 #define heim_base_atomic_integer_max	MAXLONG
 
@@ -186,6 +203,21 @@ heim_base_atomic_dec(heim_base_atomic_integer_type *x)
     return t;
 }
 
+static inline int
+heim_base_atomic_cas(heim_base_atomic_integer_type *x,
+		     heim_base_atomic_integer_type expected,
+		     heim_base_atomic_integer_type desired)
+{
+    int ret = 0;
+    HEIMDAL_MUTEX_lock(&_heim_base_mutex);
+    if (*x == expected) {
+	*x = desired;
+	ret = 1;
+    }
+    HEIMDAL_MUTEX_unlock(&_heim_base_mutex);
+    return ret;
+}
+
 static inline void *
 heim_base_exchange_pointer(void *target, void *value)
 {
@@ -68,6 +68,11 @@
     const char *e_text;                                         \
     char *e_text_buf;                                           \
     heim_string_t reason;                                       \
-    heim_array_t kv
+    heim_array_t kv;                                            \
+                                                                \
+    /* Structured audit, see heim_audit_trail() */              \
+    heim_svc_audit_sink audit_sink;                             \
+    void *audit_sink_ctx;                                       \
+    heim_svc_audit_record audit
 
 #endif /* HEIMBASE_SVC_H */
@@ -533,6 +533,50 @@ void heim_w32_service_thread_detach(void *);
 
 typedef struct heim_svc_req_desc_common_s *heim_svc_req_desc;
 
+/*
+ * Structured audit records.  When a request has an audit sink, the
+ * heim_audit_*() functions store typed fields in this fixed size
+ * record, which is part of the request, instead of formatting strings,
+ * and heim_audit_trail() hands the record to the sink.  Keys and string
+ * values are NUL terminated and live at strspace + keyoff and
+ * strspace + stroff.
+ */
+
+#define HEIM_SVC_AUDIT_MAXFIELDS	24
+#define HEIM_SVC_AUDIT_STRSPACE		1024
+
+#define HEIM_SVC_AUDIT_TYPE_NUMBER	1
+#define HEIM_SVC_AUDIT_TYPE_STRING	2
+
+struct heim_svc_audit_field {
+    unsigned short keyoff;
+    int type;
+    int64_t number;
+    unsigned short stroff;
+    unsigned short strsize;	/* excluding the NUL */
+};
+
+typedef struct heim_svc_audit_record {
+    /* set by heim_audit_trail() */
+    const char *reqtype;
+    const char *result;
+    int64_t error;
+    const char *from;
+    const char *cname;
+    const char *sname;
+    const char *e_text;
+    int64_t time;		/* end of the request, seconds */
+    int64_t elapsed;		/* microseconds */
+    /* added while the request is processed */
+    unsigned int nfields;
+    unsigned int strused;
+    int truncated;		/* some fields did not fit */
+    struct heim_svc_audit_field fields[HEIM_SVC_AUDIT_MAXFIELDS];
+    char strspace[HEIM_SVC_AUDIT_STRSPACE];
+} heim_svc_audit_record;
+
+typedef void (*heim_svc_audit_sink)(void *, const heim_svc_audit_record *);
+
 #include <heimbase-protos.h>
 
 #endif /* HEIM_BASE_H */
@@ -41,6 +41,15 @@
 #include <stdarg.h>
 #include <vis.h>
 
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_WRITEV)
+#define HEIM_LOG_ASYNC 1
+#include <pthread.h>
+#include <signal.h>
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#endif
+
 typedef struct heim_pcontext_s *heim_pcontext;
 typedef struct heim_pconfig *heim_pconfig;
 struct heim_svc_req_desc_common_s {
@@ -208,8 +217,372 @@ struct file_data {
 #define FILEDISP_REOPEN         0x2
 #define FILEDISP_IFEXISTS       0x3
     int freefilename;
+    int async;
+    char *async_path;   /* expanded filename, for the writer thread */
 };
 
+#ifdef HEIM_LOG_ASYNC
+
+/*
+ * Asynchronous delivery for file destinations, see heim_log_set_async().
+ *
+ * Each process has one bounded queue of formatted lines.  A logging
+ * thread claims a slot with a compare-and-swap and never waits for
+ * the disk or the writer: when the queue is full the line is dropped
+ * and counted.  A writer thread drains the queue, handing each run of
+ * lines for the same destination to a single writev().  Slot sequence
+ * numbers tell the writer which slots have been filled in.
+ *
+ * A slot without a line closes its destination: the writer frees the
+ * file_data once the lines queued before it are out, so a destination
+ * is never freed under the writer.
+ */
+
+#define LOGQ_BATCH 64
+
+struct log_slot {
+    heim_base_atomic_integer_type seq;
+    struct file_data *f;
+    char *line;
+    size_t len;
+    size_t tlen;        /* length of the time stamp that starts line */
+};
+
+static struct log_slot *logq_slots;
+static unsigned int logq_mask;
+static heim_base_atomic_integer_type logq_head;      /* next slot to fill */
+static heim_base_atomic_integer_type logq_tail;      /* next slot to write */
+static heim_base_atomic_integer_type logq_dropped;
+static heim_base_atomic_integer_type logq_sleeping;
+static heim_base_atomic_integer_type logq_running;
+static heim_base_atomic_integer_type logq_reported;
+static char logq_timestr[64];   /* time stamp of the last line written */
+static size_t logq_timelen;
+static HEIMDAL_MUTEX logq_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static pthread_cond_t logq_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t logq_drained = PTHREAD_COND_INITIALIZER;
+
+static int
+logq_ready(unsigned int pos)
+{
+    return heim_base_atomic_load(&logq_slots[pos & logq_mask].seq) == pos + 1;
+}
+
+static void
+logq_write(struct file_data *f, struct iovec *iov, int n)
+{
+    int fd = -1;
+
+    if (f->disp == FILEDISP_KEEPOPEN) {
+        if (f->fd)
+            fd = fileno(f->fd);
+    } else {
+        int flags = O_WRONLY | (f->mode[0] == 'a' ? O_APPEND : O_TRUNC);
+        struct timeval tv;
+
+        if (f->disp == FILEDISP_IFEXISTS) {
+            /* Cache failure for 1s */
+            gettimeofday(&tv, NULL);
+            if (tv.tv_sec == f->tv.tv_sec)
+                return;
+        } else {
+            flags |= O_CREAT;
+        }
+        fd = open(f->async_path, flags, 0666);
+        if (fd == -1 && f->disp == FILEDISP_IFEXISTS)
+            gettimeofday(&f->tv, NULL);
+    }
+    if (fd == -1)
+        return;
+
+    while (n > 0) {
+        ssize_t sz = writev(fd, iov, n);
+
+        if (sz < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        while (n > 0 && (size_t)sz >= iov->iov_len) {
+            sz -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + sz;
+            iov->iov_len -= sz;
+        }
+    }
+
+    if (f->disp != FILEDISP_KEEPOPEN)
+        close(fd);
+}
+
+/* Log the number of lines dropped since the last report to `f' */
+static void
+logq_report_dropped(struct file_data *f)
+{
+    unsigned int dropped = heim_base_atomic_load(&logq_dropped);
+    unsigned int reported = heim_base_atomic_load(&logq_reported);
+    struct iovec iov;
+    char buf[128];
+    int len;
+
+    if (dropped == reported)
+        return;
+    len = snprintf(buf, sizeof(buf), "%.*s %u log messages dropped\n",
+                   (int)logq_timelen, logq_timestr, dropped - reported);
+    if (len > 0 && (size_t)len < sizeof(buf)) {
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        logq_write(f, &iov, 1);
+    }
+    heim_base_atomic_store(&logq_reported, dropped);
+}
+
+static void free_file_data(struct file_data *);
+
+static void *
+logq_writer(void *arg)
+{
+    struct iovec iov[LOGQ_BATCH];
+    struct file_data *lastf = NULL;
+
+    for (;;) {
+        unsigned int pos = heim_base_atomic_load(&logq_tail);
+        struct log_slot *last;
+        struct file_data *f;
+        int i, n;
+
+        if (!logq_ready(pos)) {
+            /* lines dropped just before the queue ran dry, e.g., at exit */
+            if (lastf)
+                logq_report_dropped(lastf);
+            HEIMDAL_MUTEX_lock(&logq_mutex);
+            pthread_cond_broadcast(&logq_drained);
+            heim_base_atomic_store(&logq_sleeping, 1);
+            while (!logq_ready(pos))
+                pthread_cond_wait(&logq_wakeup, &logq_mutex);
+            heim_base_atomic_store(&logq_sleeping, 0);
+            HEIMDAL_MUTEX_unlock(&logq_mutex);
+        }
+
+        f = logq_slots[pos & logq_mask].f;
+        if (logq_slots[pos & logq_mask].line == NULL) {
+            logq_report_dropped(f);
+            free_file_data(f);
+            if (lastf == f)
+                lastf = NULL;
+            heim_base_atomic_store(&logq_slots[pos & logq_mask].seq,
+                                   pos + logq_mask + 1);
+            heim_base_atomic_store(&logq_tail, pos + 1);
+            continue;
+        }
+        for (n = 0; n < LOGQ_BATCH && logq_ready(pos + n); n++) {
+            struct log_slot *s = &logq_slots[(pos + n) & logq_mask];
+
+            if (s->f != f || s->line == NULL)
+                break;
+            iov[n].iov_base = s->line;
+            iov[n].iov_len = s->len;
+        }
+        logq_write(f, iov, n);
+        lastf = f;
+
+        last = &logq_slots[(pos + n - 1) & logq_mask];
+        if (last->tlen < sizeof(logq_timestr)) {
+            memcpy(logq_timestr, last->line, last->tlen);
+            logq_timelen = last->tlen;
+        }
+        logq_report_dropped(f);
+
+        for (i = 0; i < n; i++) {
+            struct log_slot *s = &logq_slots[(pos + i) & logq_mask];
+
+            free(s->line);
+            s->line = NULL;
+            heim_base_atomic_store(&s->seq, pos + i + logq_mask + 1);
+        }
+        heim_base_atomic_store(&logq_tail, pos + n);
+    }
+    return NULL;
+}
+
+/*
+ * Only the thread that forked survives in the child, take the queue
+ * back to empty and let the next message start a new writer.
+ */
+static void
+logq_atfork_child(void)
+{
+    unsigned int pos;
+
+    for (pos = 0; pos <= logq_mask; pos++) {
+        free(logq_slots[pos].line);
+        logq_slots[pos].line = NULL;
+        heim_base_atomic_init(&logq_slots[pos].seq, pos);
+    }
+    heim_base_atomic_init(&logq_head, 0);
+    heim_base_atomic_init(&logq_tail, 0);
+    heim_base_atomic_init(&logq_dropped, 0);
+    heim_base_atomic_init(&logq_sleeping, 0);
+    heim_base_atomic_init(&logq_running, 0);
+    heim_base_atomic_init(&logq_reported, 0);
+    HEIMDAL_MUTEX_init(&logq_mutex);
+    pthread_cond_init(&logq_wakeup, NULL);
+    pthread_cond_init(&logq_drained, NULL);
+}
+
+static void
+logq_atexit(void)
+{
+    heim_log_flush();
+}
+
+static int
+logq_start(void)
+{
+    static int registered = 0;
+    sigset_t all, old;
+    pthread_t thread;
+    int ret = 0;
+
+    HEIMDAL_MUTEX_lock(&logq_mutex);
+    if (heim_base_atomic_load(&logq_running))
+        goto out;
+    if (!registered) {
+        if (pthread_atfork(NULL, NULL, logq_atfork_child) != 0) {
+            ret = -1;
+            goto out;
+        }
+        atexit(logq_atexit);
+        registered = 1;
+    }
+
+    /* signals are for the logging threads, not the writer */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    ret = pthread_create(&thread, NULL, logq_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret == 0) {
+        pthread_detach(thread);
+        heim_base_atomic_store(&logq_running, 1);
+    }
+out:
+    HEIMDAL_MUTEX_unlock(&logq_mutex);
+    return ret;
+}
+
+static int
+logq_init(size_t entries)
+{
+    size_t i, n = 1;
+
+    if (logq_slots)
+        return 0;
+    while (n < entries && n < 0x80000000U)
+        n <<= 1;
+    logq_slots = calloc(n, sizeof(logq_slots[0]));
+    if (logq_slots == NULL)
+        return ENOMEM;
+    for (i = 0; i < n; i++)
+        heim_base_atomic_init(&logq_slots[i].seq, (unsigned int)i);
+    logq_mask = n - 1;
+    return 0;
+}
+
+/*
+ * Claim a slot, only while one is free, and fill it in.  The writer
+ * releases a slot before it moves logq_tail past it, so a claimed slot
+ * is ready.
+ */
+static int
+logq_claim(struct file_data *f, char *line, size_t len, size_t tlen)
+{
+    struct log_slot *s;
+    unsigned int pos;
+
+    do {
+        pos = heim_base_atomic_load(&logq_head);
+        if (pos - heim_base_atomic_load(&logq_tail) > logq_mask)
+            return -1;
+    } while (!heim_base_atomic_cas(&logq_head, pos, pos + 1));
+    s = &logq_slots[pos & logq_mask];
+    s->f = f;
+    s->line = line;
+    s->len = len;
+    s->tlen = tlen;
+    heim_base_atomic_store(&s->seq, pos + 1);
+
+    if (heim_base_atomic_load(&logq_sleeping)) {
+        HEIMDAL_MUTEX_lock(&logq_mutex);
+        pthread_cond_signal(&logq_wakeup);
+        HEIMDAL_MUTEX_unlock(&logq_mutex);
+    }
+    return 0;
+}
+
+/*
+ * Queue a line for the writer thread.  Returns non-zero when the line
+ * must be written synchronously instead.
+ */
+static int
+logq_put(struct file_data *f, const char *timestr, const char *msg)
+{
+    size_t tlen = strlen(timestr);
+    size_t i, j;
+    char *line;
+
+    if (!heim_base_atomic_load(&logq_running) && logq_start() != 0)
+        return -1;
+
+    if (heim_base_atomic_load(&logq_head) -
+        heim_base_atomic_load(&logq_tail) > logq_mask) {
+        (void) heim_base_atomic_inc(&logq_dropped);
+        return 0;
+    }
+    line = malloc(tlen + strlen(msg) + 2);
+    if (line == NULL) {
+        (void) heim_base_atomic_inc(&logq_dropped);
+        return 0;
+    }
+    memcpy(line, timestr, tlen);
+    j = tlen;
+    line[j++] = ' ';
+    for (i = 0; msg[i]; i++)
+        if (msg[i] >= 32 || msg[i] == '\t')
+            line[j++] = msg[i];
+    line[j++] = '\n';
+
+    if (logq_claim(f, line, j, tlen) != 0) {
+        (void) heim_base_atomic_inc(&logq_dropped);
+        free(line);
+    }
+    return 0;
+}
+
+/*
+ * Hand `f' to the writer to be freed after the lines queued for it.
+ * Returns non-zero when the caller must free it: there is no writer,
+ * or the queue stays full, in which case `f' is leaked rather than
+ * freed under a writer that may still hold it.
+ */
+static int
+logq_close(struct file_data *f)
+{
+    if (!heim_base_atomic_load(&logq_running))
+        return -1;
+    if (logq_claim(f, NULL, 0, 0) != 0) {
+        heim_log_flush();
+        if (logq_claim(f, NULL, 0, 0) != 0)
+            return 0;
+    }
+    heim_log_flush();
+    return 0;
+}
+
+#endif /* HEIM_LOG_ASYNC */
+
 static void HEIM_CALLCONV
 log_file(heim_context context, const char *timestr, const char *msg, void *data)
 {
@@ -219,6 +592,11 @@ log_file(heim_context context, const char *timestr, const char *msg, void *data)
     size_t i;
     size_t j;
 
+#ifdef HEIM_LOG_ASYNC
+    if (f->async && logq_put(f, timestr, msg) == 0)
+        return;
+#endif
+
     if (f->disp != FILEDISP_KEEPOPEN) {
         char *filename;
         int flags = -1;
@@ -275,15 +653,27 @@ out:
     }
 }
 
-static void HEIM_CALLCONV
-close_file(void *data)
+static void
+free_file_data(struct file_data *f)
 {
-    struct file_data *f = data;
     if (f->disp == FILEDISP_KEEPOPEN && f->filename)
         fclose(f->fd);
+    free(f->async_path);
     if (f->filename && f->freefilename)
         free((char *)f->filename);
-    free(data);
+    free(f);
+}
+
+static void HEIM_CALLCONV
+close_file(void *data)
+{
+    struct file_data *f = data;
+
+#ifdef HEIM_LOG_ASYNC
+    if (f->async && logq_close(f) == 0)
+        return;
+#endif
+    free_file_data(f);
 }
 
 static heim_error_code
@@ -302,10 +692,103 @@ open_file(heim_context context, heim_log_facility *fac, int min, int max,
     fd->fd = f;
     fd->disp = disp;
     fd->freefilename = freefilename;
+    fd->async = 0;
+    fd->async_path = NULL;
 
     return heim_addlog_func(context, fac, min, max, log_file, close_file, fd);
 }
 
+/**
+ * Wait until the lines queued for asynchronous delivery by this
+ * process have been written, and the lines dropped so far have been
+ * counted in the log, or until the writer stops making progress for a
+ * second.  This also happens at exit.
+ */
+
+void
+heim_log_flush(void)
+{
+#ifdef HEIM_LOG_ASYNC
+    unsigned int target, dropped, tail;
+
+    if (!heim_base_atomic_load(&logq_running))
+        return;
+
+    target = heim_base_atomic_load(&logq_head);
+    dropped = heim_base_atomic_load(&logq_dropped);
+    HEIMDAL_MUTEX_lock(&logq_mutex);
+    while ((int)((tail = heim_base_atomic_load(&logq_tail)) - target) < 0 ||
+           (int)(heim_base_atomic_load(&logq_reported) - dropped) < 0) {
+        struct timespec ts;
+        struct timeval tv;
+
+        pthread_cond_signal(&logq_wakeup);
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec + 1;
+        ts.tv_nsec = tv.tv_usec * 1000;
+        if (pthread_cond_timedwait(&logq_drained, &logq_mutex, &ts) != 0 &&
+            heim_base_atomic_load(&logq_tail) == tail)
+            break;
+    }
+    HEIMDAL_MUTEX_unlock(&logq_mutex);
+#endif
+}
+
+/**
+ * Deliver the file destinations of a log facility (FILE, DEVICE,
+ * CONSOLE, STDERR) from a writer thread instead of in the caller.
+ * The lines go through a queue of @entries lines shared by the whole
+ * process; lines logged while it is full are dropped and their number
+ * is logged once there is room, or when the facility is closed.  Syslog destinations are unaffected,
+ * and where threads are not available logging stays synchronous.
+ *
+ * @param context A heim context
+ * @param fac the log facility
+ * @param entries size of the queue, 0 leaves the facility alone
+ *
+ * @return Return an error code or 0.
+ */
+
+heim_error_code
+heim_log_set_async(heim_context context, heim_log_facility *fac,
+                   size_t entries)
+{
+#ifdef HEIM_LOG_ASYNC
+    heim_error_code ret;
+    int i;
+
+    if (fac == NULL || entries == 0)
+        return 0;
+
+    HEIMDAL_MUTEX_lock(&logq_mutex);
+    ret = logq_init(entries);
+    HEIMDAL_MUTEX_unlock(&logq_mutex);
+    if (ret)
+        return heim_enomem(context);
+
+    for (i = 0; i < fac->len; i++) {
+        struct file_data *f;
+
+        if (fac->val[i].log_func != log_file)
+            continue;
+        f = fac->val[i].data;
+        if (f->async)
+            continue;
+        if (f->disp == FILEDISP_KEEPOPEN) {
+            if (f->fd)
+                fflush(f->fd);
+        } else {
+            ret = heim_expand_path_tokens(context, f->filename, 1,
+                                          &f->async_path, NULL);
+            if (ret)
+                return ret;
+        }
+        f->async = 1;
+    }
+#endif
+    return 0;
+}
+
 heim_error_code
 heim_addlog_dest(heim_context context, heim_log_facility *f, const char *orig)
 {
@@ -452,13 +935,41 @@ heim_closelog(heim_context context, heim_log_facility *fac)
 static void
 format_time(heim_context context, time_t t, char *s, size_t len)
 {
-    struct tm *tm = heim_context_get_log_utc(context) ?
-        gmtime(&t) : localtime(&t);
+    struct tm tms, *tm;
+
+    /* the static struct tm of gmtime() is shared by all threads */
+    if (heim_context_get_log_utc(context)) {
+#ifdef _WIN32
+        tm = gmtime(&t); /* per thread in the CRT */
+#else
+        tm = gmtime_r(&t, &tms);
+#endif
+    } else {
+        tm = localtime_r(&t, &tms);
+    }
     if (tm && strftime(s, len, heim_context_get_time_fmt(context), tm))
         return;
     snprintf(s, len, "%ld", (long)t);
 }
 
+/* the time stamp only changes once a second, keep the last one around */
+static HEIMDAL_THREAD_LOCAL heim_context log_time_context;
+static HEIMDAL_THREAD_LOCAL time_t log_time;
+static HEIMDAL_THREAD_LOCAL char log_time_str[64];
+
+static const char *
+log_timestr(heim_context context)
+{
+    time_t t = time(NULL);
+
+    if (t != log_time || context != log_time_context) {
+        format_time(context, t, log_time_str, sizeof(log_time_str));
+        log_time = t;
+        log_time_context = context;
+    }
+    return log_time_str;
+}
+
 #undef __attribute__
 #define __attribute__(X)
 
@@ -474,17 +985,14 @@ __attribute__ ((__format__ (__printf__, 5, 0)))
 
     char *msg = NULL;
     const char *actual = NULL;
-    char buf[64];
-    time_t t = 0;
+    const char *timestr = NULL;
     int i;
 
     for (i = 0; fac && i < fac->len; i++)
         if (fac->val[i].min <= level &&
             (fac->val[i].max < 0 || fac->val[i].max >= level)) {
-            if (t == 0) {
-                t = time(NULL);
-                format_time(context, t, buf, sizeof(buf));
-            }
+            if (timestr == NULL)
+                timestr = log_timestr(context);
             if (actual == NULL) {
                 int ret = vasprintf(&msg, fmt, ap);
                 if (ret < 0 || msg == NULL)
@@ -492,7 +1000,8 @@ __attribute__ ((__format__ (__printf__, 5, 0)))
                 else
                     actual = msg;
             }
-            (*fac->val[i].log_func)(context, buf, actual, fac->val[i].data);
+            (*fac->val[i].log_func)(context, timestr, actual,
+                                    fac->val[i].data);
         }
     if (reply == NULL)
         free(msg);
@@ -633,6 +1142,104 @@ heim_add_debug_dest(heim_context context, const char *program,
     return 0;
 }
 
+/*
+ * Find the field for key k in the structured audit record of r, or
+ * add it.  Keys are copied into the string space of the record, since
+ * callers (plugins too) need not pass constants.
+ */
+static struct heim_svc_audit_field *
+audit_field(heim_svc_req_desc r, const char *k)
+{
+    heim_svc_audit_record *rec = &r->audit;
+    struct heim_svc_audit_field *f;
+    size_t len = strlen(k);
+    unsigned int i;
+
+    for (i = 0; i < rec->nfields; i++)
+        if (strcmp(rec->strspace + rec->fields[i].keyoff, k) == 0)
+            return &rec->fields[i];
+    if (rec->nfields == HEIM_SVC_AUDIT_MAXFIELDS ||
+        len >= sizeof(rec->strspace) - rec->strused) {
+        rec->truncated = 1;
+        return NULL;
+    }
+    f = &rec->fields[rec->nfields++];
+    memcpy(rec->strspace + rec->strused, k, len + 1);
+    f->keyoff = rec->strused;
+    f->type = HEIM_SVC_AUDIT_TYPE_NUMBER;
+    f->number = 0;
+    rec->strused += len + 1;
+    return f;
+}
+
+/*
+ * Format a string value into the string space of the record, without
+ * allocating.  Values that do not fit are truncated; a new field with
+ * no room at all for its value is not added.
+ */
+static void
+audit_vsetstr(heim_svc_req_desc r, int flags, const char *k,
+              const char *prev, const char *fmt, va_list ap)
+        __attribute__ ((__format__ (__printf__, 5, 0)))
+{
+    heim_svc_audit_record *rec = &r->audit;
+    struct heim_svc_audit_field *f;
+    unsigned int nfields = rec->nfields;
+    size_t strused = rec->strused;
+    size_t space;
+    char *s;
+    size_t i, j, len;
+    int n;
+
+    /* the key goes first, then the value */
+    f = audit_field(r, k);
+    if (f == NULL)
+        return;
+    space = sizeof(rec->strspace) - rec->strused;
+    s = rec->strspace + rec->strused;
+    if (space < 2) {
+        rec->truncated = 1;
+        goto unset;
+    }
+    n = vsnprintf(s, space, fmt, ap);
+    if (n < 0)
+        goto unset;
+    len = n;
+    if (len >= space) {
+        len = space - 1;
+        rec->truncated = 1;
+    }
+    if (prev) {
+        /* the value so far goes after the new one, as in text mode */
+        n = snprintf(s + len, space - len, ": %s", prev);
+        if (n < 0 || (size_t)n >= space - len) {
+            rec->truncated = 1;
+            len = space - 1;
+        } else {
+            len += n;
+        }
+    }
+    if (flags & HEIM_SVC_AUDIT_EATWHITE) {
+        for (i = 0, j = 0; i < len; i++)
+            if (s[i] != ' ' && s[i] != '\t')
+                s[j++] = s[i];
+        s[j] = '\0';
+        len = j;
+    }
+
+    f->type = HEIM_SVC_AUDIT_TYPE_STRING;
+    f->number = 0;
+    f->stroff = rec->strused;
+    f->strsize = len;
+    rec->strused += len + 1;
+    return;
+
+unset:
+    /* take back a field just added, rather than leave it a number 0 */
+    rec->nfields = nfields;
+    rec->strused = strused;
+}
+
 static heim_string_t
 fmtkv(int flags, const char *k, const char *fmt, va_list ap)
         __attribute__ ((__format__ (__printf__, 3, 0)))
@@ -683,6 +1290,18 @@ heim_audit_vaddreason(heim_svc_req_desc r, const char *fmt, va_list ap)
 {
     heim_string_t str;
 
+    if (r->audit_sink) {
+        const char *prev = NULL;
+        unsigned int i;
+
+        for (i = 0; i < r->audit.nfields; i++)
+            if (strcmp(r->audit.strspace + r->audit.fields[i].keyoff,
+                       "reason") == 0)
+                prev = r->audit.strspace + r->audit.fields[i].stroff;
+        audit_vsetstr(r, 0, "reason", prev, fmt, ap);
+        return;
+    }
+
     str = fmtkv(HEIM_SVC_AUDIT_VISLAST, "reason", fmt, ap);
     if (!str) {
         heim_log(r->hcontext, r->logf, 1, "heim_audit_vaddreason: "
@@ -732,6 +1351,12 @@ heim_audit_vaddkv(heim_svc_req_desc r, int flags, const char *k,
 {
     heim_string_t str;
 
+    if (r->audit_sink) {
+        if (k)
+            audit_vsetstr(r, flags, k, NULL, fmt, ap);
+        return;
+    }
+
     str = fmtkv(flags, k, fmt, ap);
     if (!str) {
         heim_log(r->hcontext, r->logf, 1, "heim_audit_vaddkv: "
@@ -757,6 +1382,31 @@ heim_audit_addkv(heim_svc_req_desc r, int flags, const char *k,
     va_end(ap);
 }
 
+/**
+ * Add a number to the audit record of a request.  Structured audit
+ * records keep it as a number, otherwise it is logged as k=v.
+ *
+ * @param r the request
+ * @param k the key
+ * @param v the value
+ */
+
+void
+heim_audit_setkv_number(heim_svc_req_desc r, const char *k, int64_t v)
+{
+    struct heim_svc_audit_field *f;
+
+    if (r->audit_sink == NULL) {
+        heim_audit_addkv(r, 0, k, "%lld", (long long)v);
+        return;
+    }
+    f = audit_field(r, k);
+    if (f == NULL)
+        return;
+    f->type = HEIM_SVC_AUDIT_TYPE_NUMBER;
+    f->number = v;
+}
+
 void
 heim_audit_addkv_timediff(heim_svc_req_desc r, const char *k,
 			  const struct timeval *start,
@@ -766,6 +1416,13 @@ heim_audit_addkv_timediff(heim_svc_req_desc r, const char *k,
     int usec;
     const char *sign = "";
 
+    if (r->audit_sink) {
+        heim_audit_setkv_number(r, k,
+                                ((int64_t)end->tv_sec - start->tv_sec) * 1000000 +
+                                end->tv_usec - start->tv_usec);
+        return;
+    }
+
     if (end->tv_sec > start->tv_sec ||
 	(end->tv_sec == start->tv_sec && end->tv_usec >= start->tv_usec)) {
 	sec  = end->tv_sec  - start->tv_sec;
@@ -810,6 +1467,23 @@ heim_audit_trail(heim_svc_req_desc r, heim_error_code ret, const char *retname)
 	break;
     }
 
+    if (r->audit_sink) {
+        heim_svc_audit_record *rec = &r->audit;
+
+        rec->reqtype = r->reqtype;
+        rec->result = retval;
+        rec->error = ret;
+        rec->from = r->from;
+        rec->cname = r->cname;
+        rec->sname = r->sname;
+        rec->e_text = r->e_text;
+        rec->time = r->tv_end.tv_sec;
+        rec->elapsed = ((int64_t)r->tv_end.tv_sec - r->tv_start.tv_sec) *
+            1000000 + r->tv_end.tv_usec - r->tv_start.tv_usec;
+        (*r->audit_sink)(r->audit_sink_ctx, rec);
+        return;
+    }
+
     heim_audit_addkv_timediff(r, "elapsed", &r->tv_start, &r->tv_end);
     if (r->e_text)
 	heim_audit_addkv(r, HEIM_SVC_AUDIT_VIS, "e-text", "%s", r->e_text);
@@ -837,3 +1511,214 @@ heim_audit_trail(heim_svc_req_desc r, heim_error_code ret, const char *retname)
              kvbuf, r->reason ? " " : "",
              r->reason ? heim_string_get_utf8(r->reason) : "");
 }
+
+/*
+ * Walk the fields of an audit record, the ones heim_audit_trail() sets
+ * first.
+ */
+
+typedef void (*audit_walk_func)(void *, const char *, int, int64_t,
+                                const char *, size_t);
+
+static void
+audit_walk_str(audit_walk_func func, void *arg, const char *k, const char *v)
+{
+    if (v)
+        (*func)(arg, k, HEIM_SVC_AUDIT_TYPE_STRING, 0, v, strlen(v));
+}
+
+static void
+audit_walk(const heim_svc_audit_record *rec, audit_walk_func func, void *arg)
+{
+    unsigned int i;
+
+    (*func)(arg, "time", HEIM_SVC_AUDIT_TYPE_NUMBER, rec->time, NULL, 0);
+    audit_walk_str(func, arg, "type", rec->reqtype);
+    audit_walk_str(func, arg, "result", rec->result);
+    (*func)(arg, "error", HEIM_SVC_AUDIT_TYPE_NUMBER, rec->error, NULL, 0);
+    audit_walk_str(func, arg, "from", rec->from);
+    audit_walk_str(func, arg, "client", rec->cname);
+    audit_walk_str(func, arg, "server", rec->sname);
+    (*func)(arg, "elapsed", HEIM_SVC_AUDIT_TYPE_NUMBER, rec->elapsed, NULL, 0);
+    audit_walk_str(func, arg, "e-text", rec->e_text);
+    for (i = 0; i < rec->nfields; i++) {
+        const struct heim_svc_audit_field *f = &rec->fields[i];
+
+        (*func)(arg, rec->strspace + f->keyoff, f->type, f->number,
+                rec->strspace + f->stroff, f->strsize);
+    }
+    if (rec->truncated)
+        (*func)(arg, "truncated", HEIM_SVC_AUDIT_TYPE_NUMBER, 1, NULL, 0);
+}
+
+struct audit_buf {
+    unsigned char *p;
+    size_t len;
+    size_t used;
+    int overflow;
+};
+
+static void
+audit_put(struct audit_buf *b, const void *data, size_t len)
+{
+    if (b->overflow || len > b->len - b->used) {
+        b->overflow = 1;
+        return;
+    }
+    memcpy(b->p + b->used, data, len);
+    b->used += len;
+}
+
+static void
+audit_json_str(struct audit_buf *b, const char *s, size_t len)
+{
+    size_t i;
+
+    audit_put(b, "\"", 1);
+    for (i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        char esc[7];
+
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            audit_put(b, esc, 2);
+        } else if (c < 0x20 || c >= 0x7f) {
+            /* non-ASCII bytes need not be UTF-8, escape them one by one */
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            audit_put(b, esc, 6);
+        } else {
+            audit_put(b, &s[i], 1);
+        }
+    }
+    audit_put(b, "\"", 1);
+}
+
+static void
+audit_json_field(void *arg, const char *k, int type, int64_t n,
+                 const char *s, size_t slen)
+{
+    struct audit_buf *b = arg;
+
+    if (b->used > 1)
+        audit_put(b, ",", 1);
+    audit_json_str(b, k, strlen(k));
+    audit_put(b, ":", 1);
+    if (type == HEIM_SVC_AUDIT_TYPE_NUMBER) {
+        char num[24];
+        int len = snprintf(num, sizeof(num), "%lld", (long long)n);
+
+        audit_put(b, num, len);
+    } else {
+        audit_json_str(b, s, slen);
+    }
+}
+
+/**
+ * Encode a structured audit record as a line of JSON: an object with
+ * the keys time, type, result, error, from, client, server, elapsed
+ * (in microseconds) and e-text, followed by the fields added while
+ * the request was processed.
+ *
+ * @param rec the record
+ * @param buf where to put the line, which ends with a newline and is
+ *        NUL terminated
+ * @param len size of buf
+ *
+ * @return the length of the line, or -1 if it does not fit in buf
+ */
+
+ssize_t
+heim_audit_record_json(const heim_svc_audit_record *rec, char *buf, size_t len)
+{
+    struct audit_buf b;
+
+    b.p = (unsigned char *)buf;
+    b.len = len;
+    b.used = 0;
+    b.overflow = 0;
+    audit_put(&b, "{", 1);
+    audit_walk(rec, audit_json_field, &b);
+    audit_put(&b, "}\n", 2);
+    if (b.overflow || b.used >= len)
+        return -1;
+    buf[b.used] = '\0';
+    return b.used;
+}
+
+static void
+audit_binary_field(void *arg, const char *k, int type, int64_t n,
+                   const char *s, size_t slen)
+{
+    struct audit_buf *b = arg;
+    size_t klen = strlen(k);
+    unsigned char hdr[2];
+    unsigned char v[8];
+    int i;
+
+    if (klen > 255)
+        klen = 255;
+    hdr[0] = type;
+    hdr[1] = klen;
+    audit_put(b, hdr, 2);
+    audit_put(b, k, klen);
+    if (type == HEIM_SVC_AUDIT_TYPE_NUMBER) {
+        uint64_t u = (uint64_t)n;
+
+        for (i = 7; i >= 0; i--, u >>= 8)
+            v[i] = u & 0xff;
+        audit_put(b, v, 8);
+    } else {
+        if (slen > 0xffff)
+            slen = 0xffff;
+        v[0] = (slen >> 8) & 0xff;
+        v[1] = slen & 0xff;
+        audit_put(b, v, 2);
+        audit_put(b, s, slen);
+    }
+    if (!b->overflow)
+        b->p[5]++;
+}
+
+/**
+ * Encode a structured audit record in a compact binary form, with the
+ * same fields as heim_audit_record_json().  All integers are big
+ * endian:
+ *
+ *   uint32  length of the record, including this length
+ *   uint8   version, 1
+ *   uint8   number of fields
+ *   and for each field
+ *     uint8   type, 1 for a number and 2 for a string
+ *     uint8   key length, followed by the key
+ *     int64   the number, or
+ *     uint16  string length, followed by the string
+ *
+ * @param rec the record
+ * @param buf where to put the record
+ * @param len size of buf
+ *
+ * @return the length of the record, or -1 if it does not fit in buf
+ */
+
+ssize_t
+heim_audit_record_binary(const heim_svc_audit_record *rec,
+                         unsigned char *buf, size_t len)
+{
+    struct audit_buf b;
+    unsigned char hdr[6] = { 0, 0, 0, 0, 1, 0 };
+
+    b.p = buf;
+    b.len = len;
+    b.used = 0;
+    b.overflow = 0;
+    audit_put(&b, hdr, sizeof(hdr));
+    audit_walk(rec, audit_binary_field, &b);
+    if (b.overflow)
+        return -1;
+    buf[0] = (b.used >> 24) & 0xff;
+    buf[1] = (b.used >> 16) & 0xff;
+    buf[2] = (b.used >> 8) & 0xff;
+    buf[3] = b.used & 0xff;
+    return b.used;
+}
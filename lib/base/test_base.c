@@ -63,6 +63,13 @@
 #include <fcntl.h>
 
 #include "baselocl.h"
+#include "heimbase-svc.h"
+
+typedef struct heim_pcontext_s *heim_pcontext;
+typedef struct heim_pconfig *heim_pconfig;
+struct heim_svc_req_desc_common_s {
+    HEIM_SVC_REQUEST_DESC_COMMON_ELEMENTS;
+};
 
 static void
 memory_free(heim_object_t obj)
@@ -939,6 +946,179 @@ test_array()
     return 0;
 }
 
+static int
+test_log_async(void)
+{
+    heim_log_facility *fac = NULL;
+    heim_context context;
+    char line[256];
+    int i, n, last = -1, written = 0, dropped = 0;
+    const int count = 2000;
+    FILE *f;
+
+    context = heim_context_init();
+    if (context == NULL)
+	return ENOMEM;
+    unlink("test_log.async");
+    if (heim_initlog(context, "test_base", &fac) ||
+	heim_addlog_dest(context, fac, "0-/FILE:test_log.async"))
+	return 1;
+
+    /* a tiny queue, most of the lines will be dropped */
+    if (heim_log_set_async(context, fac, 2))
+	return 1;
+    for (i = 0; i < count; i++)
+	heim_log(context, fac, 0, "line %d", i);
+    heim_closelog(context, fac);
+    heim_context_free(&context);
+
+    f = fopen("test_log.async", "r");
+    if (f == NULL)
+	return 1;
+    while (fgets(line, sizeof(line), f)) {
+	if (sscanf(line, "%*s line %d", &n) == 1) {
+	    if (n <= last) {
+		printf("log line %d after %d\n", n, last);
+		return 1;
+	    }
+	    last = n;
+	    written++;
+	} else if (sscanf(line, "%*s %d log messages dropped", &n) == 1) {
+	    dropped += n;
+	} else {
+	    printf("unexpected log line: %s", line);
+	    return 1;
+	}
+    }
+    fclose(f);
+    unlink("test_log.async");
+
+    /* every line is either written or counted, even those dropped last */
+    if (written == 0 || written + dropped != count) {
+	printf("%d log lines written and %d dropped of %d\n",
+	       written, dropped, count);
+	return 1;
+    }
+    return 0;
+}
+
+static void
+test_audit_sink(void *ptr, const heim_svc_audit_record *rec)
+{
+    unsigned char bin[1024];
+    ssize_t len;
+
+    if (heim_audit_record_json(rec, ptr, 1024) < 0)
+	strlcpy(ptr, "json record too large", 1024);
+
+    /* 12 fields, the length is in front */
+    len = heim_audit_record_binary(rec, bin, sizeof(bin));
+    if (len < 6 || ((bin[0] << 24) | (bin[1] << 16) | (bin[2] << 8) | bin[3])
+	!= len || bin[4] != 1 || bin[5] != 12)
+	strlcpy(ptr, "bad binary record", 1024);
+}
+
+static int
+test_audit(void)
+{
+    struct heim_svc_req_desc_common_s *r;
+    char json[1024];
+    char key[8];
+    const char *expect =
+	"{\"time\":101,\"type\":\"AS-REQ\",\"result\":\"SUCCESS\","
+	"\"error\":0,\"from\":\"IPv4:127.0.0.1\","
+	"\"client\":\"f\\u00f6o@TEST.H5L.SE\","
+	"\"server\":\"krbtgt/TEST.H5L.SE@TEST.H5L.SE\","
+	"\"elapsed\":999750,\"etype\":\"18/17\","
+	"\"flags\":\"forwardable,renewable\",\"auth\":1234567890,"
+	"\"reason\":\"second \\\"try\\\": first\"}\n";
+
+    r = calloc(1, sizeof(*r));
+    if (r == NULL)
+	return ENOMEM;
+    r->hcontext = heim_context_init();
+    r->audit_sink = test_audit_sink;
+    r->audit_sink_ctx = json;
+    r->reqtype = "AS-REQ";
+    r->from = "IPv4:127.0.0.1";
+    r->cname = "f\366o@TEST.H5L.SE";
+    r->sname = "krbtgt/TEST.H5L.SE@TEST.H5L.SE";
+    r->tv_start.tv_sec = 100;
+    r->tv_start.tv_usec = 500;
+    r->tv_end.tv_sec = 101;
+    r->tv_end.tv_usec = 250;
+
+    heim_audit_addkv(r, 0, "etype", "%d/%d", 18, 17);
+    heim_audit_addkv(r, HEIM_SVC_AUDIT_EATWHITE, "flags", "%s",
+		     "forwardable, renewable");
+    /* keys are copied, they need not outlive the call */
+    strlcpy(key, "auth", sizeof(key));
+    heim_audit_setkv_number(r, key, 1234567890);
+    strlcpy(key, "junk", sizeof(key));
+    heim_audit_addreason(r, "first");
+    heim_audit_addreason(r, "second \"try\"");
+    json[0] = '\0';
+    heim_audit_trail(r, 0, NULL);
+
+    heim_context_free(&r->hcontext);
+    free(r);
+
+    if (strcmp(json, expect) != 0) {
+	printf("audit record: %s", json);
+	return 1;
+    }
+    return 0;
+}
+
+static void
+test_audit_keys(void *ptr, const heim_svc_audit_record *rec)
+{
+    int *found = ptr;
+    unsigned int i;
+
+    for (i = 0; i < rec->nfields; i++)
+	if (strcmp(rec->strspace + rec->fields[i].keyoff, "b") == 0)
+	    (*found)++;
+}
+
+static int
+test_audit_full(void)
+{
+    struct heim_svc_req_desc_common_s *r;
+    char *filler;
+    size_t len;
+    int found = 0;
+
+    r = calloc(1, sizeof(*r));
+    if (r == NULL)
+	return ENOMEM;
+    r->hcontext = heim_context_init();
+    r->audit_sink = test_audit_keys;
+    r->audit_sink_ctx = &found;
+    r->reqtype = "AS-REQ";
+
+    /* leave room for the key "b" but not for its value */
+    len = sizeof(r->audit.strspace) - r->audit.strused - 2 - 1 - 3;
+    filler = malloc(len + 1);
+    if (filler == NULL)
+	return ENOMEM;
+    memset(filler, 'x', len);
+    filler[len] = '\0';
+    heim_audit_addkv(r, 0, "a", "%s", filler);
+    heim_audit_addkv(r, 0, "b", "%s", "y");
+    heim_audit_trail(r, 0, NULL);
+
+    free(filler);
+    heim_context_free(&r->hcontext);
+    free(r);
+
+    if (found) {
+	printf("audit field without room for its value was added\n");
+	return 1;
+    }
+    return 0;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -956,6 +1136,9 @@ main(int argc, char **argv)
     res |= test_db(NULL, NULL);
     res |= test_db("json", argc > 1 ? argv[1] : "test_db.json");
     res |= test_array();
+    res |= test_log_async();
+    res |= test_audit();
+    res |= test_audit_full();
 
     return res ? 1 : 0;
 }
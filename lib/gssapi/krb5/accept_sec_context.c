@@ -277,7 +277,8 @@ gsskrb5_acceptor_ready(OM_uint32 * minor_status,
     ret = _gssapi_msg_order_create(minor_status,
 				   &ctx->order,
 				   _gssapi_msg_order_f(ctx->flags),
-				   seq_number, 0, is_cfx);
+				   seq_number,
+				   _gssapi_msg_order_window(context), is_cfx);
     if (ret)
 	return ret;
 
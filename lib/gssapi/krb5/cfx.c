@@ -162,6 +162,27 @@ _gssapi_wrap_size_cfx(OM_uint32 *minor_status,
  * Rotate "rrc" bytes to the front or back
  */
 
+static void
+rrc_reverse(u_char *p, size_t len)
+{
+    size_t i, j;
+    u_char c;
+
+    if (len < 2)
+	return;
+    for (i = 0, j = len - 1; i < j; i++, j--) {
+	c = p[i];
+	p[i] = p[j];
+	p[j] = c;
+    }
+}
+
+/*
+ * Rotate in place.  The RRC is normally small enough to go through a
+ * buffer on the stack; larger ones (DCE style with a large EC, or peers
+ * that choose their own RRC) are rotated by reversing both parts and then
+ * the whole, so this never allocates.
+ */
 static krb5_error_code
 rrc_rotate(void *data, size_t len, uint16_t rrc, krb5_boolean unrotate)
 {
@@ -178,14 +199,21 @@ rrc_rotate(void *data, size_t len, uint16_t rrc, krb5_boolean unrotate)
 
     left = len - rrc;
 
-    if (rrc <= sizeof(buf)) {
-	tmp = buf;
-    } else {
-	tmp = malloc(rrc);
-	if (tmp == NULL)
-	    return ENOMEM;
+    if (rrc > sizeof(buf)) {
+	tmp = data;
+	if (unrotate) {
+	    rrc_reverse(tmp, rrc);
+	    rrc_reverse(tmp + rrc, left);
+	    rrc_reverse(tmp, len);
+	} else {
+	    rrc_reverse(tmp, len);
+	    rrc_reverse(tmp, rrc);
+	    rrc_reverse(tmp + rrc, left);
+	}
+	return 0;
     }
 
+    tmp = buf;
     if (unrotate) {
 	memcpy(tmp, data, rrc);
 	memmove(data, (u_char *)data + rrc, left);
@@ -196,12 +224,28 @@ rrc_rotate(void *data, size_t len, uint16_t rrc, krb5_boolean unrotate)
 	memcpy(data, tmp, rrc);
     }
 
-    if (rrc > sizeof(buf))
-	free(tmp);
-
     return 0;
 }
 
+/*
+ * Copy a rotated token body of len bytes from src to dst, undoing the
+ * rotation by rrc on the way, so that the caller's buffer is not touched.
+ */
+static void
+rrc_unrotate_copy(void *dst, const void *src, size_t len, uint16_t rrc)
+{
+    size_t left;
+
+    if (len == 0)
+	return;
+
+    rrc %= len;
+    left = len - rrc;
+
+    memcpy(dst, (const u_char *)src + rrc, left);
+    memcpy((u_char *)dst + left, src, rrc);
+}
+
 gss_iov_buffer_desc *
 _gk_find_buffer(gss_iov_buffer_desc *iov, int iov_count, OM_uint32 type)
 {
@@ -1196,7 +1240,7 @@ OM_uint32 _gssapi_wrap_cfx(OM_uint32 *minor_status,
     gss_cfx_wrap_token token;
     krb5_error_code ret;
     unsigned usage;
-    krb5_data cipher;
+    krb5_crypto_iov data[3];
     size_t wrapped_len, cksumsize;
     uint16_t padlength, rrc = 0;
     int32_t seq_number;
@@ -1294,7 +1338,23 @@ OM_uint32 _gssapi_wrap_cfx(OM_uint32 *minor_status,
     }
 
     if (conf_req_flag) {
+	size_t k5hsize, k5tsize;
+
+	ret = krb5_crypto_length(context, ctx->crypto,
+				 KRB5_CRYPTO_TYPE_HEADER, &k5hsize);
+	if (ret == 0)
+	    ret = krb5_crypto_length(context, ctx->crypto,
+				     KRB5_CRYPTO_TYPE_TRAILER, &k5tsize);
+	if (ret != 0) {
+	    *minor_status = ret;
+	    _gsskrb5_release_buffer(minor_status, output_message_buffer);
+	    return GSS_S_FAILURE;
+	}
+
 	/*
+	 * Encrypt in place in the output buffer, the Kerberos header
+	 * (confounder) and trailer (checksum) around the data.
+	 *
 	 * Any necessary padding is added here to ensure that the
 	 * encrypted token header is always at the end of the
 	 * ciphertext.
@@ -1303,22 +1363,33 @@ OM_uint32 _gssapi_wrap_cfx(OM_uint32 *minor_status,
 	 * bytes are initialized.
 	 */
 	p += sizeof(*token);
-	memcpy(p, input_message_buffer->value, input_message_buffer->length);
-	memset(p + input_message_buffer->length, 0xFF, padlength);
-	memcpy(p + input_message_buffer->length + padlength,
-	       token, sizeof(*token));
-
-	ret = krb5_encrypt(context, ctx->crypto,
-			   usage, p,
-			   input_message_buffer->length + padlength +
-				sizeof(*token),
-			   &cipher);
+	data[0].flags = KRB5_CRYPTO_TYPE_HEADER;
+	data[0].data.data = p;
+	data[0].data.length = k5hsize;
+	data[1].flags = KRB5_CRYPTO_TYPE_DATA;
+	data[1].data.data = p + k5hsize;
+	data[1].data.length = input_message_buffer->length + padlength +
+	    sizeof(*token);
+	data[2].flags = KRB5_CRYPTO_TYPE_TRAILER;
+	data[2].data.data = p + k5hsize + data[1].data.length;
+	data[2].data.length = k5tsize;
+	assert(sizeof(*token) + k5hsize + data[1].data.length + k5tsize ==
+	       wrapped_len);
+
+	memcpy(data[1].data.data, input_message_buffer->value,
+	       input_message_buffer->length);
+	memset((u_char *)data[1].data.data + input_message_buffer->length,
+	       0xFF, padlength);
+	memcpy((u_char *)data[1].data.data + input_message_buffer->length +
+	       padlength, token, sizeof(*token));
+
+	ret = krb5_encrypt_iov_ivec(context, ctx->crypto, usage,
+				    data, 3, NULL);
 	if (ret != 0) {
 	    *minor_status = ret;
 	    _gsskrb5_release_buffer(minor_status, output_message_buffer);
 	    return GSS_S_FAILURE;
 	}
-	assert(sizeof(*token) + cipher.length == wrapped_len);
 	token->RRC[0] = (rrc >> 8) & 0xFF;
 	token->RRC[1] = (rrc >> 0) & 0xFF;
 
@@ -1327,64 +1398,54 @@ OM_uint32 _gssapi_wrap_cfx(OM_uint32 *minor_status,
 	 * for DCERPC, as windows rotates by EC+RRC.
 	 */
 	if (IS_DCE_STYLE(ctx)) {
-		ret = rrc_rotate(cipher.data, cipher.length, rrc+padlength, FALSE);
+		ret = rrc_rotate(p, wrapped_len - sizeof(*token),
+				 rrc+padlength, FALSE);
 	} else {
-		ret = rrc_rotate(cipher.data, cipher.length, rrc, FALSE);
+		ret = rrc_rotate(p, wrapped_len - sizeof(*token), rrc, FALSE);
 	}
 	if (ret != 0) {
 	    *minor_status = ret;
 	    _gsskrb5_release_buffer(minor_status, output_message_buffer);
 	    return GSS_S_FAILURE;
 	}
-	memcpy(p, cipher.data, cipher.length);
-	krb5_data_free(&cipher);
     } else {
-	char *buf;
-	Checksum cksum;
-
-	buf = malloc(input_message_buffer->length + sizeof(*token));
-	if (buf == NULL) {
-	    *minor_status = ENOMEM;
-	    _gsskrb5_release_buffer(minor_status, output_message_buffer);
-	    return GSS_S_FAILURE;
-	}
-	memcpy(buf, input_message_buffer->value, input_message_buffer->length);
-	memcpy(buf + input_message_buffer->length, token, sizeof(*token));
+	/*
+	 * Checksum (plaintext-data | "header") straight into the
+	 * output buffer, the header as it is now, with EC and RRC 0.
+	 */
+	p += sizeof(*token);
+	memcpy(p, input_message_buffer->value, input_message_buffer->length);
 
-	ret = krb5_create_checksum(context, ctx->crypto,
-				   usage, 0, buf,
-				   input_message_buffer->length +
-					sizeof(*token),
-				   &cksum);
+	data[0].flags = KRB5_CRYPTO_TYPE_DATA;
+	data[0].data.data = p;
+	data[0].data.length = input_message_buffer->length;
+	data[1].flags = KRB5_CRYPTO_TYPE_DATA;
+	data[1].data.data = token;
+	data[1].data.length = sizeof(*token);
+	data[2].flags = KRB5_CRYPTO_TYPE_CHECKSUM;
+	data[2].data.data = p + input_message_buffer->length;
+	data[2].data.length = cksumsize;
+
+	ret = krb5_create_checksum_iov(context, ctx->crypto, usage,
+				       data, 3, NULL);
 	if (ret != 0) {
 	    *minor_status = ret;
 	    _gsskrb5_release_buffer(minor_status, output_message_buffer);
-	    free(buf);
 	    return GSS_S_FAILURE;
 	}
 
-	free(buf);
-
-	assert(cksum.checksum.length == cksumsize);
-	token->EC[0] =  (cksum.checksum.length >> 8) & 0xFF;
-	token->EC[1] =  (cksum.checksum.length >> 0) & 0xFF;
+	token->EC[0] =  (cksumsize >> 8) & 0xFF;
+	token->EC[1] =  (cksumsize >> 0) & 0xFF;
 	token->RRC[0] = (rrc >> 8) & 0xFF;
 	token->RRC[1] = (rrc >> 0) & 0xFF;
 
-	p += sizeof(*token);
-	memcpy(p, input_message_buffer->value, input_message_buffer->length);
-	memcpy(p + input_message_buffer->length,
-	       cksum.checksum.data, cksum.checksum.length);
-
 	ret = rrc_rotate(p,
-	    input_message_buffer->length + cksum.checksum.length, rrc, FALSE);
+	    input_message_buffer->length + cksumsize, rrc, FALSE);
 	if (ret != 0) {
 	    *minor_status = ret;
 	    _gsskrb5_release_buffer(minor_status, output_message_buffer);
-	    free_Checksum(&cksum);
 	    return GSS_S_FAILURE;
 	}
-	free_Checksum(&cksum);
     }
 
     if (conf_state != NULL) {
@@ -1407,11 +1468,11 @@ OM_uint32 _gssapi_unwrap_cfx(OM_uint32 *minor_status,
     u_char token_flags;
     krb5_error_code ret;
     unsigned usage;
-    krb5_data data;
+    krb5_crypto_iov data[3];
     uint16_t ec, rrc;
     OM_uint32 seq_number_lo, seq_number_hi;
     size_t len;
-    u_char *p;
+    u_char *p, *buf;
 
     *minor_status = 0;
 
@@ -1491,33 +1552,63 @@ OM_uint32 _gssapi_unwrap_cfx(OM_uint32 *minor_status,
     len -= (p - (u_char *)input_message_buffer->value);
 
     if (token_flags & CFXSealed) {
-	/*
-	 * this is really ugly, but needed against windows
-	 * for DCERPC, as windows rotates by EC+RRC.
-	 */
-	if (IS_DCE_STYLE(ctx)) {
-		*minor_status = rrc_rotate(p, len, rrc+ec, TRUE);
-	} else {
-		*minor_status = rrc_rotate(p, len, rrc, TRUE);
+	size_t k5hsize, k5tsize;
+
+	ret = krb5_crypto_length(context, ctx->crypto,
+				 KRB5_CRYPTO_TYPE_HEADER, &k5hsize);
+	if (ret == 0)
+	    ret = krb5_crypto_length(context, ctx->crypto,
+				     KRB5_CRYPTO_TYPE_TRAILER, &k5tsize);
+	if (ret != 0) {
+	    *minor_status = ret;
+	    return GSS_S_FAILURE;
 	}
-	if (*minor_status != 0) {
+	if (len < k5hsize + k5tsize)
+	    return GSS_S_DEFECTIVE_TOKEN;
+
+	buf = malloc(len);
+	if (buf == NULL) {
+	    *minor_status = ENOMEM;
 	    return GSS_S_FAILURE;
 	}
 
-	ret = krb5_decrypt(context, ctx->crypto, usage,
-	    p, len, &data);
+	/*
+	 * Copy the ciphertext out once, unrotating it on the way, and
+	 * decrypt it in place in what becomes the output buffer.
+	 *
+	 * this is really ugly, but needed against windows
+	 * for DCERPC, as windows rotates by EC+RRC.
+	 */
+	if (IS_DCE_STYLE(ctx))
+	    rrc_unrotate_copy(buf, p, len, rrc + ec);
+	else
+	    rrc_unrotate_copy(buf, p, len, rrc);
+
+	data[0].flags = KRB5_CRYPTO_TYPE_HEADER;
+	data[0].data.data = buf;
+	data[0].data.length = k5hsize;
+	data[1].flags = KRB5_CRYPTO_TYPE_DATA;
+	data[1].data.data = buf + k5hsize;
+	data[1].data.length = len - k5hsize - k5tsize;
+	data[2].flags = KRB5_CRYPTO_TYPE_TRAILER;
+	data[2].data.data = buf + len - k5tsize;
+	data[2].data.length = k5tsize;
+
+	ret = krb5_decrypt_iov_ivec(context, ctx->crypto, usage,
+				    data, 3, NULL);
 	if (ret != 0) {
+	    free(buf);
 	    *minor_status = ret;
 	    return GSS_S_BAD_MIC;
 	}
 
 	/* Check that there is room for the pad and token header */
-	if (data.length < ec + sizeof(*token)) {
-	    krb5_data_free(&data);
+	if (data[1].data.length < ec + sizeof(*token)) {
+	    free(buf);
 	    return GSS_S_DEFECTIVE_TOKEN;
 	}
-	p = data.data;
-	p += data.length - sizeof(*token);
+	p = data[1].data.data;
+	p += data[1].data.length - sizeof(*token);
 
 	/* RRC is unprotected; don't modify input buffer */
 	((gss_cfx_wrap_token)p)->RRC[0] = token->RRC[0];
@@ -1525,21 +1616,17 @@ OM_uint32 _gssapi_unwrap_cfx(OM_uint32 *minor_status,
 
 	/* Check the integrity of the header */
 	if (ct_memcmp(p, token, sizeof(*token)) != 0) {
-	    krb5_data_free(&data);
+	    free(buf);
 	    return GSS_S_BAD_MIC;
 	}
 
-	output_message_buffer->value = data.data;
-	output_message_buffer->length = data.length - ec - sizeof(*token);
+	output_message_buffer->length =
+	    data[1].data.length - ec - sizeof(*token);
+	memmove(buf, data[1].data.data, output_message_buffer->length);
+	output_message_buffer->value = buf;
     } else {
 	Checksum cksum;
 
-	/* Rotate by RRC; bogus to do this in-place XXX */
-	*minor_status = rrc_rotate(p, len, rrc, TRUE);
-	if (*minor_status != 0) {
-	    return GSS_S_FAILURE;
-	}
-
 	/* Determine checksum type */
 	ret = krb5_crypto_get_checksum_type(context,
 					    ctx->crypto,
@@ -1557,21 +1644,25 @@ OM_uint32 _gssapi_unwrap_cfx(OM_uint32 *minor_status,
 	    return GSS_S_BAD_MIC;
 	}
 
-	/* Length now is of the plaintext only, no checksum */
-	len -= cksum.checksum.length;
-	cksum.checksum.data = p + len;
-
-	output_message_buffer->length = len; /* for later */
-	output_message_buffer->value = malloc(len + sizeof(*token));
-	if (output_message_buffer->value == NULL) {
+	buf = malloc(len + sizeof(*token));
+	if (buf == NULL) {
 	    *minor_status = ENOMEM;
 	    return GSS_S_FAILURE;
 	}
 
-	/* Checksum is over (plaintext-data | "header") */
-	memcpy(output_message_buffer->value, p, len);
-	memcpy((u_char *)output_message_buffer->value + len,
-	       token, sizeof(*token));
+	/* Unrotate by RRC as we copy, leaving the input alone */
+	rrc_unrotate_copy(buf, p, len, rrc);
+
+	/* Length now is of the plaintext only, no checksum */
+	len -= cksum.checksum.length;
+
+	/* Checksum is over (plaintext-data | "header"); move it past that */
+	memmove(buf + len + sizeof(*token), buf + len, cksum.checksum.length);
+	cksum.checksum.data = buf + len + sizeof(*token);
+	memcpy(buf + len, token, sizeof(*token));
+
+	output_message_buffer->length = len; /* for later */
+	output_message_buffer->value = buf;
 
 	/* EC is not included in checksum calculation */
 	token = (gss_cfx_wrap_token)((u_char *)output_message_buffer->value +
@@ -33,15 +33,33 @@
 
 #include "gsskrb5_locl.h"
 
-#define DEFAULT_JITTER_WINDOW 20
+/*
+ * Replay and sequence detection with a sliding window, as in RFC 4303
+ * (IPsec ESP) section 3.4.3: one bit per sequence number in the
+ * jitter_window numbers up to the highest one seen, so that every check
+ * is O(1) whatever the window size.
+ *
+ * The bits live in a ring of 64-bit words indexed by offset from the
+ * first sequence number (RFC 6479), so moving the window forward clears
+ * the words it moves into instead of shifting the whole bitmap.  The
+ * ring has a spare word so that the word being cleared is never one the
+ * window still needs.
+ *
+ * The export format is still the old list of the most recently received
+ * sequence numbers, highest first.
+ */
+
+#define DEFAULT_JITTER_WINDOW 64
+#define MAX_JITTER_WINDOW (1 << 20)
 
 struct gss_msg_order {
     OM_uint32 flags;
-    OM_uint32 start;
-    OM_uint32 length;
+    OM_uint32 start;		/* not used, kept for export */
     OM_uint32 jitter_window;
     OM_uint32 first_seq;
-    OM_uint32 elem[1];
+    OM_uint32 next_off;		/* offset from first_seq of the next expected */
+    OM_uint32 nwords;		/* power of two */
+    uint64_t bitmap[1];
 };
 
 
@@ -54,22 +72,44 @@ msg_order_alloc(OM_uint32 *minor_status,
 		struct gss_msg_order **o,
 		OM_uint32 jitter_window)
 {
+    OM_uint32 nwords;
     size_t len;
 
-    len = jitter_window * sizeof((*o)->elem[0]);
+    for (nwords = 1; nwords < (jitter_window + 63) / 64 + 1; nwords <<= 1)
+	;
+
+    len = nwords * sizeof((*o)->bitmap[0]);
     len += sizeof(**o);
-    len -= sizeof((*o)->elem[0]);
+    len -= sizeof((*o)->bitmap[0]);
 
     *o = calloc(1, len);
     if (*o == NULL) {
 	*minor_status = ENOMEM;
 	return GSS_S_FAILURE;
     }
+    (*o)->jitter_window = jitter_window;
+    (*o)->nwords = nwords;
 
     *minor_status = 0;
     return GSS_S_COMPLETE;
 }
 
+/*
+ * The window size set in krb5.conf, if any, for _gssapi_msg_order_create()
+ */
+
+OM_uint32
+_gssapi_msg_order_window(krb5_context context)
+{
+    int w;
+
+    w = krb5_config_get_int_default(context, NULL, 0,
+				    "gssapi", "replay_window", NULL);
+    if (w < 0 || w > MAX_JITTER_WINDOW)
+	return 0;
+    return w;
+}
+
 /*
  *
  */
@@ -92,10 +132,8 @@ _gssapi_msg_order_create(OM_uint32 *minor_status,
         return ret;
 
     (*o)->flags = flags;
-    (*o)->length = 0;
     (*o)->first_seq = seq_num;
-    (*o)->jitter_window = jitter_window;
-    (*o)->elem[0] = seq_num - 1;
+    (*o)->next_off = 0;
 
     *minor_status = 0;
     return GSS_S_COMPLETE;
@@ -109,27 +147,34 @@ _gssapi_msg_order_destroy(struct gss_msg_order **m)
     return GSS_S_COMPLETE;
 }
 
-static void
-elem_set(struct gss_msg_order *o, unsigned int slot, OM_uint32 val)
+static inline uint64_t *
+bit_word(struct gss_msg_order *o, OM_uint32 off)
 {
-    o->elem[slot % o->jitter_window] = val;
+    return &o->bitmap[(off / 64) & (o->nwords - 1)];
 }
 
-static void
-elem_insert(struct gss_msg_order *o,
-	    unsigned int after_slot,
-	    OM_uint32 seq_num)
+static inline uint64_t
+bit_mask(OM_uint32 off)
 {
-    assert(o->jitter_window > after_slot);
-
-    if (o->length > after_slot)
-	memmove(&o->elem[after_slot + 1], &o->elem[after_slot],
-		(o->length - after_slot - 1) * sizeof(o->elem[0]));
-
-    elem_set(o, after_slot, seq_num);
+    return (uint64_t)1 << (off % 64);
+}
 
-    if (o->length < o->jitter_window)
-	o->length++;
+/* Move the window forward so that it ends at offset `off' */
+static void
+window_advance(struct gss_msg_order *o, OM_uint32 off)
+{
+    OM_uint32 last_word, n;
+
+    if (o->next_off != 0) {
+	last_word = (o->next_off - 1) / 64;
+	n = off / 64 - last_word;
+	if (n > o->nwords)
+	    n = o->nwords;
+	while (n-- > 0)
+	    *bit_word(o, ++last_word * 64) = 0;
+    }
+    *bit_word(o, off) |= bit_mask(off);
+    o->next_off = off + 1;
 }
 
 /* rule 1: expected sequence number */
@@ -140,8 +185,8 @@ elem_insert(struct gss_msg_order *o,
 OM_uint32
 _gssapi_msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
 {
-    OM_uint32 r;
-    size_t i;
+    OM_uint32 r, off;
+    uint64_t *w;
 
     if (o == NULL)
 	return GSS_S_COMPLETE;
@@ -149,9 +194,11 @@ _gssapi_msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
     if ((o->flags & (GSS_C_REPLAY_FLAG|GSS_C_SEQUENCE_FLAG)) == 0)
 	return GSS_S_COMPLETE;
 
+    off = seq_num - o->first_seq;
+
     /* check if the packet is the next in order */
-    if (o->elem[0] == seq_num - 1) {
-	elem_insert(o, 0, seq_num);
+    if (off == o->next_off) {
+	window_advance(o, off);
 	return GSS_S_COMPLETE;
     }
 
@@ -159,11 +206,8 @@ _gssapi_msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
 
     /* sequence number larger then largest sequence number
      * or smaller then the first sequence number */
-    if (seq_num > o->elem[0]
-	|| seq_num < o->first_seq
-	|| o->length == 0)
-    {
-	elem_insert(o, 0, seq_num);
+    if (off > o->next_off) {
+	window_advance(o, off);
 	if (r) {
 	    return GSS_S_COMPLETE;
 	} else {
@@ -171,33 +215,23 @@ _gssapi_msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
 	}
     }
 
-    assert(o->length > 0);
-
-    /* sequence number smaller the first sequence number */
-    if (seq_num < o->elem[o->length - 1]) {
+    /* sequence number older than the window */
+    if (o->next_off - 1 - off >= o->jitter_window) {
 	if (r)
 	    return(GSS_S_OLD_TOKEN);
 	else
 	    return(GSS_S_UNSEQ_TOKEN);
     }
 
-    if (seq_num == o->elem[o->length - 1]) {
+    w = bit_word(o, off);
+    if (*w & bit_mask(off))
 	return GSS_S_DUPLICATE_TOKEN;
-    }
-
-    for (i = 0; i < o->length - 1; i++) {
-	if (o->elem[i] == seq_num)
-	    return GSS_S_DUPLICATE_TOKEN;
-	if (o->elem[i + 1] < seq_num && o->elem[i] < seq_num) {
-	    elem_insert(o, i, seq_num);
-	    if (r)
-		return GSS_S_COMPLETE;
-	    else
-		return GSS_S_UNSEQ_TOKEN;
-	}
-    }
+    *w |= bit_mask(off);
 
-    return GSS_S_FAILURE;
+    if (r)
+	return GSS_S_COMPLETE;
+    else
+	return GSS_S_UNSEQ_TOKEN;
 }
 
 OM_uint32
@@ -214,7 +248,16 @@ krb5_error_code
 _gssapi_msg_order_export(krb5_storage *sp, struct gss_msg_order *o)
 {
     krb5_error_code kret;
-    OM_uint32 i;
+    OM_uint32 i, d, n, length;
+
+    /* Number of sequence numbers received in the window */
+    n = min(o->next_off, o->jitter_window);
+    for (length = 0, d = 0; d < n; d++) {
+	OM_uint32 off = o->next_off - 1 - d;
+
+	if (*bit_word(o, off) & bit_mask(off))
+	    length++;
+    }
 
     kret = krb5_store_int32(sp, o->flags);
     if (kret)
@@ -222,7 +265,7 @@ _gssapi_msg_order_export(krb5_storage *sp, struct gss_msg_order *o)
     kret = krb5_store_int32(sp, o->start);
     if (kret)
         return kret;
-    kret = krb5_store_int32(sp, o->length);
+    kret = krb5_store_int32(sp, length);
     if (kret)
         return kret;
     kret = krb5_store_int32(sp, o->jitter_window);
@@ -232,8 +275,29 @@ _gssapi_msg_order_export(krb5_storage *sp, struct gss_msg_order *o)
     if (kret)
         return kret;
 
-    for (i = 0; i < o->jitter_window; i++) {
-        kret = krb5_store_int32(sp, o->elem[i]);
+    /*
+     * The received sequence numbers, highest first; with none, the
+     * first one is the one before the next expected.
+     */
+    i = 0;
+    if (length == 0) {
+	kret = krb5_store_int32(sp, o->first_seq + o->next_off - 1);
+	if (kret)
+	    return kret;
+	i++;
+    }
+    for (d = 0; d < n; d++) {
+	OM_uint32 off = o->next_off - 1 - d;
+
+	if ((*bit_word(o, off) & bit_mask(off)) == 0)
+	    continue;
+	kret = krb5_store_int32(sp, o->first_seq + off);
+	if (kret)
+	    return kret;
+	i++;
+    }
+    for (; i < o->jitter_window; i++) {
+        kret = krb5_store_int32(sp, 0);
 	if (kret)
 	    return kret;
     }
@@ -249,6 +313,8 @@ _gssapi_msg_order_import(OM_uint32 *minor_status,
     OM_uint32 ret;
     krb5_error_code kret;
     int32_t i, flags, start, length, jitter_window, first_seq;
+    int32_t seq;
+    OM_uint32 last = 0, off;
 
     kret = krb5_ret_int32(sp, &flags);
     if (kret)
@@ -266,20 +332,35 @@ _gssapi_msg_order_import(OM_uint32 *minor_status,
     if (kret)
 	goto failed;
 
+    if (jitter_window <= 0 || jitter_window > MAX_JITTER_WINDOW ||
+	length < 0 || length > jitter_window) {
+	*minor_status = EINVAL;
+	return GSS_S_FAILURE;
+    }
+
     ret = msg_order_alloc(minor_status, o, jitter_window);
     if (ret != GSS_S_COMPLETE)
         return ret;
 
     (*o)->flags = flags;
     (*o)->start = start;
-    (*o)->length = length;
-    (*o)->jitter_window = jitter_window;
     (*o)->first_seq = first_seq;
 
     for( i = 0; i < jitter_window; i++ ) {
-        kret = krb5_ret_int32(sp, (int32_t*)&((*o)->elem[i]));
+        kret = krb5_ret_int32(sp, &seq);
 	if (kret)
 	    goto failed;
+	if (i == 0) {
+	    /* The highest received, or the one before the next expected */
+	    last = seq;
+	    (*o)->next_off = last - (*o)->first_seq + 1;
+	}
+	if (i >= length)
+	    continue;
+	if (last - (OM_uint32)seq >= (*o)->jitter_window)
+	    continue;
+	off = (OM_uint32)seq - (*o)->first_seq;
+	*bit_word(*o, off) |= bit_mask(off);
     }
 
     *minor_status = 0;
@@ -193,7 +193,7 @@ make_rfc4121_context(OM_uint32 *minor,
 
     major = _gssapi_msg_order_create(minor, &ctx->order,
 				     _gssapi_msg_order_f(ctx->flags),
-				     0, 0, 1);
+				     0, _gssapi_msg_order_window(context), 1);
     if (major != GSS_S_COMPLETE)
 	goto out;
 
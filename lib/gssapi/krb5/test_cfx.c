@@ -131,8 +131,151 @@ test_special(krb5_context context, krb5_crypto crypto,
 		  (int)testsize, (int)rsize, (int)max_wrap_size);
 }
 
+/*
+ * Lay out a message the way _gssapi_wrap_cfx_iov() does, with its data
+ * spread over separate buffers, encrypt it in place and check that
+ * krb5_decrypt() of the same bytes put together gives the data back, then
+ * decrypt it in place.
+ *
+ * If count is not zero, also time that many in place round trips of
+ * msgsize bytes and print the throughput.
+ */
+
+#define IOV_PIECES 4
+
+static void
+test_iov_wrap(krb5_context context, krb5_enctype enctype,
+	      size_t msgsize, int count)
+{
+    krb5_crypto_iov iov[IOV_PIECES + 4];
+    unsigned char token_header[16];
+    krb5_keyblock keyblock;
+    krb5_crypto crypto;
+    krb5_error_code ret;
+    krb5_data plain, out;
+    struct timeval start, stop;
+    unsigned char *p, *q;
+    char *name;
+    size_t len, piece;
+    double secs;
+    int i, n, iter;
+
+    ret = krb5_generate_random_keyblock(context, enctype, &keyblock);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+    ret = krb5_crypto_init(context, &keyblock, 0, &crypto);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init");
+
+    ret = krb5_data_alloc(&plain, msgsize);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_data_alloc");
+    krb5_generate_random_block(plain.data, plain.length);
+    krb5_generate_random_block(token_header, sizeof(token_header));
 
+    piece = msgsize / IOV_PIECES;
 
+    n = 0;
+    iov[n++].flags = KRB5_CRYPTO_TYPE_HEADER;
+    for (i = 0; i < IOV_PIECES; i++) {
+	iov[n].flags = KRB5_CRYPTO_TYPE_DATA;
+	iov[n++].data.length =
+	    (i == IOV_PIECES - 1) ? msgsize - i * piece : piece;
+    }
+    iov[n].flags = KRB5_CRYPTO_TYPE_DATA;	/* copy of the token header */
+    iov[n++].data.length = sizeof(token_header);
+    iov[n++].flags = KRB5_CRYPTO_TYPE_PADDING;
+    iov[n++].flags = KRB5_CRYPTO_TYPE_TRAILER;
+
+    ret = krb5_crypto_length_iov(context, crypto, iov, n);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_length_iov");
+    for (len = 0, i = 0; i < n; i++) {
+	iov[i].data.data = emalloc(iov[i].data.length + 1);
+	len += iov[i].data.length;
+    }
+
+    for (p = plain.data, i = 1; i <= IOV_PIECES; i++) {
+	memcpy(iov[i].data.data, p, iov[i].data.length);
+	p += iov[i].data.length;
+    }
+    memcpy(iov[IOV_PIECES + 1].data.data, token_header, sizeof(token_header));
+
+    ret = krb5_encrypt_iov_ivec(context, crypto, KRB5_KU_USAGE_INITIATOR_SEAL,
+				iov, n, NULL);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_encrypt_iov_ivec");
+
+    q = emalloc(len);
+    for (p = q, i = 0; i < n; i++) {
+	memcpy(p, iov[i].data.data, iov[i].data.length);
+	p += iov[i].data.length;
+    }
+    ret = krb5_decrypt(context, crypto, KRB5_KU_USAGE_INITIATOR_SEAL,
+		       q, len, &out);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_decrypt of iov encrypted token");
+    if (out.length != msgsize + sizeof(token_header) ||
+	memcmp(out.data, plain.data, msgsize) != 0 ||
+	memcmp((char *)out.data + msgsize, token_header,
+	       sizeof(token_header)) != 0)
+	krb5_errx(context, 1, "krb5_decrypt of iov encrypted token differs");
+    krb5_data_free(&out);
+    free(q);
+
+    ret = krb5_decrypt_iov_ivec(context, crypto, KRB5_KU_USAGE_INITIATOR_SEAL,
+				iov, n, NULL);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_decrypt_iov_ivec");
+    for (p = plain.data, i = 1; i <= IOV_PIECES; i++) {
+	if (memcmp(iov[i].data.data, p, iov[i].data.length) != 0)
+	    krb5_errx(context, 1, "krb5_decrypt_iov_ivec data differs");
+	p += iov[i].data.length;
+    }
+
+    if (count) {
+	gettimeofday(&start, NULL);
+	for (iter = 0; iter < count; iter++) {
+	    ret = krb5_encrypt_iov_ivec(context, crypto,
+					KRB5_KU_USAGE_INITIATOR_SEAL,
+					iov, n, NULL);
+	    if (ret == 0)
+		ret = krb5_decrypt_iov_ivec(context, crypto,
+					    KRB5_KU_USAGE_INITIATOR_SEAL,
+					    iov, n, NULL);
+	    if (ret)
+		krb5_err(context, 1, ret, "iov wrap/unwrap");
+	}
+	gettimeofday(&stop, NULL);
+	timevalsub(&stop, &start);
+	secs = stop.tv_sec + stop.tv_usec / 1000000.0;
+	ret = krb5_enctype_to_string(context, enctype, &name);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_enctype_to_string");
+	printf("%s: %d wrap/unwrap of %lu bytes in %.3fs, %.1f MB/s\n",
+	       name, count, (unsigned long)msgsize, secs,
+	       secs > 0 ? (double)msgsize * count / secs / 1000000 : 0.0);
+	free(name);
+    }
+
+    for (i = 0; i < n; i++)
+	free(iov[i].data.data);
+    krb5_data_free(&plain);
+    krb5_crypto_destroy(context, crypto);
+    krb5_free_keyblock_contents(context, &keyblock);
+}
+
+static const krb5_enctype iov_enctypes[] = {
+    KRB5_ENCTYPE_AES128_CTS_HMAC_SHA1_96,
+    KRB5_ENCTYPE_AES256_CTS_HMAC_SHA1_96,
+    KRB5_ENCTYPE_AES128_CTS_HMAC_SHA256_128,
+    KRB5_ENCTYPE_AES256_CTS_HMAC_SHA384_192
+};
+
+/*
+ * With an argument, the number of round trips to time for the
+ * throughput of the in place wrap/unwrap of 64k messages.
+ */
 
 int
 main(int argc, char **argv)
@@ -141,7 +284,10 @@ main(int argc, char **argv)
     krb5_error_code ret;
     krb5_context context;
     krb5_crypto crypto;
-    int i;
+    int i, count = 0;
+
+    if (argc > 1)
+	count = atoi(argv[1]);
 
     ret = krb5_init_context(&context);
     if (ret)
@@ -165,6 +311,12 @@ main(int argc, char **argv)
 	test_range(&tests[i], 0, context, crypto);
     }
 
+    for (i = 0; i < sizeof(iov_enctypes)/sizeof(iov_enctypes[0]); i++) {
+	test_iov_wrap(context, iov_enctypes[i], 1, 0);
+	test_iov_wrap(context, iov_enctypes[i], 1000, 0);
+	test_iov_wrap(context, iov_enctypes[i], 65536, count);
+    }
+
     krb5_free_keyblock_contents(context, &keyblock);
     krb5_crypto_destroy(context, crypto);
     krb5_free_context(context);
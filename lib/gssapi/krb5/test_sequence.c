@@ -78,6 +78,52 @@ OM_uint32 pattern8[] = {
     4294967293U, 4294967294U, 4294967295U, 0, 1, 2
 };
 
+/* reordered across a bitmap word, then dup 50 */
+OM_uint32 pattern9[] = {
+    0, 1, 2, 3, 62, 63, 64, 65, 61, 50, 66, 50
+};
+
+/* 40 is outside the window */
+OM_uint32 pattern10[] = {
+    0, 1, 2, 3, 62, 63, 64, 65, 40
+};
+
+/* reordered and duplicated, then exported: see test_seq_export() */
+OM_uint32 pattern11[] = {
+    0, 1, 2, 3, 62, 63, 64, 65, 61, 50
+};
+
+struct probe {
+    OM_uint32 seq;
+    OM_uint32 expected;
+};
+
+/* what should be said about what follows pattern11, with replay detection */
+struct probe probes1[] = {
+    { 61, GSS_S_DUPLICATE_TOKEN },
+    { 50, GSS_S_DUPLICATE_TOKEN },
+    { 55, GSS_S_COMPLETE },
+    { 55, GSS_S_DUPLICATE_TOKEN },
+    { 40, GSS_S_OLD_TOKEN },
+    { 66, GSS_S_COMPLETE },
+    { 70, GSS_S_COMPLETE },
+    { 68, GSS_S_COMPLETE },
+    { 70, GSS_S_DUPLICATE_TOKEN }
+};
+
+/* ... and with sequence detection too */
+struct probe probes2[] = {
+    { 61, GSS_S_DUPLICATE_TOKEN },
+    { 50, GSS_S_DUPLICATE_TOKEN },
+    { 55, GSS_S_UNSEQ_TOKEN },
+    { 55, GSS_S_DUPLICATE_TOKEN },
+    { 40, GSS_S_UNSEQ_TOKEN },
+    { 66, GSS_S_COMPLETE },
+    { 70, GSS_S_GAP_TOKEN },
+    { 68, GSS_S_UNSEQ_TOKEN },
+    { 70, GSS_S_DUPLICATE_TOKEN }
+};
+
 static int
 test_seq(int t, OM_uint32 flags, OM_uint32 start_seq,
 	 OM_uint32 *pattern, int pattern_len, OM_uint32 expected_error)
@@ -141,6 +187,59 @@ test_seq(int t, OM_uint32 flags, OM_uint32 start_seq,
     return 0;
 }
 
+/*
+ * Feed a pattern to an order, export it mid-stream and import it again,
+ * then check that the original and the imported copy agree with the
+ * probes about what comes after.
+ */
+static int
+test_seq_export(int t, OM_uint32 flags,
+		OM_uint32 *pattern, int pattern_len,
+		struct probe *probes, int nprobes)
+{
+    struct gss_msg_order *o, *o2;
+    OM_uint32 maj_stat, maj_stat2, min_stat;
+    krb5_storage *sp;
+    int i, failed = 0;
+
+    maj_stat = _gssapi_msg_order_create(&min_stat, &o, flags, 0, 20, 0);
+    if (maj_stat)
+	errx(1, "create: %d %d", maj_stat, min_stat);
+
+    for (i = 0; i < pattern_len; i++)
+	(void) _gssapi_msg_order_check(o, pattern[i]);
+
+    sp = krb5_storage_emem();
+    if (sp == NULL)
+	errx(1, "krb5_storage_from_emem");
+
+    if (_gssapi_msg_order_export(sp, o))
+	errx(1, "export");
+    krb5_storage_seek(sp, 0, SEEK_SET);
+    maj_stat = _gssapi_msg_order_import(&min_stat, sp, &o2);
+    if (maj_stat)
+	errx(1, "import: %d %d", maj_stat, min_stat);
+
+    for (i = 0; i < nprobes; i++) {
+	maj_stat = _gssapi_msg_order_check(o, probes[i].seq);
+	maj_stat2 = _gssapi_msg_order_check(o2, probes[i].seq);
+	if (maj_stat != probes[i].expected ||
+	    maj_stat2 != probes[i].expected) {
+	    printf("export test %d probe %d (%lu) gave %d before and %d "
+		   "after export (should have been %d)\n",
+		   t, i, (unsigned long)probes[i].seq, maj_stat, maj_stat2,
+		   probes[i].expected);
+	    failed = 1;
+	}
+    }
+
+    _gssapi_msg_order_destroy(&o);
+    _gssapi_msg_order_destroy(&o2);
+    krb5_storage_free(sp);
+
+    return failed;
+}
+
 struct {
     OM_uint32 flags;
     OM_uint32 *pattern;
@@ -344,6 +443,24 @@ struct {
 	sizeof(pattern8)/sizeof(pattern8[0]),
 	GSS_S_COMPLETE,
 	4294967293U
+    },
+    {
+	GSS_C_REPLAY_FLAG,
+	pattern9,
+	sizeof(pattern9)/sizeof(pattern9[0]),
+	GSS_S_DUPLICATE_TOKEN
+    },
+    {
+	GSS_C_REPLAY_FLAG,
+	pattern10,
+	sizeof(pattern10)/sizeof(pattern10[0]),
+	GSS_S_OLD_TOKEN
+    },
+    {
+	GSS_C_SEQUENCE_FLAG,
+	pattern10,
+	sizeof(pattern10)/sizeof(pattern10[0]),
+	GSS_S_GAP_TOKEN
     }
 };
 
@@ -361,6 +478,14 @@ main(int argc, char **argv)
 		     pl[i].error_code))
 	    failed++;
     }
+    if (test_seq_export(0, GSS_C_REPLAY_FLAG,
+			pattern11, sizeof(pattern11)/sizeof(pattern11[0]),
+			probes1, sizeof(probes1)/sizeof(probes1[0])))
+	failed++;
+    if (test_seq_export(1, GSS_C_REPLAY_FLAG|GSS_C_SEQUENCE_FLAG,
+			pattern11, sizeof(pattern11)/sizeof(pattern11[0]),
+			probes2, sizeof(probes2)/sizeof(probes2[0])))
+	failed++;
     if (failed)
 	printf("FAILED %d tests\n", failed);
     return failed != 0;
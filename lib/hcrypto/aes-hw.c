@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+#include <roken.h>
+
+#ifdef KRB5
+#include <krb5-types.h>
+#endif
+
+#include "aes-hw.h"
+
+#ifdef HAVE_HC_AES_HW
+
+#ifdef HC_AES_HW_X86
+#include <cpuid.h>
+#include <wmmintrin.h>
+#define HC_AES_TARGET __attribute__((target("aes,sse2")))
+#endif
+
+#ifdef HC_AES_HW_ARM64
+#ifdef __linux__
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#endif
+#include <arm_neon.h>
+#if defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES)
+#define HC_AES_TARGET
+#elif defined(__clang__)
+#define HC_AES_TARGET __attribute__((target("crypto")))
+#else
+#define HC_AES_TARGET __attribute__((target("+crypto")))
+#endif
+#endif
+
+/*
+ * Whether the CPU has the AES instructions.  Setting
+ * HCRYPTO_DISABLE_HW_AES in the environment forces the table based
+ * implementation, which the tests use to check both.  The answer must
+ * not change during the life of the process since the key schedules
+ * differ, so it is computed once.
+ */
+
+static int hw_state = -1;
+
+static int
+probe_hw(void)
+{
+    if (!issuid() && getenv("HCRYPTO_DISABLE_HW_AES") != NULL)
+	return 0;
+#ifdef HC_AES_HW_X86
+    {
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+	    return 0;
+	/* AES-NI and SSE2 */
+	return (ecx & (1U << 25)) && (edx & (1U << 26));
+    }
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#else
+    /* every 64-bit Apple CPU has the crypto extensions */
+    return 1;
+#endif
+}
+
+int
+aes_hw_available(void)
+{
+    if (hw_state == -1)
+	hw_state = probe_hw();
+    return hw_state;
+}
+
+/*
+ * Turn a key schedule from rijndaelKeySetupEnc()/rijndaelKeySetupDec()
+ * into the byte order the instructions want.
+ */
+
+void
+aes_hw_key_setup(uint32_t *rk, int rounds)
+{
+    unsigned char *p = (unsigned char *)rk;
+    int i;
+
+    for (i = 0; i < (rounds + 1) * 4; i++) {
+	uint32_t w = rk[i];
+
+	p[i * 4 + 0] = (w >> 24) & 0xff;
+	p[i * 4 + 1] = (w >> 16) & 0xff;
+	p[i * 4 + 2] = (w >>  8) & 0xff;
+	p[i * 4 + 3] = (w      ) & 0xff;
+    }
+}
+
+#ifdef HC_AES_HW_X86
+
+typedef __m128i block;
+
+#define LOAD(p)		_mm_loadu_si128((const __m128i *)(const void *)(p))
+#define STORE(p, b)	_mm_storeu_si128((__m128i *)(void *)(p), (b))
+#define XOR(a, b)	_mm_xor_si128((a), (b))
+
+static inline HC_AES_TARGET block
+encrypt_block(const block *k, int rounds, block b)
+{
+    int i;
+
+    b = XOR(b, k[0]);
+    for (i = 1; i < rounds; i++)
+	b = _mm_aesenc_si128(b, k[i]);
+    return _mm_aesenclast_si128(b, k[rounds]);
+}
+
+static inline HC_AES_TARGET block
+decrypt_block(const block *k, int rounds, block b)
+{
+    int i;
+
+    b = XOR(b, k[0]);
+    for (i = 1; i < rounds; i++)
+	b = _mm_aesdec_si128(b, k[i]);
+    return _mm_aesdeclast_si128(b, k[rounds]);
+}
+
+/* four independent blocks, to keep the pipeline full */
+static inline HC_AES_TARGET void
+decrypt_4blocks(const block *k, int rounds, block *b)
+{
+    int i;
+
+    b[0] = XOR(b[0], k[0]);
+    b[1] = XOR(b[1], k[0]);
+    b[2] = XOR(b[2], k[0]);
+    b[3] = XOR(b[3], k[0]);
+    for (i = 1; i < rounds; i++) {
+	b[0] = _mm_aesdec_si128(b[0], k[i]);
+	b[1] = _mm_aesdec_si128(b[1], k[i]);
+	b[2] = _mm_aesdec_si128(b[2], k[i]);
+	b[3] = _mm_aesdec_si128(b[3], k[i]);
+    }
+    b[0] = _mm_aesdeclast_si128(b[0], k[rounds]);
+    b[1] = _mm_aesdeclast_si128(b[1], k[rounds]);
+    b[2] = _mm_aesdeclast_si128(b[2], k[rounds]);
+    b[3] = _mm_aesdeclast_si128(b[3], k[rounds]);
+}
+
+#else /* HC_AES_HW_ARM64 */
+
+typedef uint8x16_t block;
+
+#define LOAD(p)		vld1q_u8((const uint8_t *)(p))
+#define STORE(p, b)	vst1q_u8((uint8_t *)(p), (b))
+#define XOR(a, b)	veorq_u8((a), (b))
+
+static inline HC_AES_TARGET block
+encrypt_block(const block *k, int rounds, block b)
+{
+    int i;
+
+    for (i = 0; i < rounds - 1; i++)
+	b = vaesmcq_u8(vaeseq_u8(b, k[i]));
+    b = vaeseq_u8(b, k[rounds - 1]);
+    return XOR(b, k[rounds]);
+}
+
+static inline HC_AES_TARGET block
+decrypt_block(const block *k, int rounds, block b)
+{
+    int i;
+
+    for (i = 0; i < rounds - 1; i++)
+	b = vaesimcq_u8(vaesdq_u8(b, k[i]));
+    b = vaesdq_u8(b, k[rounds - 1]);
+    return XOR(b, k[rounds]);
+}
+
+static inline HC_AES_TARGET void
+decrypt_4blocks(const block *k, int rounds, block *b)
+{
+    int i;
+
+    for (i = 0; i < rounds - 1; i++) {
+	b[0] = vaesimcq_u8(vaesdq_u8(b[0], k[i]));
+	b[1] = vaesimcq_u8(vaesdq_u8(b[1], k[i]));
+	b[2] = vaesimcq_u8(vaesdq_u8(b[2], k[i]));
+	b[3] = vaesimcq_u8(vaesdq_u8(b[3], k[i]));
+    }
+    b[0] = XOR(vaesdq_u8(b[0], k[rounds - 1]), k[rounds]);
+    b[1] = XOR(vaesdq_u8(b[1], k[rounds - 1]), k[rounds]);
+    b[2] = XOR(vaesdq_u8(b[2], k[rounds - 1]), k[rounds]);
+    b[3] = XOR(vaesdq_u8(b[3], k[rounds - 1]), k[rounds]);
+}
+
+#endif
+
+/* AES_KEY always has room for 15 round keys, whatever the key size */
+static inline HC_AES_TARGET void
+load_key(const uint32_t *rk, block *k)
+{
+    int i;
+
+    for (i = 0; i < 15; i++)
+	k[i] = LOAD(rk + i * 4);
+}
+
+HC_AES_TARGET void
+aes_hw_encrypt(const uint32_t *rk, int rounds,
+	       const unsigned char *in, unsigned char *out)
+{
+    block k[15];
+
+    load_key(rk, k);
+    STORE(out, encrypt_block(k, rounds, LOAD(in)));
+}
+
+HC_AES_TARGET void
+aes_hw_decrypt(const uint32_t *rk, int rounds,
+	       const unsigned char *in, unsigned char *out)
+{
+    block k[15];
+
+    load_key(rk, k);
+    STORE(out, decrypt_block(k, rounds, LOAD(in)));
+}
+
+/*
+ * CBC over whole blocks; `size' must be a multiple of the block size.
+ */
+
+HC_AES_TARGET void
+aes_hw_cbc_encrypt(const uint32_t *rk, int rounds, const unsigned char *in,
+		   unsigned char *out, size_t size, unsigned char *iv)
+{
+    block k[15], b;
+
+    load_key(rk, k);
+    b = LOAD(iv);
+    for (; size >= 16; size -= 16, in += 16, out += 16) {
+	b = encrypt_block(k, rounds, XOR(b, LOAD(in)));
+	STORE(out, b);
+    }
+    STORE(iv, b);
+}
+
+HC_AES_TARGET void
+aes_hw_cbc_decrypt(const uint32_t *rk, int rounds, const unsigned char *in,
+		   unsigned char *out, size_t size, unsigned char *iv)
+{
+    block k[15], prev, c[4], b[4];
+
+    load_key(rk, k);
+    prev = LOAD(iv);
+
+    /* unlike encryption, decryption of the blocks is independent */
+    for (; size >= 64; size -= 64, in += 64, out += 64) {
+	b[0] = c[0] = LOAD(in);
+	b[1] = c[1] = LOAD(in + 16);
+	b[2] = c[2] = LOAD(in + 32);
+	b[3] = c[3] = LOAD(in + 48);
+	decrypt_4blocks(k, rounds, b);
+	STORE(out,      XOR(b[0], prev));
+	STORE(out + 16, XOR(b[1], c[0]));
+	STORE(out + 32, XOR(b[2], c[1]));
+	STORE(out + 48, XOR(b[3], c[2]));
+	prev = c[3];
+    }
+    for (; size >= 16; size -= 16, in += 16, out += 16) {
+	c[0] = LOAD(in);
+	STORE(out, XOR(decrypt_block(k, rounds, c[0]), prev));
+	prev = c[0];
+    }
+    STORE(iv, prev);
+}
+
+#endif /* HAVE_HC_AES_HW */
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Hardware AES (AES-NI on x86, the ARMv8 cryptography extensions on
+ * aarch64) for aes.c.  The hardware code uses the same key schedule
+ * as rijndael-alg-fst.c but stores the round keys as bytes.
+ */
+
+#ifndef HEIM_AES_HW_H
+#define HEIM_AES_HW_H 1
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HC_AES_HW_COMPILER 1
+#elif defined(__clang__)
+#define HC_AES_HW_COMPILER 1
+#endif
+
+#ifdef HC_AES_HW_COMPILER
+#if defined(__x86_64__) || defined(__i386__)
+#define HC_AES_HW_X86 1
+#elif defined(__aarch64__) && (defined(__linux__) || defined(__APPLE__))
+#define HC_AES_HW_ARM64 1
+#endif
+#endif
+
+#if defined(HC_AES_HW_X86) || defined(HC_AES_HW_ARM64)
+#define HAVE_HC_AES_HW 1
+#endif
+
+/* symbol renaming */
+#define aes_hw_available _hc_aes_hw_available
+#define aes_hw_key_setup _hc_aes_hw_key_setup
+#define aes_hw_encrypt _hc_aes_hw_encrypt
+#define aes_hw_decrypt _hc_aes_hw_decrypt
+#define aes_hw_cbc_encrypt _hc_aes_hw_cbc_encrypt
+#define aes_hw_cbc_decrypt _hc_aes_hw_cbc_decrypt
+
+#ifdef HAVE_HC_AES_HW
+
+int aes_hw_available(void);
+void aes_hw_key_setup(uint32_t *, int);
+void aes_hw_encrypt(const uint32_t *, int,
+		    const unsigned char *, unsigned char *);
+void aes_hw_decrypt(const uint32_t *, int,
+		    const unsigned char *, unsigned char *);
+void aes_hw_cbc_encrypt(const uint32_t *, int, const unsigned char *,
+			unsigned char *, size_t, unsigned char *);
+void aes_hw_cbc_decrypt(const uint32_t *, int, const unsigned char *,
+			unsigned char *, size_t, unsigned char *);
+
+#else
+
+#define aes_hw_available() 0
+
+#endif
+
+#endif /* HEIM_AES_HW_H */
@@ -39,14 +39,24 @@
 #endif
 
 #include "rijndael-alg-fst.h"
+#include "aes-hw.h"
 #include "aes.h"
 
+/*
+ * When the CPU has AES instructions the key schedule is kept in the
+ * byte order they use and all operations go through aes-hw.c.
+ */
+
 int
 AES_set_encrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 {
     key->rounds = rijndaelKeySetupEnc(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
+#ifdef HAVE_HC_AES_HW
+    if (aes_hw_available())
+	aes_hw_key_setup(key->key, key->rounds);
+#endif
     return 0;
 }
 
@@ -56,18 +66,34 @@ AES_set_decrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
     key->rounds = rijndaelKeySetupDec(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
+#ifdef HAVE_HC_AES_HW
+    if (aes_hw_available())
+	aes_hw_key_setup(key->key, key->rounds);
+#endif
     return 0;
 }
 
 void
 AES_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef HAVE_HC_AES_HW
+    if (aes_hw_available()) {
+	aes_hw_encrypt(key->key, key->rounds, in, out);
+	return;
+    }
+#endif
     rijndaelEncrypt(key->key, key->rounds, in, out);
 }
 
 void
 AES_decrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef HAVE_HC_AES_HW
+    if (aes_hw_available()) {
+	aes_hw_decrypt(key->key, key->rounds, in, out);
+	return;
+    }
+#endif
     rijndaelDecrypt(key->key, key->rounds, in, out);
 }
 
@@ -79,6 +105,20 @@ AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
     unsigned char tmp[AES_BLOCK_SIZE];
     int i;
 
+#ifdef HAVE_HC_AES_HW
+    if (aes_hw_available() && size >= AES_BLOCK_SIZE) {
+	unsigned long len = size & ~(unsigned long)(AES_BLOCK_SIZE - 1);
+
+	if (forward_encrypt)
+	    aes_hw_cbc_encrypt(key->key, key->rounds, in, out, len, iv);
+	else
+	    aes_hw_cbc_decrypt(key->key, key->rounds, in, out, len, iv);
+	in += len;
+	out += len;
+	size -= len;
+    }
+#endif
+
     if (forward_encrypt) {
 	while (size >= AES_BLOCK_SIZE) {
 	    for (i = 0; i < AES_BLOCK_SIZE; i++)
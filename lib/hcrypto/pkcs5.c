@@ -41,6 +41,100 @@
 #include <evp.h>
 #include <hmac.h>
 
+/*
+ * PBKDF2 for digests whose state is plain memory (no cleanup function),
+ * which is true for the hcrypto digests.  The HMAC key is the same for
+ * every iteration, so the states after hashing the inner and outer
+ * pads are computed once and copied, which halves the number of
+ * compression function calls and avoids the allocations HMAC() does.
+ */
+
+static int
+pbkdf2_copy_state(const void * password, size_t password_len,
+		  const void * salt, size_t salt_len,
+		  unsigned long iter,
+		  const EVP_MD *md,
+		  size_t keylen, void *key)
+{
+    size_t ctx_size = md->ctx_size;
+    size_t hsize = md->hash_size;
+    size_t bsize = md->block_size;
+    unsigned char *mem, *ictx, *octx, *ctx, *pad, *u, *t;
+    unsigned char counter[4];
+    unsigned char *p = key;
+    uint32_t keypart;
+    unsigned long i;
+    size_t j, len, memlen;
+
+    memlen = 3 * ctx_size + bsize + 2 * hsize;
+    mem = malloc(memlen);
+    if (mem == NULL)
+	return 0;
+    ictx = mem;
+    octx = ictx + ctx_size;
+    ctx = octx + ctx_size;
+    pad = ctx + ctx_size;
+    u = pad + bsize;
+    t = u + hsize;
+
+    if (password_len > bsize) {
+	(md->init)((EVP_MD_CTX *)ctx);
+	(md->update)((EVP_MD_CTX *)ctx, password, password_len);
+	(md->final)(t, (EVP_MD_CTX *)ctx);
+	password = t;
+	password_len = hsize;
+    }
+
+    memset(pad, 0x36, bsize);
+    for (j = 0; j < password_len; j++)
+	pad[j] ^= ((const unsigned char *)password)[j];
+    (md->init)((EVP_MD_CTX *)ictx);
+    (md->update)((EVP_MD_CTX *)ictx, pad, bsize);
+
+    memset(pad, 0x5c, bsize);
+    for (j = 0; j < password_len; j++)
+	pad[j] ^= ((const unsigned char *)password)[j];
+    (md->init)((EVP_MD_CTX *)octx);
+    (md->update)((EVP_MD_CTX *)octx, pad, bsize);
+
+    for (keypart = 1; keylen > 0; keypart++) {
+	len = min(keylen, hsize);
+
+	counter[0] = (keypart >> 24) & 0xff;
+	counter[1] = (keypart >> 16) & 0xff;
+	counter[2] = (keypart >> 8)  & 0xff;
+	counter[3] = (keypart)       & 0xff;
+
+	memcpy(ctx, ictx, ctx_size);
+	(md->update)((EVP_MD_CTX *)ctx, salt, salt_len);
+	(md->update)((EVP_MD_CTX *)ctx, counter, sizeof(counter));
+	(md->final)(u, (EVP_MD_CTX *)ctx);
+	memcpy(ctx, octx, ctx_size);
+	(md->update)((EVP_MD_CTX *)ctx, u, hsize);
+	(md->final)(u, (EVP_MD_CTX *)ctx);
+	memcpy(t, u, hsize);
+
+	for (i = 1; i < iter; i++) {
+	    memcpy(ctx, ictx, ctx_size);
+	    (md->update)((EVP_MD_CTX *)ctx, u, hsize);
+	    (md->final)(u, (EVP_MD_CTX *)ctx);
+	    memcpy(ctx, octx, ctx_size);
+	    (md->update)((EVP_MD_CTX *)ctx, u, hsize);
+	    (md->final)(u, (EVP_MD_CTX *)ctx);
+	    for (j = 0; j < hsize; j++)
+		t[j] ^= u[j];
+	}
+
+	memcpy(p, t, len);
+	p += len;
+	keylen -= len;
+    }
+
+    memset_s(mem, memlen, 0, memlen);
+    free(mem);
+    return 1;
+}
+
 /**
  * As descriped in PKCS5, convert a password, salt, and iteration counter into a crypto key.
  *
@@ -76,6 +170,10 @@ PKCS5_PBKDF2_HMAC(const void * password, size_t password_len,
     if (md == NULL)
 	return 0;
 
+    if (md->cleanup == NULL && md->ctx_size > 0)
+	return pbkdf2_copy_state(password, password_len, salt, salt_len,
+				 iter, md, keylen, key);
+
     checksumsize = EVP_MD_size(md);
     datalen = salt_len + 4;
 
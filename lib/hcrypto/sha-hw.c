@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+#include <roken.h>
+
+#ifdef KRB5
+#include <krb5-types.h>
+#endif
+
+#include "sha-hw.h"
+
+#ifdef HAVE_HC_SHA_HW
+
+#ifdef HC_SHA_HW_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#define HC_SHA_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+#endif
+
+#ifdef HC_SHA_HW_ARM64
+#ifdef __linux__
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+#include <arm_neon.h>
+#if defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2)
+#define HC_SHA_TARGET
+#elif defined(__clang__)
+#define HC_SHA_TARGET __attribute__((target("crypto")))
+#else
+#define HC_SHA_TARGET __attribute__((target("+crypto")))
+#endif
+#endif
+
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/*
+ * Whether the CPU has the SHA instructions.  Setting
+ * HCRYPTO_DISABLE_HW_SHA in the environment forces the portable code,
+ * which the tests use to check both.
+ */
+
+static int hw_state = -1;
+
+static int
+probe_hw(void)
+{
+    if (!issuid() && getenv("HCRYPTO_DISABLE_HW_SHA") != NULL)
+	return 0;
+#ifdef HC_SHA_HW_X86
+    {
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+	    return 0;
+	/* SSSE3 and SSE4.1 */
+	if (!(ecx & (1U << 9)) || !(ecx & (1U << 19)))
+	    return 0;
+	if (__get_cpuid_max(0, NULL) < 7)
+	    return 0;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	/* SHA */
+	return (ebx & (1U << 29)) != 0;
+    }
+#elif defined(__linux__)
+    {
+	unsigned long hwcap = getauxval(AT_HWCAP);
+
+	return (hwcap & HWCAP_SHA1) && (hwcap & HWCAP_SHA2);
+    }
+#else
+    /* every 64-bit Apple CPU has the crypto extensions */
+    return 1;
+#endif
+}
+
+int
+sha_hw_available(void)
+{
+    if (hw_state == -1)
+	hw_state = probe_hw();
+    return hw_state;
+}
+
+#ifdef HC_SHA_HW_X86
+
+/*
+ * The SHA-1 instructions want the message words of a group of four
+ * rounds and the state words A-D in reverse order in the register, and
+ * E in the top lane.  The immediate of sha1rnds4 selects the round
+ * function and must be a constant, hence the macro.
+ */
+
+#define SHA1_GROUPS(first, last, func)					\
+    for (g = (first); g < (last); g++) {				\
+	if (g >= 4)							\
+	    W[g & 3] = _mm_sha1msg2_epu32(				\
+		_mm_xor_si128(_mm_sha1msg1_epu32(W[g & 3],		\
+						 W[(g + 1) & 3]),	\
+			      W[(g + 2) & 3]),				\
+		W[(g + 3) & 3]);					\
+	if (g == 0)							\
+	    e = _mm_add_epi32(e, W[0]);					\
+	else								\
+	    e = _mm_sha1nexte_epu32(prev, W[g & 3]);			\
+	prev = abcd;							\
+	abcd = _mm_sha1rnds4_epu32(abcd, e, (func));			\
+    }
+
+HC_SHA_TARGET void
+sha1_hw_compress(uint32_t *state, const unsigned char *p, size_t nblocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+					0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e, e_save, prev, W[4];
+    int g, i;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1b);
+    e = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for (; nblocks > 0; nblocks--, p += 64) {
+	abcd_save = abcd;
+	e_save = e;
+
+	for (i = 0; i < 4; i++)
+	    W[i] = _mm_shuffle_epi8(
+		_mm_loadu_si128((const __m128i *)(p + i * 16)), mask);
+
+	SHA1_GROUPS(0, 5, 0);
+	SHA1_GROUPS(5, 10, 1);
+	SHA1_GROUPS(10, 15, 2);
+	SHA1_GROUPS(15, 20, 3);
+
+	e = _mm_sha1nexte_epu32(prev, e_save);
+	abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = _mm_extract_epi32(e, 3);
+}
+
+/*
+ * The SHA-256 instructions keep the state as ABEF and CDGH.
+ */
+
+HC_SHA_TARGET void
+sha256_hw_compress(uint32_t *state, const unsigned char *p, size_t nblocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					0x0405060700010203ULL);
+    __m128i state0, state1, abef_save, cdgh_save, msg, tmp, W[4];
+    int g, i;
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]),
+			    0xb1);				/* CDAB */
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]),
+			       0x1b);				/* EFGH */
+    state0 = _mm_alignr_epi8(tmp, state1, 8);			/* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);		/* CDGH */
+
+    for (; nblocks > 0; nblocks--, p += 64) {
+	abef_save = state0;
+	cdgh_save = state1;
+
+	for (i = 0; i < 4; i++)
+	    W[i] = _mm_shuffle_epi8(
+		_mm_loadu_si128((const __m128i *)(p + i * 16)), mask);
+
+	for (g = 0; g < 16; g++) {
+	    msg = _mm_add_epi32(W[g & 3],
+				_mm_loadu_si128((const __m128i *)&K256[g * 4]));
+	    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	    state0 = _mm_sha256rnds2_epu32(state0, state1,
+					   _mm_shuffle_epi32(msg, 0x0e));
+	    if (g < 12)
+		W[g & 3] = _mm_sha256msg2_epu32(
+		    _mm_add_epi32(_mm_sha256msg1_epu32(W[g & 3],
+						       W[(g + 1) & 3]),
+				  _mm_alignr_epi8(W[(g + 3) & 3],
+						  W[(g + 2) & 3], 4)),
+		    W[(g + 3) & 3]);
+	}
+
+	state0 = _mm_add_epi32(state0, abef_save);
+	state1 = _mm_add_epi32(state1, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);			/* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xb1);			/* DCHG */
+    _mm_storeu_si128((__m128i *)&state[0],
+		     _mm_blend_epi16(tmp, state1, 0xf0));	/* DCBA */
+    _mm_storeu_si128((__m128i *)&state[4],
+		     _mm_alignr_epi8(state1, tmp, 8));		/* HGFE */
+}
+
+#else /* HC_SHA_HW_ARM64 */
+
+static inline HC_SHA_TARGET uint32x4_t
+load_be(const unsigned char *p)
+{
+    return vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p)));
+}
+
+HC_SHA_TARGET void
+sha1_hw_compress(uint32_t *state, const unsigned char *p, size_t nblocks)
+{
+    static const uint32_t K[4] = {
+	0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6
+    };
+    uint32x4_t abcd, abcd_save, tmp, W[4];
+    uint32_t e, e_next, e_save;
+    int g;
+
+    abcd = vld1q_u32(state);
+    e = state[4];
+
+    for (; nblocks > 0; nblocks--, p += 64) {
+	abcd_save = abcd;
+	e_save = e;
+
+	W[0] = load_be(p);
+	W[1] = load_be(p + 16);
+	W[2] = load_be(p + 32);
+	W[3] = load_be(p + 48);
+
+	for (g = 0; g < 20; g++) {
+	    tmp = vaddq_u32(W[g & 3], vdupq_n_u32(K[g / 5]));
+	    if (g < 16)
+		W[g & 3] = vsha1su1q_u32(vsha1su0q_u32(W[g & 3],
+						       W[(g + 1) & 3],
+						       W[(g + 2) & 3]),
+					 W[(g + 3) & 3]);
+	    e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+	    if (g < 5)
+		abcd = vsha1cq_u32(abcd, e, tmp);
+	    else if (g >= 10 && g < 15)
+		abcd = vsha1mq_u32(abcd, e, tmp);
+	    else
+		abcd = vsha1pq_u32(abcd, e, tmp);
+	    e = e_next;
+	}
+
+	abcd = vaddq_u32(abcd, abcd_save);
+	e += e_save;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e;
+}
+
+HC_SHA_TARGET void
+sha256_hw_compress(uint32_t *state, const unsigned char *p, size_t nblocks)
+{
+    uint32x4_t state0, state1, save0, save1, tmp, prev, W[4];
+    int g;
+
+    state0 = vld1q_u32(&state[0]);
+    state1 = vld1q_u32(&state[4]);
+
+    for (; nblocks > 0; nblocks--, p += 64) {
+	save0 = state0;
+	save1 = state1;
+
+	W[0] = load_be(p);
+	W[1] = load_be(p + 16);
+	W[2] = load_be(p + 32);
+	W[3] = load_be(p + 48);
+
+	for (g = 0; g < 16; g++) {
+	    tmp = vaddq_u32(W[g & 3], vld1q_u32(&K256[g * 4]));
+	    if (g < 12)
+		W[g & 3] = vsha256su1q_u32(vsha256su0q_u32(W[g & 3],
+							   W[(g + 1) & 3]),
+					   W[(g + 2) & 3], W[(g + 3) & 3]);
+	    prev = state0;
+	    state0 = vsha256hq_u32(state0, state1, tmp);
+	    state1 = vsha256h2q_u32(state1, prev, tmp);
+	}
+
+	state0 = vaddq_u32(state0, save0);
+	state1 = vaddq_u32(state1, save1);
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+
+#endif
+
+#endif /* HAVE_HC_SHA_HW */
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SHA-1 and SHA-256 compression functions using the SHA extensions on
+ * x86 and the ARMv8 cryptography extensions on aarch64, for sha.c and
+ * sha256.c.  They take the state in the usual word order and the
+ * message as big-endian bytes.
+ */
+
+#ifndef HEIM_SHA_HW_H
+#define HEIM_SHA_HW_H 1
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HC_SHA_HW_COMPILER 1
+#elif defined(__clang__)
+#define HC_SHA_HW_COMPILER 1
+#endif
+
+#ifdef HC_SHA_HW_COMPILER
+#if defined(__x86_64__) || defined(__i386__)
+#define HC_SHA_HW_X86 1
+#elif defined(__aarch64__) && (defined(__linux__) || defined(__APPLE__))
+#define HC_SHA_HW_ARM64 1
+#endif
+#endif
+
+#if defined(HC_SHA_HW_X86) || defined(HC_SHA_HW_ARM64)
+#define HAVE_HC_SHA_HW 1
+#endif
+
+/* symbol renaming */
+#define sha_hw_available _hc_sha_hw_available
+#define sha1_hw_compress _hc_sha1_hw_compress
+#define sha256_hw_compress _hc_sha256_hw_compress
+
+#ifdef HAVE_HC_SHA_HW
+
+int sha_hw_available(void);
+void sha1_hw_compress(uint32_t *, const unsigned char *, size_t);
+void sha256_hw_compress(uint32_t *, const unsigned char *, size_t);
+
+#else
+
+#define sha_hw_available() 0
+
+#endif
+
+#endif /* HEIM_SHA_HW_H */
@@ -36,6 +36,7 @@
 
 #include "hash.h"
 #include "sha.h"
+#include "sha-hw.h"
 
 #define A m->counter[0]
 #define B m->counter[1]
@@ -234,12 +235,29 @@ SHA1_Update (struct sha *m, const void *v, size_t len)
       ++m->sz[1];
   offset = (old_sz / 8)  % 64;
   while(len > 0){
-    size_t l = min(len, 64 - offset);
+    size_t l;
+#ifdef HAVE_HC_SHA_HW
+    if (offset == 0 && len >= 64 && sha_hw_available()) {
+      l = len / 64;
+      sha1_hw_compress(m->counter, p, l);
+      p += l * 64;
+      len -= l * 64;
+      continue;
+    }
+#endif
+    l = min(len, 64 - offset);
     memcpy(m->save + offset, p, l);
     offset += l;
     p += l;
     len -= l;
     if(offset == 64){
+#ifdef HAVE_HC_SHA_HW
+      if (sha_hw_available()) {
+	sha1_hw_compress(m->counter, m->save, 1);
+	offset = 0;
+	continue;
+      }
+#endif
 #if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
       int i;
       uint32_t SHA1current[16];
@@ -193,6 +193,35 @@ test_bulk_digest(const char *cname, const EVP_MD *md)
     return 0;
 }
 
+static int
+test_bulk_pbkdf2(const char *cname, const EVP_MD *md)
+{
+    static const char password[] = "password";
+    static const char salt[] = "salt";
+    unsigned char key[32];
+    int i;
+    int64_t M = 0;
+
+    if (md == NULL) {
+        printf("%s not supported\n", cname);
+	return 0;
+    }
+
+    for (i = 0; i < loops; i++) {
+        STATS_START(M);
+        if (PKCS5_PBKDF2_HMAC(password, sizeof(password) - 1,
+                              salt, sizeof(salt) - 1, 4096, md,
+                              sizeof(key), key) != 1)
+	    errx(1, "PKCS5_PBKDF2_HMAC failed");
+        STATS_END(M);
+    }
+
+    printf("%s: mean time %llu usec%s\n", cname, (unsigned long long)M,
+           (M == 1) ? "" : "s");
+
+    return 0;
+}
+
 static void
 test_bulk_provider_hcrypto(void)
 {
@@ -208,6 +237,8 @@ test_bulk_provider_hcrypto(void)
     test_bulk_digest("hcrypto_sha256",		EVP_hcrypto_sha256());
     test_bulk_digest("hcrypto_sha384",		EVP_hcrypto_sha384());
     test_bulk_digest("hcrypto_sha512",		EVP_hcrypto_sha512());
+    test_bulk_pbkdf2("hcrypto_pbkdf2_sha1",	EVP_hcrypto_sha1());
+    test_bulk_pbkdf2("hcrypto_pbkdf2_sha256",	EVP_hcrypto_sha256());
 }
 
 #ifdef __APPLE__
@@ -101,6 +101,83 @@ const struct tests pkcs5_tests[] = {
     }
 };
 
+struct sha2_tests {
+    const EVP_MD *(*md)(void);
+    const char *password;
+    const char *salt;
+    int iterations;
+    size_t keylen;
+    const void *key;
+};
+
+/* computed with an independent implementation */
+const struct sha2_tests pkcs5_sha2_tests[] = {
+    { EVP_sha256,
+      "password",
+      "salt",
+      4096,
+      40,
+      "\xc5\xe4\x78\xd5\x92\x88\xc8\x41\xaa\x53\x0d\xb6\x84\x5c\x4c\x8d"
+      "\x96\x28\x93\xa0\x01\xce\x4e\x11\xa4\x96\x38\x73\xaa\x98\x13\x4a"
+      "\xf7\xad\x98\xc1\xb4\x58\xce\x3f"
+    },
+    { EVP_sha256,
+      "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX"
+      "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX"
+      "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX",
+      "pass phrase exceeds block size",
+      1200,
+      40,
+      "\x4c\x7a\x50\x1f\x99\xb1\xda\x6f\xb4\x2f\x6d\xfd\x6d\x86\xe6\x92"
+      "\x9f\xe8\x11\x90\xea\x41\x08\x1d\x0e\x67\x16\xcb\x63\x0a\x00\x3f"
+      "\x4b\xc1\x3f\x11\x2c\x57\x0c\xad"
+    },
+    { EVP_sha384,
+      "password",
+      "salt",
+      4096,
+      64,
+      "\x55\x97\x26\xbe\x38\xdb\x12\x5b\xc8\x5e\xd7\x89\x5f\x6e\x3c\xf5"
+      "\x74\xc7\xa0\x1c\x08\x0c\x34\x47\xdb\x1e\x8a\x76\x76\x4d\xeb\x3c"
+      "\x30\x7b\x94\x85\x3f\xbe\x42\x4f\x64\x88\xc5\xf4\xf1\x28\x96\x26"
+      "\x1d\x1e\xb4\x30\x35\x3c\x76\x9e\xe2\xa7\x7a\x26\xfd\x0a\x23\x47"
+    },
+    { EVP_sha384,
+      "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX"
+      "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX"
+      "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX",
+      "pass phrase exceeds block size",
+      1200,
+      64,
+      "\xfe\xe3\xe1\x84\xc9\x25\x3e\x10\x47\xc8\x7d\x53\xc6\xa5\xe3\x77"
+      "\x29\x41\x76\xbd\x4b\xe3\x9b\xac\x05\x6c\x11\xdd\x17\xc5\x93\x80"
+      "\x53\xbf\x1a\x01\xb7\x0c\xd0\x7f\x9e\x80\xab\x01\x7a\x37\x95\x4c"
+      "\x7e\x7f\x72\xb7\x10\x7d\xc7\x7e\xe7\x1b\x48\xf5\xa2\xb8\x7f\xbf"
+    },
+    { EVP_sha512,
+      "password",
+      "salt",
+      4096,
+      64,
+      "\xd1\x97\xb1\xb3\x3d\xb0\x14\x3e\x01\x8b\x12\xf3\xd1\xd1\x47\x9e"
+      "\x6c\xde\xbd\xcc\x97\xc5\xc0\xf8\x7f\x69\x02\xe0\x72\xf4\x57\xb5"
+      "\x14\x3f\x30\x60\x26\x41\xb3\xd5\x5c\xd3\x35\x98\x8c\xb3\x6b\x84"
+      "\x37\x60\x60\xec\xd5\x32\xe0\x39\xb7\x42\xa2\x39\x43\x4a\xf2\xd5"
+    },
+    { EVP_sha512,
+      "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX"
+      "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX"
+      "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX",
+      "pass phrase exceeds block size",
+      1200,
+      64,
+      "\x0f\xb2\xed\x2c\x0e\x6e\xfb\x7d\x7d\x8e\xdd\x58\x01\xb4\x59\x72"
+      "\x99\x92\x16\x30\x5e\xa4\x36\x8d\x76\x14\x80\xf3\xe3\x7a\x22\xb9"
+      "\xb2\x3f\x5c\x8a\x06\x96\xbe\xc7\xb1\xd1\x74\xfd\x7e\x9b\x5c\x63"
+      "\x47\xa1\xeb\x81\x81\xd5\x29\x2a\x23\x8b\xa2\x9f\xdc\x9b\xc7\x62"
+    }
+};
+
 static int
 test_pkcs5_pbe2(const struct tests *t)
 {
@@ -134,6 +211,26 @@ test_pkcs5_pbe2(const struct tests *t)
     return error;
 }
 
+static int
+test_pkcs5_sha2(const struct sha2_tests *t)
+{
+    unsigned char key[64];
+    int ret;
+
+    ret = PKCS5_PBKDF2_HMAC(t->password, strlen(t->password),
+			    t->salt, strlen(t->salt),
+			    t->iterations, (*t->md)(),
+			    t->keylen, key);
+    if (ret != 1)
+	errx(1, "PKCS5_PBKDF2_HMAC: %d", ret);
+
+    if (memcmp(t->key, key, t->keylen) != 0) {
+	printf("incorrect %d byte key\n", (int)t->keylen);
+	return 1;
+    }
+    return 0;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -142,6 +239,8 @@ main(int argc, char **argv)
 
     for (i = 0; i < sizeof(pkcs5_tests)/sizeof(pkcs5_tests[0]); i++)
 	ret += test_pkcs5_pbe2(&pkcs5_tests[i]);
+    for (i = 0; i < sizeof(pkcs5_sha2_tests)/sizeof(pkcs5_sha2_tests[0]); i++)
+	ret += test_pkcs5_sha2(&pkcs5_sha2_tests[i]);
 
     return ret;
 }
@@ -45,6 +45,7 @@
 typedef struct mdb_info {
     MDB_env *e;
     MDB_txn *t;
+    MDB_txn *wt;	/* write transaction of the current batch */
     MDB_dbi d;
     MDB_cursor *c;
 } mdb_info;
@@ -56,9 +57,12 @@ DB_close(krb5_context context, HDB *db)
 
     mdb_cursor_close(mi->c);
     mdb_txn_abort(mi->t);
+    if (mi->wt)
+	mdb_txn_abort(mi->wt);
     mdb_env_close(mi->e);
     mi->c = 0;
     mi->t = 0;
+    mi->wt = 0;
     mi->e = 0;
     return 0;
 }
@@ -84,6 +88,36 @@ DB_set_sync(krb5_context context, HDB *db, int on)
     return mdb_env_sync(mi->e, 0);
 }
 
+/*
+ * A batch is one write transaction; each put or delete in it is a nested
+ * transaction so that it can fail without losing the rest of the batch.
+ */
+static krb5_error_code
+DB_begin_batch(krb5_context context, HDB *db)
+{
+    mdb_info *mi = (mdb_info *)db->hdb_db;
+
+    if (mi->e == NULL || mi->wt != NULL)
+	return EINVAL;
+    return mdb_txn_begin(mi->e, NULL, 0, &mi->wt);
+}
+
+static krb5_error_code
+DB_end_batch(krb5_context context, HDB *db, int commit)
+{
+    mdb_info *mi = (mdb_info *)db->hdb_db;
+    int code = 0;
+
+    if (mi->wt == NULL)
+	return EINVAL;
+    if (commit)
+	code = mdb_txn_commit(mi->wt);
+    else
+	mdb_txn_abort(mi->wt);
+    mi->wt = 0;
+    return code;
+}
+
 static krb5_error_code
 DB_lock(krb5_context context, HDB *db, int operation)
 {
@@ -213,6 +247,16 @@ DB__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
     k.mv_data = key.data;
     k.mv_size = key.length;
 
+    /* Within a batch, see its changes */
+    if (mi->wt) {
+	code = mdb_get(mi->wt, mi->d, &k, &v);
+	if (code == 0)
+	    krb5_data_copy(reply, v.mv_data, v.mv_size);
+	if(code == MDB_NOTFOUND)
+	    return HDB_ERR_NOENTRY;
+	return code;
+    }
+
     code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &txn);
     if (code)
 	return code;
@@ -240,7 +284,7 @@ DB__put(krb5_context context, HDB *db, int replace,
     v.mv_data = value.data;
     v.mv_size = value.length;
 
-    code = mdb_txn_begin(mi->e, NULL, 0, &txn);
+    code = mdb_txn_begin(mi->e, mi->wt, 0, &txn);
     if (code)
 	return code;
 
@@ -269,7 +313,7 @@ DB__del(krb5_context context, HDB *db, krb5_data key)
     k.mv_data = key.data;
     k.mv_size = key.length;
 
-    code = mdb_txn_begin(mi->e, NULL, 0, &txn);
+    code = mdb_txn_begin(mi->e, mi->wt, 0, &txn);
     if (code)
 	return code;
 
@@ -396,7 +440,8 @@ hdb_mdb_create(krb5_context context, HDB **db,
     }
     (*db)->hdb_master_key_set = 0;
     (*db)->hdb_openp = 0;
-    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL;
+    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL |
+	HDB_CAP_F_CONCURRENT_READERS;
     (*db)->hdb_open  = DB_open;
     (*db)->hdb_close = DB_close;
     (*db)->hdb_fetch_kvno = _hdb_fetch_kvno;
@@ -412,6 +457,8 @@ hdb_mdb_create(krb5_context context, HDB **db,
     (*db)->hdb__del = DB__del;
     (*db)->hdb_destroy = DB_destroy;
     (*db)->hdb_set_sync = DB_set_sync;
+    (*db)->hdb_begin_batch = DB_begin_batch;
+    (*db)->hdb_end_batch = DB_end_batch;
     return 0;
 }
 #endif /* HAVE_LMDB */
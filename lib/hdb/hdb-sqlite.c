@@ -52,6 +52,8 @@ typedef struct hdb_sqlite_db {
     sqlite3_stmt *remove;
     sqlite3_stmt *get_all_entries;
 
+    int in_batch;
+
 } hdb_sqlite_db;
 
 /* This should be used to mark updates which make the code incompatible
@@ -297,6 +299,38 @@ hdb_sqlite_exec_stmt(krb5_context context,
     return 0;
 }
 
+/*
+ * Stores and removes are each a transaction of their own or, within a
+ * batch, a savepoint in the batch's transaction so that a failed one is
+ * undone without undoing the rest of the batch.
+ */
+static krb5_error_code
+hdb_sqlite_begin(krb5_context context, hdb_sqlite_db *hsdb)
+{
+    return hdb_sqlite_exec_stmt(context, hsdb,
+                                hsdb->in_batch ? "SAVEPOINT hdb_op" :
+                                                 "BEGIN IMMEDIATE TRANSACTION",
+                                HDB_ERR_UK_SERROR);
+}
+
+static krb5_error_code
+hdb_sqlite_commit(krb5_context context, hdb_sqlite_db *hsdb)
+{
+    return hdb_sqlite_exec_stmt(context, hsdb,
+                                hsdb->in_batch ? "RELEASE hdb_op" : "COMMIT",
+                                HDB_ERR_UK_SERROR);
+}
+
+static void
+hdb_sqlite_rollback(krb5_context context, hdb_sqlite_db *hsdb)
+{
+    (void) hdb_sqlite_exec_stmt(context, hsdb,
+                                hsdb->in_batch ?
+                                    "ROLLBACK TO hdb_op; RELEASE hdb_op" :
+                                    "ROLLBACK",
+                                0);
+}
+
 /**
  *
  */
@@ -378,6 +412,7 @@ hdb_sqlite_close_database(krb5_context context, HDB *db)
     hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
 
     finalize_stmts(context, hsdb);
+    hsdb->in_batch = 0;
 
     /* XXX Use sqlite3_close_v2() when we upgrade SQLite3 */
     if (sqlite3_close(hsdb->db) != SQLITE_OK) {
@@ -596,9 +631,7 @@ hdb_sqlite_store(krb5_context context, HDB *db, unsigned flags,
 
     krb5_data_zero(&value);
 
-    ret = hdb_sqlite_exec_stmt(context, hsdb,
-                               "BEGIN IMMEDIATE TRANSACTION",
-                               HDB_ERR_UK_SERROR);
+    ret = hdb_sqlite_begin(context, hsdb);
     if(ret != SQLITE_OK) {
 	ret = HDB_ERR_UK_SERROR;
         krb5_set_error_message(context, ret,
@@ -722,11 +755,11 @@ commit:
     sqlite3_reset(get_ids);
 
     if ((flags & HDB_F_PRECHECK)) {
-        (void) hdb_sqlite_exec_stmt(context, hsdb, "ROLLBACK", 0);
+        hdb_sqlite_rollback(context, hsdb);
         return 0;
     }
 
-    ret = hdb_sqlite_exec_stmt(context, hsdb, "COMMIT", HDB_ERR_UK_SERROR);
+    ret = hdb_sqlite_commit(context, hsdb);
     if(ret != SQLITE_OK)
 	krb5_warnx(context, "hdb-sqlite: COMMIT problem: %ld: %s",
 		   (long)HDB_ERR_UK_SERROR, sqlite3_errmsg(hsdb->db));
@@ -740,7 +773,7 @@ rollback:
     krb5_warnx(context, "hdb-sqlite: store rollback problem: %d: %s",
 	       ret, sqlite3_errmsg(hsdb->db));
 
-    (void) hdb_sqlite_exec_stmt(context, hsdb, "ROLLBACK", 0);
+    hdb_sqlite_rollback(context, hsdb);
     return ret;
 }
 
@@ -816,6 +849,43 @@ hdb_sqlite_set_sync(krb5_context context, HDB *db, int on)
                                 HDB_ERR_UK_SERROR);
 }
 
+/*
+ * A batch is one transaction; see hdb_sqlite_begin().
+ */
+static krb5_error_code
+hdb_sqlite_begin_batch(krb5_context context, HDB *db)
+{
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *)(db->hdb_db);
+    krb5_error_code ret;
+
+    if (hsdb->in_batch)
+        return EINVAL;
+    ret = hdb_sqlite_exec_stmt(context, hsdb, "BEGIN IMMEDIATE TRANSACTION",
+                               HDB_ERR_UK_SERROR);
+    if (ret == 0)
+        hsdb->in_batch = 1;
+    return ret;
+}
+
+static krb5_error_code
+hdb_sqlite_end_batch(krb5_context context, HDB *db, int commit)
+{
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *)(db->hdb_db);
+    krb5_error_code ret;
+
+    if (!hsdb->in_batch)
+        return EINVAL;
+    hsdb->in_batch = 0;
+    if (!commit) {
+        hdb_sqlite_rollback(context, hsdb);
+        return 0;
+    }
+    ret = hdb_sqlite_exec_stmt(context, hsdb, "COMMIT", HDB_ERR_UK_SERROR);
+    if (ret)
+        hdb_sqlite_rollback(context, hsdb);
+    return ret;
+}
+
 /*
  * Not sure if this is needed.
  */
@@ -933,12 +1003,10 @@ hdb_sqlite_remove(krb5_context context, HDB *db,
 
     bind_principal(context, principal, rm, 1);
 
-    ret = hdb_sqlite_exec_stmt(context, hsdb,
-                               "BEGIN IMMEDIATE TRANSACTION",
-                               HDB_ERR_UK_SERROR);
+    ret = hdb_sqlite_begin(context, hsdb);
     if (ret != SQLITE_OK) {
 	ret = HDB_ERR_UK_SERROR;
-        (void) hdb_sqlite_exec_stmt(context, hsdb, "ROLLBACK", 0);
+        hdb_sqlite_rollback(context, hsdb);
         krb5_set_error_message(context, ret,
 			       "SQLite BEGIN TRANSACTION failed: %s",
 			       sqlite3_errmsg(hsdb->db));
@@ -954,7 +1022,7 @@ hdb_sqlite_remove(krb5_context context, HDB *db,
         sqlite3_clear_bindings(get_ids);
         sqlite3_reset(get_ids);
         if (ret == SQLITE_DONE) {
-            (void) hdb_sqlite_exec_stmt(context, hsdb, "ROLLBACK", 0);
+            hdb_sqlite_rollback(context, hsdb);
             return HDB_ERR_NOENTRY;
         }
     }
@@ -963,18 +1031,18 @@ hdb_sqlite_remove(krb5_context context, HDB *db,
     sqlite3_clear_bindings(rm);
     sqlite3_reset(rm);
     if (ret != SQLITE_DONE) {
-        (void) hdb_sqlite_exec_stmt(context, hsdb, "ROLLBACK", 0);
+        hdb_sqlite_rollback(context, hsdb);
 	ret = HDB_ERR_UK_SERROR;
         krb5_set_error_message(context, ret, "sqlite remove failed: %d", ret);
         return ret;
     }
 
     if ((flags & HDB_F_PRECHECK)) {
-        (void) hdb_sqlite_exec_stmt(context, hsdb, "ROLLBACK", 0);
+        hdb_sqlite_rollback(context, hsdb);
         return 0;
     }
 
-    ret = hdb_sqlite_exec_stmt(context, hsdb, "COMMIT", HDB_ERR_UK_SERROR);
+    ret = hdb_sqlite_commit(context, hsdb);
     if (ret != SQLITE_OK)
 	krb5_warnx(context, "hdb-sqlite: COMMIT problem: %ld: %s",
 		   (long)HDB_ERR_UK_SERROR, sqlite3_errmsg(hsdb->db));
@@ -1045,6 +1113,8 @@ hdb_sqlite_create(krb5_context context, HDB **db, const char *filename)
     (*db)->hdb_destroy = hdb_sqlite_destroy;
     (*db)->hdb_rename = hdb_sqlite_rename;
     (*db)->hdb_set_sync = hdb_sqlite_set_sync;
+    (*db)->hdb_begin_batch = hdb_sqlite_begin_batch;
+    (*db)->hdb_end_batch = hdb_sqlite_end_batch;
     (*db)->hdb__get = NULL;
     (*db)->hdb__put = NULL;
     (*db)->hdb__del = NULL;
@@ -72,6 +72,7 @@ enum hdb_lockop{ HDB_RLOCK, HDB_WLOCK };
 #define HDB_CAP_F_HANDLE_PASSWORDS	2
 #define HDB_CAP_F_PASSWORD_UPDATE_KEYS	4
 #define HDB_CAP_F_SHARED_DIRECTORY      8
+#define HDB_CAP_F_CONCURRENT_READERS    16 /* open handles see others' updates */
 
 /* auth status values */
 #define HDB_AUTH_SUCCESS		0
@@ -279,9 +280,25 @@ typedef struct HDB {
      * sync and does an fsync().
      */
     krb5_error_code (*hdb_set_sync)(krb5_context, struct HDB *, int);
+
+    /**
+     * Start a batch: until hdb_end_batch() the backend applies stores and
+     * removes in one transaction, each still succeeding or failing on its
+     * own within it.
+     *
+     * Optional; backends that leave these NULL apply every change as it
+     * is made.
+     */
+    krb5_error_code (*hdb_begin_batch)(krb5_context, struct HDB *);
+
+    /**
+     * End the batch started by hdb_begin_batch(), committing it if
+     * `commit' is non-zero and abandoning it otherwise.
+     */
+    krb5_error_code (*hdb_end_batch)(krb5_context, struct HDB *, int commit);
 }HDB;
 
-#define HDB_INTERFACE_VERSION	10
+#define HDB_INTERFACE_VERSION	11
 
 struct hdb_method {
     int			version;
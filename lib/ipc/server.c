@@ -34,6 +34,9 @@
  */
 
 #include "hi_locl.h"
+#ifndef HAVE_GCD
+#include "heim_threads.h"
+#endif
 #include <assert.h>
 #include <err.h>
 
@@ -482,6 +485,24 @@ struct client {
 #ifndef HAVE_GCD
 static unsigned num_clients = 0;
 static struct client **clients = NULL;
+
+/*
+ * Calls completed by other threads than the one running the loop are
+ * queued here and finished by the loop, which is woken up by a byte
+ * written to wakeup_pipe.
+ */
+struct pending_complete {
+    struct socket_call *sc;
+    int returnvalue;
+    heim_idata reply;
+    struct pending_complete *next;
+};
+
+static HEIMDAL_THREAD_LOCAL int in_process_loop;
+static HEIMDAL_MUTEX pending_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct pending_complete *pending_head = NULL;
+static struct pending_complete **pending_tail = &pending_head;
+static int wakeup_pipe[2] = { -1, -1 };
 #endif
 
 static void handle_read(struct client *);
@@ -722,10 +743,10 @@ output_data(struct client *c, const void *data, size_t len)
     c->flags |= WAITING_WRITE;
 }
 
-static void
-socket_complete(heim_sipc_call ctx, int returnvalue, heim_idata *reply)
+static struct client *
+socket_complete_internal(struct socket_call *sc, int returnvalue,
+			 heim_idata *reply)
 {
-    struct socket_call *sc = (struct socket_call *)ctx;
     struct client *c = sc->c;
 
     /* double complete ? */
@@ -762,7 +783,86 @@ socket_complete(heim_sipc_call ctx, int returnvalue, heim_idata *reply)
     sc->c = NULL; /* so we can catch double complete */
     free(sc);
 
-    maybe_close(c);
+    return c;
+}
+
+#ifndef HAVE_GCD
+
+/*
+ * Queue a completion from another thread for the loop; the reply is
+ * copied since the caller frees it when we return.
+ */
+
+static void
+socket_complete_deferred(struct socket_call *sc, int returnvalue,
+			 heim_idata *reply)
+{
+    struct pending_complete *p;
+
+    p = emalloc(sizeof(*p));
+    p->sc = sc;
+    p->returnvalue = returnvalue;
+    p->reply.length = reply ? reply->length : 0;
+    p->reply.data = NULL;
+    if (p->reply.length) {
+	p->reply.data = emalloc(p->reply.length);
+	memcpy(p->reply.data, reply->data, p->reply.length);
+    }
+    p->next = NULL;
+
+    HEIMDAL_MUTEX_lock(&pending_mutex);
+    *pending_tail = p;
+    pending_tail = &p->next;
+    HEIMDAL_MUTEX_unlock(&pending_mutex);
+
+    /* a full pipe already has the loop woken up */
+    (void) write(wakeup_pipe[1], "", 1);
+}
+
+static void
+run_pending_completions(void)
+{
+    struct pending_complete *p, *next;
+    char buf[64];
+
+    while (read(wakeup_pipe[0], buf, sizeof(buf)) > 0)
+	;
+
+    HEIMDAL_MUTEX_lock(&pending_mutex);
+    p = pending_head;
+    pending_head = NULL;
+    pending_tail = &pending_head;
+    HEIMDAL_MUTEX_unlock(&pending_mutex);
+
+    /* process_loop() closes the clients that are done */
+    for (; p != NULL; p = next) {
+	next = p->next;
+	socket_complete_internal(p->sc, p->returnvalue, &p->reply);
+	free(p->reply.data);
+	free(p);
+    }
+}
+
+#endif
+
+/*
+ * Complete a call; with the poll loop this may be done from any
+ * thread, so that callbacks can hand slow requests to other threads
+ * and return to the loop at once.
+ */
+
+static void
+socket_complete(heim_sipc_call ctx, int returnvalue, heim_idata *reply)
+{
+    struct socket_call *sc = (struct socket_call *)ctx;
+
+#ifndef HAVE_GCD
+    if (!in_process_loop) {
+	socket_complete_deferred(sc, returnvalue, reply);
+	return;
+    }
+#endif
+    maybe_close(socket_complete_internal(sc, returnvalue, reply));
 }
 
 /* remove HTTP %-quoting from buf */
@@ -875,10 +975,12 @@ handle_read(struct client *c)
     assert((c->flags & DOOR_FD) == 0);
 
     if (c->flags & LISTEN_SOCKET) {
-	add_new_socket(c->fd,
-		       WAITING_READ | (c->flags & INHERIT_MASK),
-		       c->callback,
-		       c->userctx);
+	/* take all pending connections, not one per wakeup */
+	while (add_new_socket(c->fd,
+			      WAITING_READ | (c->flags & INHERIT_MASK),
+			      c->callback,
+			      c->userctx) != NULL)
+	    ;
 	return;
     }
 
@@ -986,9 +1088,18 @@ process_loop(void)
     unsigned n;
     unsigned num_fds;
 
+    in_process_loop = 1;
+    if (pipe(wakeup_pipe) == -1)
+	err(1, "pipe(2) failed");
+    for (n = 0; n < 2; n++) {
+	rk_cloexec(wakeup_pipe[n]);
+	fcntl(wakeup_pipe[n], F_SETFL,
+	      fcntl(wakeup_pipe[n], F_GETFL, 0) | O_NONBLOCK);
+    }
+
     while (num_clients > 0) {
 
-	fds = malloc(num_clients * sizeof(fds[0]));
+	fds = malloc((num_clients + 1) * sizeof(fds[0]));
 	if(fds == NULL)
 	    abort();
 
@@ -1001,16 +1112,25 @@ process_loop(void)
 		fds[n].events |= POLLIN;
 	    if (clients[n]->flags & WAITING_WRITE)
 		fds[n].events |= POLLOUT;
+	    /* waiting for calls to complete, don't spin on POLLHUP */
+	    if (fds[n].events == 0)
+		fds[n].fd = -1;
 
 	    fds[n].revents = 0;
 	}
+	fds[num_fds].fd = wakeup_pipe[0];
+	fds[num_fds].events = POLLIN;
+	fds[num_fds].revents = 0;
 
-	while (poll(fds, num_fds, -1) == -1) {
+	while (poll(fds, num_fds + 1, -1) == -1) {
             if (errno == EINTR || errno == EAGAIN)
                 continue;
             err(1, "poll(2) failed");
         }
 
+	if (fds[num_fds].revents & POLLIN)
+	    run_pending_completions();
+
 	for (n = 0 ; n < num_fds; n++) {
 	    if (clients[n] == NULL)
 		continue;
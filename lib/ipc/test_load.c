@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Load test for the socket server: thousands of clients connect at
+ * once to a unix socket service and make one call each.  The first
+ * few calls are slow: the service hands them to another thread that
+ * holds on to them, like a request waiting for a KDC, and completes
+ * them only once every other client has its reply.  This times out if
+ * the loop stalls on the calls in progress, or misses their completion
+ * from the other thread while nothing else happens on the sockets.
+ */
+
+#include "config.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/poll.h>
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <krb5-types.h>
+#include <heim-ipc.h>
+#include <getarg.h>
+#include <err.h>
+#include <roken.h>
+
+#define SERVICE "org.h5l.test-load"
+
+static int num_clients = 2000;
+static int num_slow = 32;
+static int timeout_sec = 60;
+static int help_flag;
+static int version_flag;
+
+static struct getargs args[] = {
+    {	"clients",	'n',	arg_integer, &num_clients,
+	"number of concurrent clients", "number" },
+    {	"slow",		's',	arg_integer, &num_slow,
+	"number of them making slow calls", "number" },
+    {	"timeout",	't',	arg_integer, &timeout_sec,
+	"seconds to wait for all replies", "seconds" },
+    {	"help",		'h',	arg_flag,   &help_flag,    NULL, NULL },
+    {	"version",	'v',	arg_flag,   &version_flag, NULL, NULL }
+};
+
+static int num_args = sizeof(args) / sizeof(args[0]);
+
+static void
+usage(int ret)
+{
+    arg_printusage (args, num_args, NULL, "");
+    exit (ret);
+}
+
+struct slow_call {
+    heim_idata req;
+    heim_ipc_complete complete;
+    heim_sipc_call cctx;
+    struct slow_call *next;
+};
+
+static pthread_mutex_t slow_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slow_cond = PTHREAD_COND_INITIALIZER;
+static struct slow_call *slow_head;
+static int slow_released;
+
+static void
+load_service(void *ctx, const heim_idata *req,
+	     const heim_icred cred,
+	     heim_ipc_complete complete,
+	     heim_sipc_call cctx)
+{
+    struct slow_call *s;
+    heim_idata rep;
+
+    if (req->length < 4 || memcmp(req->data, "slow", 4) != 0) {
+	rep = *req;
+	(*complete)(cctx, 0, &rep);
+	return;
+    }
+
+    s = emalloc(sizeof(*s));
+    s->req.length = req->length;
+    s->req.data = emalloc(req->length);
+    memcpy(s->req.data, req->data, req->length);
+    s->complete = complete;
+    s->cctx = cctx;
+
+    pthread_mutex_lock(&slow_mutex);
+    s->next = slow_head;
+    slow_head = s;
+    pthread_cond_signal(&slow_cond);
+    pthread_mutex_unlock(&slow_mutex);
+}
+
+static void *
+slow_thread(void *arg)
+{
+    struct slow_call *s;
+
+    pthread_mutex_lock(&slow_mutex);
+    while (!slow_released)
+	pthread_cond_wait(&slow_cond, &slow_mutex);
+    pthread_mutex_unlock(&slow_mutex);
+
+    /* let the loop go idle, so only the completions can wake it up */
+    usleep(100000);
+
+    for (;;) {
+	pthread_mutex_lock(&slow_mutex);
+	while (slow_head == NULL)
+	    pthread_cond_wait(&slow_cond, &slow_mutex);
+	s = slow_head;
+	slow_head = s->next;
+	pthread_mutex_unlock(&slow_mutex);
+
+	(*s->complete)(s->cctx, 0, &s->req);
+	free(s->req.data);
+	free(s);
+    }
+    return NULL;
+}
+
+static void *
+server_thread(void *arg)
+{
+    heim_ipc_main();
+    return NULL;
+}
+
+#define REQ_SIZE 32
+
+struct load_client {
+    int fd;
+    char req[REQ_SIZE];
+    size_t reqlen;
+    unsigned char rep[8 + REQ_SIZE];
+    size_t replen;
+    int done;
+};
+
+static double
+elapsed_ms(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000.0 +
+	(now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+/* read what there is of a reply; -1 if it's wrong */
+static int
+read_reply(struct load_client *c)
+{
+    uint32_t len, rv;
+    ssize_t n;
+
+    n = read(c->fd, c->rep + c->replen, sizeof(c->rep) - c->replen);
+    if (n <= 0)
+	return n == 0 || errno != EAGAIN ? -1 : 0;
+    c->replen += n;
+    if (c->replen < 8)
+	return 0;
+    memcpy(&len, c->rep, 4);
+    memcpy(&rv, c->rep + 4, 4);
+    len = ntohl(len);
+    rv = ntohl(rv);
+    if (rv != 0 || len != c->reqlen)
+	return -1;
+    if (c->replen < 8 + len)
+	return 0;
+    if (memcmp(c->rep + 8, c->req, len) != 0)
+	return -1;
+    c->done = 1;
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct load_client *clients;
+    struct sockaddr_un un;
+    struct pollfd *fds;
+    struct timeval start;
+    char dir[] = "test_load-XXXXXX";
+    pthread_t thr;
+    heim_sipc u;
+    int optidx = 0;
+    int i, n, ret, left, fast_left;
+    double fast_ms = 0;
+
+    setprogname(argv[0]);
+
+    if (getarg(args, num_args, argc, argv, &optidx))
+	usage(1);
+
+    if (help_flag)
+	usage(0);
+
+    if (version_flag) {
+	print_version(NULL);
+	exit(0);
+    }
+
+#ifdef HAVE_SETRLIMIT
+    {
+	struct rlimit rl;
+
+	/* each client takes a descriptor here and one in the server */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+	    rl.rlim_cur = rl.rlim_max;
+	    setrlimit(RLIMIT_NOFILE, &rl);
+	    getrlimit(RLIMIT_NOFILE, &rl);
+	    if (rl.rlim_cur != RLIM_INFINITY &&
+		(rlim_t)num_clients * 2 + 64 > rl.rlim_cur) {
+		num_clients = (rl.rlim_cur - 64) / 2;
+		warnx("only %d clients for the file descriptor limit",
+		      num_clients);
+	    }
+	}
+    }
+#endif
+    if (num_slow > num_clients)
+	num_slow = num_clients;
+
+    if (mkdtemp(dir) == NULL)
+	err(1, "mkdtemp");
+    setenv("HEIM_IPC_DIR", dir, 1);
+
+    ret = heim_sipc_service_unix(SERVICE, load_service, NULL, &u);
+    if (ret)
+	errx(1, "heim_sipc_service_unix: %d", ret);
+    if (pthread_create(&thr, NULL, slow_thread, NULL) != 0 ||
+	pthread_create(&thr, NULL, server_thread, NULL) != 0)
+	errx(1, "pthread_create");
+
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    snprintf(un.sun_path, sizeof(un.sun_path), "%s/.heim_%s-socket",
+	     dir, SERVICE);
+
+    clients = ecalloc(num_clients, sizeof(clients[0]));
+    fds = ecalloc(num_clients, sizeof(fds[0]));
+
+    gettimeofday(&start, NULL);
+
+    /* the slow calls go first, so they are pending for all the others */
+    for (i = 0; i < num_clients; i++) {
+	struct load_client *c = &clients[i];
+	uint32_t len;
+
+	c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (c->fd < 0)
+	    err(1, "socket");
+	if (connect(c->fd, (struct sockaddr *)&un, sizeof(un)) < 0)
+	    err(1, "connect %d", i);
+	c->reqlen = snprintf(c->req, sizeof(c->req), "%s %d",
+			     i < num_slow ? "slow" : "fast", i);
+	len = htonl(c->reqlen);
+	if (net_write(c->fd, &len, sizeof(len)) != sizeof(len) ||
+	    net_write(c->fd, c->req, c->reqlen) != (ssize_t)c->reqlen)
+	    err(1, "write %d", i);
+	socket_set_nonblocking(c->fd, 1);
+    }
+
+    left = num_clients;
+    fast_left = num_clients - num_slow;
+    while (left > 0) {
+	if (elapsed_ms(&start) > timeout_sec * 1000.0)
+	    errx(1, "timed out with %d fast and %d slow calls left",
+		 fast_left, left - fast_left);
+
+	for (i = n = 0; i < num_clients; i++) {
+	    if (clients[i].done)
+		continue;
+	    fds[n].fd = clients[i].fd;
+	    fds[n].events = POLLIN;
+	    fds[n].revents = 0;
+	    n++;
+	}
+	if (poll(fds, n, 1000) < 0 && errno != EINTR)
+	    err(1, "poll");
+
+	for (i = n = 0; i < num_clients; i++) {
+	    struct load_client *c = &clients[i];
+
+	    if (c->done)
+		continue;
+	    if (fds[n++].revents == 0)
+		continue;
+	    if (read_reply(c) < 0)
+		errx(1, "bad reply to call %d", i);
+	    if (!c->done)
+		continue;
+	    left--;
+	    if (i < num_slow)
+		continue;
+	    if (--fast_left == 0) {
+		fast_ms = elapsed_ms(&start);
+		pthread_mutex_lock(&slow_mutex);
+		slow_released = 1;
+		pthread_cond_signal(&slow_cond);
+		pthread_mutex_unlock(&slow_mutex);
+	    }
+	}
+    }
+
+    printf("%d clients: %d calls answered in %.1f ms "
+	   "with %d slow calls pending, all in %.1f ms\n",
+	   num_clients, num_clients - num_slow, fast_ms, num_slow,
+	   elapsed_ms(&start));
+
+    for (i = 0; i < num_clients; i++)
+	close(clients[i].fd);
+    unlink(un.sun_path);
+    rmdir(dir);
+
+    return 0;
+}
@@ -62,9 +62,13 @@ enum iprop_cmd { I_HAVE = 1,
 		 NOW_YOU_HAVE = 5,
 		 ARE_YOU_THERE = 6,
 		 I_AM_HERE = 7,
-		 YOU_HAVE_LAST_VERSION = 8
+		 YOU_HAVE_LAST_VERSION = 8,
+		 MANY_PRINCS = 9
 };
 
+/* Capabilities a slave may send after its version in an I_HAVE */
+#define IPROP_CAP_MANY_PRINCS	0x1
+
 extern sig_atomic_t exit_flag;
 void setup_signal(void);
 
@@ -33,10 +33,18 @@
 
 #include "iprop.h"
 #include <rtbl.h>
+#include <parse_bytes.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 static krb5_log_facility *log_facility;
 
 static int verbose;
+static int stream_dumps;
+static const char *max_snapshot_str = "1 GB";
+static off_t max_snapshot_size;
+static const char *event_loop_str = "select";
 
 static const char *slave_stats_file;
 static const char *slave_stats_temp_file;
@@ -123,6 +131,37 @@ make_listen_socket (krb5_context context, const char *port_str)
 }
 
 
+/*
+ * With --stream-dumps complete databases are sent from a snapshot of the
+ * HDB rather than from the dump file.  A snapshot is a list of chunks,
+ * each a MANY_PRINCS opcode followed by a run of length-prefixed entries,
+ * taken in one pass over the HDB and shared by all the slaves that start
+ * receiving a complete database while it is current.  The chunks are
+ * spilled to an unlinked temporary file as they are produced, so only
+ * one chunk per slave being sent to is ever held in memory.  The file
+ * goes away when the last slave is done with the snapshot.  A database
+ * that would make the file larger than --max-snapshot-size is sent from
+ * the dump file instead.
+ */
+#define DUMP_CHUNK_SIZE (256 * 1024)
+
+struct dump_chunk {
+    off_t           off;
+    size_t          len;
+};
+
+struct dump_snapshot {
+    uint32_t            vno;
+    time_t              taken;
+    unsigned int        refs;
+    int                 fd;
+    off_t               size;
+    size_t              nchunks;
+    struct dump_chunk   *chunks;
+};
+
+static struct dump_snapshot *current_snapshot;
+
 struct slave {
     krb5_socket_t fd;
     struct sockaddr_in addr;
@@ -136,6 +175,12 @@ struct slave {
 #define SLAVE_F_DEAD	0x1
 #define SLAVE_F_AYT	0x2
 #define SLAVE_F_READY   0x4
+#define SLAVE_F_MANY    0x8     /* takes MANY_PRINCS */
+    unsigned int ready;         /* what the event loop found fd ready for */
+#define SLAVE_R_READ    0x1
+#define SLAVE_R_WRITE   0x2
+    uint32_t epoll_events;      /* what we asked epoll to watch fd for */
+    unsigned long stalls;       /* times sending to it would have blocked */
     /*
      * We'll use non-blocking I/O so no slave can hold us back.
      *
@@ -152,6 +197,11 @@ struct slave {
         /* For send_complete() we need an sp as part of the tail */
         krb5_storage    *dump;
         uint32_t        vno;
+        /* Or, with --stream-dumps, a snapshot and our place in it */
+        struct dump_snapshot *snap;
+        size_t          chunk;
+        krb5_data       chunk_data;     /* chunk being sent as ONE_PRINCs */
+        size_t          chunk_off;
     } tail;
     struct {
         uint8_t         header_buf[4];
@@ -232,11 +282,39 @@ slave_gone_p (slave *s)
     return 0;
 }
 
+static void
+snapshot_free(struct dump_snapshot *snap)
+{
+    if (snap->fd != -1)
+        close(snap->fd);
+    free(snap->chunks);
+    free(snap);
+}
+
+/* Stop sending a snapshot to s */
+static void
+snapshot_detach(slave *s)
+{
+    struct dump_snapshot *snap = s->tail.snap;
+
+    if (snap == NULL)
+        return;
+    krb5_data_free(&s->tail.chunk_data);
+    s->tail.snap = NULL;
+    if (--snap->refs > 0)
+        return;
+    if (snap == current_snapshot)
+        current_snapshot = NULL;
+    snapshot_free(snap);
+}
+
 static void
 slave_dead(krb5_context context, slave *s)
 {
     krb5_warnx(context, "slave %s dead", s->name);
 
+    snapshot_detach(s);
+
     if (!rk_IS_BAD_SOCKET(s->fd)) {
 	rk_closesocket (s->fd);
 	s->fd = rk_INVALID_SOCKET;
@@ -261,6 +339,7 @@ remove_slave (krb5_context context, slave *s, slave **root)
     krb5_data_free(&s->input.packet);
     krb5_data_free(&s->tail.packet);
     krb5_storage_free(s->tail.dump);
+    snapshot_detach(s);
 
     for (p = root; *p; p = &(*p)->next)
 	if (*p == s) {
@@ -270,7 +349,7 @@ remove_slave (krb5_context context, slave *s, slave **root)
     free (s);
 }
 
-static void
+static slave *
 add_slave (krb5_context context, krb5_keytab keytab, slave **root,
 	   krb5_socket_t fd)
 {
@@ -284,7 +363,7 @@ add_slave (krb5_context context, krb5_keytab keytab, slave **root,
     s = calloc(1, sizeof(*s));
     if (s == NULL) {
 	krb5_warnx (context, "add_slave: no memory");
-	return;
+	return NULL;
     }
     s->name = NULL;
     s->ac = NULL;
@@ -292,6 +371,7 @@ add_slave (krb5_context context, krb5_keytab keytab, slave **root,
     s->tail.header.data = NULL;
     s->tail.packet.data = NULL;
     s->tail.dump = NULL;
+    s->tail.snap = NULL;
 
     addr_len = sizeof(s->addr);
     s->fd = accept (fd, (struct sockaddr *)&s->addr, &addr_len);
@@ -331,9 +411,9 @@ add_slave (krb5_context context, krb5_keytab keytab, slave **root,
     socket_set_nonblocking(s->fd, 1);
 
     /*
-     * We write message lengths separately from the payload, and may do
-     * back-to-back small writes when flushing pending input and then a new
-     * update.  Avoid Nagle delays.
+     * What remains of a message is written separately from its length, and
+     * we may do back-to-back small writes when flushing pending input and
+     * then a new update.  Avoid Nagle delays.
      */
 #if defined(IPPROTO_TCP) && defined(TCP_NODELAY)
     {
@@ -385,9 +465,10 @@ add_slave (krb5_context context, krb5_keytab keytab, slave **root,
     slave_seen(s);
     s->next = *root;
     *root = s;
-    return;
+    return s;
 error:
     remove_slave(context, s, root);
+    return NULL;
 }
 
 static int
@@ -515,9 +596,14 @@ write_dump (krb5_context context, krb5_storage *dump,
     /*
      * We don't need to fsync(2) after the real version is written as
      * it is not a disaster if it doesn't make it to disk if we crash.
-     * After all, we'll just create a new dumpfile.
+     * After all, we'll just create a new dumpfile.  The storage is
+     * buffered though, so do write it out before the caller gives up
+     * its exclusive lock.
      */
 
+    if (ret == 0 && krb5_storage_seek(dump, 0, SEEK_CUR) == -1)
+        ret = errno;
+
     if (ret == 0)
         krb5_warnx(context, "wrote new dumpfile (version %u)",
                    current_version);
@@ -528,8 +614,168 @@ write_dump (krb5_context context, krb5_storage *dump,
     return ret;
 }
 
+struct snapshot_builder {
+    struct dump_snapshot    *snap;
+    krb5_storage            *sp;
+};
+
+/* Write the entries collected so far out to the snapshot file as a chunk */
 static int
-mk_priv_tail(krb5_context context, slave *s, krb5_data *data)
+snapshot_add_chunk(krb5_context context, struct snapshot_builder *b)
+{
+    struct dump_snapshot *snap = b->snap;
+    struct dump_chunk *chunks;
+    krb5_data data;
+    ssize_t bytes;
+    int ret;
+
+    ret = krb5_storage_to_data(b->sp, &data);
+    if (ret)
+        return ret;
+    if (max_snapshot_size > 0 &&
+        snap->size + (off_t)data.length > max_snapshot_size) {
+        krb5_data_free(&data);
+        return EFBIG;
+    }
+    chunks = realloc(snap->chunks, (snap->nchunks + 1) * sizeof(*chunks));
+    if (chunks == NULL) {
+        krb5_data_free(&data);
+        return krb5_enomem(context);
+    }
+    snap->chunks = chunks;
+    bytes = pwrite(snap->fd, data.data, data.length, snap->size);
+    ret = bytes < 0 ? errno : (size_t)bytes != data.length ? EIO : 0;
+    krb5_data_free(&data);
+    if (ret)
+        return ret;
+    chunks[snap->nchunks].off = snap->size;
+    chunks[snap->nchunks].len = bytes;
+    snap->size += bytes;
+    snap->nchunks++;
+
+    /* Keep the MANY_PRINCS opcode for the next chunk */
+    ret = krb5_storage_truncate(b->sp, 4);
+    if (ret == 0 && krb5_storage_seek(b->sp, 4, SEEK_SET) != 4)
+        ret = errno;
+    return ret;
+}
+
+static int
+snapshot_one(krb5_context context, HDB *db, hdb_entry_ex *entry, void *v)
+{
+    struct snapshot_builder *b = v;
+    krb5_error_code ret;
+    krb5_data data;
+
+    ret = hdb_entry2value(context, &entry->entry, &data);
+    if (ret)
+        return ret;
+    ret = krb5_store_data(b->sp, data);
+    krb5_data_free(&data);
+    if (ret == 0 && krb5_storage_seek(b->sp, 0, SEEK_CUR) >= DUMP_CHUNK_SIZE)
+        ret = snapshot_add_chunk(context, b);
+    return ret;
+}
+
+/* Read chunk i of a snapshot back from its file */
+static int
+snapshot_read_chunk(struct dump_snapshot *snap, size_t i, krb5_data *data)
+{
+    struct dump_chunk *c = &snap->chunks[i];
+    ssize_t bytes;
+    int ret;
+
+    ret = krb5_data_alloc(data, c->len);
+    if (ret)
+        return ret;
+    bytes = pread(snap->fd, data->data, c->len, c->off);
+    if (bytes >= 0 && (size_t)bytes == c->len)
+        return 0;
+    ret = bytes < 0 ? errno : EIO;
+    krb5_data_free(data);
+    return ret;
+}
+
+/*
+ * Take a snapshot of the HDB, in one hdb_foreach() pass (with LMDB that's
+ * one read transaction), for --stream-dumps.  Returns EFBIG if it would
+ * be larger than --max-snapshot-size.
+ */
+static krb5_error_code
+snapshot_take(krb5_context context, const char *database,
+              uint32_t current_version, struct dump_snapshot **snapp)
+{
+    struct snapshot_builder b;
+    krb5_error_code ret;
+    char *fn = NULL;
+    HDB *db;
+
+    *snapp = NULL;
+    if (asprintf(&fn, "%s/ipropd.snapshot.XXXXXX", hdb_db_dir(context)) == -1)
+        fn = NULL;
+    b.snap = calloc(1, sizeof(*b.snap));
+    b.sp = krb5_storage_emem();
+    if (fn == NULL || b.snap == NULL || b.sp == NULL) {
+        krb5_warnx(context, "snapshot_take: out of memory");
+        free(fn);
+        free(b.snap);
+        krb5_storage_free(b.sp);
+        return ENOMEM;
+    }
+    b.snap->fd = mkstemp(fn);
+    if (b.snap->fd == -1) {
+        ret = errno;
+        krb5_warn(context, ret, "snapshot_take: %s", fn);
+        free(fn);
+        free(b.snap);
+        krb5_storage_free(b.sp);
+        return ret;
+    }
+    /* Nobody else needs to see it; it's gone once we close it */
+    (void) unlink(fn);
+    free(fn);
+    rk_cloexec(b.snap->fd);
+
+    ret = hdb_create (context, &db, database);
+    if (ret)
+	krb5_err (context, IPROPD_RESTART, ret, "hdb_create: %s", database);
+    ret = db->hdb_open (context, db, O_RDONLY, 0);
+    if (ret)
+	krb5_err (context, IPROPD_RESTART, ret, "db->open");
+
+    ret = krb5_store_uint32(b.sp, MANY_PRINCS);
+    if (ret == 0)
+        ret = hdb_foreach(context, db, HDB_F_ADMIN_DATA, snapshot_one, &b);
+    if (ret == 0 && krb5_storage_seek(b.sp, 0, SEEK_CUR) > 4)
+        ret = snapshot_add_chunk(context, &b);
+
+    (*db->hdb_close)(context, db);
+    (*db->hdb_destroy)(context, db);
+    krb5_storage_free(b.sp);
+
+    if (ret == EFBIG) {
+        krb5_warnx(context, "HDB snapshot (version %u) would be larger than "
+                   "%s", current_version, max_snapshot_str);
+        snapshot_free(b.snap);
+        return ret;
+    }
+    if (ret) {
+        krb5_warn(context, ret, "failed to take HDB snapshot (version %u)",
+                  current_version);
+        snapshot_free(b.snap);
+        return ret;
+    }
+
+    b.snap->vno = current_version;
+    b.snap->taken = time(NULL);
+    krb5_warnx(context, "took HDB snapshot (version %u, %lu chunks)",
+               current_version, (unsigned long)b.snap->nchunks);
+    *snapp = b.snap;
+    return 0;
+}
+
+static int
+mk_priv_tail(krb5_context context, slave *s, const krb5_data *data)
 {
     uint32_t len;
     int ret;
@@ -548,7 +794,8 @@ mk_priv_tail(krb5_context context, slave *s, krb5_data *data)
 static int
 have_tail(slave *s)
 {
-    return s->tail.header.length || s->tail.packet.length || s->tail.dump;
+    return s->tail.header.length || s->tail.packet.length || s->tail.dump ||
+           s->tail.snap;
 }
 
 static int
@@ -560,6 +807,84 @@ more_diffs(slave *s)
 #define SEND_COMPLETE_MAX_RECORDS 50
 #define SEND_DIFFS_MAX_RECORDS 50
 
+/*
+ * Make the next message of a snapshot being sent to s the tail: a whole
+ * chunk as one MANY_PRINCS if the slave takes those, else the chunk's
+ * next entry as a ONE_PRINC, and finally the NOW_YOU_HAVE.
+ *
+ * Returns HEIM_ERR_EOF when the snapshot has been sent.
+ */
+static int
+snapshot_next(krb5_context context, slave *s)
+{
+    struct dump_snapshot *snap = s->tail.snap;
+    krb5_data *c;
+    unsigned char *p;
+    krb5_data data;
+    uint8_t buf[8];
+    size_t rem;
+    uint32_t len;
+    int ret;
+
+    if (s->tail.chunk > snap->nchunks) {
+        s->version = snap->vno;
+        snapshot_detach(s);
+        return HEIM_ERR_EOF;
+    }
+
+    if (s->tail.chunk == snap->nchunks) {
+        _krb5_put_int(buf, NOW_YOU_HAVE, 4);
+        _krb5_put_int(buf + 4, snap->vno, 4);
+        data.data = buf;
+        data.length = sizeof(buf);
+        s->tail.chunk++;
+        return mk_priv_tail(context, s, &data);
+    }
+
+    if (s->flags & SLAVE_F_MANY) {
+        ret = snapshot_read_chunk(snap, s->tail.chunk, &data);
+        if (ret)
+            return ret;
+        ret = mk_priv_tail(context, s, &data);
+        krb5_data_free(&data);
+        if (ret == 0)
+            s->tail.chunk++;
+        return ret;
+    }
+
+    c = &s->tail.chunk_data;
+    if (c->length == 0) {
+        ret = snapshot_read_chunk(snap, s->tail.chunk, c);
+        if (ret)
+            return ret;
+    }
+    p = (unsigned char *)c->data + s->tail.chunk_off;
+    rem = c->length - s->tail.chunk_off;
+    if (rem < 4)
+        return EINVAL;
+    len = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+          ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+    if (len > rem - 4)
+        return EINVAL;
+    ret = krb5_data_alloc(&data, len + 4);
+    if (ret)
+        return ret;
+    _krb5_put_int(data.data, ONE_PRINC, 4);
+    memcpy((char *)data.data + 4, p + 4, len);
+    ret = mk_priv_tail(context, s, &data);
+    krb5_data_free(&data);
+    if (ret)
+        return ret;
+
+    s->tail.chunk_off += 4 + len;
+    if (s->tail.chunk_off == c->length) {
+        krb5_data_free(c);
+        s->tail.chunk++;
+        s->tail.chunk_off = 4;
+    }
+    return 0;
+}
+
 static int
 send_tail(krb5_context context, slave *s)
 {
@@ -583,17 +908,30 @@ send_tail(krb5_context context, slave *s)
             return 0;
 
         if (s->tail.header.length) {
-            bytes = krb5_net_write(context, &s->fd,
-                                   s->tail.header.data,
-                                   s->tail.header.length);
+            /* Send the length and (as much as we can of) the message at once */
+            struct iovec iov[2];
+            size_t hlen = s->tail.header.length;
+
+            iov[0].iov_base = s->tail.header.data;
+            iov[0].iov_len = hlen;
+            iov[1].iov_base = (char *)s->tail.packet.data + s->tail.packet_off;
+            iov[1].iov_len = s->tail.packet.length - s->tail.packet_off;
+            do {
+                bytes = writev(s->fd, iov, 2);
+            } while (bytes < 0 && errno == EINTR);
             if (bytes < 0)
                 goto err;
 
-            s->tail.header.length -= bytes;
-            s->tail.header.data = (char *)s->tail.header.data + bytes;
-            rem = s->tail.header.length;
-            if (rem)
+            if ((size_t)bytes < hlen) {
+                s->tail.header.length -= bytes;
+                s->tail.header.data = (char *)s->tail.header.data + bytes;
+                rem = s->tail.header.length;
                 goto ewouldblock;
+            }
+            s->tail.header.length = 0;
+            s->tail.packet_off += bytes - hlen;
+            if ((size_t)bytes > hlen)
+                slave_seen(s);
         }
 
         if (s->tail.packet.length) {
@@ -613,6 +951,18 @@ send_tail(krb5_context context, slave *s)
             s->tail.packet_off = 0;
         }
 
+        if (s->tail.snap != NULL) {
+            ret = snapshot_next(context, s);
+            if (ret == 0)
+                continue;
+            if (ret == HEIM_ERR_EOF)
+                return 0;
+            krb5_warn(context, ret, "failed to make and send a KRB-PRIV to %s",
+                      s->name);
+            slave_dead(context, s);
+            return ret;
+        }
+
         if (s->tail.dump == NULL)
             return 0;
 
@@ -643,7 +993,7 @@ send_tail(krb5_context context, slave *s)
         return ret;
     }
 
-    if (ret == 0 && s->tail.dump != NULL)
+    if (ret == 0 && (s->tail.dump != NULL || s->tail.snap != NULL))
         return EWOULDBLOCK;
 
 err:
@@ -655,12 +1005,54 @@ err:
     }
 
 ewouldblock:
+    s->stalls++;
     if (verbose)
         krb5_warnx(context, "would block writing %llu bytes to slave %s",
                    (unsigned long long)rem, s->name);
     return EWOULDBLOCK;
 }
 
+/*
+ * send_complete() for --stream-dumps: share the current snapshot if it's
+ * still whole and recent enough, else take a new one.
+ */
+static int
+send_complete_stream(krb5_context context, slave *s, const char *database,
+                     uint32_t current_version, uint32_t oldest_version,
+                     uint32_t initial_log_tstamp)
+{
+    struct dump_snapshot *snap = current_snapshot;
+    krb5_error_code ret;
+    krb5_data data;
+    uint8_t buf[4];
+
+    if (snap == NULL || snap->taken <= initial_log_tstamp ||
+        snap->vno < oldest_version || snap->vno > current_version) {
+        /* Slaves still sending the old one keep it until they're done */
+        current_snapshot = NULL;
+        if (verbose)
+            krb5_warnx(context, "send_complete: taking HDB snapshot");
+        ret = snapshot_take(context, database, current_version, &snap);
+        if (ret)
+            return ret;
+        current_snapshot = snap;
+    }
+
+    snap->refs++;
+    s->tail.snap = snap;
+    s->tail.chunk = 0;
+    s->tail.chunk_off = 4;
+
+    _krb5_put_int(buf, TELL_YOU_EVERYTHING, 4);
+    data.data = buf;
+    data.length = sizeof(buf);
+    if (mk_priv_tail(context, s, &data) != 0) {
+        slave_dead(context, s);
+        return EINVAL;
+    }
+    return send_tail(context, s);
+}
+
 static int
 send_complete(krb5_context context, slave *s, const char *database,
 	      uint32_t current_version, uint32_t oldest_version,
@@ -673,6 +1065,17 @@ send_complete(krb5_context context, slave *s, const char *database,
     struct stat st;
     char *dfn;
 
+    if (stream_dumps) {
+        ret = send_complete_stream(context, s, database, current_version,
+                                   oldest_version, initial_log_tstamp);
+        if (ret != EFBIG)
+            return ret;
+        /* The database has outgrown snapshots; don't take any more */
+        krb5_warnx(context, "sending complete databases from the dump "
+                   "file from now on");
+        stream_dumps = 0;
+    }
+
     ret = asprintf(&dfn, "%s/ipropd.dumpfile", hdb_db_dir(context));
     if (ret == -1 || !dfn)
 	return krb5_enomem(context);
@@ -686,10 +1089,10 @@ send_complete(krb5_context context, slave *s, const char *database,
     }
     free(dfn);
 
-    dump = krb5_storage_from_fd(fd);
+    dump = krb5_storage_buffered_from_fd(fd);
     if (!dump) {
 	ret = errno;
-	krb5_warn(context, ret, "krb5_storage_from_fd");
+	krb5_warn(context, ret, "krb5_storage_buffered_from_fd");
 	goto done;
     }
 
@@ -792,7 +1195,7 @@ send_complete(krb5_context context, slave *s, const char *database,
      * (which we may have just created), so we are reading to start sending
      * the data down the wire.
      *
-     * Note: (krb5_storage_from_fd() dup()'s the fd)
+     * Note: (krb5_storage_buffered_from_fd() dup()'s the fd)
      */
 
     s->tail.dump = dump;
@@ -1007,45 +1410,33 @@ get_left(kadm5_server_context *server_context, slave *s, krb5_storage *sp,
                 return left;
         }
 
-        if (krb5_storage_seek(sp, pos, SEEK_SET) != pos)
+        /*
+         * Otherwise look the slave's successor entry up in the log's index.
+         * That's a binary search, so it's cheap enough to do while holding
+         * the lock.
+         */
+        ret = kadm5_log_goto_indexed_version(server_context, sp,
+                                             s->version + 1);
+        if (ret == 0) {
+            if ((left = krb5_storage_seek(sp, 0, SEEK_CUR)) <= 0)
+                goto err;
+            break;
+        }
+        if (ret != ENOENT)
             goto err;
 
         /*
-         * Drop the lock and try to find the left entry by seeking backward
-         * from the end of the end of the log.  If we succeed, re-acquire the
-         * lock, update "next_diff", and retry the fast-path.
+         * The index doesn't have it.  Drop the lock and walk backward from
+         * the end of the log.  If we succeed, re-acquire the lock, update
+         * "next_diff", and retry the fast-path.
          */
         flock(log_fd, LOCK_UN);
 
-        /* Slow path: seek backwards, entry by entry, from the end */
-        for (;;) {
-            enum kadm_ops op;
-            uint32_t len;
-
-            ret = kadm5_log_previous(context, sp, &ver, NULL, &op, &len);
-            if (ret)
-                return -1;
-            left = krb5_storage_seek(sp, -16, SEEK_CUR);
-            if (left < 0)
-                return left;
-            if (ver == s->version + 1)
-                break;
-
-            /*
-             * We don't expect to reach the slave's version, unless the log
-             * has been modified after we released the lock.
-             */
-            if (ver == s->version) {
-                krb5_warnx(context, "iprop log truncated while sending diffs "
-                           "to slave??  ver = %lu", (unsigned long)ver);
-                return -1;
-            }
-
-            /* If we've reached the uber record, send the complete database */
-            if (left == 0 || (ver == 0 && op == kadm_nop))
-                return 0;
-        }
-        assert(ver == s->version + 1);
+        ret = kadm5_log_goto_version(server_context, sp, s->version + 1);
+        if (ret == HEIM_ERR_EOF)
+            return 0;   /* The slave's version is no longer in the log */
+        if (ret != 0 || (left = krb5_storage_seek(sp, 0, SEEK_CUR)) <= 0)
+            return -1;
 
         /* Set up the fast-path pre-conditions */
         s->next_diff.last_version_sent = s->version;
@@ -1059,11 +1450,18 @@ get_left(kadm5_server_context *server_context, slave *s, krb5_storage *sp,
          *
          * We just updated the fast path pre-conditions, so unless a log
          * truncation event happens between the point where we dropped the lock
-         * and the point where we rearcuire it above, we will hit the fast
+         * and the point where we reacquire it above, we will hit the fast
          * path.
          */
     }
 
+    /* Set up the fast-path pre-conditions */
+    s->next_diff.last_version_sent = s->version;
+    s->next_diff.off_next_version = left;
+    s->next_diff.initial_version = *initial_verp;
+    s->next_diff.initial_tstamp = *initial_timep;
+    return left;
+
  err:
     flock(log_fd, LOCK_UN);
     return -1;
@@ -1104,6 +1502,106 @@ get_right(krb5_context context, int log_fd, krb5_storage *sp,
     return right;
 }
 
+/*
+ * Slaves at the same version get the same diffs, so we keep the last few
+ * batches of diffs read from the log and share them: the log is read once
+ * for all the slaves at a version, though each still gets its own KRB-PRIV.
+ *
+ * The cache is only good for one current_version, and is cleared when the
+ * log file is replaced.
+ */
+#define DIFF_CACHE_SIZE 8
+
+struct diff_batch {
+    uint32_t    from;                   /* slave version it applies to */
+    uint32_t    to;                     /* version of its last entry */
+    off_t       right;                  /* offset in log past that entry */
+    uint32_t    initial_version;
+    uint32_t    initial_tstamp;
+    krb5_data   data;                   /* FOR_YOU and the entries */
+};
+
+static struct diff_batch diff_cache[DIFF_CACHE_SIZE];
+static size_t diff_cache_next;
+static uint32_t diff_cache_version;
+
+static void
+diff_cache_clear(void)
+{
+    size_t i;
+
+    for (i = 0; i < DIFF_CACHE_SIZE; i++) {
+        krb5_data_free(&diff_cache[i].data);
+        diff_cache[i].from = diff_cache[i].to = 0;
+    }
+    diff_cache_next = 0;
+}
+
+static struct diff_batch *
+diff_cache_find(uint32_t from, uint32_t current_version)
+{
+    size_t i;
+
+    if (current_version != diff_cache_version) {
+        diff_cache_clear();
+        diff_cache_version = current_version;
+        return NULL;
+    }
+    for (i = 0; i < DIFF_CACHE_SIZE; i++) {
+        if (diff_cache[i].data.length && diff_cache[i].from == from)
+            return &diff_cache[i];
+    }
+    return NULL;
+}
+
+static void
+diff_cache_add(const struct diff_batch *batch)
+{
+    struct diff_batch *b = &diff_cache[diff_cache_next];
+
+    krb5_data_free(&b->data);
+    if (krb5_data_copy(&b->data, batch->data.data, batch->data.length))
+        return;
+    b->from = batch->from;
+    b->to = batch->to;
+    b->right = batch->right;
+    b->initial_version = batch->initial_version;
+    b->initial_tstamp = batch->initial_tstamp;
+    diff_cache_next = (diff_cache_next + 1) % DIFF_CACHE_SIZE;
+}
+
+static void
+send_diff_batch(krb5_context context, slave *s, const struct diff_batch *b,
+                uint32_t current_version)
+{
+    int ret;
+
+    ret = mk_priv_tail(context, s, &b->data);
+    if (ret == 0) {
+        /* Save the fast-path continuation */
+        s->next_diff.last_version_sent = b->to;
+        s->next_diff.off_next_version = b->right;
+        s->next_diff.initial_version = b->initial_version;
+        s->next_diff.initial_tstamp = b->initial_tstamp;
+        s->next_diff.more = b->to < current_version;
+        ret = send_tail(context, s);
+
+        krb5_warnx(context,
+                   "syncing slave %s from version %lu to version %lu",
+                   s->name, (unsigned long)s->version,
+                   (unsigned long)b->to);
+        s->version = b->to;
+    }
+
+    if (ret && ret != EWOULDBLOCK) {
+        krb5_warn(context, ret, "send_diffs: making or sending "
+                  "KRB-PRIV message");
+        slave_dead(context, s);
+        return;
+    }
+    slave_seen(s);
+}
+
 static void
 send_diffs(kadm5_server_context *server_context, slave *s, int log_fd,
            const char *database, uint32_t current_version)
@@ -1117,6 +1615,7 @@ send_diffs(kadm5_server_context *server_context, slave *s, int log_fd,
     off_t right = 0;
     krb5_ssize_t bytes;
     krb5_data data;
+    struct diff_batch batch, *b;
     int ret = 0;
 
     if (!diffready(context, s) || nodiffs(context, s, current_version))
@@ -1125,7 +1624,13 @@ send_diffs(kadm5_server_context *server_context, slave *s, int log_fd,
     if (verbose)
         krb5_warnx(context, "sending diffs to live-seeming slave %s", s->name);
 
-    sp = krb5_storage_from_fd(log_fd);
+    b = diff_cache_find(s->version, current_version);
+    if (b != NULL) {
+        send_diff_batch(context, s, b, current_version);
+        return;
+    }
+
+    sp = krb5_storage_buffered_from_fd(log_fd);
     if (sp == NULL)
         krb5_err(context, IPROPD_RESTART_SLOW, ENOMEM,
                  "send_diffs: out of memory");
@@ -1193,32 +1698,15 @@ send_diffs(kadm5_server_context *server_context, slave *s, int log_fd,
     krb5_store_uint32(sp, FOR_YOU);
     krb5_storage_free(sp);
 
-    ret = mk_priv_tail(context, s, &data);
+    batch.from = s->version;
+    batch.to = ver;
+    batch.right = right;
+    batch.initial_version = initial_version;
+    batch.initial_tstamp = initial_tstamp;
+    batch.data = data;
+    diff_cache_add(&batch);
+    send_diff_batch(context, s, &batch, current_version);
     krb5_data_free(&data);
-    if (ret == 0) {
-        /* Save the fast-path continuation */
-        s->next_diff.last_version_sent = ver;
-        s->next_diff.off_next_version = right;
-        s->next_diff.initial_version = initial_version;
-        s->next_diff.initial_tstamp = initial_tstamp;
-        s->next_diff.more = ver < current_version;
-        ret = send_tail(context, s);
-
-        krb5_warnx(context,
-                   "syncing slave %s from version %lu to version %lu",
-                   s->name, (unsigned long)s->version,
-                   (unsigned long)ver);
-        s->version = ver;
-    }
-
-    if (ret && ret != EWOULDBLOCK) {
-        krb5_warn(context, ret, "send_diffs: making or sending "
-                  "KRB-PRIV message");
-        slave_dead(context, s);
-        return;
-    }
-    slave_seen(s);
-    return;
 }
 
 /* Sensible bound on slave message size */
@@ -1326,6 +1814,14 @@ process_msg(kadm5_server_context *server_context, slave *s, int log_fd,
 	    krb5_warnx(context, "process_msg: client send too little I_HAVE data");
 	    break;
 	}
+        /* Newer slaves follow the version with their capabilities */
+        {
+            uint32_t caps;
+
+            if (krb5_ret_uint32(sp, &caps) == 0 &&
+                (caps & IPROP_CAP_MANY_PRINCS))
+                s->flags |= SLAVE_F_MANY;
+        }
         /*
          * XXX Make the slave send the timestamp as well, and try to get it
          * here, and pass it to send_diffs().
@@ -1393,6 +1889,8 @@ process_msg(kadm5_server_context *server_context, slave *s, int log_fd,
 #define SLAVE_VERSION	"Version"
 #define SLAVE_STATUS	"Status"
 #define SLAVE_SEEN	"Last Seen"
+#define SLAVE_PENDING	"Pending"
+#define SLAVE_STALLS	"Stalls"
 
 static void
 init_stats_names(krb5_context context)
@@ -1463,6 +1961,8 @@ write_stats(krb5_context context, slave *slaves, uint32_t current_version)
     rtbl_add_column(tbl, SLAVE_VERSION, RTBL_ALIGN_RIGHT);
     rtbl_add_column(tbl, SLAVE_STATUS, 0);
     rtbl_add_column(tbl, SLAVE_SEEN, 0);
+    rtbl_add_column(tbl, SLAVE_PENDING, RTBL_ALIGN_RIGHT);
+    rtbl_add_column(tbl, SLAVE_STALLS, RTBL_ALIGN_RIGHT);
 
     rtbl_set_prefix(tbl, "  ");
     rtbl_set_column_prefix(tbl, SLAVE_NAME, "");
@@ -1491,6 +1991,14 @@ write_stats(krb5_context context, slave *slaves, uint32_t current_version)
 	ret = krb5_format_time(context, slaves->seen, str, sizeof(str), TRUE);
 	rtbl_add_column_entry(tbl, SLAVE_SEEN, str);
 
+        /* Bytes of the current message not yet taken by the slave */
+	snprintf(str, sizeof(str), "%lu", (unsigned long)
+                 (slaves->tail.header.length +
+                  slaves->tail.packet.length - slaves->tail.packet_off));
+	rtbl_add_column_entry(tbl, SLAVE_PENDING, str);
+	snprintf(str, sizeof(str), "%lu", slaves->stalls);
+	rtbl_add_column_entry(tbl, SLAVE_STALLS, str);
+
 	slaves = slaves->next;
     }
 
@@ -1502,6 +2010,199 @@ write_stats(krb5_context context, slave *slaves, uint32_t current_version)
 }
 
 
+/* The master's own descriptors, and which of them the event loop found ready */
+struct master_fds {
+    krb5_socket_t signal_fd;
+    krb5_socket_t listen_fd;
+    int restarter_fd;
+    unsigned int ready;
+#define MASTER_R_SIGNAL         0x1
+#define MASTER_R_LISTEN         0x2
+#define MASTER_R_RESTARTER      0x4
+};
+
+/*
+ * Wait up to `to' for the master's or the slaves' descriptors, noting which
+ * are ready in m->ready and in each slave's ready.  Slaves with something
+ * to send are also waited on for writability.
+ *
+ * Returns the number of descriptors ready, or -1 and sets errno.
+ */
+static int
+wait_select(krb5_context context, struct master_fds *m, slave *slaves,
+            struct timeval *to)
+{
+    fd_set readset, writeset;
+    int max_fd = 0;
+    slave *p;
+    int ret;
+
+#ifndef NO_LIMIT_FD_SETSIZE
+    if (m->signal_fd >= FD_SETSIZE || m->listen_fd >= FD_SETSIZE ||
+        m->restarter_fd >= FD_SETSIZE)
+        krb5_errx (context, IPROPD_RESTART, "fd too large");
+#endif
+
+    FD_ZERO(&readset);
+    FD_ZERO(&writeset);
+    FD_SET(m->signal_fd, &readset);
+    max_fd = max(max_fd, m->signal_fd);
+    FD_SET(m->listen_fd, &readset);
+    max_fd = max(max_fd, m->listen_fd);
+    if (m->restarter_fd > -1) {
+        FD_SET(m->restarter_fd, &readset);
+        max_fd = max(max_fd, m->restarter_fd);
+    }
+
+    for (p = slaves; p != NULL; p = p->next) {
+        if (p->flags & SLAVE_F_DEAD)
+            continue;
+        FD_SET(p->fd, &readset);
+        if (have_tail(p) || more_diffs(p))
+            FD_SET(p->fd, &writeset);
+        max_fd = max(max_fd, p->fd);
+    }
+
+    ret = select(max_fd + 1, &readset, &writeset, NULL, to);
+
+    m->ready = 0;
+    for (p = slaves; p != NULL; p = p->next)
+        p->ready = 0;
+    if (ret <= 0)
+        return ret;
+
+    if (FD_ISSET(m->signal_fd, &readset))
+        m->ready |= MASTER_R_SIGNAL;
+    if (FD_ISSET(m->listen_fd, &readset))
+        m->ready |= MASTER_R_LISTEN;
+    if (m->restarter_fd > -1 && FD_ISSET(m->restarter_fd, &readset))
+        m->ready |= MASTER_R_RESTARTER;
+    for (p = slaves; p != NULL; p = p->next) {
+        if (p->flags & SLAVE_F_DEAD)
+            continue;
+        if (FD_ISSET(p->fd, &readset))
+            p->ready |= SLAVE_R_READ;
+        if (FD_ISSET(p->fd, &writeset))
+            p->ready |= SLAVE_R_WRITE;
+    }
+    return ret;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define EPOLL_MAX_EVENTS 64
+
+static int
+epoll_add(int epfd, int fd, void *ptr)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = ptr;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * Returns an epoll descriptor watching the master's descriptors, or -1,
+ * in which case we use select().
+ *
+ * The events for these point at their struct master_fds field, those for
+ * slaves (added with epoll_add_slave()) at the slave.
+ */
+static int
+epoll_setup(krb5_context context, struct master_fds *m)
+{
+    int epfd;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        krb5_warn(context, errno, "epoll_create1");
+        return -1;
+    }
+    if (epoll_add(epfd, m->signal_fd, &m->signal_fd) == -1 ||
+        epoll_add(epfd, m->listen_fd, &m->listen_fd) == -1 ||
+        (m->restarter_fd > -1 &&
+         epoll_add(epfd, m->restarter_fd, &m->restarter_fd) == -1)) {
+        krb5_warn(context, errno, "epoll_ctl");
+        close(epfd);
+        return -1;
+    }
+    return epfd;
+}
+
+static void
+epoll_add_slave(krb5_context context, int epfd, slave *s)
+{
+    if (epoll_add(epfd, s->fd, s) == -1) {
+        krb5_warn(context, errno, "epoll_ctl");
+        slave_dead(context, s);
+        return;
+    }
+    s->epoll_events = EPOLLIN;
+}
+
+/*
+ * Same as wait_select(), but the kernel keeps the set of descriptors, so
+ * there is no FD_SETSIZE limit on the number of slaves and a wakeup costs
+ * in proportion to the descriptors that are ready rather than to all of
+ * them.  A dead slave's descriptor leaves the set when it's closed.
+ */
+static int
+wait_epoll(krb5_context context, int epfd, struct master_fds *m,
+           slave *slaves, struct timeval *to)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    slave *p;
+    int i, n;
+
+    for (p = slaves; p != NULL; p = p->next) {
+        uint32_t want = EPOLLIN;
+        struct epoll_event ev;
+
+        p->ready = 0;
+        if (p->flags & SLAVE_F_DEAD)
+            continue;
+        if (have_tail(p) || more_diffs(p))
+            want |= EPOLLOUT;
+        if (want == p->epoll_events)
+            continue;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = want;
+        ev.data.ptr = p;
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, p->fd, &ev) == -1) {
+            krb5_warn(context, errno, "epoll_ctl");
+            slave_dead(context, p);
+            continue;
+        }
+        p->epoll_events = want;
+    }
+
+    m->ready = 0;
+    n = epoll_wait(epfd, events, EPOLL_MAX_EVENTS, to->tv_sec * 1000);
+    for (i = 0; i < n; i++) {
+        void *ptr = events[i].data.ptr;
+
+        if (ptr == &m->signal_fd) {
+            m->ready |= MASTER_R_SIGNAL;
+        } else if (ptr == &m->listen_fd) {
+            m->ready |= MASTER_R_LISTEN;
+        } else if (ptr == &m->restarter_fd) {
+            m->ready |= MASTER_R_RESTARTER;
+        } else {
+            p = ptr;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                p->ready |= SLAVE_R_READ;
+            if (events[i].events & EPOLLOUT)
+                p->ready |= SLAVE_R_WRITE;
+        }
+    }
+    return n;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
+
+
 static char sHDB[] = "HDBGET:";
 static char *realm;
 static int version_flag;
@@ -1525,6 +2226,13 @@ static struct getargs args[] = {
       "time before slave is polled for presence", "time"},
     { "time-gone", 0, arg_string, rk_UNCONST(&slave_time_gone),
       "time of inactivity after which a slave is considered gone", "time"},
+    { "event-loop", 0, arg_string, rk_UNCONST(&event_loop_str),
+      "how to wait for slaves", "select|epoll" },
+    { "stream-dumps", 0, arg_flag, &stream_dumps,
+      "send complete databases from an HDB snapshot, not a dump file",
+      NULL },
+    { "max-snapshot-size", 0, arg_string, rk_UNCONST(&max_snapshot_str),
+      "largest HDB snapshot to send complete databases from", "size" },
     { "port", 0, arg_string, &port_str,
       "port ipropd will listen to", "port"},
     { "detach", 0, arg_flag, &detach_from_console,
@@ -1556,6 +2264,8 @@ main(int argc, char **argv)
     int aret;
     int optidx = 0;
     int restarter_fd = -1;
+    int epfd = -1;
+    struct master_fds m;
     struct stat st;
 
     setprogname(argv[0]);
@@ -1604,6 +2314,9 @@ main(int argc, char **argv)
     time_before_missing = parse_time (slave_time_missing,  "s");
     if (time_before_missing < 0)
 	krb5_errx (context, 1, "couldn't parse time: %s", slave_time_missing);
+    max_snapshot_size = parse_bytes(max_snapshot_str, "byte");
+    if (max_snapshot_size < 0)
+	krb5_errx (context, 1, "couldn't parse size: %s", max_snapshot_str);
 
     krb5_openlog(context, "ipropd-master", &log_facility);
     krb5_set_warn_dest(context, log_facility);
@@ -1657,46 +2370,40 @@ main(int argc, char **argv)
     roken_detach_finish(NULL, daemon_child);
     restarter_fd = restarter(context, NULL);
 
+    m.signal_fd = signal_fd;
+    m.listen_fd = listen_fd;
+    m.restarter_fd = restarter_fd;
+    if (strcasecmp(event_loop_str, "epoll") == 0) {
+#ifdef HAVE_SYS_EPOLL_H
+        epfd = epoll_setup(context, &m);
+        if (epfd == -1)
+            krb5_warnx(context, "epoll event loop unavailable, using select");
+#else
+        krb5_warnx(context, "epoll event loop not supported, using select");
+#endif
+    } else if (strcasecmp(event_loop_str, "select") != 0) {
+        krb5_warnx(context, "unknown event-loop `%s', using select",
+                   event_loop_str);
+    }
+
     while (exit_flag == 0){
 	slave *p;
-	fd_set readset, writeset;
-	int max_fd = 0;
 	struct timeval to = {30, 0};
 	uint32_t vers;
         struct stat st2;;
 
-#ifndef NO_LIMIT_FD_SETSIZE
-	if (signal_fd >= FD_SETSIZE || listen_fd >= FD_SETSIZE ||
-            restarter_fd >= FD_SETSIZE)
-	    krb5_errx (context, IPROPD_RESTART, "fd too large");
+#ifdef HAVE_SYS_EPOLL_H
+        if (epfd != -1)
+            ret = wait_epoll(context, epfd, &m, slaves, &to);
+        else
 #endif
-
-	FD_ZERO(&readset);
-	FD_ZERO(&writeset);
-	FD_SET(signal_fd, &readset);
-	max_fd = max(max_fd, signal_fd);
-	FD_SET(listen_fd, &readset);
-	max_fd = max(max_fd, listen_fd);
-        if (restarter_fd > -1) {
-            FD_SET(restarter_fd, &readset);
-            max_fd = max(max_fd, restarter_fd);
-        }
-
-	for (p = slaves; p != NULL; p = p->next) {
-	    if (p->flags & SLAVE_F_DEAD)
-		continue;
-	    FD_SET(p->fd, &readset);
-            if (have_tail(p) || more_diffs(p))
-                FD_SET(p->fd, &writeset);
-	    max_fd = max(max_fd, p->fd);
-	}
-
-	ret = select(max_fd + 1, &readset, &writeset, NULL, &to);
+            ret = wait_select(context, &m, slaves, &to);
 	if (ret < 0) {
 	    if (errno == EINTR)
 		continue;
 	    else
-		krb5_err (context, IPROPD_RESTART, errno, "select");
+		krb5_err (context, IPROPD_RESTART, errno,
+                          epfd != -1 ? "epoll_wait" : "select");
 	}
 
         if (stat(server_context->log_context.log_file, &st2) == -1) {
@@ -1715,6 +2422,7 @@ main(int argc, char **argv)
             if (fstat(log_fd, &st) == -1)
                 krb5_err(context, IPROPD_RESTART_SLOW, errno, "stat %s",
                          server_context->log_context.log_file);
+            diff_cache_clear();
 
             if (flock(log_fd, LOCK_SH) == -1)
                 krb5_err(context, IPROPD_RESTART, errno, "shared flock %s",
@@ -1752,12 +2460,12 @@ main(int argc, char **argv)
 	    }
 	}
 
-        if (ret && FD_ISSET(restarter_fd, &readset)) {
+        if (m.ready & MASTER_R_RESTARTER) {
             exit_flag = SIGTERM;
             break;
         }
 
-	if (ret && FD_ISSET(signal_fd, &readset)) {
+	if (m.ready & MASTER_R_SIGNAL) {
 #ifndef NO_UNIX_SOCKETS
 	    struct sockaddr_un peer_addr;
 #else
@@ -1813,7 +2521,7 @@ main(int argc, char **argv)
 
 	for (p = slaves; p != NULL; p = p->next) {
             if (!(p->flags & SLAVE_F_DEAD) &&
-                FD_ISSET(p->fd, &writeset) &&
+                (p->ready & SLAVE_R_WRITE) &&
                 ((have_tail(p) && send_tail(context, p) == 0) ||
                  (!have_tail(p) && more_diffs(p)))) {
                 send_diffs(server_context, p, log_fd, database,
@@ -1824,7 +2532,7 @@ main(int argc, char **argv)
 	for(p = slaves; p != NULL; p = p->next) {
 	    if (p->flags & SLAVE_F_DEAD)
 	        continue;
-	    if (ret && FD_ISSET(p->fd, &readset)) {
+	    if (ret && (p->ready & SLAVE_R_READ)) {
 		--ret;
 		assert(ret >= 0);
                 ret = process_msg(server_context, p, log_fd, database,
@@ -1837,8 +2545,12 @@ main(int argc, char **argv)
 		send_are_you_there (context, p);
 	}
 
-	if (ret && FD_ISSET(listen_fd, &readset)) {
-	    add_slave (context, keytab, &slaves, listen_fd);
+	if (ret && (m.ready & MASTER_R_LISTEN)) {
+	    p = add_slave (context, keytab, &slaves, listen_fd);
+#ifdef HAVE_SYS_EPOLL_H
+            if (p != NULL && epfd != -1)
+                epoll_add_slave(context, epfd, p);
+#endif
 	    --ret;
 	    assert(ret >= 0);
 	}
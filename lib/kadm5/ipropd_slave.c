@@ -38,6 +38,7 @@ RCSID("$Id$");
 static const char *config_name = "ipropd-slave";
 
 static int verbose;
+static int no_capabilities; /* neither ask for nor take MANY_PRINCS */
 
 static krb5_log_facility *log_facility;
 static char five_min[] = "5 min";
@@ -174,16 +175,19 @@ ihave(krb5_context context, krb5_auth_context auth_context,
       int fd, uint32_t version)
 {
     int ret;
-    u_char buf[8];
+    u_char buf[12];
     krb5_storage *sp;
     krb5_data data;
 
-    sp = krb5_storage_from_mem(buf, 8);
+    /* Masters that don't know about capabilities ignore them */
+    sp = krb5_storage_from_mem(buf, 12);
     ret = krb5_store_uint32(sp, I_HAVE);
     if (ret == 0)
         ret = krb5_store_uint32(sp, version);
+    if (ret == 0 && !no_capabilities)
+        ret = krb5_store_uint32(sp, IPROP_CAP_MANY_PRINCS);
     krb5_storage_free(sp);
-    data.length = 8;
+    data.length = no_capabilities ? 8 : 12;
     data.data   = buf;
 
     if (ret == 0) {
@@ -483,6 +487,43 @@ reinit_log(krb5_context context,
         krb5_err(context, IPROPD_RESTART_SLOW, ret, "kadm5_log_reinit");
 }
 
+/* Entries of a complete database stored per HDB batch */
+#define RECEIVE_BATCH_MAX 1024
+
+/*
+ * Store one entry of a complete database sent by the master, committing
+ * them RECEIVE_BATCH_MAX at a time if the HDB can batch.  `nbatched' counts
+ * the entries in the open batch.
+ */
+static void
+store_one(krb5_context context, HDB *mydb, krb5_data *value, size_t *nbatched)
+{
+    hdb_entry_ex entry;
+    int batching = mydb->hdb_begin_batch != NULL;
+    int ret;
+
+    memset(&entry, 0, sizeof(entry));
+
+    ret = hdb_value2entry(context, value, &entry.entry);
+    if (ret)
+	krb5_err(context, IPROPD_RESTART, ret, "hdb_value2entry");
+    if (batching && *nbatched == 0) {
+        ret = mydb->hdb_begin_batch(context, mydb);
+        if (ret)
+            krb5_err(context, IPROPD_RESTART_SLOW, ret, "hdb_begin_batch");
+    }
+    ret = mydb->hdb_store(context, mydb, 0, &entry);
+    if (ret)
+	krb5_err(context, IPROPD_RESTART_SLOW, ret, "hdb_store");
+    if (batching && ++(*nbatched) == RECEIVE_BATCH_MAX) {
+        *nbatched = 0;
+        ret = mydb->hdb_end_batch(context, mydb, 1);
+        if (ret)
+            krb5_err(context, IPROPD_RESTART_SLOW, ret, "hdb_end_batch");
+    }
+
+    hdb_free_entry(context, &entry);
+}
 
 static krb5_error_code
 receive_everything(krb5_context context, int fd,
@@ -494,6 +535,7 @@ receive_everything(krb5_context context, int fd,
     uint32_t vno = 0;
     uint32_t opcode;
     krb5_storage *sp;
+    size_t nbatched = 0;
 
     char *dbname;
     HDB *mydb;
@@ -537,31 +579,31 @@ receive_everything(krb5_context context, int fd,
 	krb5_ret_uint32(sp, &opcode);
 	if (opcode == ONE_PRINC) {
 	    krb5_data fake_data;
-	    hdb_entry_ex entry;
 
 	    krb5_storage_free(sp);
 
 	    fake_data.data   = (char *)data.data + 4;
 	    fake_data.length = data.length - 4;
 
-	    memset(&entry, 0, sizeof(entry));
-
-	    ret = hdb_value2entry(context, &fake_data, &entry.entry);
-	    if (ret)
-		krb5_err(context, IPROPD_RESTART, ret, "hdb_value2entry");
-	    ret = mydb->hdb_store(server_context->context,
-				  mydb,
-				  0, &entry);
-	    if (ret)
-		krb5_err(context, IPROPD_RESTART_SLOW, ret, "hdb_store");
+	    store_one(context, mydb, &fake_data, &nbatched);
+	    krb5_data_free(&data);
+	} else if (opcode == MANY_PRINCS && !no_capabilities) {
+	    krb5_data value;
 
-	    hdb_free_entry(context, &entry);
+	    /* A run of length-prefixed entries, up to the end of the message */
+	    while ((ret = krb5_ret_data(sp, &value)) == 0) {
+		store_one(context, mydb, &value, &nbatched);
+		krb5_data_free(&value);
+	    }
+	    if (ret != HEIM_ERR_EOF)
+		krb5_err(context, IPROPD_RESTART, ret, "MANY_PRINCS");
+	    krb5_storage_free(sp);
 	    krb5_data_free(&data);
 	} else if (opcode == NOW_YOU_HAVE)
 	    ;
 	else
 	    krb5_errx(context, 1, "strange opcode %d", opcode);
-    } while (opcode == ONE_PRINC);
+    } while (opcode == ONE_PRINC || opcode == MANY_PRINCS);
 
     if (opcode != NOW_YOU_HAVE)
         krb5_errx(context, IPROPD_RESTART_SLOW,
@@ -570,6 +612,12 @@ receive_everything(krb5_context context, int fd,
     krb5_ret_uint32(sp, &vno);
     krb5_storage_free(sp);
 
+    if (nbatched > 0) {
+        ret = mydb->hdb_end_batch(context, mydb, 1);
+        if (ret)
+            krb5_err(context, IPROPD_RESTART_SLOW, ret, "hdb_end_batch");
+    }
+
     reinit_log(context, server_context, vno);
 
     ret = mydb->hdb_set_sync(context, mydb, 1);
@@ -675,6 +723,8 @@ static struct getargs args[] = {
       "detach from console", NULL },
     { "daemon-child",       0 ,      arg_integer, &daemon_child,
       "private argument, do not use", NULL },
+    { "no-capabilities",    0 ,      arg_flag, &no_capabilities,
+      "private argument, for testing: act like an old slave", NULL },
     { "hostname", 0, arg_string, rk_UNCONST(&slave_str),
       "hostname of slave (if not same as hostname)", "hostname" },
     { "verbose", 0, arg_flag, &verbose, NULL, NULL },
@@ -1050,6 +1100,7 @@ main(int argc, char **argv)
 	    case NOW_YOU_HAVE :
 	    case I_HAVE :
 	    case ONE_PRINC :
+	    case MANY_PRINCS :
 	    case I_AM_HERE :
 	    default :
 		krb5_warnx (context, "Ignoring command %d", tmp);
@@ -145,6 +145,24 @@ RCSID("$Id$");
  * On masters the log should never have more than one unconfirmed
  * record, but slaves append all of a master's "diffs" and then call
  * kadm5_log_recover() to recover.
+ *
+ * Next to the log there is an index file (the log's name with ".idx"
+ * appended) that maps the version of every confirmed record to the
+ * record's offset, so that finding a record by version (as the
+ * ipropd-master must do for every slave that reconnects) is a binary
+ * search rather than a walk backwards from the end of the log:
+ *
+ * magic ("IPIX")               4 bytes
+ * index format (1)             4 bytes
+ * then, per record, in log order:
+ *   version number             4 bytes
+ *   offset of record header    8 bytes
+ *
+ * The index is only a hint.  It is appended to whenever records are
+ * confirmed, discarded when the log is truncated or reinitialized, and
+ * rebuilt from the log when its last entry doesn't match the log.  It is
+ * never fsync()ed, and readers always check the record an index entry
+ * points to, falling back on walking the log.
  */
 
 /*
@@ -465,6 +483,196 @@ get_max_log_size(krb5_context context)
 
 static kadm5_ret_t truncate_if_needed(kadm5_server_context *);
 
+#define LOG_INDEX_MAGIC         0x49504958 /* "IPIX" */
+#define LOG_INDEX_FORMAT        1
+#define LOG_INDEX_HEADER_SZ     ((off_t)(sizeof(uint32_t) * 2))
+#define LOG_INDEX_ENTRY_SZ      ((off_t)(sizeof(uint32_t) + sizeof(uint64_t)))
+
+static char *
+log_index_name(kadm5_log_context *log_context)
+{
+    char *s;
+
+    if (asprintf(&s, "%s.idx", log_context->log_file) == -1)
+        return NULL;
+    return s;
+}
+
+static uint32_t
+log_index_get32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/* Check the index header and that the index holds whole entries */
+static int
+log_index_valid(const unsigned char *hdr, off_t size)
+{
+    return size >= LOG_INDEX_HEADER_SZ &&
+           (size - LOG_INDEX_HEADER_SZ) % LOG_INDEX_ENTRY_SZ == 0 &&
+           log_index_get32(hdr) == LOG_INDEX_MAGIC &&
+           log_index_get32(hdr + 4) == LOG_INDEX_FORMAT;
+}
+
+/* Discard the index, e.g., because the log's records have moved */
+static void
+log_index_reset(kadm5_server_context *context)
+{
+    char *name = log_index_name(&context->log_context);
+
+    if (name != NULL)
+        (void) unlink(name);
+    free(name);
+}
+
+/*
+ * Bring the index up to date with the log's records ending at `end',
+ * which must be confirmed.  The caller must hold the log exclusively
+ * locked.
+ *
+ * Normally this checks the index's last entry against the log and
+ * appends the records that follow it.  If the last entry doesn't match
+ * the log the index is rebuilt.  Errors are ignored: the index is just
+ * a hint.  Does not preserve the log fd's offset.
+ */
+static void
+log_index_update(kadm5_server_context *context, off_t end)
+{
+    kadm5_log_context *log_context = &context->log_context;
+    krb5_storage *sp = NULL;
+    krb5_storage *entries = NULL;
+    unsigned char buf[LOG_INDEX_ENTRY_SZ];
+    krb5_data data;
+    struct stat st;
+    char *name;
+    uint32_t ver;
+    off_t isize, off;
+    int fd;
+
+    krb5_data_zero(&data);
+    name = log_index_name(log_context);
+    if (name == NULL)
+        return;
+    fd = open(name, O_RDWR | O_CREAT | O_BINARY | O_CLOEXEC, 0600);
+    free(name);
+    if (fd < 0)
+        return;
+    sp = krb5_storage_buffered_from_fd(log_context->log_fd);
+    entries = krb5_storage_emem();
+    if (sp == NULL || entries == NULL || fstat(fd, &st) == -1)
+        goto out;
+
+    /* Find where the index leaves off, if it's usable */
+    isize = st.st_size;
+    off = -1;
+    if (isize > LOG_INDEX_HEADER_SZ &&
+        pread(fd, buf, LOG_INDEX_HEADER_SZ, 0) == LOG_INDEX_HEADER_SZ &&
+        log_index_valid(buf, isize) &&
+        pread(fd, buf, LOG_INDEX_ENTRY_SZ, isize - LOG_INDEX_ENTRY_SZ) ==
+        LOG_INDEX_ENTRY_SZ) {
+        off = ((off_t)log_index_get32(buf + 4) << 32) |
+            log_index_get32(buf + 8);
+        if (off <= 0 || off >= end ||
+            krb5_storage_seek(sp, off, SEEK_SET) != off ||
+            kadm5_log_next(context->context, sp, &ver, NULL, NULL,
+                           NULL) != 0 ||
+            ver != log_index_get32(buf))
+            off = -1;
+    }
+
+    /* Else start over from the first record */
+    if (off == -1) {
+        isize = 0;
+        if (krb5_store_uint32(entries, LOG_INDEX_MAGIC) != 0 ||
+            krb5_store_uint32(entries, LOG_INDEX_FORMAT) != 0 ||
+            kadm5_log_goto_first(context, sp) != 0)
+            goto out;
+    }
+
+    for (;;) {
+        off = krb5_storage_seek(sp, 0, SEEK_CUR);
+        if (off < 0 || off >= end)
+            break;
+        if (kadm5_log_next(context->context, sp, &ver, NULL, NULL, NULL) ||
+            krb5_store_uint32(entries, ver) ||
+            krb5_store_uint64(entries, off))
+            goto out;
+    }
+
+    if (krb5_storage_to_data(entries, &data) != 0 || data.length == 0)
+        goto out;
+    if (isize == 0 && ftruncate(fd, 0) == -1)
+        goto out;
+    if (pwrite(fd, data.data, data.length, isize) != (ssize_t)data.length)
+        (void) ftruncate(fd, isize);
+
+out:
+    krb5_data_free(&data);
+    krb5_storage_free(entries);
+    krb5_storage_free(sp);
+    (void) close(fd);
+}
+
+/*
+ * Look up the offset of the record with version `ver' in the index.
+ * Returns ENOENT if there's no index or the version isn't in it.
+ */
+static kadm5_ret_t
+log_index_lookup(kadm5_server_context *context, uint32_t ver, off_t *offp)
+{
+#ifdef HAVE_MMAP
+    const unsigned char *map, *p;
+    kadm5_ret_t ret = ENOENT;
+    struct stat st;
+    size_t lo, hi, mid;
+    uint32_t v;
+    char *name;
+    int fd;
+
+    name = log_index_name(&context->log_context);
+    if (name == NULL)
+        return ENOMEM;
+    fd = open(name, O_RDONLY | O_BINARY | O_CLOEXEC);
+    free(name);
+    if (fd < 0)
+        return ENOENT;
+    if (fstat(fd, &st) == -1 || st.st_size <= LOG_INDEX_HEADER_SZ ||
+        st.st_size != (size_t)st.st_size) {
+        (void) close(fd);
+        return ENOENT;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    (void) close(fd);
+    if (map == MAP_FAILED)
+        return ENOENT;
+
+    if (log_index_valid(map, st.st_size)) {
+        lo = 0;
+        hi = (st.st_size - LOG_INDEX_HEADER_SZ) / LOG_INDEX_ENTRY_SZ;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            p = map + LOG_INDEX_HEADER_SZ + mid * LOG_INDEX_ENTRY_SZ;
+            v = log_index_get32(p);
+            if (v == ver) {
+                *offp = ((off_t)log_index_get32(p + 4) << 32) |
+                    log_index_get32(p + 8);
+                ret = 0;
+                break;
+            }
+            if (v < ver)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    }
+    (void) munmap((void *)map, st.st_size);
+    return ret;
+#else
+    return ENOENT;
+#endif
+}
+
 /*
  * Get the version and timestamp metadata of either the first, or last
  * confirmed entry in the log.
@@ -503,7 +711,7 @@ kadm5_log_get_version_fd(kadm5_server_context *server_context, int fd,
     *ver = 0;
     *tstamp = 0;
 
-    sp = krb5_storage_from_fd(fd);
+    sp = krb5_storage_buffered_from_fd(fd);
     if (sp == NULL)
         return errno ? errno : ENOMEM;
 
@@ -726,6 +934,8 @@ kadm5_log_reinit(kadm5_server_context *server_context, uint32_t vno)
         }
     }
 
+    log_index_reset(server_context);
+
     /* Write uber entry and truncation nop with version `vno` */
     log_context->version = vno;
     return kadm5_log_nop(server_context, kadm_nop_plain);
@@ -1659,6 +1869,8 @@ out:
     krb5_data_free(&data);
     krb5_storage_free(sp);
     krb5_storage_free(mem_sp);
+    if (ret == 0 && off > LOG_UBER_SZ)
+        log_index_update(context, off);
     if (lseek(log_context->log_fd, off, SEEK_SET) == -1)
         ret = ret ? ret : errno;
 
@@ -1757,8 +1969,42 @@ struct replay_cb_data {
     size_t count;
     uint32_t ver;
     enum kadm_recover_mode mode;
+    int batching;
+    int in_batch;
+    size_t batched;
+    off_t batch_end;
 };
 
+/* Most entries replayed in one HDB batch */
+#define REPLAY_BATCH_MAX 1024
+
+/*
+ * Commit the batch of replayed entries and confirm them in the log.
+ *
+ * Should we crash between the two, the whole batch is replayed again on
+ * recovery.  That yields the same result as long as no rename is batched
+ * with other entries: creates and deletes of what's already created or
+ * deleted are skipped, and modifies set the same attributes again.
+ */
+static kadm5_ret_t
+replay_batch_end(kadm5_server_context *context, struct replay_cb_data *data,
+                 krb5_storage *sp)
+{
+    size_t batched = data->batched;
+    kadm5_ret_t ret;
+
+    data->in_batch = 0;
+    data->batched = 0;
+    ret = context->db->hdb_end_batch(context->context, context->db, 1);
+    if (ret || batched == 0)
+        return ret;
+    kadm5_log_set_version(context, data->ver);
+    ret = log_update_uber(context, data->batch_end);
+    if (ret == 0)
+        ret = krb5_storage_fsync(sp);
+    return ret;
+}
+
 
 /*
  * Recover or perform the initial commit of an unconfirmed log entry
@@ -1779,6 +2025,23 @@ recover_replay(kadm5_server_context *context,
     /* We're at the start of the payload; compute end of entry offset */
     off = krb5_storage_seek(sp, 0, SEEK_CUR) + len + LOG_TRAILER_SZ;
 
+    if (data->batching) {
+        /* Renames go in batches of their own; see replay_batch_end() */
+        if (op == kadm_rename && data->in_batch) {
+            ret = replay_batch_end(context, data, sp);
+            if (ret)
+                return ret;
+        }
+        /* If we can't start a batch, replay one entry at a time */
+        if (!data->in_batch) {
+            if (context->db->hdb_begin_batch(context->context,
+                                             context->db) == 0)
+                data->in_batch = 1;
+            else
+                data->batching = 0;
+        }
+    }
+
     /* We cannot perform log recovery on LDAP and such backends */
     if (data->mode == kadm_recover_replay &&
         (context->db->hdb_capability_flags & HDB_CAP_F_SHARED_DIRECTORY))
@@ -1801,6 +2064,13 @@ recover_replay(kadm5_server_context *context,
     data->count++;
     data->ver = ver;
 
+    if (data->batching) {
+        data->batch_end = off;
+        if (++data->batched < REPLAY_BATCH_MAX && op != kadm_rename)
+            return 0;
+        return replay_batch_end(context, data, sp);
+    }
+
     /*
      * With replay we may be making multiple HDB changes.  We must sync the
      * confirmation of each one before moving on to the next.  Otherwise, we
@@ -1826,7 +2096,24 @@ kadm5_log_recover(kadm5_server_context *context, enum kadm_recover_mode mode)
     replay_data.count = 0;
     replay_data.ver = 0;
     replay_data.mode = mode;
+    replay_data.in_batch = 0;
+    replay_data.batched = 0;
+    replay_data.batch_end = 0;
 
+    /*
+     * When replaying (on slaves, mostly) apply entries in batches, each one
+     * HDB transaction, instead of committing and syncing each entry.
+     */
+    replay_data.batching = mode == kadm_recover_replay &&
+        context->db->hdb_begin_batch != NULL &&
+        context->db->hdb_end_batch != NULL &&
+        !(context->db->hdb_capability_flags & HDB_CAP_F_SHARED_DIRECTORY);
+
+    /*
+     * Not a buffered storage: freeing that would move the fd's offset back
+     * to where kadm5_log_goto_end() left it, undoing the offset that
+     * replaying (log_update_uber()) leaves for the next append.
+     */
     sp = krb5_storage_from_fd(context->log_context.log_fd);
     if (sp == NULL)
         return errno ? errno : EIO;
@@ -1835,6 +2122,16 @@ kadm5_log_recover(kadm5_server_context *context, enum kadm_recover_mode mode)
     if (ret == 0)
         ret = kadm5_log_foreach(context, kadm_forward | kadm_unconfirmed,
                                 NULL, recover_replay, &replay_data);
+    if (replay_data.in_batch) {
+        /*
+         * Keep what was replayed before the end of the log or before the
+         * first entry that failed.
+         */
+        kadm5_ret_t ret2 = replay_batch_end(context, &replay_data, sp);
+
+        if (ret == 0)
+            ret = ret2;
+    }
     if (ret == 0 && mode == kadm_recover_commit && replay_data.count != 1)
         ret = KADM5_LOG_CORRUPT;
     krb5_storage_free(sp);
@@ -1884,7 +2181,7 @@ kadm5_log_foreach(kadm5_server_context *context,
          * the start, then there's no need to kadm5_log_goto_end()
          * -- no reason to try to find the end.
          */
-        sp = krb5_storage_from_fd(fd);
+        sp = krb5_storage_buffered_from_fd(fd);
         if (sp == NULL)
             return errno ? errno : ENOMEM;
 
@@ -1897,7 +2194,7 @@ kadm5_log_foreach(kadm5_server_context *context,
         }
     } else {
         /* Get the end of the log based on the uber entry */
-        sp = krb5_storage_from_fd(fd);
+        sp = krb5_storage_buffered_from_fd(fd);
         if (sp == NULL)
             return errno ? errno : ENOMEM;
         ret = kadm5_log_goto_end(context, sp);
@@ -2241,6 +2538,88 @@ log_corrupt:
     return KADM5_LOG_CORRUPT;
 }
 
+/*
+ * Go to the start of the confirmed record with version `ver' using
+ * only the log's index.  Returns ENOENT if the index doesn't have it
+ * (or is stale), in which case `sp' is left at the end of the log.
+ * This is cheap enough to do with the log locked.
+ */
+kadm5_ret_t
+kadm5_log_goto_indexed_version(kadm5_server_context *server_context,
+                               krb5_storage *sp, uint32_t ver)
+{
+    krb5_context context = server_context->context;
+    kadm5_ret_t ret;
+    uint32_t v;
+    off_t end, off;
+
+    ret = kadm5_log_goto_end(server_context, sp);
+    if (ret)
+        return ret;
+    end = krb5_storage_seek(sp, 0, SEEK_CUR);
+    if (end < 0)
+        return errno;
+
+    if (ver != 0 &&
+        log_index_lookup(server_context, ver, &off) == 0 && off < end &&
+        krb5_storage_seek(sp, off, SEEK_SET) == off &&
+        kadm5_log_next(context, sp, &v, NULL, NULL, NULL) == 0 &&
+        v == ver) {
+        if (krb5_storage_seek(sp, off, SEEK_SET) != off)
+            return errno;
+        return 0;
+    }
+
+    if (krb5_storage_seek(sp, end, SEEK_SET) != end)
+        return errno;
+    return ENOENT;
+}
+
+/*
+ * Go to the start of the confirmed record with version `ver'.
+ *
+ * The record is looked up in the log's index; if the index doesn't
+ * have it (or is stale) this walks backwards from the end of the log.
+ * Returns HEIM_ERR_EOF if the log has no such confirmed record, in
+ * which case `sp' is left at the end of the log.
+ */
+kadm5_ret_t
+kadm5_log_goto_version(kadm5_server_context *server_context,
+                       krb5_storage *sp, uint32_t ver)
+{
+    krb5_context context = server_context->context;
+    kadm5_ret_t ret;
+    enum kadm_ops op;
+    uint32_t v, len;
+    off_t end, off;
+
+    ret = kadm5_log_goto_indexed_version(server_context, sp, ver);
+    if (ret != ENOENT)
+        return ret;
+    if (ver == 0)
+        return HEIM_ERR_EOF;
+
+    /* No usable index entry; walk backwards from the end */
+    end = krb5_storage_seek(sp, 0, SEEK_CUR);
+    if (end < 0)
+        return errno;
+    for (;;) {
+        ret = kadm5_log_previous(context, sp, &v, NULL, &op, &len);
+        if (ret)
+            return ret;
+        off = krb5_storage_seek(sp, -LOG_HEADER_SZ, SEEK_CUR);
+        if (off < 0)
+            return errno;
+        if (v == ver)
+            return 0;
+        if (off == 0 || v < ver)
+            break;
+    }
+    if (krb5_storage_seek(sp, end, SEEK_SET) != end)
+        return errno;
+    return HEIM_ERR_EOF;
+}
+
 /*
  * Replay a record from the log
  */
@@ -2353,7 +2732,7 @@ load_entries_cb(kadm5_server_context *server_context,
     }
 
     /*
-     * sp here is a krb5_storage_from_fd() of the log file, and the
+     * sp here is a krb5_storage_buffered_from_fd() of the log file, and the
      * offset pointer points at the current log record payload.
      *
      * Seek back to the start of the record poayload so we can read the
@@ -2484,6 +2863,9 @@ kadm5_log_truncate(kadm5_server_context *context, size_t keep, size_t maxbytes)
         return EOVERFLOW; /* caller should ask for fewer entries */
     }
 
+    /* The records kept will move, so the index must go */
+    log_index_reset(context);
+
     /* Truncate to zero size and seek to zero offset */
     if (ftruncate(context->log_context.log_fd, 0) < 0 ||
         lseek(context->log_context.log_fd, 0, SEEK_SET) < 0) {
@@ -2564,9 +2946,10 @@ kadm5_log_truncate(kadm5_server_context *context, size_t keep, size_t maxbytes)
         return ret;
     }
 
-    /* Done.  Now rebuild the log_context state. */
+    /* Done.  Now rebuild the index and the log_context state. */
+    log_index_update(context, off);
     (void) lseek(context->log_context.log_fd, off, SEEK_SET);
-    sp = krb5_storage_from_fd(context->log_context.log_fd);
+    sp = krb5_storage_buffered_from_fd(context->log_context.log_fd);
     if (sp == NULL)
 	return errno ? errno : krb5_enomem(context->context);
     ret = kadm5_log_goto_end(context, sp);
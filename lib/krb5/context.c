@@ -105,6 +105,11 @@ init_context_from_config_file(krb5_context context)
     char **s;
     krb5_enctype *tmptypes;
 
+    ret = heim_config_compile(context->hcontext,
+                              (const heim_config_section *)context->cf);
+    if (ret)
+        return ret;
+
     INIT_FIELD(context, time, max_skew, 5 * 60, "clockskew");
     INIT_FIELD(context, time, kdc_timeout, 30, "kdc_timeout");
     INIT_FIELD(context, time, host_timeout, 3, "host_timeout");
@@ -597,6 +602,10 @@ krb5_copy_context(krb5_context context, krb5_context *out)
     ret = _krb5_config_copy(context, context->cf, &p->cf);
     if (ret)
 	goto out;
+    ret = heim_config_compile(p->hcontext,
+                              (const heim_config_section *)p->cf);
+    if (ret)
+	goto out;
 
     /* XXX should copy */
     _krb5_init_ets(p);
@@ -637,6 +646,7 @@ krb5_copy_context(krb5_context context, krb5_context *out)
 KRB5_LIB_FUNCTION void KRB5_LIB_CALL
 krb5_free_context(krb5_context context)
 {
+    krb5_crypto_set_cache_size(context, 0);
     _krb5_free_name_canon_rules(context, context->name_canon_rules);
     if (context->default_cc_name)
 	free(context->default_cc_name);
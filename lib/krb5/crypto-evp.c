@@ -163,6 +163,8 @@ _krb5_evp_hmac_iov(krb5_context context,
     return 0;
 }
 
+static const unsigned char zero_ivec[EVP_MAX_BLOCK_LENGTH] = { 0 };
+
 krb5_error_code
 _krb5_evp_encrypt(krb5_context context,
 		struct _krb5_key_data *key,
@@ -175,16 +177,11 @@ _krb5_evp_encrypt(krb5_context context,
     struct _krb5_evp_schedule *ctx = key->schedule->data;
     EVP_CIPHER_CTX *c;
     c = encryptp ? &ctx->ectx : &ctx->dctx;
-    if (ivec == NULL) {
-	/* alloca ? */
-	size_t len2 = EVP_CIPHER_CTX_iv_length(c);
-	void *loiv = malloc(len2);
-	if (loiv == NULL)
-	    return krb5_enomem(context);
-	memset(loiv, 0, len2);
-	EVP_CipherInit_ex(c, NULL, NULL, NULL, loiv, -1);
-	free(loiv);
-    } else
+    heim_assert(EVP_CIPHER_CTX_iv_length(c) <= sizeof(zero_ivec),
+		"ivec too big for zero_ivec");
+    if (ivec == NULL)
+	EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
+    else
 	EVP_CipherInit_ex(c, NULL, NULL, NULL, ivec, -1);
     EVP_Cipher(c, data, data, len);
     return 0;
@@ -198,8 +195,6 @@ struct _krb5_evp_iov_cursor
     int nextidx;
 };
 
-static const unsigned char zero_ivec[EVP_MAX_BLOCK_LENGTH] = { 0 };
-
 static inline int
 _krb5_evp_iov_should_encrypt(struct krb5_crypto_iov *iov)
 {
@@ -381,7 +376,7 @@ _krb5_evp_encrypt_iov(krb5_context context,
     while (!_krb5_evp_iov_cursor_done(&cursor)) {
 
 	/* Number of bytes of data in this iovec that are in whole blocks */
-        wholeblocks = cursor.current.length & ~blockmask;
+        wholeblocks = cursor.current.length & blockmask;
 
         if (wholeblocks != 0) {
             EVP_Cipher(c, cursor.current.data,
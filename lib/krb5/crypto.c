@@ -1548,6 +1548,50 @@ iov_uncoalesce(krb5_context context,
     return 0;
 }
 
+/*
+ * The checksum of F_ENC_THEN_CKSUM enctypes covers the ivec, the header
+ * and the DATA and SIGN_ONLY buffers, laid out as iov_coalesce() would.
+ * Describe that in sign_iov (of IOV_SIGN_MAX entries) so that it can be
+ * checksummed where it lies.
+ *
+ * Returns FALSE if it can't be done without copying: too many buffers, or
+ * padding (which is checksummed as zeros); the caller then coalesces.
+ */
+#define IOV_SIGN_MAX 16
+
+static krb5_boolean
+iov_sign_prefixed(krb5_data *prefix,
+		  krb5_crypto_iov *data,
+		  int num_data,
+		  krb5_crypto_iov *sign_iov,
+		  int *num_sign)
+{
+    krb5_crypto_iov *hiv, *piv;
+    int i, n;
+
+    if (num_data + 1 > IOV_SIGN_MAX)
+	return FALSE;
+
+    piv = iov_find(data, num_data, KRB5_CRYPTO_TYPE_PADDING);
+    if (piv && piv->data.length != 0)
+	return FALSE;
+
+    hiv = iov_find(data, num_data, KRB5_CRYPTO_TYPE_HEADER);
+
+    n = 0;
+    sign_iov[n].flags = KRB5_CRYPTO_TYPE_DATA;
+    sign_iov[n++].data = *prefix;
+    sign_iov[n++] = *hiv;
+    for (i = 0; i < num_data; i++) {
+	if (data[i].flags == KRB5_CRYPTO_TYPE_DATA ||
+	    data[i].flags == KRB5_CRYPTO_TYPE_SIGN_ONLY)
+	    sign_iov[n++] = data[i];
+    }
+    *num_sign = n;
+
+    return TRUE;
+}
+
 static krb5_error_code
 iov_pad_validate(const struct _krb5_encryption_type *et,
 		 krb5_crypto_iov *data,
@@ -1660,7 +1704,9 @@ krb5_encrypt_iov_ivec(krb5_context context,
 
     if (et->flags & F_ENC_THEN_CKSUM) {
 	unsigned char old_ivec[EVP_MAX_IV_LENGTH];
+	krb5_crypto_iov sign_iov[IOV_SIGN_MAX];
 	krb5_data ivec_data;
+	int num_sign;
 
 	heim_assert(et->blocksize <= sizeof(old_ivec),
 		    "blocksize too big for ivec buffer");
@@ -1701,29 +1747,45 @@ krb5_encrypt_iov_ivec(krb5_context context,
 	ivec_data.length = et->blocksize;
 	ivec_data.data = old_ivec;
 
-	ret = iov_coalesce(context, &ivec_data, data, num_data, TRUE, &sign_data);
-	if(ret)
-	    goto cleanup;
-
-        ret = create_checksum(context,
-                              et->keyed_checksum,
-                              crypto,
-                              INTEGRITY_USAGE(usage),
-                              sign_data.data,
-                              sign_data.length,
-                              &cksum);
+	if (iov_sign_prefixed(&ivec_data, data, num_data,
+			      sign_iov, &num_sign)) {
+	    /* checksum straight into the trailer */
+	    cksum.checksum = tiv->data;
+	    ret = create_checksum_iov(context,
+				      et->keyed_checksum,
+				      crypto,
+				      INTEGRITY_USAGE(usage),
+				      sign_iov,
+				      num_sign,
+				      &cksum);
+	    if (ret)
+		goto cleanup;
+	} else {
+	    ret = iov_coalesce(context, &ivec_data, data, num_data, TRUE,
+			       &sign_data);
+	    if(ret)
+		goto cleanup;
 
-        if(ret == 0 && cksum.checksum.length != trailersz) {
-            free_Checksum (&cksum);
-            krb5_clear_error_message (context);
-            ret = KRB5_CRYPTO_INTERNAL;
-        }
-        if (ret)
-            goto cleanup;
+	    ret = create_checksum(context,
+				  et->keyed_checksum,
+				  crypto,
+				  INTEGRITY_USAGE(usage),
+				  sign_data.data,
+				  sign_data.length,
+				  &cksum);
+
+	    if(ret == 0 && cksum.checksum.length != trailersz) {
+		free_Checksum (&cksum);
+		krb5_clear_error_message (context);
+		ret = KRB5_CRYPTO_INTERNAL;
+	    }
+	    if (ret)
+		goto cleanup;
 
-        /* save cksum at end */
-        memcpy(tiv->data.data, cksum.checksum.data, cksum.checksum.length);
-        free_Checksum (&cksum);
+	    /* save cksum at end */
+	    memcpy(tiv->data.data, cksum.checksum.data, cksum.checksum.length);
+	    free_Checksum (&cksum);
+	}
 
     } else {
         cksum.checksum = tiv->data;
@@ -1878,7 +1940,9 @@ krb5_decrypt_iov_ivec(krb5_context context,
 	if(ret)
 	    goto cleanup;
     } else {
+	krb5_crypto_iov sign_iov[IOV_SIGN_MAX];
 	krb5_data ivec_data;
+	int num_sign;
 	static unsigned char zero_ivec[EVP_MAX_IV_LENGTH];
 
 	heim_assert(et->blocksize <= sizeof(zero_ivec),
@@ -1887,24 +1951,27 @@ krb5_decrypt_iov_ivec(krb5_context context,
 	ivec_data.length = et->blocksize;
 	ivec_data.data = ivec ? ivec : zero_ivec;
 
-	ret = iov_coalesce(context, &ivec_data, data, num_data, TRUE, &sign_data);
-	if(ret)
-	    goto cleanup;
-
 	cksum.checksum.data   = tiv->data.data;
 	cksum.checksum.length = tiv->data.length;
 	cksum.cksumtype       = CHECKSUMTYPE(et->keyed_checksum);
 
-	ret = verify_checksum(context,
-			      crypto,
-			      INTEGRITY_USAGE(usage),
-			      sign_data.data,
-			      sign_data.length,
-			      &cksum);
-	if(ret)
-	    goto cleanup;
+	if (iov_sign_prefixed(&ivec_data, data, num_data,
+			      sign_iov, &num_sign)) {
+	    ret = verify_checksum_iov(context, crypto, INTEGRITY_USAGE(usage),
+				      sign_iov, num_sign, &cksum);
+	} else {
+	    ret = iov_coalesce(context, &ivec_data, data, num_data, TRUE,
+			       &sign_data);
+	    if(ret)
+		goto cleanup;
 
-	ret = iov_coalesce(context, NULL, data, num_data, FALSE, &enc_data);
+	    ret = verify_checksum(context,
+				  crypto,
+				  INTEGRITY_USAGE(usage),
+				  sign_data.data,
+				  sign_data.length,
+				  &cksum);
+	}
 	if(ret)
 	    goto cleanup;
 
@@ -1916,14 +1983,25 @@ krb5_decrypt_iov_ivec(krb5_context context,
 	if(ret)
 	    goto cleanup;
 
-	ret = (*et->encrypt)(context, dkey, enc_data.data, enc_data.length,
-			     0, usage, ivec);
-	if(ret)
-	    goto cleanup;
+	if (et->encrypt_iov != NULL) {
+	    ret = (*et->encrypt_iov)(context, dkey, data, num_data,
+				     0, usage, ivec);
+	    if(ret)
+		goto cleanup;
+	} else {
+	    ret = iov_coalesce(context, NULL, data, num_data, FALSE, &enc_data);
+	    if(ret)
+		goto cleanup;
 
-	ret = iov_uncoalesce(context, &enc_data, data, num_data);
-	if(ret)
-	    goto cleanup;
+	    ret = (*et->encrypt)(context, dkey, enc_data.data, enc_data.length,
+				 0, usage, ivec);
+	    if(ret)
+		goto cleanup;
+
+	    ret = iov_uncoalesce(context, &enc_data, data, num_data);
+	    if(ret)
+		goto cleanup;
+	}
     }
 
 cleanup:
@@ -2483,6 +2561,235 @@ _get_derived_key(krb5_context context,
     return _krb5_derive_key(context, crypto->et, d, constant, sizeof(constant));
 }
 
+/*
+ * A context may keep a cache of crypto contexts, so that processes
+ * that use the same long-term keys over and over (the KDC) compute
+ * the key schedules and derived keys of each key only once.  The
+ * cache holds a reference to each crypto context and hands out more
+ * references from krb5_crypto_init(); krb5_crypto_destroy() drops
+ * one.
+ *
+ * Cached contexts are found through a hash table on
+ * crypto_cache_hash().  Session keys are only used for an exchange
+ * or two and must not push the long-term keys out, so a key is only
+ * cached the second time it is seen (`seen' remembers the hashes of
+ * recent misses), and then goes to a probationary LRU list of a
+ * quarter of the cache.  Only when it is used again from the cache
+ * does it move to the protected list, so keys that are used just a
+ * couple of times only ever evict each other.
+ */
+
+#define CRYPTO_CACHE_PROBATION	0
+#define CRYPTO_CACHE_PROTECTED	1
+
+struct _krb5_crypto_cache_list {
+    size_t max;
+    size_t count;
+    struct krb5_crypto_data *head;	/* most recently used */
+    struct krb5_crypto_data *tail;
+};
+
+struct _krb5_crypto_cache {
+    size_t size;
+    size_t nbuckets;			/* a power of two */
+    struct krb5_crypto_data **buckets;
+    unsigned *seen;			/* nbuckets hashes of misses */
+    struct _krb5_crypto_cache_list list[2];
+};
+
+static unsigned
+crypto_cache_hash(krb5_enctype etype, const krb5_keyblock *key)
+{
+    const unsigned char *p = key->keyvalue.data;
+    unsigned h = 2166136261U;
+    size_t i;
+
+    h = (h ^ (unsigned)etype) * 16777619U;
+    h = (h ^ (unsigned)key->keytype) * 16777619U;
+    for (i = 0; i < key->keyvalue.length; i++)
+	h = (h ^ p[i]) * 16777619U;
+    return h;
+}
+
+static void
+crypto_cache_unlink(struct _krb5_crypto_cache *cache, krb5_crypto crypto)
+{
+    struct _krb5_crypto_cache_list *list = &cache->list[crypto->cache_list];
+
+    if (crypto->cache_prev)
+	crypto->cache_prev->cache_next = crypto->cache_next;
+    else
+	list->head = crypto->cache_next;
+    if (crypto->cache_next)
+	crypto->cache_next->cache_prev = crypto->cache_prev;
+    else
+	list->tail = crypto->cache_prev;
+    crypto->cache_prev = crypto->cache_next = NULL;
+    list->count--;
+}
+
+static void
+crypto_cache_push(struct _krb5_crypto_cache *cache, krb5_crypto crypto,
+		  int which)
+{
+    struct _krb5_crypto_cache_list *list = &cache->list[which];
+
+    crypto->cache_list = which;
+    crypto->cache_prev = NULL;
+    crypto->cache_next = list->head;
+    if (list->head)
+	list->head->cache_prev = crypto;
+    else
+	list->tail = crypto;
+    list->head = crypto;
+    list->count++;
+}
+
+static void
+crypto_cache_insert(struct _krb5_crypto_cache *cache, krb5_crypto crypto)
+{
+    krb5_crypto *b = &cache->buckets[crypto->hash & (cache->nbuckets - 1)];
+
+    crypto->cache_hnext = *b;
+    *b = crypto;
+}
+
+static void
+crypto_cache_remove(krb5_context context, struct _krb5_crypto_cache *cache,
+		    krb5_crypto crypto)
+{
+    krb5_crypto *b = &cache->buckets[crypto->hash & (cache->nbuckets - 1)];
+
+    for (; *b != NULL; b = &(*b)->cache_hnext) {
+	if (*b == crypto) {
+	    *b = crypto->cache_hnext;
+	    break;
+	}
+    }
+    crypto->cache_hnext = NULL;
+    crypto_cache_unlink(cache, crypto);
+    krb5_crypto_destroy(context, crypto);
+}
+
+static krb5_crypto
+crypto_cache_find(struct _krb5_crypto_cache *cache, unsigned hash,
+		  krb5_enctype etype, const krb5_keyblock *key)
+{
+    krb5_crypto c;
+
+    c = cache->buckets[hash & (cache->nbuckets - 1)];
+    for (; c != NULL; c = c->cache_hnext) {
+	if (c->hash == hash && c->et->type == etype &&
+	    c->key.key->keytype == key->keytype &&
+	    c->key.key->keyvalue.length == key->keyvalue.length &&
+	    ct_memcmp(c->key.key->keyvalue.data, key->keyvalue.data,
+		      key->keyvalue.length) == 0)
+	    return c;
+    }
+    return NULL;
+}
+
+static void
+crypto_cache_trim(krb5_context context, struct _krb5_crypto_cache *cache)
+{
+    struct _krb5_crypto_cache_list *protected;
+    struct _krb5_crypto_cache_list *probation;
+    krb5_crypto c;
+
+    protected = &cache->list[CRYPTO_CACHE_PROTECTED];
+    probation = &cache->list[CRYPTO_CACHE_PROBATION];
+
+    /* keys falling out of the protected list get one more chance */
+    while (protected->count > protected->max) {
+	c = protected->tail;
+	crypto_cache_unlink(cache, c);
+	crypto_cache_push(cache, c, CRYPTO_CACHE_PROBATION);
+    }
+    while (probation->count > probation->max)
+	crypto_cache_remove(context, cache, probation->tail);
+}
+
+/**
+ * Make krb5_crypto_init() return shared crypto contexts for keys it
+ * has seen recently, so that their key schedules and derived keys are
+ * computed only once.  At most `size' keys are remembered; a size of
+ * zero turns the cache off.
+ *
+ * Keys are only cached once they are used repeatedly, so that short
+ * lived keys, e.g., session keys, don't push out long-term ones.
+ *
+ * The crypto contexts are shared and not locked, so this should only
+ * be used by programs that do not use the context from more than one
+ * thread.
+ *
+ * @param context Kerberos context
+ * @param size number of crypto contexts to keep
+ *
+ * @return Return an error code or 0.
+ *
+ * @ingroup krb5_crypto
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_crypto_set_cache_size(krb5_context context, size_t size)
+{
+    struct _krb5_crypto_cache *cache = context->crypto_cache;
+    krb5_crypto *buckets, c;
+    unsigned *seen;
+    size_t nbuckets, i;
+
+    if (size == 0) {
+	if (cache == NULL)
+	    return 0;
+	for (i = 0; i < 2; i++)
+	    while (cache->list[i].tail != NULL)
+		crypto_cache_remove(context, cache, cache->list[i].tail);
+	free(cache->buckets);
+	free(cache->seen);
+	free(cache);
+	context->crypto_cache = NULL;
+	return 0;
+    }
+
+    if (cache == NULL) {
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+	    return krb5_enomem(context);
+	context->crypto_cache = cache;
+    }
+
+    for (nbuckets = 8; nbuckets < size; nbuckets *= 2)
+	;
+    if (nbuckets != cache->nbuckets) {
+	buckets = calloc(nbuckets, sizeof(buckets[0]));
+	seen = calloc(nbuckets, sizeof(seen[0]));
+	if (buckets == NULL || seen == NULL) {
+	    free(buckets);
+	    free(seen);
+	    if (cache->buckets == NULL) {
+		free(cache);
+		context->crypto_cache = NULL;
+	    }
+	    return krb5_enomem(context);
+	}
+	free(cache->buckets);
+	free(cache->seen);
+	cache->buckets = buckets;
+	cache->seen = seen;
+	cache->nbuckets = nbuckets;
+	for (i = 0; i < 2; i++)
+	    for (c = cache->list[i].head; c != NULL; c = c->cache_next)
+		crypto_cache_insert(cache, c);
+    }
+
+    cache->size = size;
+    cache->list[CRYPTO_CACHE_PROBATION].max = size < 4 ? 1 : size / 4;
+    cache->list[CRYPTO_CACHE_PROTECTED].max =
+	size - cache->list[CRYPTO_CACHE_PROBATION].max;
+    crypto_cache_trim(context, cache);
+    return 0;
+}
+
 /**
  * Create a crypto context used for all encryption and signature
  * operation. The encryption type to use is taken from the key, but
@@ -2507,12 +2814,29 @@ krb5_crypto_init(krb5_context context,
 		 krb5_enctype etype,
 		 krb5_crypto *crypto)
 {
+    struct _krb5_crypto_cache *cache = context->crypto_cache;
     krb5_error_code ret;
+    unsigned hash = 0;
+
+    if(etype == (krb5_enctype)ETYPE_NULL)
+	etype = key->keytype;
+    if (cache) {
+	hash = crypto_cache_hash(etype, key);
+	*crypto = crypto_cache_find(cache, hash, etype, key);
+	if (*crypto) {
+	    crypto_cache_unlink(cache, *crypto);
+	    if (cache->list[CRYPTO_CACHE_PROTECTED].max > 0)
+		crypto_cache_push(cache, *crypto, CRYPTO_CACHE_PROTECTED);
+	    else
+		crypto_cache_push(cache, *crypto, CRYPTO_CACHE_PROBATION);
+	    crypto_cache_trim(context, cache);
+	    (*crypto)->refcount++;
+	    return 0;
+	}
+    }
     ALLOC(*crypto, 1);
     if (*crypto == NULL)
 	return krb5_enomem(context);
-    if(etype == (krb5_enctype)ETYPE_NULL)
-	etype = key->keytype;
     (*crypto)->et = _krb5_find_enctype(etype);
     if((*crypto)->et == NULL || ((*crypto)->et->flags & F_DISABLED)) {
 	free(*crypto);
@@ -2535,6 +2859,17 @@ krb5_crypto_init(krb5_context context,
     (*crypto)->key.schedule = NULL;
     (*crypto)->num_key_usage = 0;
     (*crypto)->key_usage = NULL;
+    (*crypto)->refcount = 1;
+    if (cache && cache->seen[hash & (cache->nbuckets - 1)] != hash) {
+	/* first sighting, remember it but don't cache it yet */
+	cache->seen[hash & (cache->nbuckets - 1)] = hash;
+    } else if (cache) {
+	(*crypto)->hash = hash;
+	(*crypto)->refcount++;
+	crypto_cache_insert(cache, *crypto);
+	crypto_cache_push(cache, *crypto, CRYPTO_CACHE_PROBATION);
+	crypto_cache_trim(context, cache);
+    }
     return 0;
 }
 
@@ -2584,6 +2919,10 @@ krb5_crypto_destroy(krb5_context context,
 {
     int i;
 
+    if (crypto->refcount > 1) {
+	crypto->refcount--;
+	return 0;
+    }
     for(i = 0; i < crypto->num_key_usage; i++)
 	free_key_usage(context, &crypto->key_usage[i], crypto->et);
     free(crypto->key_usage);
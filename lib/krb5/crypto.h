@@ -216,6 +216,12 @@ struct krb5_crypto_data {
     HMAC_CTX *hmacctx;
     int num_key_usage;
     struct _krb5_key_usage *key_usage;
+    unsigned refcount;
+    unsigned hash;			/* only set when cached */
+    struct krb5_crypto_data *cache_prev;
+    struct krb5_crypto_data *cache_next;
+    struct krb5_crypto_data *cache_hnext;
+    int cache_list;
 };
 
 #endif
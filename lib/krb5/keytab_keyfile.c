@@ -203,7 +203,7 @@ akf_start_seq_get(krb5_context context,
     }
 
     c->data = NULL;
-    c->sp = krb5_storage_from_fd(c->fd);
+    c->sp = krb5_storage_buffered_from_fd(c->fd);
     if (c->sp == NULL) {
 	close(c->fd);
 	krb5_clear_error_message (context);
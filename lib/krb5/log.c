@@ -81,6 +81,27 @@ krb5_openlog(krb5_context context,
     return ret;
 }
 
+/**
+ * Write the file destinations of a log facility from a background
+ * thread, through a queue of @entries lines, see heim_log_set_async().
+ *
+ * @param context A Kerberos 5 context
+ * @param fac the log facility
+ * @param entries size of the queue, 0 keeps logging synchronous
+ *
+ * @return Return an error code or 0.
+ *
+ * @ingroup krb5_error
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_log_set_async(krb5_context context,
+                   krb5_log_facility *fac,
+                   size_t entries)
+{
+    return heim_log_set_async(context->hcontext, fac, entries);
+}
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_closelog(krb5_context context,
              krb5_log_facility *fac)
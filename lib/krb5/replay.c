@@ -34,10 +34,64 @@
 #include "krb5_locl.h"
 #include <vis.h>
 
+#if defined(HAVE_MMAP) && defined(HAVE_FCNTL)
+#define HAVE_RC_HASH 1
+#endif
+
+enum rc_type { RC_FILE = 0, RC_HASH };
+
 struct krb5_rcache_data {
     char *name;
+    enum rc_type type;
+    int fd;
+    unsigned char *map;
+    size_t maplen;
 };
 
+/*
+ * The HASH replay cache is a file holding a fixed size open addressing
+ * hash table that every process using it maps shared.  An
+ * authenticator's checksum, keyed with the table's random salt so
+ * that clients can't aim at one bucket, selects a bucket of
+ * RC_HASH_BUCKET_SLOTS slots; a store locks just that bucket with
+ * fcntl(), looks for the checksum among the slots that are still
+ * inside the lifespan, and reuses the first expired (or never used)
+ * slot for the new entry.  Lookups and inserts therefore cost the same
+ * however busy the acceptor is.  A bucket whose slots are all still
+ * inside the lifespan fails the store: forgetting a live entry would
+ * let its replay through.  The table is sized from the expected rate
+ * of authenticators so that this doesn't happen.
+ *
+ * A table is never resized in place, since other processes have it
+ * mapped: a new one is written next to it and renamed over it.  The
+ * old one is marked replaced first, under a lock on the whole file,
+ * and stores that find the mark map the new one.
+ */
+
+#define RC_HASH_MAGIC		0x52434831 /* "RCH1" */
+#define RC_HASH_VERSION		2
+#define RC_HASH_BUCKET_SLOTS	32
+#define RC_HASH_DEFAULT_BUCKETS	16384
+#define RC_HASH_MAX_BUCKETS	(1U << 22) /* a 3 GB file */
+
+struct rc_hash_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nbuckets;
+    int32_t lifespan;
+    unsigned char salt[16];
+    uint32_t replaced;
+    unsigned char pad[28];
+};
+
+struct rc_hash_slot {
+    int64_t stamp;
+    unsigned char data[16];
+};
+
+#define RC_HASH_BUCKET_SIZE \
+    (RC_HASH_BUCKET_SLOTS * sizeof(struct rc_hash_slot))
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_resolve(krb5_context context,
 		krb5_rcache id,
@@ -57,8 +111,16 @@ krb5_rc_resolve_type(krb5_context context,
 		     krb5_rcache *id,
 		     const char *type)
 {
+    enum rc_type t;
+
     *id = NULL;
-    if(strcmp(type, "FILE")) {
+    if (strcmp(type, "FILE") == 0)
+	t = RC_FILE;
+#ifdef HAVE_RC_HASH
+    else if (strcmp(type, "HASH") == 0)
+	t = RC_HASH;
+#endif
+    else {
 	krb5_set_error_message (context, KRB5_RC_TYPE_NOTFOUND,
 				N_("replay cache type %s not supported", ""),
 				type);
@@ -70,6 +132,8 @@ krb5_rc_resolve_type(krb5_context context,
 			       N_("malloc: out of memory", ""));
 	return KRB5_RC_MALLOC;
     }
+    (*id)->type = t;
+    (*id)->fd = -1;
     return 0;
 }
 
@@ -79,16 +143,21 @@ krb5_rc_resolve_full(krb5_context context,
 		     const char *string_name)
 {
     krb5_error_code ret;
+    const char *type;
 
     *id = NULL;
 
-    if(strncmp(string_name, "FILE:", 5)) {
+    if (strncmp(string_name, "FILE:", 5) == 0)
+	type = "FILE";
+    else if (strncmp(string_name, "HASH:", 5) == 0)
+	type = "HASH";
+    else {
 	krb5_set_error_message(context, KRB5_RC_TYPE_NOTFOUND,
 			       N_("replay cache type %s not supported", ""),
 			       string_name);
 	return KRB5_RC_TYPE_NOTFOUND;
     }
-    ret = krb5_rc_resolve_type(context, id, "FILE");
+    ret = krb5_rc_resolve_type(context, id, type);
     if(ret)
 	return ret;
     ret = krb5_rc_resolve(context, *id, string_name + 5);
@@ -123,15 +192,314 @@ struct rc_entry{
     unsigned char data[16];
 };
 
+#ifdef HAVE_RC_HASH
+
+static krb5_error_code
+rc_hash_error(krb5_context context, krb5_rcache id, const char *op, int ret)
+{
+    char buf[128];
+
+    rk_strerror_r(ret, buf, sizeof(buf));
+    krb5_set_error_message(context, ret, "%s(%s): %s", op, id->name, buf);
+    return ret;
+}
+
+static void
+rc_hash_unmap(krb5_rcache id)
+{
+    if (id->map != NULL)
+	munmap(id->map, id->maplen);
+    id->map = NULL;
+    id->maplen = 0;
+    if (id->fd != -1)
+	close(id->fd);
+    id->fd = -1;
+}
+
+static int
+rc_hash_valid(const struct rc_hash_header *h, off_t size)
+{
+    return h->magic == RC_HASH_MAGIC && h->version == RC_HASH_VERSION &&
+	h->nbuckets > 0 &&
+	size == (off_t)(sizeof(*h) + (off_t)h->nbuckets * RC_HASH_BUCKET_SIZE);
+}
+
+static krb5_error_code
+rc_hash_map(krb5_context context, krb5_rcache id)
+{
+    struct stat sb;
+    void *p;
+
+    /* keep the mapping unless the table was replaced */
+    if (id->map != NULL) {
+	if (!((struct rc_hash_header *)id->map)->replaced)
+	    return 0;
+	rc_hash_unmap(id);
+    }
+
+    id->fd = open(id->name, O_RDWR | O_BINARY | O_CLOEXEC);
+    if (id->fd < 0)
+	return rc_hash_error(context, id, "open", errno);
+    if (fstat(id->fd, &sb) < 0) {
+	int ret = errno;
+	rc_hash_unmap(id);
+	return rc_hash_error(context, id, "fstat", ret);
+    }
+    if (sb.st_size < (off_t)sizeof(struct rc_hash_header))
+	goto bad;
+    p = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, id->fd, 0);
+    if (p == MAP_FAILED) {
+	int ret = errno;
+	rc_hash_unmap(id);
+	return rc_hash_error(context, id, "mmap", ret);
+    }
+    id->map = p;
+    id->maplen = sb.st_size;
+    if (!rc_hash_valid(p, sb.st_size))
+	goto bad;
+    return 0;
+
+ bad:
+    rc_hash_unmap(id);
+    krb5_set_error_message(context, KRB5_RC_IO_UNKNOWN,
+			   N_("%s is not a replay cache", ""), id->name);
+    return KRB5_RC_IO_UNKNOWN;
+}
+
+static int
+rc_hash_lock(int fd, uint32_t bucket, short type)
+{
+    struct flock l;
+
+    l.l_start = sizeof(struct rc_hash_header) +
+	(off_t)bucket * RC_HASH_BUCKET_SIZE;
+    l.l_len = RC_HASH_BUCKET_SIZE;
+    l.l_type = type;
+    l.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &l) < 0) {
+	if (errno == EINTR)
+	    continue;
+	if (errno == EINVAL) /* no locking, as _krb5_xlock() */
+	    return 0;
+	return errno;
+    }
+    return 0;
+}
+
+/*
+ * Tell processes that have the table open in `fd' to look for a new
+ * one.  The caller holds a lock on the whole file, so no store is
+ * in progress.
+ */
+static krb5_error_code
+rc_hash_retire(krb5_context context, krb5_rcache id, int fd)
+{
+    uint32_t replaced = 1;
+
+    if (pwrite(fd, &replaced, sizeof(replaced),
+	       offsetof(struct rc_hash_header, replaced)) != sizeof(replaced))
+	return rc_hash_error(context, id, "write", errno);
+    return 0;
+}
+
+/* Write a new table and rename it over the old one, valid in `old_fd' */
+static krb5_error_code
+rc_hash_create(krb5_context context, krb5_rcache id, int old_fd,
+	       uint32_t nbuckets, krb5_deltat auth_lifespan)
+{
+    struct rc_hash_header h;
+    char *tmp;
+    int ret = 0, fd;
+
+    if (asprintf(&tmp, "%s.XXXXXX", id->name) < 0 || tmp == NULL)
+	return krb5_enomem(context);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+	ret = rc_hash_error(context, id, "mkstemp", errno);
+	free(tmp);
+	return ret;
+    }
+
+    memset(&h, 0, sizeof(h));
+    h.magic = RC_HASH_MAGIC;
+    h.version = RC_HASH_VERSION;
+    h.nbuckets = nbuckets;
+    h.lifespan = auth_lifespan;
+    krb5_generate_random_block(h.salt, sizeof(h.salt));
+
+    if (ftruncate(fd, sizeof(h) + (off_t)nbuckets * RC_HASH_BUCKET_SIZE) < 0)
+	ret = rc_hash_error(context, id, "ftruncate", errno);
+    else if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+	ret = rc_hash_error(context, id, "write", errno);
+    else if (old_fd != -1 && (ret = rc_hash_retire(context, id, old_fd)))
+	;
+    else if (rename(tmp, id->name) < 0)
+	ret = rc_hash_error(context, id, "rename", errno);
+    close(fd);
+    if (ret)
+	unlink(tmp);
+    free(tmp);
+    return ret;
+}
+
+static krb5_error_code
+rc_hash_initialize(krb5_context context,
+		   krb5_rcache id,
+		   krb5_deltat auth_lifespan)
+{
+    struct rc_hash_header h;
+    struct stat sb;
+    uint64_t n;
+    uint32_t nbuckets;
+    int32_t lifespan;
+    off_t size;
+    int ret, fd, rate, valid;
+
+    /*
+     * Three times the authenticators of one lifespan at the expected
+     * rate leaves about ten live entries per bucket, and a bucket then
+     * practically never fills up.
+     */
+    rate = krb5_config_get_int_default(context, NULL, 0, "libdefaults",
+				       "rcache_hash_rate", NULL);
+    n = RC_HASH_DEFAULT_BUCKETS;
+    if (rate > 0 && auth_lifespan > 0)
+	n = max(n, (uint64_t)rate * auth_lifespan * 3 / RC_HASH_BUCKET_SLOTS);
+    n = min(n, RC_HASH_MAX_BUCKETS);
+    nbuckets = krb5_config_get_int_default(context, NULL, n, "libdefaults",
+					   "rcache_hash_buckets", NULL);
+    if (nbuckets == 0 || nbuckets > RC_HASH_MAX_BUCKETS)
+	nbuckets = n;
+    size = sizeof(h) + (off_t)nbuckets * RC_HASH_BUCKET_SIZE;
+
+    rc_hash_unmap(id);
+    fd = open(id->name, O_RDWR | O_BINARY | O_CLOEXEC);
+    if (fd < 0) {
+	if (errno != ENOENT)
+	    return rc_hash_error(context, id, "open", errno);
+	return rc_hash_create(context, id, -1, nbuckets, auth_lifespan);
+    }
+    ret = _krb5_xlock(context, fd, 1, id->name);
+    if (ret) {
+	close(fd);
+	return ret;
+    }
+
+    /*
+     * Other processes may have the table mapped, so a valid table of
+     * the right size is kept along with its entries; only the
+     * lifespan is updated.  Anything else is replaced by a new table.
+     */
+    if (fstat(fd, &sb) < 0) {
+	ret = rc_hash_error(context, id, "fstat", errno);
+	goto out;
+    }
+    valid = pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+	rc_hash_valid(&h, sb.st_size) && !h.replaced;
+    if (!valid || sb.st_size != size || h.nbuckets != nbuckets) {
+	ret = rc_hash_create(context, id, valid ? fd : -1, nbuckets,
+			     auth_lifespan);
+    } else {
+	lifespan = auth_lifespan;
+	if (pwrite(fd, &lifespan, sizeof(lifespan),
+		   offsetof(struct rc_hash_header, lifespan)) !=
+	    sizeof(lifespan))
+	    ret = rc_hash_error(context, id, "write", errno);
+    }
+
+ out:
+    _krb5_xunlock(context, fd);
+    close(fd);
+    return ret;
+}
+
+static krb5_error_code
+rc_hash_store(krb5_context context,
+	      krb5_rcache id,
+	      const unsigned char data[16],
+	      time_t now)
+{
+    struct rc_hash_header *h;
+    struct rc_hash_slot *slot, *free_slot = NULL;
+    unsigned char key[sizeof(h->salt) + 16], md[16];
+    uint32_t bucket;
+    time_t t;
+    size_t i;
+    int ret;
+
+    ret = rc_hash_map(context, id);
+    if (ret)
+	return ret;
+ again:
+    h = (struct rc_hash_header *)id->map;
+    t = now - h->lifespan;
+
+    memcpy(key, h->salt, sizeof(h->salt));
+    memcpy(key + sizeof(h->salt), data, 16);
+    EVP_Digest(key, sizeof(key), md, NULL, EVP_md5(), NULL);
+    bucket = ((uint32_t)md[0] | ((uint32_t)md[1] << 8) |
+	      ((uint32_t)md[2] << 16) | ((uint32_t)md[3] << 24)) %
+	h->nbuckets;
+    slot = (struct rc_hash_slot *)(id->map + sizeof(*h) +
+				   (size_t)bucket * RC_HASH_BUCKET_SIZE);
+
+    ret = rc_hash_lock(id->fd, bucket, F_WRLCK);
+    if (ret)
+	return rc_hash_error(context, id, "fcntl", ret);
+
+    /* replaced since it was mapped: the entry belongs in the new table */
+    if (h->replaced) {
+	rc_hash_lock(id->fd, bucket, F_UNLCK);
+	ret = rc_hash_map(context, id);
+	if (ret)
+	    return ret;
+	goto again;
+    }
+
+    for (i = 0; i < RC_HASH_BUCKET_SLOTS; i++) {
+	if (slot[i].stamp < t) {
+	    if (free_slot == NULL)
+		free_slot = &slot[i];
+	    continue;
+	}
+	if (memcmp(slot[i].data, data, sizeof(slot[i].data)) == 0) {
+	    rc_hash_lock(id->fd, bucket, F_UNLCK);
+	    krb5_clear_error_message(context);
+	    return KRB5_RC_REPLAY;
+	}
+    }
+    if (free_slot == NULL) {
+	rc_hash_lock(id->fd, bucket, F_UNLCK);
+	krb5_set_error_message(context, KRB5_RC_IO,
+			       N_("replay cache %s is full, raise "
+				  "rcache_hash_rate", ""), id->name);
+	return KRB5_RC_IO;
+    }
+    memcpy(free_slot->data, data, sizeof(free_slot->data));
+    free_slot->stamp = now;
+    rc_hash_lock(id->fd, bucket, F_UNLCK);
+
+    return 0;
+}
+
+#endif /* HAVE_RC_HASH */
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_initialize(krb5_context context,
 		   krb5_rcache id,
 		   krb5_deltat auth_lifespan)
 {
-    FILE *f = fopen(id->name, "w");
+    FILE *f;
     struct rc_entry tmp;
     int ret;
 
+#ifdef HAVE_RC_HASH
+    if (id->type == RC_HASH)
+	return rc_hash_initialize(context, id, auth_lifespan);
+#endif
+
+    f = fopen(id->name, "w");
+
     if(f == NULL) {
 	char buf[128];
 	ret = errno;
@@ -159,6 +527,14 @@ krb5_rc_destroy(krb5_context context,
 {
     int ret;
 
+#ifdef HAVE_RC_HASH
+    /* processes that have the table mapped must stop using it */
+    if (id->type == RC_HASH && rc_hash_map(context, id) == 0 &&
+	_krb5_xlock(context, id->fd, 1, id->name) == 0) {
+	(void) rc_hash_retire(context, id, id->fd);
+	_krb5_xunlock(context, id->fd);
+    }
+#endif
     if(remove(id->name) < 0) {
 	char buf[128];
 	ret = errno;
@@ -173,6 +549,9 @@ KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_close(krb5_context context,
 	      krb5_rcache id)
 {
+#ifdef HAVE_RC_HASH
+    rc_hash_unmap(id);
+#endif
     free(id->name);
     free(id);
     return 0;
@@ -210,6 +589,10 @@ krb5_rc_store(krb5_context context,
 
     ent.stamp = time(NULL);
     checksum_authenticator(rep, ent.data);
+#ifdef HAVE_RC_HASH
+    if (id->type == RC_HASH)
+	return rc_hash_store(context, id, ent.data, ent.stamp);
+#endif
     f = fopen(id->name, "r");
     if(f == NULL) {
 	char buf[128];
@@ -267,9 +650,24 @@ krb5_rc_get_lifespan(krb5_context context,
 		     krb5_rcache id,
 		     krb5_deltat *auth_lifespan)
 {
-    FILE *f = fopen(id->name, "r");
+    FILE *f;
     int r;
     struct rc_entry ent;
+
+#ifdef HAVE_RC_HASH
+    if (id->type == RC_HASH) {
+	krb5_error_code ret = rc_hash_map(context, id);
+	if (ret)
+	    return ret;
+	*auth_lifespan = ((struct rc_hash_header *)id->map)->lifespan;
+	return 0;
+    }
+#endif
+    f = fopen(id->name, "r");
+    if (f == NULL) {
+	krb5_clear_error_message (context);
+	return KRB5_RC_IO_UNKNOWN;
+    }
     r = fread(&ent, sizeof(ent), 1, f);
     fclose(f);
     if(r){
@@ -291,7 +689,7 @@ KRB5_LIB_FUNCTION const char* KRB5_LIB_CALL
 krb5_rc_get_type(krb5_context context,
 		 krb5_rcache id)
 {
-    return "FILE";
+    return id->type == RC_HASH ? "HASH" : "FILE";
 }
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
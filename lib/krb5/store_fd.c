@@ -36,9 +36,20 @@
 
 typedef struct fd_storage {
     int fd;
+    /* the rest is only used by krb5_storage_buffered_from_fd() */
+    unsigned char *buf;
+    size_t bufsize;
+    off_t off;			/* file offset of buf[0] */
+    size_t len;			/* bytes in buf */
+    size_t pos;			/* current position in buf */
+    unsigned int dirty:1;	/* buf holds writes not yet made */
+    unsigned int backward:1;	/* last seek went backward */
 } fd_storage;
 
 #define FD(S) (((fd_storage*)(S)->data)->fd)
+#define FDS(S) ((fd_storage*)(S)->data)
+
+#define FD_BUFSIZ 16384
 
 static ssize_t
 fd_fetch(krb5_storage * sp, void *data, size_t size)
@@ -131,22 +142,243 @@ fd_free(krb5_storage * sp)
         errno = save_errno;
 }
 
-/**
- *
- *
- * @return A krb5_storage on success, or NULL on out of memory error.
- *
- * @ingroup krb5_storage
+/*
+ * Buffered variant.  Reads are served from a read-ahead buffer and
+ * writes are collected in it, so a krb5_ret_uint32() is a memcpy()
+ * rather than a read(2).
  *
- * @sa krb5_storage_emem()
- * @sa krb5_storage_from_mem()
- * @sa krb5_storage_from_readonly_mem()
- * @sa krb5_storage_from_data()
- * @sa krb5_storage_from_socket()
+ * The dup()ed descriptor shares its offset with the caller's, which may
+ * also be moved by other storages on the same file while this one is in
+ * use (the kadm5 log code does that).  So the file offset is never
+ * trusted: every read and write is preceded by an lseek(2) to where it
+ * belongs, and when the storage is freed the offset is left at the
+ * storage's position, as with the unbuffered storage.
  */
 
-KRB5_LIB_FUNCTION krb5_storage * KRB5_LIB_CALL
-krb5_storage_from_fd(int fd_in)
+static ssize_t
+fd_read_at(fd_storage *s, off_t off, void *data, size_t size)
+{
+    char *cbuf = (char *)data;
+    ssize_t count;
+    size_t rem = size;
+
+    if (lseek(s->fd, off, SEEK_SET) == -1)
+	return -1;
+    while (rem > 0) {
+	count = read(s->fd, cbuf, rem);
+	if (count < 0) {
+	    if (errno == EINTR)
+		continue;
+	    else if (rem == size)
+		return count;
+	    else
+		return size - rem;
+	} else if (count == 0) {
+	    break;
+	}
+	cbuf += count;
+	rem -= count;
+    }
+    return size - rem;
+}
+
+static ssize_t
+fd_write_at(fd_storage *s, off_t off, const void *data, size_t size)
+{
+    const char *cbuf = (const char *)data;
+    ssize_t count;
+    size_t rem = size;
+
+    if (lseek(s->fd, off, SEEK_SET) == -1)
+	return -1;
+    while (rem > 0) {
+	count = write(s->fd, cbuf, rem);
+	if (count < 0) {
+	    if (errno == EINTR)
+		continue;
+	    else if (rem == size)
+		return count;
+	    else
+		return size - rem;
+	}
+	cbuf += count;
+	rem -= count;
+    }
+    return size;
+}
+
+/* write out pending writes, or forget read-ahead, keeping the position */
+static int
+fdb_flush(fd_storage *s)
+{
+    if (s->dirty && s->len > 0) {
+	ssize_t count = fd_write_at(s, s->off, s->buf, s->len);
+
+	if (count < 0 || (size_t)count != s->len) {
+	    if (count >= 0)
+		errno = EIO;
+	    return -1;
+	}
+    }
+    s->off += s->pos;
+    s->len = s->pos = 0;
+    s->dirty = 0;
+    return 0;
+}
+
+static ssize_t
+fdb_fetch(krb5_storage * sp, void *data, size_t size)
+{
+    fd_storage *s = FDS(sp);
+    char *cbuf = (char *)data;
+    ssize_t count;
+    size_t n, rem = size;
+
+    if (s->dirty && fdb_flush(s) == -1)
+	return -1;
+
+    while (rem > 0) {
+	if (s->pos < s->len) {
+	    n = s->len - s->pos < rem ? s->len - s->pos : rem;
+	    memcpy(cbuf, s->buf + s->pos, n);
+	    s->pos += n;
+	    cbuf += n;
+	    rem -= n;
+	    continue;
+	}
+	fdb_flush(s);
+
+	if (rem >= s->bufsize) {
+	    count = fd_read_at(s, s->off, cbuf, rem);
+	    if (count < 0)
+		return rem == size ? -1 : (ssize_t)(size - rem);
+	    s->off += count;
+	    rem -= count;
+	    break;
+	}
+
+	/*
+	 * After a backward seek keep some of what precedes the position
+	 * in the buffer, the log code walks backwards through entries.
+	 */
+	n = 0;
+	if (s->backward)
+	    n = s->off < (off_t)(s->bufsize / 2) ? s->off : s->bufsize / 2;
+	s->backward = 0;
+	count = fd_read_at(s, s->off - n, s->buf, s->bufsize);
+	if (count < 0)
+	    return rem == size ? -1 : (ssize_t)(size - rem);
+	if ((size_t)count <= n)
+	    break;		/* end of file */
+	s->off -= n;
+	s->len = count;
+	s->pos = n;
+    }
+    return size - rem;
+}
+
+static ssize_t
+fdb_store(krb5_storage * sp, const void *data, size_t size)
+{
+    fd_storage *s = FDS(sp);
+    ssize_t count;
+
+    if ((!s->dirty || s->len + size > s->bufsize) && fdb_flush(s) == -1)
+	return -1;
+
+    if (size >= s->bufsize) {
+	count = fd_write_at(s, s->off, data, size);
+	if (count > 0)
+	    s->off += count;
+	return count;
+    }
+    memcpy(s->buf + s->len, data, size);
+    s->len += size;
+    s->pos = s->len;
+    s->dirty = 1;
+    return size;
+}
+
+static off_t
+fdb_seek(krb5_storage * sp, off_t offset, int whence)
+{
+    fd_storage *s = FDS(sp);
+    off_t cur = s->off + s->pos;
+    off_t target;
+
+    if (s->dirty && fdb_flush(s) == -1)
+	return -1;
+
+    switch (whence) {
+    case SEEK_SET:
+	target = offset;
+	break;
+    case SEEK_CUR:
+	target = cur + offset;
+	break;
+    case SEEK_END:
+	target = lseek(s->fd, offset, SEEK_END);
+	if (target == -1)
+	    return -1;
+	break;
+    default:
+	errno = EINVAL;
+	return -1;
+    }
+    if (target < 0) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    if (target >= s->off && target <= s->off + (off_t)s->len) {
+	s->pos = target - s->off;
+    } else {
+	s->backward = target < cur;
+	s->off = target;
+	s->len = s->pos = 0;
+    }
+    return target;
+}
+
+static int
+fdb_trunc(krb5_storage * sp, off_t offset)
+{
+    fd_storage *s = FDS(sp);
+
+    if (fdb_flush(s) == -1)
+	return errno;
+    if (ftruncate(s->fd, offset) == -1)
+	return errno;
+    if (s->off > offset)
+	s->off = offset;
+    return 0;
+}
+
+static int
+fdb_sync(krb5_storage * sp)
+{
+    if (fdb_flush(FDS(sp)) == -1)
+	return errno;
+    if (fsync(FD(sp)) == -1)
+	return errno;
+    return 0;
+}
+
+static void
+fdb_free(krb5_storage * sp)
+{
+    fd_storage *s = FDS(sp);
+    int save_errno = errno;
+
+    (void) fdb_flush(s);
+    (void) lseek(s->fd, s->off + s->pos, SEEK_SET);
+    free(s->buf);
+    if (close(s->fd) == 0)
+        errno = save_errno;
+}
+
+static krb5_storage *
+fd_storage_alloc(int fd_in)
 {
     krb5_storage *sp;
     int saved_errno;
@@ -186,15 +418,105 @@ krb5_storage_from_fd(int fd_in)
 	errno = saved_errno;
 	return NULL;
     }
+    memset(sp->data, 0, sizeof(fd_storage));
     sp->flags = 0;
     sp->eof_code = HEIM_ERR_EOF;
     FD(sp) = fd;
+    sp->max_alloc = UINT_MAX/8;
+    return sp;
+}
+
+/**
+ * Create a krb5_storage on a file descriptor.  Every read and write
+ * on the storage is a read(2) or write(2) on the descriptor, see
+ * krb5_storage_buffered_from_fd() for a buffered variant.
+ *
+ * @param fd_in the file descriptor, it is dup()ed
+ *
+ * @return A krb5_storage on success, or NULL on out of memory error.
+ *
+ * @ingroup krb5_storage
+ *
+ * @sa krb5_storage_emem()
+ * @sa krb5_storage_from_mem()
+ * @sa krb5_storage_from_readonly_mem()
+ * @sa krb5_storage_from_data()
+ * @sa krb5_storage_from_socket()
+ * @sa krb5_storage_buffered_from_fd()
+ */
+
+KRB5_LIB_FUNCTION krb5_storage * KRB5_LIB_CALL
+krb5_storage_from_fd(int fd_in)
+{
+    krb5_storage *sp;
+
+    sp = fd_storage_alloc(fd_in);
+    if (sp == NULL)
+	return NULL;
     sp->fetch = fd_fetch;
     sp->store = fd_store;
     sp->seek = fd_seek;
     sp->trunc = fd_trunc;
     sp->fsync = fd_sync;
     sp->free = fd_free;
-    sp->max_alloc = UINT_MAX/8;
+    return sp;
+}
+
+/**
+ * Create a buffered krb5_storage on a seekable file descriptor.  Reads
+ * are done in large blocks and writes are collected until the storage
+ * is seeked, truncated, synced or freed, or the buffer is full.
+ *
+ * Errors from collected writes are returned by whichever of those
+ * operations writes them out, use krb5_storage_fsync() to see them.
+ *
+ * Other users of the file descriptor may move its offset while the
+ * storage is in use, but should not write to the file where the
+ * storage has buffered it.
+ *
+ * @param fd_in the file descriptor, it is dup()ed
+ *
+ * @return A krb5_storage on success, or NULL on error (errno is set).
+ *
+ * @ingroup krb5_storage
+ *
+ * @sa krb5_storage_from_fd()
+ * @sa krb5_storage_stdio_from_fd()
+ */
+
+KRB5_LIB_FUNCTION krb5_storage * KRB5_LIB_CALL
+krb5_storage_buffered_from_fd(int fd_in)
+{
+    krb5_storage *sp;
+    fd_storage *s;
+    off_t off;
+    int saved_errno;
+
+    off = lseek(fd_in, 0, SEEK_CUR);
+    if (off == -1)
+        return NULL;
+
+    sp = fd_storage_alloc(fd_in);
+    if (sp == NULL)
+	return NULL;
+    s = FDS(sp);
+    errno = ENOMEM;
+    s->buf = malloc(FD_BUFSIZ);
+    if (s->buf == NULL) {
+	saved_errno = errno;
+	close(s->fd);
+	free(s);
+	free(sp);
+	errno = saved_errno;
+	return NULL;
+    }
+    s->bufsize = FD_BUFSIZ;
+    s->off = off;
+    sp->fetch = fdb_fetch;
+    sp->store = fdb_store;
+    sp->seek = fdb_seek;
+    sp->trunc = fdb_trunc;
+    sp->fsync = fdb_sync;
+    sp->free = fdb_free;
     return sp;
 }
@@ -237,10 +237,122 @@ check_escaped_strings(void)
     krb5_free_context(context);
 }
 
+static const char compiled_config[] =
+    "[libdefaults]\n"
+    "\tdefault_realm = TEST.H5L.SE\n"
+    "\tclockskew = 1 min 30 s\n"
+    "\tmax_retries = 0x10\n"
+    "\tdns_lookup_kdc = yes\n"
+    "\tdns_lookup_realm = 0\n"
+    "\tdns_lookup_realm = 1\n"
+    "[realms]\n"
+    "\tTEST.H5L.SE = {\n"
+    "\t\tkdc = kdc1\n"
+    "\t}\n"
+    "\tTEST.H5L.SE = {\n"
+    "\t\tkdc = kdc2\n"
+    "\t\tadmin_server = admin\n"
+    "\t\tsub = {\n"
+    "\t\t\tvalue = true\n"
+    "\t\t}\n"
+    "\t}\n"
+    "[kdc]\n"
+    "\tkdc = not-a-section\n";
+
+/*
+ * Lookups in the compiled context configuration must give the same
+ * results as walking an uncompiled copy of it.
+ */
+
+static void
+check_compiled(void)
+{
+    krb5_context context;
+    krb5_config_section *c = NULL;
+    krb5_error_code ret;
+    const char *s1, *s2;
+    char **l1, **l2;
+    int i, j;
+    const char *names[][4] = {
+	{ "libdefaults", "default_realm", NULL },
+	{ "libdefaults", "clockskew", NULL },
+	{ "libdefaults", "max_retries", NULL },
+	{ "libdefaults", "dns_lookup_kdc", NULL },
+	{ "libdefaults", "dns_lookup_realm", NULL },
+	{ "libdefaults", "missing", NULL },
+	{ "realms", "TEST.H5L.SE", "kdc", NULL },
+	{ "realms", "TEST.H5L.SE", "admin_server", NULL },
+	{ "realms", "TEST.H5L.SE", "sub", NULL },
+	{ "kdc", "kdc", "x", NULL },
+	{ "libdefaults", NULL },
+    };
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context %d", ret);
+    ret = krb5_set_config(context, compiled_config);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_set_config");
+    ret = krb5_config_parse_string_multi(context, compiled_config, &c);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_config_parse_string_multi");
+
+    for (i = 0; i < sizeof(names)/sizeof(names[0]); i++) {
+	const char **n = names[i];
+
+	s1 = krb5_config_get_string(context, NULL, n[0], n[1], n[2], n[3]);
+	s2 = krb5_config_get_string(context, c, n[0], n[1], n[2], n[3]);
+	if ((s1 == NULL) != (s2 == NULL) || (s1 && strcmp(s1, s2) != 0))
+	    krb5_errx(context, 1, "string %s/%s: %s != %s", n[0], n[1],
+		      s1 ? s1 : "NULL", s2 ? s2 : "NULL");
+	if ((krb5_config_get_list(context, NULL, n[0], n[1], n[2], n[3])
+	     == NULL) !=
+	    (krb5_config_get_list(context, c, n[0], n[1], n[2], n[3]) == NULL))
+	    krb5_errx(context, 1, "list %s/%s", n[0], n[1]);
+	if (krb5_config_get_bool_default(context, NULL, 7, n[0], n[1], n[2],
+					 n[3]) !=
+	    krb5_config_get_bool_default(context, c, 7, n[0], n[1], n[2], n[3]))
+	    krb5_errx(context, 1, "bool %s/%s", n[0], n[1]);
+	if (krb5_config_get_int_default(context, NULL, 7, n[0], n[1], n[2],
+					n[3]) !=
+	    krb5_config_get_int_default(context, c, 7, n[0], n[1], n[2], n[3]))
+	    krb5_errx(context, 1, "int %s/%s", n[0], n[1]);
+	if (krb5_config_get_time_default(context, NULL, 7, n[0], n[1], n[2],
+					 n[3]) !=
+	    krb5_config_get_time_default(context, c, 7, n[0], n[1], n[2], n[3]))
+	    krb5_errx(context, 1, "time %s/%s", n[0], n[1]);
+
+	l1 = krb5_config_get_strings(context, NULL, n[0], n[1], n[2], n[3]);
+	l2 = krb5_config_get_strings(context, c, n[0], n[1], n[2], n[3]);
+	for (j = 0; l1 && l2 && l1[j] && l2[j]; j++)
+	    if (strcmp(l1[j], l2[j]) != 0)
+		break;
+	if ((l1 == NULL) != (l2 == NULL) || (l1 && (l1[j] || l2[j])))
+	    krb5_errx(context, 1, "strings %s/%s", n[0], n[1]);
+	krb5_config_free_strings(l1);
+	krb5_config_free_strings(l2);
+    }
+
+    if (krb5_config_get_time(context, NULL, "libdefaults", "clockskew",
+			     NULL) != 90)
+	krb5_errx(context, 1, "clockskew is not 90 seconds");
+    s1 = krb5_config_get_string(context, NULL, "realms", "TEST.H5L.SE",
+				"admin_server", NULL);
+    if (s1 == NULL || strcmp(s1, "admin") != 0)
+	krb5_errx(context, 1, "second realm section not found");
+    if (!krb5_config_get_bool(context, NULL, "realms", "TEST.H5L.SE",
+			      "sub", "value", NULL))
+	krb5_errx(context, 1, "nested value not found");
+
+    krb5_config_file_free(context, c);
+    krb5_free_context(context);
+}
+
 int
 main(int argc, char **argv)
 {
     check_config_files();
     check_escaped_strings();
+    check_compiled();
     return 0;
 }
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of KTH nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY KTH AND ITS CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL KTH OR ITS CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "krb5_locl.h"
+#include <getarg.h>
+#include <err.h>
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+static void
+make_auth(Authenticator *auth, char **name, int n)
+{
+    static char *realm = "TEST.H5L.SE";
+
+    memset(auth, 0, sizeof(*auth));
+    auth->crealm = realm;
+    auth->cname.name_type = KRB5_NT_PRINCIPAL;
+    auth->cname.name_string.len = 1;
+    auth->cname.name_string.val = name;
+    auth->ctime = 1000000 + n / 1000000;
+    auth->cusec = n % 1000000;
+}
+
+static void
+store(krb5_context context, krb5_rcache id, int n, krb5_error_code expect)
+{
+    krb5_error_code ret;
+    Authenticator auth;
+    char *name = "lha";
+
+    make_auth(&auth, &name, n);
+    ret = krb5_rc_store(context, id, &auth);
+    if (ret != expect)
+	krb5_errx(context, 1, "%s: store %d returned %d, expected %d",
+		  krb5_rc_get_name(context, id), n, ret, expect);
+}
+
+static void
+test_rcache(krb5_context context, const char *name)
+{
+    krb5_error_code ret;
+    krb5_rcache id, id2;
+    krb5_deltat lifespan;
+
+    ret = krb5_rc_resolve_full(context, &id, name);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", name);
+    ret = krb5_rc_initialize(context, id, 300);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize: %s", name);
+
+    store(context, id, 1, 0);
+    store(context, id, 2, 0);
+    store(context, id, 1, KRB5_RC_REPLAY);
+
+    /* a second handle sees what the first one stored */
+    ret = krb5_rc_resolve_full(context, &id2, name);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", name);
+    store(context, id2, 2, KRB5_RC_REPLAY);
+    store(context, id2, 3, 0);
+    store(context, id, 3, KRB5_RC_REPLAY);
+
+    ret = krb5_rc_get_lifespan(context, id2, &lifespan);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_get_lifespan: %s", name);
+    if (lifespan != 300)
+	krb5_errx(context, 1, "%s: lifespan %d", name, (int)lifespan);
+
+    krb5_rc_close(context, id2);
+    ret = krb5_rc_destroy(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_destroy: %s", name);
+}
+
+#if defined(HAVE_MMAP) && defined(HAVE_FCNTL)
+static void
+test_hash_full(krb5_context context, const char *name)
+{
+    krb5_error_code ret;
+    krb5_rcache id, id2;
+    int i;
+
+    /* id2 has the default sized table mapped while it is replaced */
+    ret = krb5_rc_resolve_full(context, &id2, name);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", name);
+    ret = krb5_rc_initialize(context, id2, 300);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize: %s", name);
+    store(context, id2, 1000, 0);
+
+    ret = krb5_set_config(context,
+			  "[libdefaults]\n\trcache_hash_buckets = 1\n");
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_set_config");
+
+    ret = krb5_rc_resolve_full(context, &id, name);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", name);
+    ret = krb5_rc_initialize(context, id, 300);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize: %s", name);
+
+    /* both handles now use the new, empty table */
+    store(context, id2, 1000, 0);
+    store(context, id, 1000, KRB5_RC_REPLAY);
+
+    /* the one bucket fills up and then refuses to forget live entries */
+    for (i = 0; i < 31; i++)
+	store(context, id, i, 0);
+    store(context, id, 31, KRB5_RC_IO);
+    store(context, id, 0, KRB5_RC_REPLAY);
+    store(context, id2, 30, KRB5_RC_REPLAY);
+
+    /* a destroyed table is not used any more */
+    krb5_rc_destroy(context, id);
+    store(context, id2, 32, ENOENT);
+    krb5_rc_close(context, id2);
+}
+
+static void
+test_hash_size(krb5_context context, const char *name)
+{
+    krb5_error_code ret;
+    krb5_rcache id;
+    struct stat sb;
+    const off_t nbuckets = 1000 * 300 * 3 / 32, bucket = 32 * 24;
+
+    /* room for three lifespans' worth of authenticators */
+    ret = krb5_set_config(context,
+			  "[libdefaults]\n\trcache_hash_rate = 1000\n");
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_set_config");
+    ret = krb5_rc_resolve_full(context, &id, name);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", name);
+    ret = krb5_rc_initialize(context, id, 300);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize: %s", name);
+    if (stat(krb5_rc_get_name(context, id), &sb) < 0)
+	err(1, "stat");
+    if (sb.st_size < nbuckets * bucket || sb.st_size >= (nbuckets + 1) * bucket)
+	krb5_errx(context, 1, "table of %ld bytes for %ld buckets",
+		  (long)sb.st_size, (long)nbuckets);
+    krb5_rc_destroy(context, id);
+}
+#endif
+
+#if defined(HAVE_MMAP) && defined(HAVE_FCNTL) && defined(HAVE_FORK)
+static void
+test_hash_procs(krb5_context context, const char *name)
+{
+    krb5_error_code ret;
+    krb5_rcache id;
+    int fd[2], i, n, total = 0, status;
+    const int nprocs = 4, count = 2000;
+
+    ret = krb5_rc_resolve_full(context, &id, name);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", name);
+    ret = krb5_rc_initialize(context, id, 300);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize: %s", name);
+    if (pipe(fd) < 0)
+	err(1, "pipe");
+
+    /* every process stores the same authenticators, each is new once */
+    for (i = 0; i < nprocs; i++) {
+	pid_t pid = fork();
+
+	if (pid < 0)
+	    err(1, "fork");
+	if (pid == 0) {
+	    krb5_rcache cid;
+	    int j, stored = 0;
+
+	    ret = krb5_rc_resolve_full(context, &cid, name);
+	    if (ret)
+		krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", name);
+	    for (j = 0; j < count; j++) {
+		Authenticator auth;
+		char *cname = "lha";
+
+		make_auth(&auth, &cname, j);
+		ret = krb5_rc_store(context, cid, &auth);
+		if (ret == 0)
+		    stored++;
+		else if (ret != KRB5_RC_REPLAY)
+		    krb5_err(context, 1, ret, "krb5_rc_store");
+	    }
+	    if (write(fd[1], &stored, sizeof(stored)) != sizeof(stored))
+		_exit(1);
+	    _exit(0);
+	}
+    }
+    close(fd[1]);
+    for (i = 0; i < nprocs; i++) {
+	if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+	    errx(1, "child failed");
+	if (read(fd[0], &n, sizeof(n)) != sizeof(n))
+	    errx(1, "short read from child");
+	total += n;
+    }
+    close(fd[0]);
+    if (total != count)
+	krb5_errx(context, 1, "%d processes accepted %d of %d authenticators",
+		  nprocs, total, count);
+
+    krb5_rc_destroy(context, id);
+}
+#endif
+
+static void
+perf_store(krb5_context context, const char *name, int times)
+{
+    krb5_error_code ret;
+    struct timeval start, end;
+    krb5_rcache id;
+    int i;
+
+    ret = krb5_rc_resolve_full(context, &id, name);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", name);
+    ret = krb5_rc_initialize(context, id, 300);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize: %s", name);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < times; i++)
+	store(context, id, i, 0);
+    gettimeofday(&end, NULL);
+    timevalsub(&end, &start);
+
+    printf("%s: %d stores in %ld.%06ld s\n", name, times,
+	   (long)end.tv_sec, (long)end.tv_usec);
+
+    krb5_rc_destroy(context, id);
+}
+
+static int version_flag = 0;
+static int help_flag	= 0;
+static int times = 0;
+
+static struct getargs args[] = {
+    {"times",	0,	arg_integer,	&times,
+     "number of stores for the performance test", "number" },
+    {"version",	0,	arg_flag,	&version_flag,
+     "print version", NULL },
+    {"help",	0,	arg_flag,	&help_flag,
+     NULL, NULL }
+};
+
+static void
+usage (int ret)
+{
+    arg_printusage (args,
+		    sizeof(args)/sizeof(*args),
+		    NULL,
+		    "");
+    exit (ret);
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_error_code ret;
+    int optidx = 0;
+
+    setprogname(argv[0]);
+
+    if(getarg(args, sizeof(args) / sizeof(args[0]), argc, argv, &optidx))
+	usage(1);
+
+    if (help_flag)
+	usage (0);
+
+    if(version_flag){
+	print_version(NULL);
+	exit(0);
+    }
+
+    argc -= optidx;
+    argv += optidx;
+
+    if (argc != 0)
+	errx(1, "argc != 0");
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx (1, "krb5_init_context failed: %d", ret);
+
+    test_rcache(context, "FILE:test_rcache.file");
+#if defined(HAVE_MMAP) && defined(HAVE_FCNTL)
+    test_rcache(context, "HASH:test_rcache.hash");
+#endif
+#if defined(HAVE_MMAP) && defined(HAVE_FCNTL) && defined(HAVE_FORK)
+    test_hash_procs(context, "HASH:test_rcache.hash");
+#endif
+
+    if (times > 0) {
+	perf_store(context, "FILE:test_rcache.file", times);
+#if defined(HAVE_MMAP) && defined(HAVE_FCNTL)
+	perf_store(context, "HASH:test_rcache.hash", times);
+#endif
+    }
+
+#if defined(HAVE_MMAP) && defined(HAVE_FCNTL)
+    test_hash_size(context, "HASH:test_rcache.hash");
+    test_hash_full(context, "HASH:test_rcache.hash");
+#endif
+
+    krb5_free_context(context);
+
+    return 0;
+}
@@ -262,14 +262,165 @@ check_too_large(krb5_context context, krb5_storage *sp)
     }
 }
 
+/*
+ * A buffered storage must not depend on the file offset it shares with
+ * other users of the descriptor, and must leave it at its own position.
+ */
+
+static void
+test_buffered(krb5_context context, const char *fn)
+{
+    krb5_storage *sp, *sp2;
+    uint32_t i, v;
+    off_t off;
+    int fd;
+
+    fd = open(fn, O_RDWR|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0)
+	krb5_err(context, 1, errno, "open(%s)", fn);
+
+    sp = krb5_storage_buffered_from_fd(fd);
+    if (sp == NULL)
+	krb5_errx(context, 1, "krb5_storage_buffered_from_fd: %s no mem", fn);
+    for (i = 0; i < 10000; i++)
+	krb5_store_uint32(sp, i);
+    if (krb5_storage_fsync(sp) != 0)
+	krb5_errx(context, 1, "krb5_storage_fsync");
+
+    /* walk backwards while someone else moves the offset */
+    sp2 = krb5_storage_from_fd(fd);
+    if (sp2 == NULL)
+	krb5_errx(context, 1, "krb5_storage_from_fd: %s no mem", fn);
+    for (i = 10000; i > 0; i--) {
+	if (krb5_storage_seek(sp, (i - 1) * 4, SEEK_SET) != (i - 1) * 4)
+	    krb5_errx(context, 1, "seek to %lu", (unsigned long)(i - 1) * 4);
+	krb5_storage_seek(sp2, (i * 7919) % 40000, SEEK_SET);
+	if (krb5_ret_uint32(sp, &v) != 0 || v != i - 1)
+	    krb5_errx(context, 1, "read %lu backwards", (unsigned long)i - 1);
+    }
+    krb5_storage_free(sp2);
+
+    /* overwrite in the middle, read back through another storage */
+    krb5_storage_seek(sp, 4000, SEEK_SET);
+    krb5_store_uint32(sp, 0xdeadbeef);
+    off = krb5_storage_seek(sp, 0, SEEK_CUR);
+    if (off != 4004)
+	krb5_errx(context, 1, "position %ld, not 4004", (long)off);
+    krb5_storage_free(sp);
+    if (lseek(fd, 0, SEEK_CUR) != 4004)
+	krb5_errx(context, 1, "fd offset not left at 4004");
+
+    sp = krb5_storage_from_fd(fd);
+    if (sp == NULL)
+	krb5_errx(context, 1, "krb5_storage_from_fd: %s no mem", fn);
+    krb5_storage_seek(sp, 3996, SEEK_SET);
+    for (i = 999; i < 1002; i++) {
+	if (krb5_ret_uint32(sp, &v) != 0 ||
+	    v != (i == 1000 ? 0xdeadbeef : i))
+	    krb5_errx(context, 1, "overwrite of 1000 not seen at %lu",
+		      (unsigned long)i);
+    }
+    krb5_storage_free(sp);
+    close(fd);
+    unlink(fn);
+}
+
+/* read(2)/write(2) calls made so far, if the system tells */
+static long
+count_syscalls(void)
+{
+    char line[128];
+    long n, total = 0;
+    FILE *f;
+
+    f = fopen("/proc/self/io", "r");
+    if (f == NULL)
+	return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+	if (sscanf(line, "syscr: %ld", &n) == 1 ||
+	    sscanf(line, "syscw: %ld", &n) == 1)
+	    total += n;
+    }
+    fclose(f);
+    return total;
+}
+
+/*
+ * Write and read back `count' records the way the iprop log stores
+ * entries, with a plain and with a buffered storage.
+ */
+
+static void
+perf_fd(krb5_context context, const char *fn, int count)
+{
+    struct timeval start, end;
+    krb5_storage *sp;
+    krb5_data data;
+    char payload[100];
+    uint32_t v;
+    long calls;
+    int buffered, fd, i;
+
+    memset(payload, 'x', sizeof(payload));
+    data.data = payload;
+    data.length = sizeof(payload);
+
+    for (buffered = 0; buffered < 2; buffered++) {
+	fd = open(fn, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0)
+	    krb5_err(context, 1, errno, "open(%s)", fn);
+	sp = buffered ? krb5_storage_buffered_from_fd(fd) :
+	    krb5_storage_from_fd(fd);
+	if (sp == NULL)
+	    krb5_errx(context, 1, "storage on %s", fn);
+
+	calls = count_syscalls();
+	gettimeofday(&start, NULL);
+	for (i = 0; i < count; i++) {
+	    krb5_store_uint32(sp, i);
+	    krb5_store_uint32(sp, 0);
+	    krb5_store_data(sp, data);
+	    krb5_store_uint32(sp, data.length);
+	    krb5_store_uint32(sp, i);
+	}
+	krb5_storage_seek(sp, 0, SEEK_SET);
+	for (i = 0; i < count; i++) {
+	    krb5_ret_uint32(sp, &v);
+	    krb5_ret_uint32(sp, &v);
+	    krb5_ret_uint32(sp, &v);
+	    krb5_storage_seek(sp, v, SEEK_CUR);
+	    krb5_ret_uint32(sp, &v);
+	    krb5_ret_uint32(sp, &v);
+	    if (v != (uint32_t)i)
+		krb5_errx(context, 1, "record %d read back as %lu", i,
+			  (unsigned long)v);
+	}
+	gettimeofday(&end, NULL);
+	timevalsub(&end, &start);
+	if (calls >= 0)
+	    calls = count_syscalls() - calls;
+
+	printf("%s: %d records in %ld.%06ld s, %ld read/write calls\n",
+	       buffered ? "buffered" : "unbuffered", count,
+	       (long)end.tv_sec, (long)end.tv_usec, calls);
+
+	krb5_storage_free(sp);
+	close(fd);
+	unlink(fn);
+    }
+}
+
 /*
  *
  */
 
 static int version_flag = 0;
 static int help_flag	= 0;
+static int times = 0;
 
 static struct getargs args[] = {
+    {"times",	0,	arg_integer,	&times,
+     "number of records for the performance test", "number" },
     {"version",	0,	arg_flag,	&version_flag,
      "print version", NULL },
     {"help",	0,	arg_flag,	&help_flag,
@@ -358,6 +509,26 @@ main(int argc, char **argv)
     close(fd);
     unlink(fn);
 
+    fd = open(fn, O_RDWR|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0)
+	krb5_err(context, 1, errno, "open(%s)", fn);
+
+    sp = krb5_storage_buffered_from_fd(fd);
+    if (sp == NULL)
+	krb5_errx(context, 1, "krb5_storage_buffered_from_fd: %s no mem", fn);
+
+    test_storage(context, sp);
+    test_truncate(context, sp, fd);
+    test_buffer_issues(context, sp);
+    krb5_storage_free(sp);
+    close(fd);
+    unlink(fn);
+
+    test_buffered(context, fn);
+
+    if (times > 0)
+	perf_fd(context, fn, times);
+
     krb5_free_context(context);
 
     return 0;